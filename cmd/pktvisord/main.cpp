@@ -4,8 +4,10 @@
 
 #include <csignal>
 #include <functional>
+#include <initializer_list>
 
 #include "CoreServer.h"
+#include "CpuAccounting.h"
 #include "CrashpadHandler.h"
 #include "HandlerManager.h"
 #include "InputStreamManager.h"
@@ -66,7 +68,11 @@ static const char USAGE[] =
     Geo Options:
       --geo-city FILE             GeoLite2 City database to use for IP to Geo mapping
       --geo-asn FILE              GeoLite2 ASN database to use for IP to ASN mapping
-      --geo-cache-size N          GeoLite2 LRU cache size, 0 to disable. (default: 10000)
+      --geo-cache-size N          GeoLite2 lookup cache size, shared by all inputs, 0 to disable. (default: 10000)
+      --geo-flat                  Precompile the GeoLite2 databases into in-memory prefix tables at startup, for constant
+                                  time lookups without a cache at the cost of memory and startup time
+      --geo-reload SECS           Check the GeoLite2 database files for changes every SECS seconds and swap in new
+                                  versions without a restart (default: 0, disabled)
     Configuration:
       --config FILE               Use specified YAML configuration to configure options, Taps, and Collection Policies
                                   Please see https://pktvisor.dev for more information
@@ -87,6 +93,8 @@ static const char USAGE[] =
     Handler Module Defaults:
       --max-deep-sample N         Never deep sample more than N% of streams (an int between 0 and 100) (default: 100)
       --periods P                 Hold this many 60 second time periods of history in memory (default: 5)
+      --perf-counters             Also attribute perf_event software counters (task-clock, context switches, page faults)
+                                  to each input and handler in the input_resources metrics. Requires perf_event access.
     pcap Input Module Options: (applicable to default policy when IFACE is specified only)
       -b BPF                      Filter packets using the given tcpdump compatible filter expression. Example: "port 53"
       -H HOSTSPEC                 Specify subnets (comma separated) to consider HOST, in CIDR form. In live capture this
@@ -111,11 +119,14 @@ struct CmdOptions {
     bool verbose{false};
     bool no_track{false};
     bool prometheus{false};
+    bool perf_counters{false};
+    bool geo_flat{false};
     std::optional<std::string> log_file;
     std::optional<std::string> prom_instance;
     std::optional<std::string> geo_city;
     std::optional<std::string> geo_asn;
     std::optional<unsigned int> geo_cache_size;
+    std::optional<unsigned int> geo_reload;
     std::optional<unsigned int> max_deep_sample;
     std::optional<unsigned int> periods;
     std::optional<YAML::Node> config;
@@ -183,6 +194,8 @@ void fill_cmd_options(std::map<std::string, docopt::value> args, CmdOptions &opt
     options.syslog = (config["syslog"] && config["syslog"].as<bool>()) || args["--syslog"].asBool();
     options.no_track = (config["no_track"] && config["no_track"].as<bool>()) || args["--no-track"].asBool();
     options.prometheus = (config["prometheus"] && config["prometheus"].as<bool>()) || args["--prometheus"].asBool();
+    options.perf_counters = (config["perf_counters"] && config["perf_counters"].as<bool>()) || args["--perf-counters"].asBool();
+    options.geo_flat = (config["geo_flat"] && config["geo_flat"].as<bool>()) || args["--geo-flat"].asBool();
 
     if (args["--log-file"]) {
         options.log_file = args["--log-file"].asString();
@@ -220,6 +233,14 @@ void fill_cmd_options(std::map<std::string, docopt::value> args, CmdOptions &opt
         options.geo_cache_size = 10000;
     }
 
+    if (args["--geo-reload"]) {
+        options.geo_reload = static_cast<unsigned int>(args["--geo-reload"].asLong());
+    } else if (config["geo_reload"]) {
+        options.geo_reload = config["geo_reload"].as<unsigned int>();
+    } else {
+        options.geo_reload = 0;
+    }
+
     if (args["--max-deep-sample"]) {
         options.max_deep_sample = static_cast<unsigned int>(args["--max-deep-sample"].asLong());
     } else if (config["max_deep_sample"]) {
@@ -296,13 +317,26 @@ void fill_cmd_options(std::map<std::string, docopt::value> args, CmdOptions &opt
     }
 }
 
-void initialize_geo(const std::string &city, const std::string &asn, unsigned int cache_size)
+void initialize_geo(const std::string &city, const std::string &asn, unsigned int cache_size, bool flat)
 {
     if (!city.empty()) {
-        geo::GeoIP().enable(city, cache_size);
+        geo::GeoIP().enable(city, cache_size, flat);
     }
     if (!asn.empty()) {
-        geo::GeoASN().enable(asn, cache_size);
+        geo::GeoASN().enable(asn, cache_size, flat);
+    }
+}
+
+void reload_geo(std::shared_ptr<spdlog::logger> logger)
+{
+    for (auto &[name, db] : {std::make_pair("city", &geo::GeoIP()), std::make_pair("asn", &geo::GeoASN())}) {
+        try {
+            if (db->enabled() && db->reload_if_changed()) {
+                logger->info("reloaded changed GeoLite2 {} database", name);
+            }
+        } catch (const std::exception &e) {
+            logger->error("GeoLite2 {} database reload failed, keeping the current version: {}", name, e.what());
+        }
     }
 }
 
@@ -564,13 +598,23 @@ int main(int argc, char *argv[])
 
     unsigned int periods = options.periods.value();
 
+    if (options.perf_counters) {
+        CpuAccount::enable_perf_counters();
+    }
+
     try {
-        initialize_geo(options.geo_city.value(), options.geo_asn.value(), options.geo_cache_size.value());
+        initialize_geo(options.geo_city.value(), options.geo_asn.value(), options.geo_cache_size.value(), options.geo_flat);
     } catch (const std::exception &e) {
         logger->error("Fatal error: {}", e.what());
         exit(EXIT_FAILURE);
     }
 
+    std::shared_ptr<timer::interval_handle> geo_reload_handle;
+    if (geo::enabled() && options.geo_reload.value()) {
+        static timer geo_timer_thread{1s};
+        geo_reload_handle = geo_timer_thread.set_interval(std::chrono::seconds(options.geo_reload.value()), [logger] { reload_geo(logger); });
+    }
+
     if (args["IFACE"]) {
         // pcap command line functionality, create default policy
         try {
@@ -15,6 +15,7 @@
 #pragma GCC diagnostic pop
 #include "Configurable.h"
 #include "Metrics.h"
+#include <mutex>
 #include <shared_mutex>
 #include <sstream>
 #include <sys/time.h>
@@ -235,8 +236,9 @@ private:
     unsigned int _num_periods{5};
 
     /**
-     * sampling
+     * sampling. events may come in from several threads, _rng is not thread safe
      */
+    std::mutex _rng_mutex;
     jsf32 _rng;
     uint32_t _deep_sample_rate{100};
     size_t _topn_count{10};
@@ -269,6 +271,11 @@ private:
      */
     void _period_shift(timespec stamp)
     {
+        std::unique_lock wlb(_base_mutex);
+        // callers check for the shift under a shared lock, another thread may have shifted since
+        if (stamp.tv_sec < _next_shift_tstamp.tv_sec) {
+            return;
+        }
         // ensure access to the buckets is locked while we period shift
         std::unique_lock wl(_bucket_mutex);
         std::unique_ptr<MetricsBucketClass> expiring_bucket;
@@ -290,7 +297,6 @@ private:
         }
         // unlock bucket lock as fast as possible, in particular before period shift callback
         wl.unlock();
-        std::unique_lock wlb(_base_mutex);
         _last_shift_tstamp.tv_sec = stamp.tv_sec;
         _next_shift_tstamp.tv_sec = stamp.tv_sec + AbstractMetricsManager::PERIOD_SEC;
         wlb.unlock();
@@ -308,12 +314,17 @@ protected:
      * (optionally) chosen, and the time window will be maintained
      *
      * @param stamp time stamp of the event
+     * @return whether the event is deep sampled. unlike _deep_sampling_now, it is not changed by events from other threads
      */
-    void new_event(timespec stamp, bool sample = true)
+    bool new_event(timespec stamp, bool sample = true)
     {
         // CRITICAL EVENT PATH
+        bool deep = _deep_sampling_now.load(std::memory_order_relaxed);
         if (sample && _deep_sample_rate != 100) {
-            _deep_sampling_now.store((_rng() % 100U < _deep_sample_rate), std::memory_order_relaxed);
+            std::unique_lock rng_lock(_rng_mutex);
+            deep = (_rng() % 100U < _deep_sample_rate);
+            rng_lock.unlock();
+            _deep_sampling_now.store(deep, std::memory_order_relaxed);
         }
         std::shared_lock rlb(_base_mutex);
         bool will_shift = _num_periods > 1 && stamp.tv_sec >= _next_shift_tstamp.tv_sec;
@@ -323,7 +334,8 @@ protected:
         }
         std::shared_lock rl(_bucket_mutex);
         // bucket base event
-        _metric_buckets[0]->new_event(_deep_sampling_now);
+        _metric_buckets[0]->new_event(deep);
+        return deep;
     }
 
     inline bool group_enabled(MetricGroupIntType g) const
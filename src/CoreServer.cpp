@@ -3,12 +3,14 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
 #include "CoreServer.h"
+#include "GeoDB.h"
 #include "HandlerManager.h"
 #include "Metrics.h"
 #include "Policies.h"
 #include "Taps.h"
 #include "visor_config.h"
 #include <chrono>
+#include <initializer_list>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 #include <spdlog/stopwatch.h>
@@ -76,6 +78,17 @@ void CoreServer::_setup_routes(const PrometheusConfig &prom_config)
         try {
             j["app"]["version"] = VISOR_VERSION_NUM;
             j["app"]["up_time_min"] = float(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - _start_time).count()) / 60;
+            for (auto &[db_name, db] : {std::make_pair("city", &geo::GeoIP()), std::make_pair("asn", &geo::GeoASN())}) {
+                if (db->enabled()) {
+                    auto stats = db->cache_stats();
+                    j["app"]["geo"][db_name]["cache_hits"] = stats.hits;
+                    j["app"]["geo"][db_name]["cache_misses"] = stats.misses;
+                    j["app"]["geo"][db_name]["cache_size"] = stats.size;
+                    j["app"]["geo"][db_name]["cache_capacity"] = stats.capacity;
+                    j["app"]["geo"][db_name]["cache_hit_rate"] = stats.hit_rate();
+                    j["app"]["geo"][db_name]["table_bytes"] = db->table_size();
+                }
+            }
             res.set_content(j.dump(), "text/json");
         } catch (const std::exception &e) {
             res.status = 500;
@@ -0,0 +1,194 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "CpuAccounting.h"
+#include <algorithm>
+#include <ctime>
+#include <initializer_list>
+#include <limits>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace visor {
+
+std::atomic<bool> CpuAccount::_perf_counters{false};
+
+#ifdef __linux__
+namespace {
+
+/**
+ * Software perf_event counters for the calling thread, opened as one group so a single read returns all of them
+ */
+class ThreadPerfCounters
+{
+    enum Counters {
+        TaskClock,
+        ContextSwitches,
+        PageFaults,
+        COUNTERS_SIZE
+    };
+
+    int _fds[COUNTERS_SIZE]{-1, -1, -1};
+    bool _open{false};
+
+    static int _open_counter(uint64_t config, int group_fd, bool exclude_kernel)
+    {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    void _close()
+    {
+        for (auto &fd : _fds) {
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+public:
+    ThreadPerfCounters()
+    {
+        // unprivileged processes may only count user space with perf_event_paranoid >= 2
+        for (bool exclude_kernel : {false, true}) {
+            _fds[TaskClock] = _open_counter(PERF_COUNT_SW_TASK_CLOCK, -1, exclude_kernel);
+            if (_fds[TaskClock] < 0) {
+                continue;
+            }
+            _fds[ContextSwitches] = _open_counter(PERF_COUNT_SW_CONTEXT_SWITCHES, _fds[TaskClock], exclude_kernel);
+            _fds[PageFaults] = _open_counter(PERF_COUNT_SW_PAGE_FAULTS, _fds[TaskClock], exclude_kernel);
+            if (_fds[ContextSwitches] >= 0 && _fds[PageFaults] >= 0) {
+                _open = true;
+                return;
+            }
+            _close();
+        }
+    }
+
+    ~ThreadPerfCounters()
+    {
+        _close();
+    }
+
+    void read(CpuUsage &usage) const
+    {
+        if (!_open) {
+            return;
+        }
+        struct {
+            uint64_t nr;
+            uint64_t values[COUNTERS_SIZE];
+        } data;
+        if (::read(_fds[TaskClock], &data, sizeof(data)) != sizeof(data) || data.nr != COUNTERS_SIZE) {
+            return;
+        }
+        usage.task_clock_ns = data.values[TaskClock];
+        usage.context_switches = data.values[ContextSwitches];
+        usage.page_faults = data.values[PageFaults];
+    }
+};
+
+}
+#endif
+
+static uint64_t thread_cpu_ns()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// cpu time one clock read adds to a sample. it is subtracted from every sample, otherwise short callbacks would mostly
+// measure the measurement
+static uint64_t clock_overhead_ns()
+{
+    static const uint64_t overhead = [] {
+        uint64_t best = std::numeric_limits<uint64_t>::max();
+        for (int i = 0; i < 64; ++i) {
+            auto start = thread_cpu_ns();
+            best = std::min(best, thread_cpu_ns() - start);
+        }
+        return best;
+    }();
+    return overhead;
+}
+
+#ifdef __linux__
+static void read_perf_counters(CpuUsage &usage)
+{
+    thread_local ThreadPerfCounters counters;
+    counters.read(usage);
+}
+#endif
+
+// the perf counters are read outside of the thread clock readings, so they do not count towards cpu_ns
+
+void CpuScope::_begin(CpuUsage &usage, [[maybe_unused]] bool perf)
+{
+#ifdef __linux__
+    if (perf) {
+        read_perf_counters(usage);
+    }
+#endif
+    usage.cpu_ns = thread_cpu_ns();
+}
+
+void CpuScope::_end(CpuUsage &usage, [[maybe_unused]] bool perf)
+{
+    usage.cpu_ns = thread_cpu_ns();
+#ifdef __linux__
+    if (perf) {
+        read_perf_counters(usage);
+    }
+#endif
+}
+
+void CpuAccount::_add_sample(const CpuUsage &sample)
+{
+    _sampled_calls.fetch_add(1, std::memory_order_relaxed);
+    auto overhead = clock_overhead_ns();
+    _cpu_ns.fetch_add(sample.cpu_ns > overhead ? sample.cpu_ns - overhead : 0, std::memory_order_relaxed);
+    _task_clock_ns.fetch_add(sample.task_clock_ns, std::memory_order_relaxed);
+    _context_switches.fetch_add(sample.context_switches, std::memory_order_relaxed);
+    _page_faults.fetch_add(sample.page_faults, std::memory_order_relaxed);
+}
+
+CpuUsage CpuAccount::usage() const
+{
+    CpuUsage usage;
+    usage.calls = _calls.load(std::memory_order_relaxed);
+    auto sampled = _sampled_calls.load(std::memory_order_relaxed);
+    if (!sampled) {
+        return usage;
+    }
+    double scale = static_cast<double>(usage.calls) / static_cast<double>(sampled);
+    usage.cpu_ns = static_cast<uint64_t>(static_cast<double>(_cpu_ns.load(std::memory_order_relaxed)) * scale);
+    usage.task_clock_ns = static_cast<uint64_t>(static_cast<double>(_task_clock_ns.load(std::memory_order_relaxed)) * scale);
+    usage.context_switches = static_cast<uint64_t>(static_cast<double>(_context_switches.load(std::memory_order_relaxed)) * scale);
+    usage.page_faults = static_cast<uint64_t>(static_cast<double>(_page_faults.load(std::memory_order_relaxed)) * scale);
+    return usage;
+}
+
+void CpuAccount::enable_perf_counters(bool enable)
+{
+    _perf_counters.store(enable, std::memory_order_relaxed);
+}
+
+bool CpuAccount::perf_counters_enabled()
+{
+    return _perf_counters.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,125 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace visor {
+
+/**
+ * CPU cost attributed to one consumer (an input event proxy or a stream handler).
+ *
+ * cpu_ns comes from the calling thread's CPU clock. task_clock_ns, context_switches and page_faults come from software
+ * perf_event counters and stay 0 unless perf counters are enabled and available.
+ */
+struct CpuUsage {
+    uint64_t calls{0};
+    uint64_t cpu_ns{0};
+    uint64_t task_clock_ns{0};
+    uint64_t context_switches{0};
+    uint64_t page_faults{0};
+
+    CpuUsage &operator+=(const CpuUsage &other)
+    {
+        calls += other.calls;
+        cpu_ns += other.cpu_ns;
+        task_clock_ns += other.task_clock_ns;
+        context_switches += other.context_switches;
+        page_faults += other.page_faults;
+        return *this;
+    }
+
+    // saturating: scaled estimates from CpuAccount::usage() are not strictly monotonic
+    CpuUsage operator-(const CpuUsage &other) const
+    {
+        auto sub = [](uint64_t a, uint64_t b) { return a > b ? a - b : 0; };
+        return {sub(calls, other.calls), sub(cpu_ns, other.cpu_ns), sub(task_clock_ns, other.task_clock_ns),
+            sub(context_switches, other.context_switches), sub(page_faults, other.page_faults)};
+    }
+};
+
+/**
+ * Accumulates the CPU cost of the calls made through CpuScope.
+ *
+ * Reading the thread CPU clock is a system call, so only one call in SAMPLE_INTERVAL is measured and usage() scales the
+ * sampled totals up to the number of calls. Counters are relaxed atomics: an account is normally updated from a single
+ * dispatch thread, but inputs with several io loops may update it concurrently, and it is read from other threads.
+ */
+class CpuAccount
+{
+    friend class CpuScope;
+
+    static std::atomic<bool> _perf_counters;
+
+    std::atomic<uint64_t> _calls{0};
+    std::atomic<uint64_t> _sampled_calls{0};
+    std::atomic<uint64_t> _cpu_ns{0};
+    std::atomic<uint64_t> _task_clock_ns{0};
+    std::atomic<uint64_t> _context_switches{0};
+    std::atomic<uint64_t> _page_faults{0};
+
+    void _add_sample(const CpuUsage &sample);
+
+public:
+    // must be a power of 2
+    static constexpr uint64_t SAMPLE_INTERVAL = 16;
+
+    CpuAccount() = default;
+    CpuAccount(const CpuAccount &) = delete;
+    CpuAccount &operator=(const CpuAccount &) = delete;
+
+    /**
+     * @return cumulative usage since creation, with sampled counters scaled to all calls
+     */
+    CpuUsage usage() const;
+
+    /**
+     * Read task-clock, context-switch and page-fault software perf_event counters in every scope, process wide.
+     * Counters are opened per thread on first use; threads where perf_event_open fails (e.g. perf_event_paranoid)
+     * report them as 0.
+     */
+    static void enable_perf_counters(bool enable = true);
+    static bool perf_counters_enabled();
+};
+
+/**
+ * Attributes the CPU time spent in its lifetime to a CpuAccount. Scopes may nest, each account sees the full time
+ * of its own scope.
+ */
+class CpuScope
+{
+    CpuAccount *_account{nullptr};
+    bool _perf{false};
+    CpuUsage _start;
+
+    static void _begin(CpuUsage &usage, bool perf);
+    static void _end(CpuUsage &usage, bool perf);
+
+public:
+    explicit CpuScope(CpuAccount &account)
+    {
+        auto calls = account._calls.fetch_add(1, std::memory_order_relaxed);
+        if ((calls & (CpuAccount::SAMPLE_INTERVAL - 1)) == 0) {
+            _account = &account;
+            _perf = CpuAccount::_perf_counters.load(std::memory_order_relaxed);
+            _begin(_start, _perf);
+        }
+    }
+
+    ~CpuScope()
+    {
+        if (_account) {
+            CpuUsage end;
+            _end(end, _perf);
+            _account->_add_sample(end - _start);
+        }
+    }
+
+    CpuScope(const CpuScope &) = delete;
+    CpuScope &operator=(const CpuScope &) = delete;
+};
+
+}
@@ -0,0 +1,96 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "GeoDB.h"
+#include "IpKey.h"
+#include <array>
+#include <cstdint>
+
+namespace visor {
+
+/**
+ * Enrichment of one packet (or flow record): the addresses of both endpoints and their GeoIP location and ASN ids.
+ *
+ * The input fills in the addresses and passes the context along its dispatch, ids are looked up lazily on first use and
+ * at most once per endpoint. Filters, metrics and chained handlers seeing the same packet all share these results
+ * instead of each repeating the lookups.
+ *
+ * A context belongs to the thread dispatching its packet and is not thread safe. Lookups only cache into the context,
+ * so handlers receive it by const reference.
+ */
+class EnrichmentContext
+{
+public:
+    enum Endpoint : uint8_t {
+        Src,
+        Dst,
+        ENDPOINTS_SIZE
+    };
+
+private:
+    enum Resolved : uint8_t {
+        GeoLoc = 1 << 0,
+        ASN = 1 << 1
+    };
+
+    std::array<IpKey, ENDPOINTS_SIZE> _ip{};
+    std::array<bool, ENDPOINTS_SIZE> _has_ip{};
+    mutable std::array<uint8_t, ENDPOINTS_SIZE> _resolved{};
+    mutable std::array<geo::MaxmindDB::Id, ENDPOINTS_SIZE> _geo_loc{};
+    mutable std::array<geo::MaxmindDB::Id, ENDPOINTS_SIZE> _asn{};
+
+public:
+    EnrichmentContext() = default;
+
+    EnrichmentContext(const IpKey &src, const IpKey &dst)
+    {
+        set_ip(Src, src);
+        set_ip(Dst, dst);
+    }
+
+    void set_ip(Endpoint endpoint, const IpKey &ip)
+    {
+        _ip[endpoint] = ip;
+        _has_ip[endpoint] = true;
+        _resolved[endpoint] = 0;
+    }
+
+    bool has_ip(Endpoint endpoint) const
+    {
+        return _has_ip[endpoint];
+    }
+
+    const IpKey &ip(Endpoint endpoint) const
+    {
+        return _ip[endpoint];
+    }
+
+    /**
+     * @return the GeoIP location id of endpoint, UNKNOWN_ID if it has no address or GeoIP is not enabled
+     */
+    geo::MaxmindDB::Id geo_loc(Endpoint endpoint) const
+    {
+        if (!(_resolved[endpoint] & GeoLoc)) {
+            _geo_loc[endpoint] = (_has_ip[endpoint] && geo::GeoIP().enabled()) ? geo::GeoIP().getGeoLocId(_ip[endpoint]) : geo::MaxmindDB::UNKNOWN_ID;
+            _resolved[endpoint] |= GeoLoc;
+        }
+        return _geo_loc[endpoint];
+    }
+
+    /**
+     * @return the ASN id of endpoint, UNKNOWN_ID if it has no address or GeoASN is not enabled
+     */
+    geo::MaxmindDB::Id asn(Endpoint endpoint) const
+    {
+        if (!(_resolved[endpoint] & ASN)) {
+            _asn[endpoint] = (_has_ip[endpoint] && geo::GeoASN().enabled()) ? geo::GeoASN().getASNId(_ip[endpoint]) : geo::MaxmindDB::UNKNOWN_ID;
+            _resolved[endpoint] |= ASN;
+        }
+        return _asn[endpoint];
+    }
+};
+
+}
@@ -0,0 +1,119 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "IpKey.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <robin_hood.h>
+
+namespace visor::geo {
+
+struct GeoCacheStats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t size{0};
+    uint64_t capacity{0};
+
+    double hit_rate() const
+    {
+        auto lookups = hits + misses;
+        return lookups ? static_cast<double>(hits) / static_cast<double>(lookups) : 0.0;
+    }
+};
+
+/**
+ * Bounded IP address to lookup id cache, safe to use from several input threads at once.
+ *
+ * Entries are spread over SHARDS independently locked shards by address hash, so concurrent lookups of different
+ * addresses rarely contend. Each shard approximates LRU with two generations: hits in the old generation are promoted
+ * to the current one, and once the current generation is full it becomes the old one, dropping everything that was
+ * not touched in the meantime. Every operation is O(1), without the per entry list bookkeeping of a true LRU.
+ *
+ * The lookup itself runs outside of the shard lock, two threads missing on the same address may both look it up.
+ */
+class GeoCache
+{
+public:
+    static constexpr size_t SHARDS = 16;
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        robin_hood::unordered_map<IpKey, uint32_t> current;
+        robin_hood::unordered_map<IpKey, uint32_t> old;
+        uint64_t hits{0};
+        uint64_t misses{0};
+    };
+
+    std::array<Shard, SHARDS> _shards;
+    size_t _generation_size;
+
+    Shard &_shard(const IpKey &key)
+    {
+        return _shards[(key.hash() >> 32) % SHARDS];
+    }
+
+public:
+    explicit GeoCache(size_t capacity)
+        : _generation_size(std::max<size_t>(capacity / SHARDS / 2, 1))
+    {
+    }
+
+    /**
+     * @return the cached id for key, or the result of lookup(key), which is then cached
+     */
+    template <typename Lookup>
+    uint32_t get(const IpKey &key, Lookup &&lookup)
+    {
+        auto &shard = _shard(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (auto it = shard.current.find(key); it != shard.current.end()) {
+                ++shard.hits;
+                return it->second;
+            }
+            if (auto it = shard.old.find(key); it != shard.old.end()) {
+                ++shard.hits;
+                auto id = it->second;
+                shard.old.erase(it);
+                _insert(shard, key, id);
+                return id;
+            }
+        }
+        auto id = lookup(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ++shard.misses;
+        _insert(shard, key, id);
+        return id;
+    }
+
+    GeoCacheStats stats()
+    {
+        GeoCacheStats stats;
+        stats.capacity = _generation_size * 2 * SHARDS;
+        for (auto &shard : _shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.hits += shard.hits;
+            stats.misses += shard.misses;
+            stats.size += shard.current.size() + shard.old.size();
+        }
+        return stats;
+    }
+
+private:
+    void _insert(Shard &shard, const IpKey &key, uint32_t id)
+    {
+        if (shard.current.size() >= _generation_size) {
+            std::swap(shard.current, shard.old);
+            shard.current.clear();
+        }
+        shard.current[key] = id;
+    }
+};
+
+}
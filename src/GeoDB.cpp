@@ -3,21 +3,23 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
 #include "GeoDB.h"
+#include <algorithm>
+#include <arpa/inet.h>
 #include <cstring>
-#include <fmt/format.h>
+#include <initializer_list>
 #include <stdexcept>
 
 namespace visor::geo {
 
 MaxmindDB &GeoIP()
 {
-    static MaxmindDB ip_db;
+    static MaxmindDB ip_db(MaxmindDB::GeoLoc);
     return ip_db;
 }
 
 MaxmindDB &GeoASN()
 {
-    static MaxmindDB asn_db;
+    static MaxmindDB asn_db(MaxmindDB::ASN);
     return asn_db;
 }
 
@@ -26,141 +28,324 @@ bool enabled()
     return (GeoIP().enabled() || GeoASN().enabled());
 }
 
-void MaxmindDB::enable(const std::string &database_filename, int cache_size)
+MaxmindDB::Database::Database(const std::string &filename)
 {
-    auto status = MMDB_open(database_filename.c_str(), MMDB_MODE_MMAP, &_mmdb);
+    // before opening: if the file is replaced in between, the next reload_if_changed() sees the new identity and loads
+    // it again, rather than never noticing the version we actually opened
+    if (stat(filename.c_str(), &file_stat) != 0) {
+        file_stat = {};
+    }
+    auto status = MMDB_open(filename.c_str(), MMDB_MODE_MMAP, &mmdb);
     if (status != MMDB_SUCCESS) {
-        std::string msg = database_filename + ": " + MMDB_strerror(status);
+        std::string msg = filename + ": " + MMDB_strerror(status);
         throw std::runtime_error(msg);
     }
-    if (cache_size != 0) {
-        _lru_cache = std::make_unique<LRUList<std::string, std::string>>(cache_size);
-    }
-    _enabled = true;
 }
 
-MaxmindDB::~MaxmindDB()
+MaxmindDB::Database::~Database()
 {
-    if (_enabled) {
-        MMDB_close(&_mmdb);
-    }
+    MMDB_close(&mmdb);
 }
 
-std::string MaxmindDB::getGeoLocString(const struct sockaddr *sa) const
+std::unique_ptr<MaxmindDB::Database> MaxmindDB::_load(const std::string &filename, int cache_size, bool flat) const
 {
-
-    if (!_enabled) {
-        return "";
+    auto db = std::make_unique<Database>(filename);
+    if (flat) {
+        try {
+            db->table = std::make_unique<GeoPrefixTable>(db->mmdb);
+        } catch (const std::runtime_error &e) {
+            throw std::runtime_error(filename + ": " + e.what());
+        }
+        const auto &records = db->table->records();
+        auto &ids = db->record_ids;
+        ids.reserve(records.size());
+        ids.push_back(UNKNOWN_ID);
+        for (size_t i = 1; i < records.size(); ++i) {
+            MMDB_lookup_result_s lookup{};
+            lookup.found_entry = true;
+            lookup.entry = records[i];
+            ids.push_back(_intern(_format(&lookup, _kind)));
+        }
+    } else if (cache_size > 0) {
+        db->cache = std::make_unique<GeoCache>(cache_size);
     }
+    return db;
+}
 
-    int mmdb_error;
+static std::atomic<uint64_t> maxmind_instances{0};
 
-    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&_mmdb, sa, &mmdb_error);
-    if (mmdb_error != MMDB_SUCCESS || !lookup.found_entry) {
-        return "Unknown";
-    }
-
-    return _getGeoLocString(&lookup);
+MaxmindDB::MaxmindDB(Kind kind)
+    : _kind(kind)
+    , _instance(++maxmind_instances)
+{
 }
 
-std::string MaxmindDB::getGeoLocString(const struct sockaddr_in *sa4) const
+void MaxmindDB::_swap(std::unique_ptr<Database> db)
 {
-
-    if (!_enabled) {
-        return "";
+    {
+        std::lock_guard<std::mutex> lock(_current_mutex);
+        _current = std::move(db);
+        _generation.fetch_add(1, std::memory_order_release);
     }
+    _release_snapshots();
+}
 
-    std::string ip_address;
-    if (_lru_cache) {
-        ip_address = fmt::format_int(sa4->sin_addr.s_addr).str();
-        if (auto geoloc = _lru_cache->getValue(ip_address); geoloc.has_value()) {
-            return geoloc.value();
+/**
+ * Drops the versions threads still hold from before the last swap, so threads which stopped doing lookups do not keep
+ * them alive. Also forgets the snapshots of threads which exited.
+ */
+void MaxmindDB::_release_snapshots()
+{
+    auto generation = _generation.load(std::memory_order_acquire);
+    std::vector<std::shared_ptr<Database>> released;
+    std::lock_guard<std::mutex> lock(_snapshots_mutex);
+    for (auto &snapshot : _snapshots) {
+        std::lock_guard<std::mutex> snapshot_lock(snapshot->mutex);
+        if (snapshot->generation != generation) {
+            released.push_back(std::move(snapshot->db));
+            snapshot->generation = 0;
         }
     }
+    // only registered here, the thread owning it exited
+    _snapshots.erase(std::remove_if(_snapshots.begin(), _snapshots.end(), [](const auto &snapshot) { return snapshot.use_count() == 1; }), _snapshots.end());
+    // released versions are destroyed here, outside of the snapshot locks
+}
 
-    int mmdb_error;
+std::shared_ptr<MaxmindDB::Database> MaxmindDB::_current_db() const
+{
+    std::lock_guard<std::mutex> lock(_current_mutex);
+    return _current;
+}
 
-    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&_mmdb, reinterpret_cast<const struct sockaddr *>(sa4), &mmdb_error);
-    if (mmdb_error != MMDB_SUCCESS || !lookup.found_entry) {
-        if (_lru_cache) {
-            _lru_cache->put(ip_address, "Unknown");
+/**
+ * Each thread keeps its own reference to the database version it last used, and only takes the shared lock to refresh
+ * it after a swap. On the lookup path, threads share nothing but the read mostly _generation counter: the snapshot
+ * lock is only contended by _swap() releasing it.
+ */
+MaxmindDB::Pin MaxmindDB::_acquire() const
+{
+    thread_local std::vector<std::pair<uint64_t, std::shared_ptr<Snapshot>>> snapshots;
+
+    auto it = std::find_if(snapshots.begin(), snapshots.end(), [this](const auto &s) { return s.first == _instance; });
+    if (it == snapshots.end()) {
+        auto snapshot = std::make_shared<Snapshot>();
+        {
+            std::lock_guard<std::mutex> lock(_snapshots_mutex);
+            _snapshots.push_back(snapshot);
         }
-        return "Unknown";
+        it = snapshots.insert(snapshots.end(), {_instance, std::move(snapshot)});
     }
+    auto &snapshot = *it->second;
 
-    if (_lru_cache) {
-        auto geoloc = _getGeoLocString(&lookup);
-        _lru_cache->put(ip_address, geoloc);
-        return geoloc;
+    std::unique_lock<std::mutex> pin(snapshot.mutex);
+    auto generation = _generation.load(std::memory_order_acquire);
+    if (snapshot.generation != generation) {
+        std::lock_guard<std::mutex> lock(_current_mutex);
+        snapshot.db = _current;
+        snapshot.generation = _generation.load(std::memory_order_relaxed);
     }
+    return Pin{std::move(pin), snapshot.db.get()};
+}
 
-    return _getGeoLocString(&lookup);
+void MaxmindDB::enable(const std::string &database_filename, int cache_size, bool flat)
+{
+    std::lock_guard<std::mutex> lock(_load_mutex);
+    _swap(_load(database_filename, cache_size, flat));
+    _filename = database_filename;
+    _cache_size = cache_size;
+    _flat = flat;
+    _enabled = true;
 }
 
-std::string MaxmindDB::getGeoLocString(const struct sockaddr_in6 *sa6) const
+bool MaxmindDB::reload_if_changed()
 {
+    std::lock_guard<std::mutex> lock(_load_mutex);
+    auto current = _current_db();
+    if (!current) {
+        return false;
+    }
+    struct stat file_stat;
+    if (stat(_filename.c_str(), &file_stat) != 0) {
+        // being replaced, try again later
+        return false;
+    }
+    const auto &loaded = current->file_stat;
+    if (file_stat.st_dev == loaded.st_dev && file_stat.st_ino == loaded.st_ino && file_stat.st_size == loaded.st_size
+        && file_stat.st_mtime == loaded.st_mtime) {
+        return false;
+    }
+    _swap(_load(_filename, _cache_size, _flat));
+    return true;
+}
 
-    if (!_enabled) {
-        return "";
+MaxmindDB::~MaxmindDB()
+{
+    // threads may keep their snapshot entries past this instance, but not its database versions
+    {
+        std::lock_guard<std::mutex> lock(_current_mutex);
+        _current.reset();
+        _generation.fetch_add(1, std::memory_order_release);
     }
+    _release_snapshots();
+}
 
-    std::string ip_address;
-    if (_lru_cache) {
-        ip_address = fmt::format("{}", sa6->sin6_addr.s6_addr);
-        if (auto geoloc = _lru_cache->getValue(ip_address); geoloc.has_value()) {
-            return geoloc.value();
+MaxmindDB::Id MaxmindDB::_intern(std::string &&name) const
+{
+    {
+        std::shared_lock lock(_names_mutex);
+        if (auto it = _name_ids.find(name); it != _name_ids.end()) {
+            return it->second;
         }
     }
+    std::unique_lock lock(_names_mutex);
+    auto [it, inserted] = _name_ids.emplace(name, static_cast<Id>(_names.size()));
+    if (inserted) {
+        _names.push_back(std::move(name));
+    }
+    return it->second;
+}
+
+const std::string &MaxmindDB::name(Id id) const
+{
+    std::shared_lock lock(_names_mutex);
+    if (id >= _names.size()) {
+        return _names[UNKNOWN_ID];
+    }
+    return _names[id];
+}
+
+GeoCacheStats MaxmindDB::cache_stats() const
+{
+    auto db = _current_db();
+    if (!db || !db->cache) {
+        return {};
+    }
+    return db->cache->stats();
+}
+
+size_t MaxmindDB::table_size() const
+{
+    auto db = _current_db();
+    if (!db || !db->table) {
+        return 0;
+    }
+    return db->table->memory_size();
+}
+
+std::string MaxmindDB::_format(MMDB_lookup_result_s *lookup, Kind kind) const
+{
+    return kind == GeoLoc ? _getGeoLocString(lookup) : _getASNString(lookup);
+}
+
+MaxmindDB::Id MaxmindDB::_lookup(const Database &db, const IpKey &ip, Kind kind) const
+{
+    struct sockaddr_storage ss {
+    };
+    if (ip.is_ipv4()) {
+        auto sa4 = reinterpret_cast<struct sockaddr_in *>(&ss);
+        sa4->sin_family = AF_INET;
+        std::memcpy(&sa4->sin_addr, &ip.addr[12], sizeof(sa4->sin_addr));
+    } else {
+        auto sa6 = reinterpret_cast<struct sockaddr_in6 *>(&ss);
+        sa6->sin6_family = AF_INET6;
+        std::memcpy(&sa6->sin6_addr, ip.addr.data(), sizeof(sa6->sin6_addr));
+    }
 
     int mmdb_error;
 
-    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&_mmdb, reinterpret_cast<const struct sockaddr *>(sa6), &mmdb_error);
+    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&db.mmdb, reinterpret_cast<const struct sockaddr *>(&ss), &mmdb_error);
     if (mmdb_error != MMDB_SUCCESS || !lookup.found_entry) {
-        if (_lru_cache) {
-            _lru_cache->put(ip_address, "Unknown");
-        }
-        return "Unknown";
+        return UNKNOWN_ID;
+    }
+
+    return _intern(_format(&lookup, kind));
+}
+
+MaxmindDB::Id MaxmindDB::_get(const IpKey &ip, Kind kind) const
+{
+    auto pin = _acquire();
+    auto db = pin.db;
+    if (!db) {
+        return UNKNOWN_ID;
+    }
+    if (db->table && kind == _kind) {
+        return db->record_ids[db->table->lookup(ip)];
     }
+    // the table and the cache only hold results of the kind the database is loaded for
+    if (!db->cache || kind != _kind) {
+        return _lookup(*db, ip, kind);
+    }
+    return db->cache->get(ip, [this, db, kind](const IpKey &key) { return _lookup(*db, key, kind); });
+}
 
-    if (_lru_cache) {
-        auto geoloc = _getGeoLocString(&lookup);
-        _lru_cache->put(ip_address, geoloc);
-        return geoloc;
+bool MaxmindDB::_parse(const char *ip_address, IpKey &ip)
+{
+    uint32_t ipv4;
+    if (inet_pton(AF_INET, ip_address, &ipv4) == 1) {
+        ip = IpKey::from_ipv4(ipv4);
+        return true;
     }
+    uint8_t ipv6[16];
+    if (inet_pton(AF_INET6, ip_address, ipv6) == 1) {
+        ip = IpKey::from_ipv6(ipv6);
+        return true;
+    }
+    return false;
+}
 
-    return _getGeoLocString(&lookup);
+MaxmindDB::Id MaxmindDB::getGeoLocId(const IpKey &ip) const
+{
+    return _get(ip, GeoLoc);
 }
 
-std::string MaxmindDB::getGeoLocString(const char *ip_address) const
+std::string MaxmindDB::getGeoLocString(const struct sockaddr *sa) const
 {
+    switch (sa->sa_family) {
+    case AF_INET:
+        return getGeoLocString(reinterpret_cast<const struct sockaddr_in *>(sa));
+    case AF_INET6:
+        return getGeoLocString(reinterpret_cast<const struct sockaddr_in6 *>(sa));
+    }
 
     if (!_enabled) {
         return "";
     }
+    return name(UNKNOWN_ID);
+}
 
-    if (_lru_cache) {
-        if (auto geoloc = _lru_cache->getValue(ip_address); geoloc.has_value()) {
-            return geoloc.value();
-        }
+std::string MaxmindDB::getGeoLocString(const struct sockaddr_in *sa4) const
+{
+
+    if (!_enabled) {
+        return "";
     }
 
-    int gai_error, mmdb_error;
+    return name(getGeoLocId(IpKey::from_ipv4(sa4->sin_addr.s_addr)));
+}
 
-    MMDB_lookup_result_s lookup = MMDB_lookup_string(&_mmdb, ip_address, &gai_error, &mmdb_error);
-    if (0 != gai_error || MMDB_SUCCESS != mmdb_error || !lookup.found_entry) {
-        if (_lru_cache) {
-            _lru_cache->put(ip_address, "Unknown");
-        }
-        return "Unknown";
+std::string MaxmindDB::getGeoLocString(const struct sockaddr_in6 *sa6) const
+{
+
+    if (!_enabled) {
+        return "";
     }
 
-    if (_lru_cache) {
-        auto geoloc = _getGeoLocString(&lookup);
-        _lru_cache->put(ip_address, geoloc);
-        return geoloc;
+    return name(getGeoLocId(IpKey::from_ipv6(sa6->sin6_addr.s6_addr)));
+}
+
+std::string MaxmindDB::getGeoLocString(const char *ip_address) const
+{
+
+    if (!_enabled) {
+        return "";
+    }
+
+    IpKey ip;
+    if (!_parse(ip_address, ip)) {
+        return name(UNKNOWN_ID);
     }
 
-    return _getGeoLocString(&lookup);
+    return name(getGeoLocId(ip));
 }
 
 std::string MaxmindDB::_getGeoLocString(MMDB_lookup_result_s *lookup) const
@@ -214,21 +399,24 @@ std::string MaxmindDB::_getGeoLocString(MMDB_lookup_result_s *lookup) const
     return geoString;
 }
 
+MaxmindDB::Id MaxmindDB::getASNId(const IpKey &ip) const
+{
+    return _get(ip, ASN);
+}
+
 std::string MaxmindDB::getASNString(const struct sockaddr *sa) const
 {
+    switch (sa->sa_family) {
+    case AF_INET:
+        return getASNString(reinterpret_cast<const struct sockaddr_in *>(sa));
+    case AF_INET6:
+        return getASNString(reinterpret_cast<const struct sockaddr_in6 *>(sa));
+    }
 
     if (!_enabled) {
         return "";
     }
-
-    int mmdb_error;
-
-    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&_mmdb, sa, &mmdb_error);
-    if (mmdb_error != MMDB_SUCCESS || !lookup.found_entry) {
-        return "Unknown";
-    }
-
-    return _getASNString(&lookup);
+    return name(UNKNOWN_ID);
 }
 
 std::string MaxmindDB::getASNString(const struct sockaddr_in *sa4) const
@@ -237,31 +425,8 @@ std::string MaxmindDB::getASNString(const struct sockaddr_in *sa4) const
     if (!_enabled) {
         return "";
     }
-    std::string ip_address;
-    if (_lru_cache) {
-        ip_address = fmt::format_int(sa4->sin_addr.s_addr).str();
-        if (auto asn = _lru_cache->getValue(ip_address); asn.has_value()) {
-            return asn.value();
-        }
-    }
 
-    int mmdb_error;
-
-    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&_mmdb, reinterpret_cast<const struct sockaddr *>(sa4), &mmdb_error);
-    if (mmdb_error != MMDB_SUCCESS || !lookup.found_entry) {
-        if (_lru_cache) {
-            _lru_cache->put(ip_address, "Unknown");
-        }
-        return "Unknown";
-    }
-
-    if (_lru_cache) {
-        auto asn = _getASNString(&lookup);
-        _lru_cache->put(ip_address, asn);
-        return asn;
-    }
-
-    return _getASNString(&lookup);
+    return name(getASNId(IpKey::from_ipv4(sa4->sin_addr.s_addr)));
 }
 
 std::string MaxmindDB::getASNString(const struct sockaddr_in6 *sa6) const
@@ -271,31 +436,7 @@ std::string MaxmindDB::getASNString(const struct sockaddr_in6 *sa6) const
         return "";
     }
 
-    std::string ip_address;
-    if (_lru_cache) {
-        ip_address = fmt::format("{}", sa6->sin6_addr.s6_addr);
-        if (auto asn = _lru_cache->getValue(ip_address); asn.has_value()) {
-            return asn.value();
-        }
-    }
-
-    int mmdb_error;
-
-    MMDB_lookup_result_s lookup = MMDB_lookup_sockaddr(&_mmdb, reinterpret_cast<const struct sockaddr *>(sa6), &mmdb_error);
-    if (mmdb_error != MMDB_SUCCESS || !lookup.found_entry) {
-        if (_lru_cache) {
-            _lru_cache->put(ip_address, "Unknown");
-        }
-        return "Unknown";
-    }
-
-    if (_lru_cache) {
-        auto asn = _getASNString(&lookup);
-        _lru_cache->put(ip_address, asn);
-        return asn;
-    }
-
-    return _getASNString(&lookup);
+    return name(getASNId(IpKey::from_ipv6(sa6->sin6_addr.s6_addr)));
 }
 
 std::string MaxmindDB::getASNString(const char *ip_address) const
@@ -305,29 +446,12 @@ std::string MaxmindDB::getASNString(const char *ip_address) const
         return "";
     }
 
-    if (_lru_cache) {
-        if (auto asn = _lru_cache->getValue(ip_address); asn.has_value()) {
-            return asn.value();
-        }
-    }
-
-    int gai_error, mmdb_error;
-
-    MMDB_lookup_result_s lookup = MMDB_lookup_string(&_mmdb, ip_address, &gai_error, &mmdb_error);
-    if (0 != gai_error || MMDB_SUCCESS != mmdb_error || !lookup.found_entry) {
-        if (_lru_cache) {
-            _lru_cache->put(ip_address, "Unknown");
-        }
-        return "Unknown";
-    }
-
-    if (_lru_cache) {
-        auto asn = _getASNString(&lookup);
-        _lru_cache->put(ip_address, asn);
-        return asn;
+    IpKey ip;
+    if (!_parse(ip_address, ip)) {
+        return name(UNKNOWN_ID);
     }
 
-    return _getASNString(&lookup);
+    return name(getASNId(ip));
 }
 
 std::string MaxmindDB::_getASNString(MMDB_lookup_result_s *lookup) const
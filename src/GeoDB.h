@@ -8,10 +8,20 @@
 #pragma GCC diagnostic ignored "-Wpedantic"
 #include <maxminddb.h>
 #pragma GCC diagnostic pop
+#include <array>
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
 
-#include "VisorLRUList.h"
+#include "GeoCache.h"
+#include "GeoPrefixTable.h"
+#include "IpKey.h"
 
 namespace visor::geo {
 
@@ -20,14 +30,57 @@ class MaxmindDB
     static constexpr size_t DEFAULT_CACHE_SIZE = 10000;
 
 public:
+    /**
+     * Interned lookup result, resolved with name(). Ids are never reused, they stay valid for the lifetime of the process,
+     * also across enable() calls
+     */
+    using Id = uint32_t;
+    static constexpr Id UNKNOWN_ID = 0;
+
+    // the kind of result a database is loaded for
+    enum Kind {
+        GeoLoc,
+        ASN,
+        KINDS_SIZE
+    };
+
+    /**
+     * @param kind what the database is loaded for, only these results are precompiled when flat. lookups of the other
+     * kind still work, through the MMDB search tree
+     */
+    explicit MaxmindDB(Kind kind = GeoLoc);
     ~MaxmindDB();
 
-    void enable(const std::string &database_filename, int cache_size = DEFAULT_CACHE_SIZE);
+    /**
+     * @param flat precompile the database into a GeoPrefixTable at load: constant time lookups without a cache, for a
+     * slower enable() and more memory. cache_size is ignored when flat
+     */
+    void enable(const std::string &database_filename, int cache_size = DEFAULT_CACHE_SIZE, bool flat = false);
     bool enabled() const
     {
         return _enabled;
     }
 
+    /**
+     * Reopen the database file if it changed on disk since it was loaded (e.g. a new GeoLite2 release was dropped in),
+     * and atomically swap it in. Lookups already running finish on the version they started with, each thread moves
+     * to the new version on its next lookup and the old one is released once those lookups are done.
+     * @return true if a new version was swapped in
+     * @throw std::runtime_error if the changed file can not be loaded, the current version then stays in use
+     */
+    bool reload_if_changed();
+
+    /*
+     * Lookups by binary address, returning interned ids. These go through the prefix table when flat, the address cache
+     * otherwise, and are safe to call concurrently from several threads. Callers are expected to check enabled() first
+     */
+    Id getGeoLocId(const IpKey &ip) const;
+    Id getASNId(const IpKey &ip) const;
+    const std::string &name(Id id) const;
+    GeoCacheStats cache_stats() const;
+    // bytes used by the precompiled prefix table, 0 if not flat
+    size_t table_size() const;
+
     /*
      * These routines accept both IPv4 and IPv6
      */
@@ -42,10 +95,66 @@ public:
     std::string getASNString(const struct sockaddr_in6 *sa6) const;
 
 private:
-    mutable MMDB_s _mmdb;
+    // one loaded version of the database file
+    struct Database {
+        MMDB_s mmdb;
+        std::unique_ptr<GeoPrefixTable> table;
+        // interned result of each table record, for the kind of the database
+        std::vector<Id> record_ids;
+        std::unique_ptr<GeoCache> cache;
+        // identity of the file, taken before it was opened
+        struct stat file_stat;
+
+        explicit Database(const std::string &filename);
+        ~Database();
+    };
+
+    // the version a thread last used. registered with its database, so _swap() can release the version of a thread
+    // which stopped doing lookups. the owning thread holds mutex for the duration of each lookup
+    struct Snapshot {
+        std::mutex mutex;
+        uint64_t generation{0};
+        std::shared_ptr<Database> db;
+    };
+
+    // a version pinned for one lookup
+    struct Pin {
+        std::unique_lock<std::mutex> lock;
+        Database *db;
+    };
+
+    const Kind _kind;
+
+    // replaced as a whole by reload_if_changed(). lookups use a per thread snapshot of it, see _acquire()
+    std::shared_ptr<Database> _current;
+    mutable std::mutex _current_mutex;
+    std::atomic<uint64_t> _generation{0};
+    const uint64_t _instance;
     bool _enabled = false;
-    std::unique_ptr<LRUList<std::string, std::string>> _lru_cache;
 
+    mutable std::mutex _snapshots_mutex;
+    mutable std::vector<std::shared_ptr<Snapshot>> _snapshots;
+
+    std::mutex _load_mutex;
+    std::string _filename;
+    int _cache_size{0};
+    bool _flat{false};
+
+    // interned lookup results, a deque so references returned by name() survive later insertions
+    mutable std::shared_mutex _names_mutex;
+    mutable std::deque<std::string> _names{"Unknown"};
+    mutable std::unordered_map<std::string, Id> _name_ids{{"Unknown", UNKNOWN_ID}};
+
+    std::unique_ptr<Database> _load(const std::string &filename, int cache_size, bool flat) const;
+    void _swap(std::unique_ptr<Database> db);
+    std::shared_ptr<Database> _current_db() const;
+    Pin _acquire() const;
+    void _release_snapshots();
+    Id _intern(std::string &&name) const;
+    Id _get(const IpKey &ip, Kind kind) const;
+    Id _lookup(const Database &db, const IpKey &ip, Kind kind) const;
+    std::string _format(MMDB_lookup_result_s *lookup, Kind kind) const;
+    static bool _parse(const char *ip_address, IpKey &ip);
     std::string _getGeoLocString(MMDB_lookup_result_s *lookup) const;
     std::string _getASNString(MMDB_lookup_result_s *lookup) const;
 };
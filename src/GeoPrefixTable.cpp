@@ -0,0 +1,146 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "GeoPrefixTable.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace visor::geo {
+
+GeoPrefixTable::GeoPrefixTable(const MMDB_s &mmdb)
+    : _mmdb(mmdb)
+{
+    // record index 0 is "not found"
+    _records.push_back(MMDB_entry_s{});
+
+    Record root{MMDB_RECORD_TYPE_SEARCH_NODE, 0, {}};
+
+    // in an IPv6 database the IPv4 space is ::/96
+    Record v4_root = root;
+    if (_mmdb.metadata.ip_version == 6) {
+        for (unsigned depth = 0; depth < 96 && v4_root.type == MMDB_RECORD_TYPE_SEARCH_NODE; ++depth) {
+            v4_root = _read(v4_root.value)[0];
+        }
+    }
+    std::vector<uint32_t> chunk(1u << ROOT_STRIDE);
+    _v4.resize(chunk.size());
+    _fill(chunk, 0, chunk.size(), v4_root, 0, ROOT_STRIDE, &GeoPrefixTable::_build_v4);
+    std::copy(chunk.begin(), chunk.end(), _v4.begin());
+
+    if (_mmdb.metadata.ip_version == 6) {
+        _v6_root.resize(1u << ROOT_STRIDE);
+        _fill(_v6_root, 0, _v6_root.size(), root, 0, ROOT_STRIDE, &GeoPrefixTable::_build_v6);
+    }
+
+    _v4.shrink_to_fit();
+    _v6_nodes.shrink_to_fit();
+    _records.shrink_to_fit();
+    _record_index = {};
+    _v6_built = {};
+}
+
+std::array<GeoPrefixTable::Record, 2> GeoPrefixTable::_read(uint64_t node) const
+{
+    if (node >= _mmdb.metadata.node_count) {
+        throw std::runtime_error("invalid search tree node " + std::to_string(node));
+    }
+    MMDB_search_node_s search_node;
+    if (auto status = MMDB_read_node(&_mmdb, static_cast<uint32_t>(node), &search_node); status != MMDB_SUCCESS) {
+        throw std::runtime_error(MMDB_strerror(status));
+    }
+    return {Record{search_node.left_record_type, search_node.left_record, search_node.left_record_entry},
+        Record{search_node.right_record_type, search_node.right_record, search_node.right_record_entry}};
+}
+
+uint32_t GeoPrefixTable::_leaf(const Record &record)
+{
+    switch (record.type) {
+    case MMDB_RECORD_TYPE_EMPTY:
+        return LEAF;
+    case MMDB_RECORD_TYPE_DATA: {
+        auto [it, inserted] = _record_index.emplace(record.entry.offset, static_cast<uint32_t>(_records.size()));
+        if (inserted) {
+            if (_records.size() >= LEAF) {
+                throw std::runtime_error("too many data records");
+            }
+            _records.push_back(record.entry);
+        }
+        return LEAF | it->second;
+    }
+    default:
+        throw std::runtime_error("invalid search tree record");
+    }
+}
+
+/**
+ * Sets chunk[begin, end) to the entries for the next `bits` bits below record, which sits `depth` bits deep. Entries
+ * that end on a search node are built by `below`.
+ */
+void GeoPrefixTable::_fill(std::vector<uint32_t> &chunk, size_t begin, size_t end, const Record &record, unsigned depth,
+    unsigned bits, uint32_t (GeoPrefixTable::*below)(const Record &, unsigned))
+{
+    if (record.type != MMDB_RECORD_TYPE_SEARCH_NODE) {
+        std::fill(chunk.begin() + begin, chunk.begin() + end, _leaf(record));
+        return;
+    }
+    if (bits == 0) {
+        chunk[begin] = (this->*below)(record, depth);
+        return;
+    }
+    auto children = _read(record.value);
+    auto middle = begin + (end - begin) / 2;
+    _fill(chunk, begin, middle, children[0], depth + 1, bits - 1, below);
+    _fill(chunk, middle, end, children[1], depth + 1, bits - 1, below);
+}
+
+uint32_t GeoPrefixTable::_build_v4(const Record &record, unsigned depth)
+{
+    if (record.type != MMDB_RECORD_TYPE_SEARCH_NODE) {
+        return _leaf(record);
+    }
+    if (depth >= 32) {
+        throw std::runtime_error("IPv4 search tree deeper than 32 bits");
+    }
+    std::vector<uint32_t> chunk(1u << V4_STRIDE);
+    _fill(chunk, 0, chunk.size(), record, depth, V4_STRIDE, &GeoPrefixTable::_build_v4);
+    if (std::all_of(chunk.begin(), chunk.end(), [&chunk](uint32_t entry) { return entry == chunk[0] && (entry & LEAF); })) {
+        return chunk[0];
+    }
+    auto offset = static_cast<uint32_t>(_v4.size());
+    if (offset + chunk.size() >= LEAF) {
+        throw std::runtime_error("IPv4 prefix table too large");
+    }
+    _v4.insert(_v4.end(), chunk.begin(), chunk.end());
+    return offset;
+}
+
+uint32_t GeoPrefixTable::_build_v6(const Record &record, unsigned depth)
+{
+    if (record.type != MMDB_RECORD_TYPE_SEARCH_NODE) {
+        return _leaf(record);
+    }
+    if (depth >= 128) {
+        throw std::runtime_error("IPv6 search tree deeper than 128 bits");
+    }
+    if (auto it = _v6_built.find(record.value); it != _v6_built.end()) {
+        return it->second;
+    }
+    auto children = _read(record.value);
+    auto left = _build_v6(children[0], depth + 1);
+    auto right = _build_v6(children[1], depth + 1);
+    uint32_t entry;
+    if (left == right && (left & LEAF)) {
+        entry = left;
+    } else {
+        entry = static_cast<uint32_t>(_v6_nodes.size());
+        if (entry >= LEAF) {
+            throw std::runtime_error("IPv6 prefix table too large");
+        }
+        _v6_nodes.push_back({left, right});
+    }
+    _v6_built.emplace(record.value, entry);
+    return entry;
+}
+
+}
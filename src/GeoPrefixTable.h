@@ -0,0 +1,114 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#include <maxminddb.h>
+#pragma GCC diagnostic pop
+#include "IpKey.h"
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace visor::geo {
+
+/**
+ * Longest prefix match table compiled from the search tree of an open MaxMind database, so lookups no longer walk the
+ * MMDB tree bit by bit.
+ *
+ * IPv4 uses a DIR-16-8-8 table: a 2^16 entry root indexed by the first 16 bits, with 256 entry chunks below it only
+ * where the database holds prefixes longer than /16 or /24. A lookup is at most three dependent reads.
+ *
+ * IPv6 uses a 2^16 entry root over the first 16 bits followed by a binary trie in a flat node array. Sibling leaves
+ * resolving to the same record are merged while building, and subtrees the database aliases (e.g. IPv4-mapped
+ * ranges) are shared.
+ *
+ * Lookups return a record index: 0 when the address is not in the database, otherwise an index into records(), one per
+ * distinct data record the tree points to. Owners resolve records to whatever they need once, after building.
+ */
+class GeoPrefixTable
+{
+    static constexpr uint32_t LEAF = 0x80000000;
+    static constexpr unsigned ROOT_STRIDE = 16;
+    static constexpr unsigned V4_STRIDE = 8;
+
+    struct Record {
+        uint8_t type;
+        uint64_t value;
+        MMDB_entry_s entry;
+    };
+
+    const MMDB_s &_mmdb;
+
+    // DIR-16-8-8, root at [0, 2^16), entries are either LEAF | record or the offset of a 256 entry chunk
+    std::vector<uint32_t> _v4;
+    // entries are either LEAF | record or an index in _v6_nodes
+    std::vector<uint32_t> _v6_root;
+    std::vector<std::array<uint32_t, 2>> _v6_nodes;
+
+    std::vector<MMDB_entry_s> _records;
+
+    // build time only
+    std::unordered_map<uint32_t, uint32_t> _record_index;
+    std::unordered_map<uint64_t, uint32_t> _v6_built;
+
+    std::array<Record, 2> _read(uint64_t node) const;
+    uint32_t _leaf(const Record &record);
+    void _fill(std::vector<uint32_t> &chunk, size_t begin, size_t end, const Record &record, unsigned depth, unsigned bits,
+        uint32_t (GeoPrefixTable::*below)(const Record &, unsigned));
+    uint32_t _build_v4(const Record &record, unsigned depth);
+    uint32_t _build_v6(const Record &record, unsigned depth);
+
+public:
+    /**
+     * Walks the whole search tree of mmdb, which has to stay open while building
+     * @throw std::runtime_error if the search tree is corrupt
+     */
+    explicit GeoPrefixTable(const MMDB_s &mmdb);
+
+    /**
+     * @return 0 if ip is not in the database, otherwise an index into records()
+     */
+    uint32_t lookup(const IpKey &ip) const
+    {
+        uint32_t entry;
+        if (ip.is_ipv4()) {
+            entry = _v4[(ip.addr[12] << 8) | ip.addr[13]];
+            if (!(entry & LEAF)) {
+                entry = _v4[entry + ip.addr[14]];
+                if (!(entry & LEAF)) {
+                    entry = _v4[entry + ip.addr[15]];
+                }
+            }
+        } else {
+            if (_v6_root.empty()) {
+                return 0;
+            }
+            entry = _v6_root[(ip.addr[0] << 8) | ip.addr[1]];
+            for (unsigned bit = ROOT_STRIDE; !(entry & LEAF); ++bit) {
+                entry = _v6_nodes[entry][(ip.addr[bit >> 3] >> (7 - (bit & 7))) & 1];
+            }
+        }
+        return entry & ~LEAF;
+    }
+
+    /**
+     * @return the data record of each record index, index 0 ("not found") holds no data
+     */
+    const std::vector<MMDB_entry_s> &records() const
+    {
+        return _records;
+    }
+
+    size_t memory_size() const
+    {
+        return (_v4.capacity() + _v6_root.capacity()) * sizeof(uint32_t) + _v6_nodes.capacity() * sizeof(_v6_nodes[0])
+            + _records.capacity() * sizeof(MMDB_entry_s);
+    }
+};
+
+}
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "AbstractModule.h"
+#include "CpuAccounting.h"
 #include "StreamHandler.h"
 #include <sigslot/signal.hpp>
 
@@ -20,6 +21,8 @@ class InputEventProxy : public Configurable
 protected:
     std::string _input_name;
     std::string _filter_hash;
+    // cost of dispatching events to the handlers attached to this proxy, see CpuScope
+    CpuAccount _cpu_account;
 
 public:
     InputEventProxy(const std::string &name, const Configurable &filter)
@@ -40,6 +43,11 @@ public:
         return _filter_hash;
     }
 
+    const CpuAccount &cpu_account() const
+    {
+        return _cpu_account;
+    }
+
     void policy_cb(const Policy *policy, Action action)
     {
         policy_signal(policy, action);
@@ -0,0 +1,162 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace visor {
+
+/**
+ * Fixed size binary IP address, for use as a TopN (or hash map) key where formatting a string per packet would be too
+ * costly. Formatting is left to output time, see to_string().
+ *
+ * IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d) so IPv4 and IPv6 can share one key type, and are formatted
+ * back in dotted form. The family is kept explicitly, so an IPv6 packet carrying a v4-mapped address stays an IPv6
+ * key, distinct from the IPv4 address it maps.
+ */
+struct IpKey {
+    std::array<uint8_t, 16> addr{};
+    uint8_t family{AF_INET6};
+
+    /**
+     * @param ipv4 address in network byte order, as returned by pcpp::IPv4Address::toInt()
+     */
+    static IpKey from_ipv4(uint32_t ipv4)
+    {
+        IpKey key;
+        key.family = AF_INET;
+        key.addr[10] = 0xff;
+        key.addr[11] = 0xff;
+        std::memcpy(&key.addr[12], &ipv4, sizeof(ipv4));
+        return key;
+    }
+
+    static IpKey from_ipv6(const uint8_t *ipv6)
+    {
+        IpKey key;
+        std::memcpy(key.addr.data(), ipv6, key.addr.size());
+        return key;
+    }
+
+    bool is_ipv4() const
+    {
+        return family == AF_INET;
+    }
+
+    std::string to_string() const
+    {
+        char buf[INET6_ADDRSTRLEN];
+        if (is_ipv4()) {
+            inet_ntop(AF_INET, &addr[12], buf, sizeof(buf));
+        } else {
+            inet_ntop(AF_INET6, addr.data(), buf, sizeof(buf));
+        }
+        return buf;
+    }
+
+    bool operator==(const IpKey &other) const
+    {
+        return family == other.family && addr == other.addr;
+    }
+
+    bool operator!=(const IpKey &other) const
+    {
+        return !(*this == other);
+    }
+
+    size_t hash() const
+    {
+        uint64_t hi, lo;
+        std::memcpy(&hi, addr.data(), sizeof(hi));
+        std::memcpy(&lo, addr.data() + sizeof(hi), sizeof(lo));
+        uint64_t h = hi ^ (lo * 0x9e3779b97f4a7c15ULL) ^ family;
+        // splitmix64 finalizer
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return static_cast<size_t>(h);
+    }
+};
+
+/**
+ * IpKey plus a port, formatted as "ip:port"
+ */
+struct IpPortKey {
+    IpKey ip;
+    uint16_t port{0};
+
+    std::string to_string() const
+    {
+        return ip.to_string() + ":" + std::to_string(port);
+    }
+
+    bool operator==(const IpPortKey &other) const
+    {
+        return port == other.port && ip == other.ip;
+    }
+
+    bool operator!=(const IpPortKey &other) const
+    {
+        return !(*this == other);
+    }
+
+    size_t hash() const
+    {
+        return ip.hash() ^ (static_cast<size_t>(port) * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// used by the default TopN::to_json() and to_prometheus(), handlers normally pass a formatter instead
+inline std::ostream &operator<<(std::ostream &os, const IpKey &key)
+{
+    return os << key.to_string();
+}
+
+inline std::ostream &operator<<(std::ostream &os, const IpPortKey &key)
+{
+    return os << key.to_string();
+}
+
+template <typename BasicJsonType>
+void to_json(BasicJsonType &j, const IpKey &key)
+{
+    j = key.to_string();
+}
+
+template <typename BasicJsonType>
+void to_json(BasicJsonType &j, const IpPortKey &key)
+{
+    j = key.to_string();
+}
+
+}
+
+namespace std {
+
+template <>
+struct hash<visor::IpKey> {
+    size_t operator()(const visor::IpKey &key) const
+    {
+        return key.hash();
+    }
+};
+
+template <>
+struct hash<visor::IpPortKey> {
+    size_t operator()(const visor::IpPortKey &key) const
+    {
+        return key.hash();
+    }
+};
+
+}
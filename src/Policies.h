@@ -65,7 +65,7 @@ public:
         _modules.push_back(m);
     }
 
-    const std::vector<AbstractRunnableModule *> &modules()
+    const std::vector<AbstractRunnableModule *> &modules() const
     {
         return _modules;
     }
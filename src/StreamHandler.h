@@ -6,6 +6,7 @@
 
 #include "AbstractMetricsManager.h"
 #include "AbstractModule.h"
+#include "CpuAccounting.h"
 #include <fmt/ostream.h>
 #include <nlohmann/json.hpp>
 #include <sstream>
@@ -26,6 +27,10 @@ public:
 class StreamHandler : public AbstractRunnableModule
 {
 
+protected:
+    // cost of this handler's event callbacks, including handlers chained after it, see CpuScope
+    CpuAccount _cpu_account;
+
 public:
     StreamHandler(const std::string &name)
         : AbstractRunnableModule(name)
@@ -34,6 +39,11 @@ public:
 
     virtual ~StreamHandler(){};
 
+    const CpuAccount &cpu_account() const
+    {
+        return _cpu_account;
+    }
+
     virtual size_t consumer_count() const = 0;
     virtual void window_json(json &j, uint64_t period, bool merged) = 0;
     virtual void window_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) = 0;
@@ -6,6 +6,8 @@
 
 namespace visor::handler::dhcp {
 
+static const std::string DHCP_BPF{"udp port 67 or udp port 68"};
+
 DhcpStreamHandler::DhcpStreamHandler(const std::string &name, InputEventProxy *proxy, const Configurable *window_config, StreamHandler *handler)
     : visor::StreamMetricsHandler<DhcpMetricsManager>(name, window_config)
 {
@@ -22,8 +24,9 @@ DhcpStreamHandler::DhcpStreamHandler(const std::string &name, InputEventProxy *p
 }
 
 // callback from input module
-void DhcpStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp)
+void DhcpStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp, [[maybe_unused]] const EnrichmentContext &enrichment)
 {
+    CpuScope scope(_cpu_account);
     pcpp::UdpLayer *udpLayer = payload.getLayerOfType<pcpp::UdpLayer>();
     assert(udpLayer);
 
@@ -48,6 +51,7 @@ void DhcpStreamHandler::start()
     }
 
     if (_pcap_proxy) {
+        _pcap_proxy->want_packets(DHCP_BPF);
         _pkt_udp_connection = _pcap_proxy->udp_signal.connect(&DhcpStreamHandler::process_udp_packet_cb, this);
         _start_tstamp_connection = _pcap_proxy->start_tstamp_signal.connect(&DhcpStreamHandler::set_start_tstamp, this);
         _end_tstamp_connection = _pcap_proxy->end_tstamp_signal.connect(&DhcpStreamHandler::set_end_tstamp, this);
@@ -68,6 +72,7 @@ void DhcpStreamHandler::stop()
         _start_tstamp_connection.disconnect();
         _end_tstamp_connection.disconnect();
         _heartbeat_connection.disconnect();
+        _pcap_proxy->release_packets(DHCP_BPF);
     }
 
     _running = false;
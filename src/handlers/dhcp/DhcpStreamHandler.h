@@ -92,7 +92,7 @@ class DhcpStreamHandler final : public visor::StreamMetricsHandler<DhcpMetricsMa
 
     sigslot::connection _heartbeat_connection;
 
-    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp);
+    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp, const EnrichmentContext &enrichment);
 
     void set_start_tstamp(timespec stamp);
     void set_end_tstamp(timespec stamp);
@@ -20,7 +20,11 @@
 
 namespace visor::handler::dns {
 
-thread_local DnsStreamHandler::DnsCacheData DnsStreamHandler::_cached_dns_layer;
+// the ports of DnsLayer::isDnsPort()
+static const std::string DNS_BPF{"port 53 or port 5353 or port 5355 or port 53000"};
+
+thread_local DnsStreamHandler::DnsCacheData DnsStreamHandler::_cached_dns_message;
+thread_local DnsWireMessage DnsStreamHandler::_tcp_dns_message;
 
 DnsStreamHandler::DnsStreamHandler(const std::string &name, InputEventProxy *proxy, const Configurable *window_config, StreamHandler *handler)
     : visor::StreamMetricsHandler<DnsMetricsManager>(name, window_config)
@@ -72,15 +76,16 @@ void DnsStreamHandler::start()
     }
     if (config_exists("only_qname_suffix")) {
         _f_enabled.set(Filters::OnlyQNameSuffix);
+        std::vector<std::string> suffixes;
         for (const auto &qname : config_get<StringList>("only_qname_suffix")) {
-            // note, this currently copies the strings, meaning there could be a big list that is duplicated
-            // we can work on trying to make this a string_view instead
             // we copy it out so that we don't have to hit the config mutex
             std::string qname_ci{qname};
             std::transform(qname_ci.begin(), qname_ci.end(), qname_ci.begin(),
                 [](unsigned char c) { return std::tolower(c); });
-            _f_qnames.emplace_back(std::move(qname_ci));
+            suffixes.emplace_back(std::move(qname_ci));
         }
+        // suffix lists can be large, match them all in one pass over the qname
+        _f_qnames = QnameSuffixTrie(suffixes);
     }
     if (config_exists("dnstap_msg_type")) {
         auto type = config_get<std::string>("dnstap_msg_type");
@@ -98,14 +103,32 @@ void DnsStreamHandler::start()
         }
     }
 
+    // DNS transaction tracking
+    unsigned int xact_ttl_secs{QueryResponsePairMgr::DEFAULT_TTL_SECS};
+    size_t xact_max_open{0};
+    if (config_exists("xact_ttl_secs")) {
+        auto ttl = config_get<uint64_t>("xact_ttl_secs");
+        if (ttl == 0 || ttl > std::numeric_limits<unsigned int>::max()) {
+            throw ConfigException("xact_ttl_secs must be a positive number of seconds");
+        }
+        xact_ttl_secs = static_cast<unsigned int>(ttl);
+    }
+    if (config_exists("xact_max_open")) {
+        xact_max_open = config_get<uint64_t>("xact_max_open");
+    }
+    _metrics->set_transaction_limits(xact_ttl_secs, xact_max_open);
+
     if (config_exists("recorded_stream")) {
         _metrics->set_recorded_stream();
     }
 
     if (_pcap_proxy) {
+        _pcap_proxy->want_packets(DNS_BPF);
         _pkt_udp_connection = _pcap_proxy->udp_signal.connect(&DnsStreamHandler::process_udp_packet_cb, this);
         _start_tstamp_connection = _pcap_proxy->start_tstamp_signal.connect(&DnsStreamHandler::set_start_tstamp, this);
         _end_tstamp_connection = _pcap_proxy->end_tstamp_signal.connect(&DnsStreamHandler::set_end_tstamp, this);
+        // only DNS connections are reassembled on our behalf
+        _pcap_proxy->want_tcp_ports(DnsLayer::isDnsPort);
         _tcp_start_connection = _pcap_proxy->tcp_connection_start_signal.connect(&DnsStreamHandler::tcp_connection_start_cb, this);
         _tcp_end_connection = _pcap_proxy->tcp_connection_end_signal.connect(&DnsStreamHandler::tcp_connection_end_cb, this);
         _tcp_message_connection = _pcap_proxy->tcp_message_ready_signal.connect(&DnsStreamHandler::tcp_message_ready_cb, this);
@@ -131,6 +154,8 @@ void DnsStreamHandler::stop()
         _tcp_start_connection.disconnect();
         _tcp_end_connection.disconnect();
         _tcp_message_connection.disconnect();
+        _pcap_proxy->release_tcp_ports(DnsLayer::isDnsPort);
+        _pcap_proxy->release_packets(DNS_BPF);
     } else if (_dnstap_proxy) {
         _dnstap_connection.disconnect();
     }
@@ -142,6 +167,7 @@ void DnsStreamHandler::stop()
 // callback from input module
 void DnsStreamHandler::process_dnstap_cb(const dnstap::Dnstap &d, [[maybe_unused]] size_t size)
 {
+    CpuScope scope(_cpu_account);
     if (_f_enabled[Filters::DnstapMsgType] && !_f_dnstap_types[d.message().type()]) {
         _metrics->process_dnstap(d, true);
     } else {
@@ -150,8 +176,9 @@ void DnsStreamHandler::process_dnstap_cb(const dnstap::Dnstap &d, [[maybe_unused
 }
 
 // callback from input module
-void DnsStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp)
+void DnsStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp, const EnrichmentContext &enrichment)
 {
+    CpuScope scope(_cpu_account);
     pcpp::UdpLayer *udpLayer = payload.getLayerOfType<pcpp::UdpLayer>();
     assert(udpLayer);
 
@@ -166,19 +193,58 @@ void DnsStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirect
         metric_port = dst_port;
     }
     if (metric_port) {
-        if (flowkey != _cached_dns_layer.flowKey || stamp.tv_sec != _cached_dns_layer.timestamp.tv_sec || stamp.tv_nsec != _cached_dns_layer.timestamp.tv_nsec) {
-            _cached_dns_layer.flowKey = flowkey;
-            _cached_dns_layer.timestamp = stamp;
-            _cached_dns_layer.dnsLayer = std::make_unique<DnsLayer>(udpLayer, &payload);
-        }
-        auto dnsLayer = _cached_dns_layer.dnsLayer.get();
-        if (!_filtering(*dnsLayer, dir, l3, pcpp::UDP, metric_port, stamp)) {
-            _metrics->process_dns_layer(*dnsLayer, dir, l3, pcpp::UDP, flowkey, metric_port, _static_suffix_size, stamp);
+        if (flowkey != _cached_dns_message.flowKey || stamp.tv_sec != _cached_dns_message.timestamp.tv_sec || stamp.tv_nsec != _cached_dns_message.timestamp.tv_nsec) {
+            _cached_dns_message.flowKey = flowkey;
+            _cached_dns_message.timestamp = stamp;
+            // a payload too short for a DNS header is still counted, see DnsMetricsBucket::process_dns_layer
+            _cached_dns_message.message.parse(udpLayer->getData() + sizeof(pcpp::udphdr), udpLayer->getDataLen() - sizeof(pcpp::udphdr));
+        }
+        const auto &message = _cached_dns_message.message;
+        if (!_filtering(message, dir, l3, pcpp::UDP, metric_port, stamp)) {
+            _metrics->process_dns_layer(message, dir, l3, pcpp::UDP, flowkey, metric_port, _static_suffix_size, stamp);
             _static_suffix_size = 0;
             // signal for chained stream handlers, if we have any
-            udp_signal(payload, dir, l3, flowkey, stamp);
+            udp_signal(payload, dir, l3, flowkey, stamp, enrichment);
+        }
+    }
+}
+
+static inline uint16_t read_msg_size(const uint8_t *data)
+{
+    // dns packet size is in network byte order.
+    return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+// feed the message staged by a previous segment, returns false if it is still incomplete or the stream is invalid
+bool TcpSessionData::_complete_partial(const uint8_t *&data, size_t &len)
+{
+    auto consume = [this, &data, &len](size_t want) {
+        auto take = std::min(want, len);
+        _partial.insert(_partial.end(), data, data + take);
+        data += take;
+        len -= take;
+    };
+
+    if (_partial.size() < sizeof(uint16_t)) {
+        consume(sizeof(uint16_t) - _partial.size());
+        if (_partial.size() < sizeof(uint16_t)) {
+            return false;
         }
     }
+    auto size = read_msg_size(_partial.data());
+    if (size < MIN_DNS_QUERY_SIZE) {
+        _partial.clear();
+        _invalid_data = true;
+        return false;
+    }
+    consume(sizeof(size) + size - _partial.size());
+    if (_partial.size() < sizeof(size) + size) {
+        return false;
+    }
+    _got_dns_msg(_partial.data() + sizeof(size), size);
+    // keeps the capacity for the next straddling message
+    _partial.clear();
+    return true;
 }
 
 void TcpSessionData::receive_dns_wire_data(const uint8_t *data, size_t len)
@@ -187,40 +253,36 @@ void TcpSessionData::receive_dns_wire_data(const uint8_t *data, size_t len)
         return;
     }
 
-    _buffer.append(reinterpret_cast<const char *>(data), len);
-
-    for (;;) {
-        std::uint16_t size;
-
-        // if buffer size < min DNS size, we know we need more data
-        if (_buffer.size() < MIN_DNS_QUERY_SIZE + sizeof(size)) {
-            break;
-        }
+    if (!_partial.empty() && !_complete_partial(data, len)) {
+        return;
+    }
 
-        // dns packet size is in network byte order.
-        size = static_cast<unsigned char>(_buffer[1]) | static_cast<unsigned char>(_buffer[0]) << 8;
+    while (len >= sizeof(uint16_t)) {
+        auto size = read_msg_size(data);
 
         // if size is less than MIN_DNS_QUERY_SIZE, it is not a dns packet
         if (size < MIN_DNS_QUERY_SIZE) {
-            _buffer.clear();
             _invalid_data = true;
-            break;
+            return;
         }
 
-        if (_buffer.size() >= sizeof(size) + size) {
-            auto data = std::make_unique<uint8_t[]>(size);
-            std::memcpy(data.get(), _buffer.data() + sizeof(size), size);
-            _buffer.erase(0, sizeof(size) + size);
-            _got_dns_msg(std::move(data), size);
-        } else {
+        if (len < sizeof(size) + size) {
             // Nope, we need more data.
             break;
         }
+        _got_dns_msg(data + sizeof(size), size);
+        data += sizeof(size) + size;
+        len -= sizeof(size) + size;
+    }
+
+    if (len) {
+        _partial.assign(data, data + len);
     }
 }
 
 void DnsStreamHandler::tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData)
 {
+    CpuScope scope(_cpu_account);
     auto flowKey = tcpData.getConnectionData().flowKey;
 
     // check if this flow already appears in the connection manager. If not add it
@@ -252,16 +314,12 @@ void DnsStreamHandler::tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamDa
     TIMEVAL_TO_TIMESPEC(&tcpData.getConnectionData().endTime, &stamp);
     auto dir = (side == 0) ? PacketDirection::fromHost : PacketDirection::toHost;
 
-    auto got_dns_message = [this, port, dir, l3Type, flowKey, stamp](std::unique_ptr<uint8_t[]> data, size_t size) {
-        // this dummy packet prevents DnsLayer from owning and trying to free the data. it is otherwise unused by the DNS layer,
-        // instead using the packet meta data we pass in
-        pcpp::Packet dummy_packet;
-        DnsLayer dnsLayer(data.get(), size, nullptr, &dummy_packet);
-        if (!_filtering(dnsLayer, dir, l3Type, pcpp::UDP, port, stamp)) {
-            _metrics->process_dns_layer(dnsLayer, dir, l3Type, pcpp::TCP, flowKey, port, _static_suffix_size, stamp);
+    auto got_dns_message = [this, port, dir, l3Type, flowKey, stamp](const uint8_t *data, size_t size) {
+        _tcp_dns_message.parse(data, size);
+        if (!_filtering(_tcp_dns_message, dir, l3Type, pcpp::UDP, port, stamp)) {
+            _metrics->process_dns_layer(_tcp_dns_message, dir, l3Type, pcpp::TCP, flowKey, port, _static_suffix_size, stamp);
             _static_suffix_size = 0;
         }
-        // data is freed upon return
     };
 
     if (!iter->second.sessionData[side]) {
@@ -273,6 +331,7 @@ void DnsStreamHandler::tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamDa
 
 void DnsStreamHandler::tcp_connection_start_cb(const pcpp::ConnectionData &connectionData)
 {
+    CpuScope scope(_cpu_account);
     // look for the connection
     auto iter = _tcp_connections.find(connectionData.flowKey);
 
@@ -292,6 +351,7 @@ void DnsStreamHandler::tcp_connection_start_cb(const pcpp::ConnectionData &conne
 
 void DnsStreamHandler::tcp_connection_end_cb(const pcpp::ConnectionData &connectionData, [[maybe_unused]] pcpp::TcpReassembly::ConnectionEndReason reason)
 {
+    CpuScope scope(_cpu_account);
     // find the connection in the connections by the flow key
     auto iter = _tcp_connections.find(connectionData.flowKey);
 
@@ -315,34 +375,27 @@ void DnsStreamHandler::info_json(json &j) const
 {
     common_info_json(j);
     j[schema_key()]["xact"]["open"] = _metrics->num_open_transactions();
+    j[schema_key()]["xact"]["overflow"] = _metrics->num_overflow_transactions();
 }
-static inline bool endsWith(std::string_view str, std::string_view suffix)
-{
-    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
-bool DnsStreamHandler::_filtering(DnsLayer &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] uint16_t port, timespec stamp)
+bool DnsStreamHandler::_filtering(const DnsWireMessage &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] uint16_t port, timespec stamp)
 {
-    if (_f_enabled[Filters::ExcludingRCode] && payload.getDnsHeader()->responseCode == _f_rcode) {
+    // a message without a header has no rcode to match
+    if (_f_enabled[Filters::ExcludingRCode] && payload.has_header() && payload.rcode() == _f_rcode) {
         goto will_filter;
-    } else if (_f_enabled[Filters::OnlyRCode] && payload.getDnsHeader()->responseCode != _f_rcode) {
+    } else if (_f_enabled[Filters::OnlyRCode] && (!payload.has_header() || payload.rcode() != _f_rcode)) {
         goto will_filter;
     }
     if (_f_enabled[Filters::OnlyQNameSuffix]) {
-        if (!payload.parseResources(true) || payload.getFirstQuery() == nullptr) {
+        if (!payload.has_question()) {
             goto will_filter;
         }
-        std::string_view qname_ci = payload.getFirstQuery()->getNameLower();
-        for (const auto &fqn : _f_qnames) {
-            // if it matched, we know we are not filtering
-            if (endsWith(qname_ci, fqn)) {
-                _static_suffix_size = fqn.size();
-                goto will_not_filter;
-            }
+        auto suffix_size = _f_qnames.match(payload.qname_lower());
+        if (!suffix_size) {
+            // none of the suffixes matched: filter
+            goto will_filter;
         }
-        // checked the whole list and none of them matched: filter
-        goto will_filter;
+        _static_suffix_size = *suffix_size;
     }
-will_not_filter:
     return false;
 will_filter:
     _metrics->process_filtered(stamp);
@@ -528,25 +581,24 @@ void DnsMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload)
         port = payload.message().query_port();
     }
 
+    // the wire message is decoded in place from the protobuf field, without a copy
+    thread_local DnsWireMessage dpayload;
+    const std::string *wire{nullptr};
     if (side == QR::query && payload.message().has_query_message()) {
-        auto query = payload.message().query_message();
-        uint8_t *buf = new uint8_t[query.size()];
-        std::memcpy(buf, query.c_str(), query.size());
-        // DnsLayer takes ownership of buf
-        DnsLayer dpayload(buf, query.size(), nullptr, nullptr);
-        lock.unlock();
-        process_dns_layer(deep, dpayload, l3, l4, port);
+        wire = &payload.message().query_message();
     } else if (side == QR::response && payload.message().has_response_message()) {
-        auto query = payload.message().response_message();
-        uint8_t *buf = new uint8_t[query.size()];
-        std::memcpy(buf, query.c_str(), query.size());
-        // DnsLayer takes ownership of buf
-        DnsLayer dpayload(buf, query.size(), nullptr, nullptr);
+        wire = &payload.message().response_message();
+    }
+    if (wire) {
         lock.unlock();
-        process_dns_layer(deep, dpayload, l3, l4, port);
+        if (dpayload.parse(reinterpret_cast<const uint8_t *>(wire->data()), wire->size())) {
+            process_dns_layer(deep, dpayload, l3, l4, port);
+        } else {
+            process_dns_layer(l3, l4, side, port);
+        }
     }
 }
-void DnsMetricsBucket::process_dns_layer(bool deep, DnsLayer &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, size_t suffix_size)
+void DnsMetricsBucket::process_dns_layer(bool deep, const DnsWireMessage &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, size_t suffix_size)
 {
     std::unique_lock lock(_mutex);
 
@@ -574,9 +626,11 @@ void DnsMetricsBucket::process_dns_layer(bool deep, DnsLayer &payload, pcpp::Pro
             break;
         }
 
-        if (payload.getDnsHeader()->queryOrResponse == QR::response) {
+        if (!payload.has_header()) {
+            // too short for a header: counted on the wire only, as neither a query nor a reply
+        } else if (payload.is_response()) {
             ++_counters.replies;
-            switch (payload.getDnsHeader()->responseCode) {
+            switch (payload.rcode()) {
             case NoError:
                 ++_counters.NOERROR;
                 break;
@@ -603,45 +657,43 @@ void DnsMetricsBucket::process_dns_layer(bool deep, DnsLayer &payload, pcpp::Pro
         _dns_topUDPPort.update(port);
     }
 
-    auto success = payload.parseResources(true);
-    if (!success) {
+    if (!payload.resources_valid()) {
         return;
     }
 
-    if (payload.getDnsHeader()->queryOrResponse == response) {
-        _dns_topRCode.update(payload.getDnsHeader()->responseCode);
+    if (payload.is_response()) {
+        _dns_topRCode.update(payload.rcode());
     }
 
-    auto query = payload.getFirstQuery();
-    if (query) {
+    if (payload.has_question()) {
 
-        auto name = query->getNameLower();
+        auto name = payload.qname_lower();
 
-        if (group_enabled(group::DnsMetrics::Cardinality)) {
-            _dns_qnameCard.update(name);
+        if (group_enabled(group::DnsMetrics::Cardinality) && name.size()) {
+            _dns_qnameCard.update(name.data(), static_cast<int>(name.size()));
         }
 
-        _dns_topQType.update(query->getDnsType());
+        _dns_topQType.update(payload.qtype());
 
         if (group_enabled(group::DnsMetrics::TopQnames)) {
-            if (payload.getDnsHeader()->queryOrResponse == response) {
-                switch (payload.getDnsHeader()->responseCode) {
+            if (payload.is_response()) {
+                switch (payload.rcode()) {
                 case SrvFail:
-                    _dns_topSRVFAIL.update(name);
+                    _dns_topSRVFAIL.update(_qname(name));
                     break;
                 case NXDomain:
-                    _dns_topNX.update(name);
+                    _dns_topNX.update(_qname(name));
                     break;
                 case Refused:
-                    _dns_topREFUSED.update(name);
+                    _dns_topREFUSED.update(_qname(name));
                     break;
                 }
             }
 
-            auto aggDomain = aggregateDomain(name, suffix_size);
-            _dns_topQname2.update(std::string(aggDomain.first));
+            auto aggDomain = aggregateDomain(payload, suffix_size);
+            _dns_topQname2.update(_qname(aggDomain.first));
             if (aggDomain.second.size()) {
-                _dns_topQname3.update(std::string(aggDomain.second));
+                _dns_topQname3.update(_qname(aggDomain.second));
             }
         }
     }
@@ -687,7 +739,7 @@ void DnsMetricsBucket::process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR
     }
 }
 
-void DnsMetricsBucket::new_dns_transaction(bool deep, float to90th, float from90th, DnsLayer &dns, PacketDirection dir, DnsTransaction xact)
+void DnsMetricsBucket::new_dns_transaction(bool deep, float to90th, float from90th, const DnsWireMessage &dns, PacketDirection dir, DnsTransaction xact)
 {
 
     uint64_t xactTime = ((xact.totalTS.tv_sec * 1'000'000'000L) + xact.totalTS.tv_nsec) / 1'000; // nanoseconds to microseconds
@@ -709,17 +761,13 @@ void DnsMetricsBucket::new_dns_transaction(bool deep, float to90th, float from90
         }
     }
 
-    if (deep) {
-        auto query = dns.getFirstQuery();
-        if (query) {
-            auto name = query->getName();
-            // dir is the direction of the last packet, meaning the reply so from a transaction perspective
-            // we look at it from the direction of the query, so the opposite side than we have here
-            if (dir == PacketDirection::toHost && from90th > 0 && xactTime >= from90th) {
-                _dns_slowXactOut.update(name);
-            } else if (dir == PacketDirection::fromHost && to90th > 0 && xactTime >= to90th) {
-                _dns_slowXactIn.update(name);
-            }
+    if (deep && dns.has_question()) {
+        // dir is the direction of the last packet, meaning the reply so from a transaction perspective
+        // we look at it from the direction of the query, so the opposite side than we have here
+        if (dir == PacketDirection::toHost && from90th > 0 && xactTime >= from90th) {
+            _dns_slowXactOut.update(_qname(dns.qname()));
+        } else if (dir == PacketDirection::fromHost && to90th > 0 && xactTime >= to90th) {
+            _dns_slowXactIn.update(_qname(dns.qname()));
         }
     }
 }
@@ -800,22 +848,22 @@ void DnsMetricsBucket::process_filtered()
 }
 
 // the general metrics manager entry point (both UDP and TCP)
-void DnsMetricsManager::process_dns_layer(DnsLayer &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t port, size_t suffix_size, timespec stamp)
+void DnsMetricsManager::process_dns_layer(const DnsWireMessage &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t port, size_t suffix_size, timespec stamp)
 {
     // base event
     new_event(stamp);
     // process in the "live" bucket. this will parse the resources if we are deep sampling
     live_bucket()->process_dns_layer(_deep_sampling_now, payload, l3, static_cast<Protocol>(l4), port, suffix_size);
 
-    if (group_enabled(group::DnsMetrics::DnsTransactions)) {
+    if (group_enabled(group::DnsMetrics::DnsTransactions) && payload.has_header()) {
         // handle dns transactions (query/response pairs)
-        if (payload.getDnsHeader()->queryOrResponse == QR::response) {
-            auto xact = _qr_pair_manager.maybe_end_transaction(flowkey, payload.getDnsHeader()->transactionID, stamp);
+        if (payload.is_response()) {
+            auto xact = _qr_pair_manager.maybe_end_transaction(flowkey, payload.transaction_id(), stamp);
             if (xact.first) {
                 live_bucket()->new_dns_transaction(_deep_sampling_now, _to90th, _from90th, payload, dir, xact.second);
             }
         } else {
-            _qr_pair_manager.start_transaction(flowkey, payload.getDnsHeader()->transactionID, stamp);
+            _qr_pair_manager.start_transaction(flowkey, payload.transaction_id(), stamp);
         }
     }
 }
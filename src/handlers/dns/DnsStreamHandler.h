@@ -7,6 +7,7 @@
 #include "AbstractMetricsManager.h"
 #include "MockInputStream.h"
 #include "PcapInputStream.h"
+#include "QnameSuffixTrie.h"
 #include "StreamHandler.h"
 #include "dns.h"
 #include "dnstap.pb.h"
@@ -15,6 +16,7 @@
 #include <bitset>
 #include <limits>
 #include <string>
+#include <vector>
 
 namespace visor::input::dnstap {
 class DnstapInputEventProxy;
@@ -66,6 +68,14 @@ protected:
     TopN<std::string> _dns_slowXactIn;
     TopN<std::string> _dns_slowXactOut;
 
+    // reused to pass qnames to the TopNs, which only copy a key the first time they see it. guarded by _mutex
+    std::string _qname_key;
+    const std::string &_qname(std::string_view name)
+    {
+        _qname_key.assign(name.data(), name.size());
+        return _qname_key;
+    }
+
     struct counters {
         Counter xacts_total;
         Counter xacts_in;
@@ -126,6 +136,7 @@ public:
         set_event_rate_info("dns", {"rates", "total"}, "Rate of all DNS wire packets (combined ingress and egress) per second");
         set_num_events_info("dns", {"wire_packets", "total"}, "Total DNS wire packets");
         set_num_sample_info("dns", {"wire_packets", "deep_samples"}, "Total DNS wire packets that were sampled for deep inspection");
+        _qname_key.reserve(DnsWireMessage::MAX_NAME_SIZE);
     }
 
     auto get_xact_data_locked() const
@@ -171,11 +182,11 @@ public:
     }
 
     void process_filtered();
-    void process_dns_layer(bool deep, DnsLayer &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, size_t suffix_size = 0);
+    void process_dns_layer(bool deep, const DnsWireMessage &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, size_t suffix_size = 0);
     void process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR side, uint16_t port);
     void process_dnstap(bool deep, const dnstap::Dnstap &payload);
 
-    void new_dns_transaction(bool deep, float to90th, float from90th, DnsLayer &dns, PacketDirection dir, DnsTransaction xact);
+    void new_dns_transaction(bool deep, float to90th, float from90th, const DnsWireMessage &dns, PacketDirection dir, DnsTransaction xact);
 };
 
 class DnsMetricsManager final : public visor::AbstractMetricsManager<DnsMetricsBucket>
@@ -212,22 +223,43 @@ public:
         return _qr_pair_manager.open_transaction_count();
     }
 
+    uint64_t num_overflow_transactions() const
+    {
+        return _qr_pair_manager.overflow_count();
+    }
+
+    void set_transaction_limits(unsigned int ttl_secs, size_t max_open)
+    {
+        _qr_pair_manager.set_ttl_secs(ttl_secs);
+        _qr_pair_manager.set_max_open(max_open);
+    }
+
     void process_filtered(timespec stamp);
-    void process_dns_layer(DnsLayer &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t port, size_t suffix_size, timespec stamp);
+    void process_dns_layer(const DnsWireMessage &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t port, size_t suffix_size, timespec stamp);
     void process_dnstap(const dnstap::Dnstap &payload, bool filtered);
 };
 
+/**
+ * Splits a reassembled DNS over TCP stream into length prefixed messages.
+ *
+ * Messages which lie entirely within one segment are handed to the callback in place. Only a message straddling
+ * segments is staged, in a buffer which is reused for the life of the session.
+ */
 class TcpSessionData final
 {
 public:
     static constexpr size_t MIN_DNS_QUERY_SIZE = 17;
-    using got_msg_cb = std::function<void(std::unique_ptr<uint8_t[]> data, size_t size)>;
+    // data is only valid for the duration of the call
+    using got_msg_cb = std::function<void(const uint8_t *data, size_t size)>;
 
 private:
-    std::string _buffer;
+    // length prefix and the part of the message received so far
+    std::vector<uint8_t> _partial;
     got_msg_cb _got_dns_msg;
     bool _invalid_data;
 
+    bool _complete_partial(const uint8_t *&data, size_t &len);
+
 public:
     TcpSessionData(
         got_msg_cb got_data_handler)
@@ -238,6 +270,11 @@ public:
 
     // called from pcpp::TcpReassembly callback, matches types
     void receive_dns_wire_data(const uint8_t *data, size_t len);
+
+    size_t buffered_size() const
+    {
+        return _partial.size();
+    }
 };
 
 struct TcpFlowData {
@@ -257,12 +294,14 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
 {
     static constexpr size_t DNSTAP_TYPE_SIZE = 15;
 
+    // per thread decode arenas: the UDP one is shared by all handlers attached to the same input, keyed by packet
     struct DnsCacheData {
         uint32_t flowKey = 0;
         timespec timestamp = timespec();
-        std::unique_ptr<DnsLayer> dnsLayer;
+        DnsWireMessage message;
     };
-    static thread_local DnsCacheData _cached_dns_layer;
+    static thread_local DnsCacheData _cached_dns_message;
+    static thread_local DnsWireMessage _tcp_dns_message;
 
     // the input event proxy we support (only one will be in use at a time)
     PcapInputEventProxy *_pcap_proxy{nullptr};
@@ -284,7 +323,7 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
 
     sigslot::connection _heartbeat_connection;
 
-    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp);
+    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp, const EnrichmentContext &enrichment);
     void process_dnstap_cb(const dnstap::Dnstap &, size_t);
     void tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData);
     void tcp_connection_start_cb(const pcpp::ConnectionData &connectionData);
@@ -311,7 +350,7 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
     };
     std::bitset<Filters::FiltersMAX> _f_enabled;
     uint16_t _f_rcode{0};
-    std::vector<std::string> _f_qnames;
+    QnameSuffixTrie _f_qnames;
     size_t _static_suffix_size{0};
     std::bitset<DNSTAP_TYPE_SIZE> _f_dnstap_types;
 
@@ -321,7 +360,7 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
         {"dns_transaction", group::DnsMetrics::DnsTransactions},
         {"top_qnames", group::DnsMetrics::TopQnames}};
 
-    bool _filtering(DnsLayer &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint16_t port, timespec stamp);
+    bool _filtering(const DnsWireMessage &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint16_t port, timespec stamp);
 
 public:
     DnsStreamHandler(const std::string &name, InputEventProxy *proxy, const Configurable *window_config, StreamHandler *handler = nullptr);
@@ -342,7 +381,7 @@ public:
     void stop() override;
     void info_json(json &j) const override;
 
-    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, uint32_t, timespec> udp_signal;
+    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, uint32_t, timespec, const EnrichmentContext &> udp_signal;
 };
 
 }
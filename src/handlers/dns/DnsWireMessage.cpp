@@ -0,0 +1,130 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "DnsWireMessage.h"
+#include "qname.h"
+#include <cstring>
+
+namespace visor::handler::dns {
+
+static inline uint16_t read_be16(const uint8_t *p)
+{
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+bool DnsWireMessage::parse(const uint8_t *data, size_t len)
+{
+    _id = _flags = 0;
+    _qdcount = _ancount = _nscount = _arcount = 0;
+    _has_header = false;
+    _resources_valid = false;
+    _has_question = false;
+    _qtype = 0;
+    _qclass = 0;
+    _question_size = 0;
+    _name_size = 0;
+    _label_count = 0;
+
+    if (data == nullptr || len < HEADER_SIZE) {
+        return false;
+    }
+
+    _id = read_be16(data);
+    _flags = read_be16(data + 2);
+    _qdcount = read_be16(data + 4);
+    _ancount = read_be16(data + 6);
+    _nscount = read_be16(data + 8);
+    _arcount = read_be16(data + 10);
+    _has_header = true;
+
+    uint32_t total_resources = static_cast<uint32_t>(_qdcount) + _ancount + _nscount + _arcount;
+    if (total_resources > MAX_RESOURCES) {
+        // probably bad packet
+        return true;
+    }
+
+    if (_qdcount == 0) {
+        _resources_valid = true;
+        return true;
+    }
+
+    _resources_valid = _has_question = _parse_question(data, len);
+    if (!_has_question) {
+        _name_size = 0;
+        _label_count = 0;
+    }
+    return true;
+}
+
+bool DnsWireMessage::_parse_question(const uint8_t *data, size_t len)
+{
+    size_t pos = HEADER_SIZE;
+    // wire offset just past the name as it appears in the question: after the first pointer or the root label
+    size_t name_end = 0;
+    int hops = 0;
+
+    for (;;) {
+        if (pos >= len) {
+            return false;
+        }
+        uint8_t label_len = data[pos];
+
+        if ((label_len & 0xc0) == 0xc0) {
+            // compression pointer
+            if (pos + 1 >= len) {
+                return false;
+            }
+            size_t target = static_cast<size_t>(label_len & 0x3f) << 8 | data[pos + 1];
+            if (name_end == 0) {
+                name_end = pos + 2;
+            }
+            if (target < HEADER_SIZE || target >= len || ++hops > MAX_POINTER_HOPS) {
+                return false;
+            }
+            pos = target;
+            continue;
+        } else if (label_len & 0xc0) {
+            // extended and binary label types are obsolete
+            return false;
+        }
+
+        if (label_len == 0) {
+            if (name_end == 0) {
+                name_end = pos + 1;
+            }
+            break;
+        }
+
+        if (pos + 1 + label_len > len) {
+            return false;
+        }
+        size_t out = _name_size;
+        if (out) {
+            if (out + 1 + label_len > MAX_NAME_SIZE) {
+                return false;
+            }
+            _name[out++] = '.';
+        } else if (label_len > MAX_NAME_SIZE) {
+            return false;
+        }
+        std::memcpy(_name + out, data + pos + 1, label_len);
+        _name_size = out + label_len;
+        pos += 1 + label_len;
+    }
+
+    // lowercase and find label boundaries in one pass over the decoded name. names failing its validation are still
+    // counted as they appear on the wire, like DnsLayer does
+    normalize_qname(_name, _name_size, _name_lower, _label_offsets, _label_count);
+
+    // qtype and qclass follow the name
+    if (name_end + 2 * sizeof(uint16_t) > len) {
+        return false;
+    }
+    _qtype = read_be16(data + name_end);
+    _qclass = read_be16(data + name_end + 2);
+    _question_size = name_end + 2 * sizeof(uint16_t) - HEADER_SIZE;
+    return true;
+}
+
+}
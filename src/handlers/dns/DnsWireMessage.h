@@ -0,0 +1,187 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace visor::handler::dns {
+
+/**
+ * Flat, allocation free decoding of the DNS header and first question from wire format.
+ *
+ * All storage is inline and fixed size, so an instance is meant to be reused as a per thread arena: parse() overwrites
+ * the previous contents and the accessors return views into this object, which stay valid until the next parse().
+ * The decoded qname is lowercased and split into labels in a single pass (see normalize_qname).
+ *
+ * This covers what the metrics hot path needs; DnsLayer remains available for full resource parsing.
+ */
+class DnsWireMessage
+{
+public:
+    static constexpr size_t HEADER_SIZE = 12;
+    static constexpr size_t MAX_NAME_SIZE = 255;
+    // one label per dot plus one, since label bytes may themselves contain dots
+    static constexpr size_t MAX_LABELS = MAX_NAME_SIZE + 1;
+    static constexpr int MAX_POINTER_HOPS = 20;
+    // same sanity limit DnsLayer::parseResources applies to the total record count
+    static constexpr uint32_t MAX_RESOURCES = 100;
+
+private:
+    uint16_t _id{0};
+    uint16_t _flags{0};
+    uint16_t _qdcount{0};
+    uint16_t _ancount{0};
+    uint16_t _nscount{0};
+    uint16_t _arcount{0};
+    bool _has_header{false};
+    bool _resources_valid{false};
+    bool _has_question{false};
+
+    uint16_t _qtype{0};
+    uint16_t _qclass{0};
+    size_t _question_size{0};
+
+    size_t _name_size{0};
+    size_t _label_count{0};
+    uint8_t _label_offsets[MAX_LABELS];
+    char _name[MAX_NAME_SIZE + 1];
+    char _name_lower[MAX_NAME_SIZE + 1];
+
+    bool _parse_question(const uint8_t *data, size_t len);
+
+public:
+    DnsWireMessage() = default;
+    DnsWireMessage(const DnsWireMessage &) = delete;
+    DnsWireMessage &operator=(const DnsWireMessage &) = delete;
+
+    /**
+     * Decode the header and first question of a DNS message in wire format. Does not allocate and does not keep a
+     * reference to data.
+     * @return false if the data is too short to hold a DNS header, true otherwise. Whether the question section could
+     * be decoded is reported separately by resources_valid() and has_question()
+     */
+    bool parse(const uint8_t *data, size_t len);
+
+    bool has_header() const
+    {
+        return _has_header;
+    }
+
+    // header
+    uint16_t transaction_id() const
+    {
+        return _id;
+    }
+    bool is_response() const
+    {
+        return _flags & 0x8000;
+    }
+    uint8_t opcode() const
+    {
+        return (_flags >> 11) & 0x0f;
+    }
+    bool authoritative_answer() const
+    {
+        return _flags & 0x0400;
+    }
+    bool truncated() const
+    {
+        return _flags & 0x0200;
+    }
+    bool recursion_desired() const
+    {
+        return _flags & 0x0100;
+    }
+    bool recursion_available() const
+    {
+        return _flags & 0x0080;
+    }
+    bool authentic_data() const
+    {
+        return _flags & 0x0020;
+    }
+    bool checking_disabled() const
+    {
+        return _flags & 0x0010;
+    }
+    uint8_t rcode() const
+    {
+        return _flags & 0x000f;
+    }
+    uint16_t question_count() const
+    {
+        return _qdcount;
+    }
+    uint16_t answer_count() const
+    {
+        return _ancount;
+    }
+    uint16_t authority_count() const
+    {
+        return _nscount;
+    }
+    uint16_t additional_count() const
+    {
+        return _arcount;
+    }
+
+    /**
+     * @return true if the record counts passed sanity checks and the first question (if any) was decoded within bounds.
+     * Mirrors the result of DnsLayer::parseResources(true)
+     */
+    bool resources_valid() const
+    {
+        return _resources_valid;
+    }
+
+    // first question
+    bool has_question() const
+    {
+        return _has_question;
+    }
+    std::string_view qname() const
+    {
+        return std::string_view(_name, _name_size);
+    }
+    std::string_view qname_lower() const
+    {
+        return std::string_view(_name_lower, _name_size);
+    }
+    uint16_t qtype() const
+    {
+        return _qtype;
+    }
+    uint16_t qclass() const
+    {
+        return _qclass;
+    }
+    /**
+     * @return size in bytes of the first question on the wire, including qtype and qclass
+     */
+    size_t question_size() const
+    {
+        return _question_size;
+    }
+
+    /**
+     * labels of the decoded qname, left to right. offsets index into qname() and qname_lower()
+     */
+    size_t label_count() const
+    {
+        return _label_count;
+    }
+    size_t label_offset(size_t index) const
+    {
+        return _label_offsets[index];
+    }
+    const uint8_t *label_offsets() const
+    {
+        return _label_offsets;
+    }
+};
+
+}
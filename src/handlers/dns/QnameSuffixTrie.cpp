@@ -0,0 +1,91 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "QnameSuffixTrie.h"
+#include <algorithm>
+#include <utility>
+
+namespace visor::handler::dns {
+
+QnameSuffixTrie::QnameSuffixTrie(const std::vector<std::string> &suffixes)
+    : _size(suffixes.size())
+{
+    // build with per node edge lists, then flatten
+    std::vector<std::vector<std::pair<uint8_t, uint32_t>>> children(1);
+    _suffix_index.assign(1, NO_SUFFIX);
+
+    for (uint32_t i = 0; i < suffixes.size(); ++i) {
+        const auto &suffix = suffixes[i];
+        uint32_t node = 0;
+        for (auto it = suffix.rbegin(); it != suffix.rend(); ++it) {
+            auto byte = static_cast<uint8_t>(*it);
+            auto &edges = children[node];
+            auto edge = std::find_if(edges.begin(), edges.end(), [byte](const auto &e) { return e.first == byte; });
+            if (edge != edges.end()) {
+                node = edge->second;
+                continue;
+            }
+            auto next = static_cast<uint32_t>(children.size());
+            edges.emplace_back(byte, next);
+            children.emplace_back();
+            _suffix_index.push_back(NO_SUFFIX);
+            node = next;
+        }
+        if (_suffix_index[node] == NO_SUFFIX) {
+            _suffix_index[node] = i;
+        }
+    }
+
+    _first_edge.reserve(children.size() + 1);
+    _edge_byte.reserve(children.size() - 1);
+    _edge_target.reserve(children.size() - 1);
+    for (auto &edges : children) {
+        std::sort(edges.begin(), edges.end());
+        _first_edge.push_back(static_cast<uint32_t>(_edge_byte.size()));
+        for (const auto &edge : edges) {
+            _edge_byte.push_back(edge.first);
+            _edge_target.push_back(edge.second);
+        }
+    }
+    _first_edge.push_back(static_cast<uint32_t>(_edge_byte.size()));
+}
+
+uint32_t QnameSuffixTrie::_child(uint32_t node, uint8_t byte) const
+{
+    auto begin = _edge_byte.begin() + _first_edge[node];
+    auto end = _edge_byte.begin() + _first_edge[node + 1];
+    auto it = std::lower_bound(begin, end, byte);
+    if (it == end || *it != byte) {
+        return 0;
+    }
+    return _edge_target[it - _edge_byte.begin()];
+}
+
+std::optional<size_t> QnameSuffixTrie::match(std::string_view qname) const
+{
+    if (_suffix_index.empty()) {
+        return std::nullopt;
+    }
+    // the root is only a suffix end for an empty suffix, which matches everything
+    uint32_t best = _suffix_index[0];
+    size_t best_size = 0;
+    uint32_t node = 0;
+    for (size_t depth = 1; depth <= qname.size(); ++depth) {
+        // the root is never a child, so 0 means no edge
+        node = _child(node, static_cast<uint8_t>(qname[qname.size() - depth]));
+        if (node == 0) {
+            break;
+        }
+        if (_suffix_index[node] < best) {
+            best = _suffix_index[node];
+            best_size = depth;
+        }
+    }
+    if (best == NO_SUFFIX) {
+        return std::nullopt;
+    }
+    return best_size;
+}
+
+}
@@ -0,0 +1,77 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace visor::handler::dns {
+
+/**
+ * Immutable set of qname suffixes, matched against a qname in a single pass over its bytes.
+ *
+ * Suffixes are stored in a trie keyed by their bytes from last to first, so matching walks the qname from its end and
+ * reports every suffix it ends with along the way. Matching is on raw bytes (like std::string::ends_with), not on
+ * label boundaries: "bar.com" matches "foo.bar.com" and also "foobar.com". Callers are expected to lowercase both sides.
+ *
+ * Once built, the nodes are flattened into contiguous arrays with the children of each node sorted by byte, so a
+ * lookup is one binary search over a handful of edges per qname byte, independent of the number of suffixes.
+ */
+class QnameSuffixTrie
+{
+    static constexpr uint32_t NO_SUFFIX = UINT32_MAX;
+
+    // children of node n are edges [_first_edge[n], _first_edge[n + 1])
+    std::vector<uint32_t> _first_edge;
+    std::vector<uint8_t> _edge_byte;
+    std::vector<uint32_t> _edge_target;
+    // index of the suffix ending at each node, NO_SUFFIX if none
+    std::vector<uint32_t> _suffix_index;
+    size_t _size{0};
+
+    uint32_t _child(uint32_t node, uint8_t byte) const;
+
+public:
+    QnameSuffixTrie() = default;
+
+    /**
+     * Build from a list of suffixes. Duplicates are allowed, the first occurrence wins.
+     */
+    explicit QnameSuffixTrie(const std::vector<std::string> &suffixes);
+
+    /**
+     * Find the suffix qname ends with. When several match, the one listed first when building wins, which is the
+     * same result a linear scan over the list would give.
+     * @return size of the matched suffix, or nullopt if none matches
+     */
+    std::optional<size_t> match(std::string_view qname) const;
+
+    /**
+     * @return number of suffixes the trie was built from, including duplicates
+     */
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    /**
+     * @return number of trie nodes, including the root
+     */
+    size_t node_count() const
+    {
+        return _suffix_index.size();
+    }
+};
+
+}
@@ -6,7 +6,7 @@
 
 namespace visor::handler::dns {
 
-AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size)
+AggDomainResult aggregateDomain(std::string_view domain, size_t suffix_size)
 {
 
     std::string_view qname2(domain);
@@ -17,20 +17,20 @@ AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size)
         qname3.remove_prefix(domain.size());
         return AggDomainResult(qname2, qname3);
     }
-    std::size_t endDot = std::string::npos;
+    std::size_t endDot = std::string_view::npos;
     if (suffix_size > 0 && domain.size() > suffix_size) {
         endDot = domain.size() - suffix_size;
     } else if (domain.back() == '.') {
         endDot = domain.size() - 2;
     }
     auto first_dot = domain.rfind('.', endDot);
-    if (first_dot != std::string::npos && first_dot > 0) {
+    if (first_dot != std::string_view::npos && first_dot > 0) {
         auto second_dot = domain.rfind('.', first_dot - 1);
-        if (second_dot != std::string::npos) {
+        if (second_dot != std::string_view::npos) {
             qname2.remove_prefix(second_dot);
             if (second_dot > 0) {
                 auto third_dot = domain.rfind('.', second_dot - 1);
-                if (third_dot != std::string::npos) {
+                if (third_dot != std::string_view::npos) {
                     qname3.remove_prefix(third_dot);
                 }
             }
@@ -42,4 +42,48 @@ AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size)
     return AggDomainResult(qname2, qname3);
 }
 
-}
\ No newline at end of file
+AggDomainResult aggregateDomain(std::string_view domain, const uint8_t *label_offsets, size_t label_count, size_t suffix_size)
+{
+    std::string_view qname2(domain);
+    std::string_view qname3(domain);
+
+    // smallest we ever agg is a.b.c which returns a.b.c and b.c
+    if (domain.size() < 5) {
+        qname3.remove_prefix(domain.size());
+        return AggDomainResult(qname2, qname3);
+    }
+
+    // dot i sits right before label i + 1
+    auto dot = [label_offsets](size_t i) -> size_t { return label_offsets[i + 1] - 1u; };
+    // number of dots (counted from the left) eligible as the first dot, equivalent of the rfind start position
+    size_t limit = label_count ? label_count - 1 : 0;
+    if (suffix_size > 0 && domain.size() > suffix_size) {
+        size_t end_dot = domain.size() - suffix_size;
+        while (limit > 0 && dot(limit - 1) > end_dot) {
+            --limit;
+        }
+    } else if (domain.back() == '.') {
+        --limit;
+    }
+
+    if (limit > 0 && dot(limit - 1) > 0) {
+        if (limit > 1) {
+            auto second_dot = dot(limit - 2);
+            qname2.remove_prefix(second_dot);
+            if (second_dot > 0 && limit > 2) {
+                qname3.remove_prefix(dot(limit - 3));
+            }
+        } else {
+            // didn't find two dots, so this is empty
+            qname3.remove_prefix(domain.size());
+        }
+    }
+    return AggDomainResult(qname2, qname3);
+}
+
+AggDomainResult aggregateDomain(const DnsWireMessage &message, size_t suffix_size)
+{
+    return aggregateDomain(message.qname_lower(), message.label_offsets(), message.label_count(), suffix_size);
+}
+
+}
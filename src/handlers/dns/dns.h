@@ -7,13 +7,18 @@
 #include "DnsLayer.h"
 #include "DnsResource.h"
 #include "DnsResourceData.h"
+#include "DnsWireMessage.h"
+#include "qname.h"
 #include <string>
 #include <unordered_map>
 
 namespace visor::handler::dns {
 
 typedef std::pair<std::string_view, std::string_view> AggDomainResult;
-AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size = 0);
+AggDomainResult aggregateDomain(std::string_view domain, size_t suffix_size = 0);
+// same result as above, without rescanning: label_offsets are the label start offsets produced by normalize_qname
+AggDomainResult aggregateDomain(std::string_view domain, const uint8_t *label_offsets, size_t label_count, size_t suffix_size = 0);
+AggDomainResult aggregateDomain(const DnsWireMessage &message, size_t suffix_size = 0);
 
 enum QR {
     query = 0,
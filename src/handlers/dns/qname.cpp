@@ -0,0 +1,192 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "qname.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VISOR_QNAME_X86_SIMD 1
+#include <cstring>
+#include <immintrin.h>
+#endif
+
+namespace visor::handler::dns {
+
+static constexpr size_t MAX_LABEL_SIZE = 63;
+
+// validate label lengths once all boundaries are known
+static inline bool labels_valid(size_t len, const uint8_t *label_offsets, size_t label_count)
+{
+    for (size_t i = 0; i < label_count; ++i) {
+        size_t end = (i + 1 < label_count) ? label_offsets[i + 1] - 1u : len;
+        size_t size = end - label_offsets[i];
+        if (size == 0 || size > MAX_LABEL_SIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// scalar loop over [pos, len), shared by all implementations for the tail
+static inline bool normalize_tail(const char *src, size_t pos, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    bool printable = true;
+    for (; pos < len; ++pos) {
+        auto c = static_cast<uint8_t>(src[pos]);
+        if (c >= 'A' && c <= 'Z') {
+            c |= 0x20;
+        } else if (c == '.') {
+            label_offsets[label_count++] = static_cast<uint8_t>(pos + 1);
+        } else if (c <= 0x20 || c >= 0x7f) {
+            printable = false;
+        }
+        dst[pos] = static_cast<char>(c);
+    }
+    return printable;
+}
+
+bool normalize_qname_scalar(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    label_count = 0;
+    if (len == 0) {
+        return true;
+    }
+    label_offsets[label_count++] = 0;
+    bool printable = normalize_tail(src, 0, len, dst, label_offsets, label_count);
+    return printable && labels_valid(len, label_offsets, label_count);
+}
+
+#ifdef VISOR_QNAME_X86_SIMD
+
+static inline void push_dots(uint32_t mask, size_t pos, uint8_t *label_offsets, size_t &label_count)
+{
+    while (mask) {
+        label_offsets[label_count++] = static_cast<uint8_t>(pos + __builtin_ctz(mask) + 1);
+        mask &= mask - 1;
+    }
+}
+
+// each block kernel lowercases one block from src to dst and returns the dot mask, accumulating non printable bytes.
+// bytes >= 0x80 are negative in the signed compares, so they are neither upper case nor printable
+struct Sse2Block {
+    static constexpr size_t WIDTH = 16;
+    __m128i not_printable = _mm_setzero_si128();
+
+    uint32_t operator()(const char *src, char *dst)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+        __m128i is_print = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+        not_printable = _mm_or_si128(not_printable, _mm_andnot_si128(is_print, _mm_set1_epi8(-1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_or_si128(v, _mm_and_si128(is_upper, _mm_set1_epi8(0x20))));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.'))));
+    }
+
+    bool printable() const
+    {
+        return _mm_movemask_epi8(not_printable) == 0;
+    }
+};
+
+struct Avx2Block {
+    static constexpr size_t WIDTH = 32;
+    __m256i not_printable;
+
+    __attribute__((target("avx2"))) Avx2Block()
+        : not_printable(_mm256_setzero_si256())
+    {
+    }
+
+    __attribute__((target("avx2"))) uint32_t operator()(const char *src, char *dst)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+        __m256i is_upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+        __m256i is_print = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x20)), _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+        not_printable = _mm256_or_si256(not_printable, _mm256_andnot_si256(is_print, _mm256_set1_epi8(-1)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_or_si256(v, _mm256_and_si256(is_upper, _mm256_set1_epi8(0x20))));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))));
+    }
+
+    __attribute__((target("avx2"))) bool printable() const
+    {
+        return _mm256_movemask_epi8(not_printable) == 0;
+    }
+};
+
+template <typename Block>
+static inline bool normalize_blocks(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    constexpr size_t W = Block::WIDTH;
+    Block block;
+
+    label_count = 0;
+    if (len == 0) {
+        return true;
+    }
+    label_offsets[label_count++] = 0;
+
+    size_t pos = 0;
+    for (; pos + W <= len; pos += W) {
+        push_dots(block(src + pos, dst + pos), pos, label_offsets, label_count);
+    }
+    if (pos < len) {
+        if (len >= W) {
+            // overlap the last full block with what was already done and drop the dots seen twice.
+            // rewriting the overlap is harmless since lowercasing is idempotent, even when dst is src
+            size_t start = len - W;
+            uint32_t dots = block(src + start, dst + start) >> (pos - start);
+            push_dots(dots, pos, label_offsets, label_count);
+        } else {
+            // short name: pad into a block sized buffer. padding bytes are printable and not dots
+            alignas(32) char buf[W];
+            std::memset(buf, 'a', W);
+            std::memcpy(buf, src, len);
+            push_dots(block(buf, buf), 0, label_offsets, label_count);
+            std::memcpy(dst, buf, len);
+        }
+    }
+    return block.printable() && labels_valid(len, label_offsets, label_count);
+}
+
+// SSE2 is part of the x86-64 baseline, no runtime check needed
+static bool normalize_qname_sse(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    return normalize_blocks<Sse2Block>(src, len, dst, label_offsets, label_count);
+}
+
+__attribute__((target("avx2"))) static bool normalize_qname_avx2(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    // names up to 16 bytes are the common case, a padded 32 byte block would be wasted work
+    if (len <= Sse2Block::WIDTH) {
+        return normalize_blocks<Sse2Block>(src, len, dst, label_offsets, label_count);
+    }
+    return normalize_blocks<Avx2Block>(src, len, dst, label_offsets, label_count);
+}
+
+using normalize_fn = bool (*)(const char *, size_t, char *, uint8_t *, size_t &);
+
+static normalize_fn select_normalize()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return normalize_qname_avx2;
+    }
+    return normalize_qname_sse;
+}
+
+bool normalize_qname(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    static const normalize_fn impl = select_normalize();
+    return impl(src, len, dst, label_offsets, label_count);
+}
+
+#else
+
+bool normalize_qname(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count)
+{
+    return normalize_qname_scalar(src, len, dst, label_offsets, label_count);
+}
+
+#endif
+
+}
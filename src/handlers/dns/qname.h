@@ -0,0 +1,32 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace visor::handler::dns {
+
+/**
+ * Normalize a decoded (dotted) qname in a single pass: ASCII lowercase src into dst, record the offset at which each
+ * label starts and validate the name.
+ *
+ * Uses AVX2 or SSE2 when the CPU supports it (selected at runtime), otherwise a scalar loop.
+ *
+ * @param src decoded name, at most 255 bytes
+ * @param len length of src
+ * @param dst output buffer of at least len bytes, may be the same as src
+ * @param label_offsets output buffer of at least len + 1 entries. a non empty name has one label more than it has dots
+ * @param label_count number of label offsets written
+ * @return true if every byte is printable ASCII, no label is empty and no label is longer than 63 bytes
+ */
+bool normalize_qname(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count);
+
+/**
+ * Scalar implementation of normalize_qname, exposed for testing and benchmarking
+ */
+bool normalize_qname_scalar(const char *src, size_t len, char *dst, uint8_t *label_offsets, size_t &label_count);
+
+}
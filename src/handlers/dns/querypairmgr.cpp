@@ -4,7 +4,6 @@
 
 #include "querypairmgr.h"
 #include <sys/time.h>
-#include <vector>
 
 static inline void timespec_diff(struct timespec *a, struct timespec *b,
     struct timespec *result)
@@ -19,18 +18,103 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b,
 
 namespace visor::handler::dns {
 
+void QueryResponsePairMgr::_wheel_insert(const DnsXactID &key, OpenTransaction &xact)
+{
+    int64_t expiry = xact.queryTS.tv_sec + _ttl_secs;
+    if (expiry < _wheel_time) {
+        // already due (or time went backwards): expire on the next tick
+        expiry = _wheel_time;
+    }
+    auto delta = expiry - _wheel_time;
+    if (delta < L0_SLOTS) {
+        xact.slot = static_cast<uint32_t>(expiry & (L0_SLOTS - 1));
+    } else if (delta < WHEEL_SPAN) {
+        xact.slot = L0_SLOTS + static_cast<uint32_t>((expiry >> L0_BITS) & (L1_SLOTS - 1));
+    } else {
+        // beyond the wheel: park in the last level 1 slot, it is placed again when that slot cascades
+        xact.slot = L0_SLOTS + static_cast<uint32_t>(((_wheel_time >> L0_BITS) + L1_SLOTS - 1) & (L1_SLOTS - 1));
+    }
+    auto &slot = _wheel[xact.slot];
+    xact.index = static_cast<uint32_t>(slot.size());
+    slot.push_back(key);
+}
+
+void QueryResponsePairMgr::_wheel_remove(const OpenTransaction &xact)
+{
+    auto &slot = _wheel[xact.slot];
+    if (xact.index + 1u != slot.size()) {
+        // swap with the last entry in the slot and fix up its index
+        const auto &last = slot.back();
+        _dns_transactions.find(last)->second.index = xact.index;
+        slot[xact.index] = last;
+    }
+    slot.pop_back();
+}
+
+void QueryResponsePairMgr::_cascade(uint32_t slot)
+{
+    // entries may land back in the same slot (a full wheel turn away), so iterate a detached copy
+    _scratch.clear();
+    _scratch.swap(_wheel[slot]);
+    for (const auto &key : _scratch) {
+        _wheel_insert(key, _dns_transactions.find(key)->second);
+    }
+}
+
+size_t QueryResponsePairMgr::_drain(int64_t now)
+{
+    // time moved past everything the wheel can represent: rebuild it around now
+    _scratch.clear();
+    for (auto &slot : _wheel) {
+        _scratch.insert(_scratch.end(), slot.begin(), slot.end());
+        slot.clear();
+    }
+    _wheel_time = now + 1;
+    size_t timed_out{0};
+    for (const auto &key : _scratch) {
+        auto iter = _dns_transactions.find(key);
+        if (now - iter->second.queryTS.tv_sec >= _ttl_secs) {
+            _dns_transactions.erase(iter);
+            ++timed_out;
+        } else {
+            _wheel_insert(key, iter->second);
+        }
+    }
+    return timed_out;
+}
+
 void QueryResponsePairMgr::start_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp)
 {
-    _dns_transactions[DnsXactID(flowKey, queryID)] = {stamp, {0, 0}};
+    if (_dns_transactions.empty()) {
+        // nothing in the wheel, so it can follow the packet clock freely
+        _wheel_time = stamp.tv_sec;
+    }
+    auto key = DnsXactID(flowKey, queryID);
+    auto iter = _dns_transactions.find(key);
+    if (iter != _dns_transactions.end()) {
+        // retransmission or id reuse: restart the timer
+        _wheel_remove(iter->second);
+        iter->second.queryTS = stamp;
+        _wheel_insert(key, iter->second);
+        return;
+    }
+    if (_max_open && _dns_transactions.size() >= _max_open) {
+        ++_overflow_count;
+        return;
+    }
+    auto &xact = _dns_transactions[key];
+    xact.queryTS = stamp;
+    _wheel_insert(key, xact);
 }
 
 std::pair<bool, DnsTransaction> QueryResponsePairMgr::maybe_end_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp)
 {
-    auto key = DnsXactID(flowKey, queryID);
-    if (_dns_transactions.find(key) != _dns_transactions.end()) {
-        auto result = _dns_transactions[key];
+    auto iter = _dns_transactions.find(DnsXactID(flowKey, queryID));
+    if (iter != _dns_transactions.end()) {
+        DnsTransaction result{iter->second.queryTS, {0, 0}};
         timespec_diff(&stamp, &result.queryTS, &result.totalTS);
-        _dns_transactions.erase(key);
+        _wheel_remove(iter->second);
+        _dns_transactions.erase(iter);
         return std::pair<bool, DnsTransaction>(true, result);
     } else {
         return std::pair<bool, DnsTransaction>(false, DnsTransaction{{0, 0}, {0, 0}});
@@ -39,17 +123,33 @@ std::pair<bool, DnsTransaction> QueryResponsePairMgr::maybe_end_transaction(uint
 
 size_t QueryResponsePairMgr::purge_old_transactions(timespec now)
 {
-    // TODO this is a simple linear search, can optimize with some better data structures
-    std::vector<DnsXactID> timed_out;
-    for (auto i : _dns_transactions) {
-        if (now.tv_sec - i.second.queryTS.tv_sec >= _ttl_secs) {
-            timed_out.push_back(i.first);
-        }
+    int64_t now_sec = now.tv_sec;
+    if (now_sec < _wheel_time) {
+        return 0;
+    }
+    if (_dns_transactions.empty()) {
+        _wheel_time = now_sec + 1;
+        return 0;
+    }
+    if (now_sec - _wheel_time >= WHEEL_SPAN) {
+        return _drain(now_sec);
     }
-    for (auto i : timed_out) {
-        _dns_transactions.erase(i);
+
+    size_t timed_out{0};
+    for (; _wheel_time <= now_sec; ++_wheel_time) {
+        if ((_wheel_time & (L0_SLOTS - 1)) == 0) {
+            // start of a level 0 turn: bring down the level 1 slot covering it
+            _cascade(L0_SLOTS + static_cast<uint32_t>((_wheel_time >> L0_BITS) & (L1_SLOTS - 1)));
+        }
+        // everything in a level 0 slot expires at exactly this second
+        auto &slot = _wheel[_wheel_time & (L0_SLOTS - 1)];
+        for (const auto &key : slot) {
+            _dns_transactions.erase(key);
+        }
+        timed_out += slot.size();
+        slot.clear();
     }
-    return timed_out.size();
+    return timed_out;
 }
 
 }
@@ -7,19 +7,27 @@
 #include <chrono>
 #include <memory>
 #include <robin_hood.h>
+#include <vector>
 
 namespace visor::handler::dns {
 
 using hr_clock = std::chrono::high_resolution_clock;
 
-// A hash function used to hash a pair of any kind
+// A hash function used to hash a pair of any kind. The two halves are combined and mixed, since std::hash
+// of an integer is the identity and a plain XOR of two small integers collides heavily
 struct hash_pair {
     template <class T1, class T2>
     size_t operator()(const std::pair<T1, T2> &p) const
     {
-        auto hash1 = std::hash<T1>{}(p.first);
-        auto hash2 = std::hash<T2>{}(p.second);
-        return hash1 ^ hash2;
+        uint64_t h = std::hash<T1>{}(p.first);
+        h ^= std::hash<T2>{}(p.second) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        // splitmix64 finalizer
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return static_cast<size_t>(h);
     }
 };
 
@@ -28,19 +36,76 @@ struct DnsTransaction {
     timespec totalTS;
 };
 
+/**
+ * Tracks open DNS transactions (queries waiting for a response), keyed by flow and query id.
+ *
+ * Expiry uses a two level timer wheel keyed by expiry second: level 0 has one slot per second for the next 256
+ * seconds, level 1 one slot per 256 seconds after that. Level 1 slots are cascaded into level 0 as time reaches them,
+ * and answered transactions are removed from their slot right away, so purging only touches transactions which
+ * actually time out.
+ */
 class QueryResponsePairMgr
 {
+public:
+    static constexpr unsigned int DEFAULT_TTL_SECS = 5;
 
+private:
     using DnsXactID = std::pair<uint32_t, uint16_t>;
-    typedef robin_hood::unordered_map<DnsXactID, DnsTransaction, hash_pair> DnsXactMap;
+
+    static constexpr unsigned int L0_BITS = 8;
+    static constexpr uint32_t L0_SLOTS = 1 << L0_BITS;
+    static constexpr uint32_t L1_SLOTS = 64;
+    static constexpr int64_t WHEEL_SPAN = int64_t{L0_SLOTS} * L1_SLOTS;
+
+    struct OpenTransaction {
+        timespec queryTS;
+        // position in the timer wheel
+        uint32_t slot;
+        uint32_t index;
+    };
+    typedef robin_hood::unordered_map<DnsXactID, OpenTransaction, hash_pair> DnsXactMap;
 
     unsigned int _ttl_secs;
+    size_t _max_open;
+    uint64_t _overflow_count{0};
     DnsXactMap _dns_transactions;
 
+    std::vector<DnsXactID> _wheel[L0_SLOTS + L1_SLOTS];
+    std::vector<DnsXactID> _scratch;
+    // next second the wheel will expire, everything before it has been processed
+    int64_t _wheel_time{0};
+
+    void _wheel_insert(const DnsXactID &key, OpenTransaction &xact);
+    void _wheel_remove(const OpenTransaction &xact);
+    void _cascade(uint32_t slot);
+    size_t _drain(int64_t now);
+
 public:
-    QueryResponsePairMgr(unsigned int ttl_secs = 5)
+    /**
+     * @param ttl_secs seconds after which an unanswered query is considered timed out
+     * @param max_open maximum number of open transactions to track, 0 for no limit. queries seen while at the limit
+     * are not tracked and are counted by overflow_count()
+     */
+    QueryResponsePairMgr(unsigned int ttl_secs = DEFAULT_TTL_SECS, size_t max_open = 0)
         : _ttl_secs(ttl_secs)
+        , _max_open(max_open)
+    {
+    }
+
+    // only safe to change while there are no open transactions
+    void set_ttl_secs(unsigned int ttl_secs)
+    {
+        _ttl_secs = ttl_secs;
+    }
+
+    void set_max_open(size_t max_open)
+    {
+        _max_open = max_open;
+    }
+
+    unsigned int ttl_secs() const
     {
+        return _ttl_secs;
     }
 
     void start_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp);
@@ -53,7 +118,11 @@ public:
     {
         return _dns_transactions.size();
     }
+
+    uint64_t overflow_count() const
+    {
+        return _overflow_count;
+    }
 };
 
 }
-
@@ -2,7 +2,9 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
+#include "../QnameSuffixTrie.h"
 #include "../dns.h"
+#include <algorithm>
 #include <benchmark/benchmark.h>
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
@@ -37,6 +39,106 @@ static void BM_aggregateDomainLong(benchmark::State &state)
 
 BENCHMARK(BM_aggregateDomainLong);
 
+static void BM_aggregateDomainNormalized(benchmark::State &state)
+{
+    AggDomainResult result;
+    std::string domain{"biz.foo.bar.com"};
+    char lower[256];
+    uint8_t offsets[256];
+    size_t count;
+    for (auto _ : state) {
+        normalize_qname(domain.data(), domain.size(), lower, offsets, count);
+        result = aggregateDomain(std::string_view(lower, domain.size()), offsets, count);
+    }
+}
+BENCHMARK(BM_aggregateDomainNormalized);
+
+static void BM_aggregateDomainNormalizedLong(benchmark::State &state)
+{
+    AggDomainResult result;
+    std::string domain{"long1.long2.long3.long4.long5.long6.long7.long8.biz.foo.bar.com"};
+    char lower[256];
+    uint8_t offsets[256];
+    size_t count;
+    for (auto _ : state) {
+        normalize_qname(domain.data(), domain.size(), lower, offsets, count);
+        result = aggregateDomain(std::string_view(lower, domain.size()), offsets, count);
+    }
+}
+BENCHMARK(BM_aggregateDomainNormalizedLong);
+
+static void BM_qnameTransformLower(benchmark::State &state)
+{
+    std::string domain{"LONG1.long2.long3.long4.long5.long6.long7.long8.biz.FOO.bar.com"};
+    for (auto _ : state) {
+        std::string lower{domain};
+        std::transform(lower.begin(), lower.end(), lower.begin(),
+            [](unsigned char c) { return std::tolower(c); });
+        benchmark::DoNotOptimize(lower);
+    }
+}
+BENCHMARK(BM_qnameTransformLower);
+
+static void BM_normalizeQname(benchmark::State &state)
+{
+    std::string domain{"LONG1.long2.long3.long4.long5.long6.long7.long8.biz.FOO.bar.com"};
+    char lower[256];
+    uint8_t offsets[256];
+    size_t count;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(normalize_qname(domain.data(), domain.size(), lower, offsets, count));
+    }
+}
+BENCHMARK(BM_normalizeQname);
+
+static void BM_normalizeQnameScalar(benchmark::State &state)
+{
+    std::string domain{"LONG1.long2.long3.long4.long5.long6.long7.long8.biz.FOO.bar.com"};
+    char lower[256];
+    uint8_t offsets[256];
+    size_t count;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(normalize_qname_scalar(domain.data(), domain.size(), lower, offsets, count));
+    }
+}
+BENCHMARK(BM_normalizeQnameScalar);
+
+static std::vector<std::string> suffix_list(size_t count)
+{
+    std::vector<std::string> suffixes;
+    for (size_t i = 0; i < count; ++i) {
+        suffixes.push_back(".zone" + std::to_string(i) + ".example.net");
+    }
+    return suffixes;
+}
+
+static void BM_qnameSuffixLinear(benchmark::State &state)
+{
+    auto suffixes = suffix_list(state.range(0));
+    std::string_view qname = "www.customer.zone9999.example.net";
+    for (auto _ : state) {
+        size_t matched = 0;
+        for (const auto &suffix : suffixes) {
+            if (qname.size() >= suffix.size() && qname.compare(qname.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                matched = suffix.size();
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(matched);
+    }
+}
+BENCHMARK(BM_qnameSuffixLinear)->Arg(10)->Arg(10000);
+
+static void BM_qnameSuffixTrie(benchmark::State &state)
+{
+    QnameSuffixTrie trie(suffix_list(state.range(0)));
+    std::string_view qname = "www.customer.zone9999.example.net";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(trie.match(qname));
+    }
+}
+BENCHMARK(BM_qnameSuffixTrie)->Arg(10)->Arg(10000);
+
 static void BM_pcapReadNoParse(benchmark::State &state)
 {
 
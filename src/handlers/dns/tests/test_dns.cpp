@@ -1,6 +1,9 @@
 #include <catch2/catch.hpp>
 
+#include "QnameSuffixTrie.h"
 #include "dns.h"
+#include "querypairmgr.h"
+#include <vector>
 
 using namespace visor::handler::dns;
 
@@ -116,3 +119,340 @@ TEST_CASE("DNS Utilities", "[dns]")
         CHECK(result.second == "");
     }
 }
+
+TEST_CASE("qname normalization", "[dns]")
+{
+    uint8_t offsets[256];
+    uint8_t scalar_offsets[256];
+    char lower[256];
+    char scalar_lower[256];
+    size_t count{0};
+    size_t scalar_count{0};
+
+    SECTION("lowercase and labels")
+    {
+        std::string name{"WwW.Example.COM"};
+        CHECK(normalize_qname(name.data(), name.size(), lower, offsets, count));
+        CHECK(std::string_view(lower, name.size()) == "www.example.com");
+        REQUIRE(count == 3);
+        CHECK(offsets[0] == 0);
+        CHECK(offsets[1] == 4);
+        CHECK(offsets[2] == 12);
+
+        CHECK(normalize_qname(name.data(), 0, lower, offsets, count));
+        CHECK(count == 0);
+    }
+
+    SECTION("validation")
+    {
+        std::string name{"a..b"};
+        CHECK(!normalize_qname(name.data(), name.size(), lower, offsets, count));
+        CHECK(count == 3);
+        name = "a.b.";
+        CHECK(!normalize_qname(name.data(), name.size(), lower, offsets, count));
+        name = "a b.com";
+        CHECK(!normalize_qname(name.data(), name.size(), lower, offsets, count));
+        name = "caf\xc3\xa9.com";
+        CHECK(!normalize_qname(name.data(), name.size(), lower, offsets, count));
+        name = std::string(64, 'a') + ".com";
+        CHECK(!normalize_qname(name.data(), name.size(), lower, offsets, count));
+        name = std::string(63, 'a') + ".com";
+        CHECK(normalize_qname(name.data(), name.size(), lower, offsets, count));
+    }
+
+    SECTION("vector and scalar implementations agree")
+    {
+        std::vector<std::string> names{
+            "a",
+            "Long1.LONG2.long3.long4.long5.long6.long7.long8.BIZ.foo.bar.com",
+            "_sip._TCP.example.org",
+            std::string(40, 'X') + "." + std::string(40, '.') + "." + std::string(60, 'z'),
+            "x\x01y.\x7f\x80\xff.Q"};
+        for (const auto &name : names) {
+            auto valid = normalize_qname(name.data(), name.size(), lower, offsets, count);
+            auto scalar_valid = normalize_qname_scalar(name.data(), name.size(), scalar_lower, scalar_offsets, scalar_count);
+            CHECK(valid == scalar_valid);
+            CHECK(std::string_view(lower, name.size()) == std::string_view(scalar_lower, name.size()));
+            REQUIRE(count == scalar_count);
+            for (size_t i = 0; i < count; ++i) {
+                CHECK(offsets[i] == scalar_offsets[i]);
+            }
+        }
+    }
+
+    SECTION("aggregateDomain from label offsets")
+    {
+        std::vector<std::string> domains{"biz.foo.bar.com", "a.com", "abcdefg.com.", "foo.bar.com", ".", "..", "a", "a.",
+            "foo.bar.com.", ".foo.bar.com", "a.b.c", ".b.c", "abcde", "www.google.co.uk", "a..b.c.", "...........",
+            "long1.long2.long3.long4.long5.long6.long7.long8.biz.foo.bar.com"};
+        std::vector<size_t> suffixes{0, 1, 3, 4, 6, 7, 8, 11, 12, 15, 100};
+        for (const auto &domain : domains) {
+            normalize_qname(domain.data(), domain.size(), lower, offsets, count);
+            for (auto suffix : suffixes) {
+                auto expected = aggregateDomain(domain, suffix);
+                auto result = aggregateDomain(domain, offsets, count, suffix);
+                INFO(domain << " suffix " << suffix);
+                CHECK(result.first == expected.first);
+                CHECK(result.second == expected.second);
+            }
+        }
+    }
+}
+
+TEST_CASE("qname suffix trie", "[dns]")
+{
+    SECTION("empty")
+    {
+        QnameSuffixTrie trie;
+        CHECK(trie.empty());
+        CHECK(!trie.match("www.example.com"));
+        CHECK(!QnameSuffixTrie(std::vector<std::string>{}).match(""));
+    }
+
+    SECTION("byte suffix match")
+    {
+        QnameSuffixTrie trie({".example.com", "bar.org", "test"});
+        CHECK(trie.size() == 3);
+        CHECK(trie.match("www.example.com") == 12);
+        CHECK(trie.match("a.b.example.com") == 12);
+        CHECK(!trie.match("example.com"));
+        CHECK(!trie.match("www.example.co"));
+        // not label aligned, same as a plain ends with
+        CHECK(trie.match("foobar.org") == 7);
+        CHECK(trie.match("bar.org") == 7);
+        CHECK(trie.match("test") == 4);
+        CHECK(!trie.match("est"));
+        CHECK(!trie.match(""));
+    }
+
+    SECTION("first listed suffix wins")
+    {
+        QnameSuffixTrie trie({"b.example.com", "example.com", "a.b.example.com", "example.com"});
+        CHECK(trie.match("a.b.example.com") == 13);
+        CHECK(trie.match("c.example.com") == 11);
+
+        QnameSuffixTrie longest_last({"com", "example.com"});
+        CHECK(longest_last.match("www.example.com") == 3);
+
+        QnameSuffixTrie empty_suffix({"example.com", ""});
+        CHECK(empty_suffix.match("www.example.com") == 11);
+        CHECK(empty_suffix.match("www.example.org") == 0);
+    }
+
+    SECTION("matches a linear scan")
+    {
+        auto ends_with = [](const std::string &str, const std::string &suffix) {
+            return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+        };
+        // small alphabet so suffixes overlap a lot
+        uint32_t seed = 42;
+        auto random_name = [&seed](size_t max_size) {
+            std::string name;
+            seed = seed * 1103515245u + 12345u;
+            auto size = (seed >> 16) % (max_size + 1);
+            for (size_t i = 0; i < size; ++i) {
+                seed = seed * 1103515245u + 12345u;
+                name.push_back("ab.c"[(seed >> 16) % 4]);
+            }
+            return name;
+        };
+        std::vector<std::string> suffixes;
+        for (int i = 0; i < 200; ++i) {
+            suffixes.push_back(random_name(8));
+        }
+        QnameSuffixTrie trie(suffixes);
+        for (int i = 0; i < 2000; ++i) {
+            auto qname = random_name(16);
+            std::optional<size_t> expected;
+            for (const auto &suffix : suffixes) {
+                if (ends_with(qname, suffix)) {
+                    expected = suffix.size();
+                    break;
+                }
+            }
+            CHECK(trie.match(qname) == expected);
+        }
+    }
+}
+
+TEST_CASE("DNS wire message", "[dns]")
+{
+    DnsWireMessage msg;
+
+    SECTION("query with mixed case qname")
+    {
+        // id 0x1234, RD, 1 question: WwW.Example.COM IN AAAA
+        const uint8_t wire[] = {0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            3, 'W', 'w', 'W', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'C', 'O', 'M', 0,
+            0x00, 0x1c, 0x00, 0x01};
+        CHECK(msg.parse(wire, sizeof(wire)));
+        CHECK(msg.transaction_id() == 0x1234);
+        CHECK(!msg.is_response());
+        CHECK(msg.recursion_desired());
+        CHECK(msg.question_count() == 1);
+        CHECK(msg.resources_valid());
+        REQUIRE(msg.has_question());
+        CHECK(msg.qname() == "WwW.Example.COM");
+        CHECK(msg.qname_lower() == "www.example.com");
+        CHECK(msg.qtype() == 28);
+        CHECK(msg.qclass() == 1);
+        CHECK(msg.question_size() == 21);
+        REQUIRE(msg.label_count() == 3);
+        CHECK(msg.label_offset(0) == 0);
+        CHECK(msg.label_offset(1) == 4);
+        CHECK(msg.label_offset(2) == 12);
+    }
+
+    SECTION("response header flags")
+    {
+        // id 0xbeef, QR AA RD RA, NXDOMAIN, root qname
+        const uint8_t wire[] = {0xbe, 0xef, 0x85, 0x83, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0, 0x00, 0x02, 0x00, 0x01};
+        CHECK(msg.parse(wire, sizeof(wire)));
+        CHECK(msg.transaction_id() == 0xbeef);
+        CHECK(msg.is_response());
+        CHECK(msg.authoritative_answer());
+        CHECK(msg.recursion_available());
+        CHECK(msg.rcode() == NXDomain);
+        REQUIRE(msg.has_question());
+        CHECK(msg.qname().empty());
+        CHECK(msg.label_count() == 0);
+        CHECK(msg.qtype() == 2);
+    }
+
+    SECTION("compression pointer")
+    {
+        // question name "A" continues through a pointer to "B.c", stored after the question
+        const uint8_t wire[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            1, 'A', 0xc0, 20, 0x00, 0x01, 0x00, 0x01,
+            1, 'B', 1, 'c', 0};
+        CHECK(msg.parse(wire, sizeof(wire)));
+        REQUIRE(msg.has_question());
+        CHECK(msg.qname() == "A.B.c");
+        CHECK(msg.qname_lower() == "a.b.c");
+        CHECK(msg.label_count() == 3);
+        CHECK(msg.qtype() == 1);
+        CHECK(msg.question_size() == 8);
+    }
+
+    SECTION("pointer loop")
+    {
+        const uint8_t wire[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0xc0, 12, 0x00, 0x01, 0x00, 0x01};
+        CHECK(msg.parse(wire, sizeof(wire)));
+        CHECK(!msg.has_question());
+        CHECK(!msg.resources_valid());
+    }
+
+    SECTION("truncated")
+    {
+        const uint8_t header[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x01};
+        CHECK(!msg.parse(header, sizeof(header)));
+        CHECK(!msg.has_header());
+
+        const uint8_t wire[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            3, 'f', 'o', 'o', 0, 0x00};
+        CHECK(msg.parse(wire, sizeof(wire)));
+        CHECK(!msg.has_question());
+        CHECK(msg.qname().empty());
+
+        // nothing of the previous message is left behind
+        CHECK(!msg.parse(header, sizeof(header)));
+        CHECK(msg.transaction_id() == 0);
+        CHECK(msg.question_count() == 0);
+    }
+
+    SECTION("too many records")
+    {
+        const uint8_t wire[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00,
+            0, 0x00, 0x01, 0x00, 0x01};
+        CHECK(msg.parse(wire, sizeof(wire)));
+        CHECK(!msg.resources_valid());
+        CHECK(!msg.has_question());
+    }
+}
+
+TEST_CASE("DNS transaction pairing", "[dns]")
+{
+    SECTION("match and time out")
+    {
+        QueryResponsePairMgr mgr(5);
+        mgr.start_transaction(1, 100, {1000, 0});
+        mgr.start_transaction(1, 101, {1001, 0});
+        mgr.start_transaction(2, 100, {1002, 0});
+        CHECK(mgr.open_transaction_count() == 3);
+
+        auto xact = mgr.maybe_end_transaction(1, 101, {1001, 500000000});
+        CHECK(xact.first);
+        CHECK(xact.second.totalTS.tv_sec == 0);
+        CHECK(xact.second.totalTS.tv_nsec == 500000000);
+        CHECK(!mgr.maybe_end_transaction(1, 101, {1002, 0}).first);
+        CHECK(mgr.open_transaction_count() == 2);
+
+        CHECK(mgr.purge_old_transactions({1004, 0}) == 0);
+        CHECK(mgr.purge_old_transactions({1005, 0}) == 1);
+        CHECK(mgr.open_transaction_count() == 1);
+        CHECK(mgr.purge_old_transactions({1006, 0}) == 0);
+        CHECK(mgr.purge_old_transactions({1007, 0}) == 1);
+        CHECK(mgr.open_transaction_count() == 0);
+    }
+
+    SECTION("restarted transaction")
+    {
+        QueryResponsePairMgr mgr(5);
+        mgr.start_transaction(1, 100, {1000, 0});
+        mgr.start_transaction(1, 100, {1003, 0});
+        CHECK(mgr.open_transaction_count() == 1);
+        CHECK(mgr.purge_old_transactions({1007, 0}) == 0);
+        CHECK(mgr.purge_old_transactions({1008, 0}) == 1);
+    }
+
+    SECTION("long ttl cascades")
+    {
+        QueryResponsePairMgr mgr(3600);
+        for (uint32_t i = 0; i < 1000; ++i) {
+            mgr.start_transaction(i, static_cast<uint16_t>(i), {1000 + i, 0});
+        }
+        for (uint32_t i = 0; i < 1000; i += 2) {
+            CHECK(mgr.maybe_end_transaction(i, static_cast<uint16_t>(i), {1000 + i, 1}).first);
+        }
+        size_t timed_out{0};
+        for (time_t now = 1000; now < 1000 + 3600; now += 60) {
+            timed_out += mgr.purge_old_transactions({now, 0});
+        }
+        CHECK(timed_out == 0);
+        CHECK(mgr.open_transaction_count() == 500);
+        // expiries are spread across [4600, 5599]
+        CHECK(mgr.purge_old_transactions({4600 + 499, 0}) == 250);
+        CHECK(mgr.purge_old_transactions({4600 + 999, 0}) == 250);
+        CHECK(mgr.open_transaction_count() == 0);
+    }
+
+    SECTION("clock jump")
+    {
+        QueryResponsePairMgr mgr(5);
+        mgr.start_transaction(1, 1, {1000, 0});
+        mgr.start_transaction(1, 2, {1000, 0});
+        CHECK(mgr.purge_old_transactions({1000 + 86400, 0}) == 2);
+        CHECK(mgr.open_transaction_count() == 0);
+        // the wheel follows the packet clock once empty
+        mgr.start_transaction(1, 3, {500, 0});
+        CHECK(mgr.purge_old_transactions({505, 0}) == 1);
+    }
+
+    SECTION("max open")
+    {
+        QueryResponsePairMgr mgr(5, 2);
+        mgr.start_transaction(1, 1, {1000, 0});
+        mgr.start_transaction(1, 2, {1000, 0});
+        mgr.start_transaction(1, 3, {1000, 0});
+        CHECK(mgr.open_transaction_count() == 2);
+        CHECK(mgr.overflow_count() == 1);
+        // restarting a tracked transaction is always allowed
+        mgr.start_transaction(1, 2, {1001, 0});
+        CHECK(mgr.overflow_count() == 1);
+        CHECK(mgr.maybe_end_transaction(1, 1, {1001, 0}).first);
+        mgr.start_transaction(1, 3, {1001, 0});
+        CHECK(mgr.open_transaction_count() == 2);
+    }
+}
@@ -2,6 +2,8 @@
 
 #include "DnsStreamHandler.h"
 #include "PcapInputStream.h"
+#include "tests/AllocCounter.h"
+#include <memory>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
@@ -9,7 +11,9 @@
 #pragma clang diagnostic ignored "-Wc99-extensions"
 #pragma clang diagnostic ignored "-Wrange-loop-analysis"
 #include <DnsLayer.h>
+#include <IPv4Layer.h>
 #include <Packet.h>
+#include <PacketUtils.h>
 #include <PcapFileDevice.h>
 #include <ProtocolType.h>
 #include <TcpLayer.h>
@@ -48,6 +52,229 @@ TEST_CASE("Ensure we use only pktvisor DnsLayer", "[pcap][ipv4][dns]")
     delete reader;
 }
 
+TEST_CASE("DnsWireMessage matches DnsLayer", "[pcap][udp][dns]")
+{
+
+    pcpp::IFileReaderDevice *reader = pcpp::IFileReaderDevice::getReader("tests/fixtures/dns_udp_tcp_random.pcap");
+
+    CHECK(reader->open());
+
+    pcpp::RawPacket rawPacket;
+    DnsWireMessage message;
+    size_t compared{0};
+
+    while (reader->getNextPacket(rawPacket)) {
+        pcpp::Packet packet(&rawPacket, pcpp::OsiModelTransportLayer);
+        auto udpLayer = packet.getLayerOfType<pcpp::UdpLayer>();
+        if (!udpLayer) {
+            continue;
+        }
+        DnsLayer dnsLayer(udpLayer, &packet);
+        REQUIRE(message.parse(dnsLayer.getData(), dnsLayer.getDataLen()));
+        CHECK(message.transaction_id() == ntohs(dnsLayer.getDnsHeader()->transactionID));
+        CHECK(message.is_response() == (dnsLayer.getDnsHeader()->queryOrResponse == QR::response));
+        CHECK(message.rcode() == dnsLayer.getDnsHeader()->responseCode);
+        CHECK(message.resources_valid() == dnsLayer.parseResources(true));
+        auto query = dnsLayer.getFirstQuery();
+        CHECK(message.has_question() == (query != nullptr));
+        if (query) {
+            CHECK(message.qname() == query->getName());
+            CHECK(message.qname_lower() == query->getNameLower());
+            CHECK(message.qtype() == query->getDnsType());
+            CHECK(message.question_size() == query->getSize());
+        }
+        ++compared;
+    }
+    CHECK(compared > 0);
+
+    reader->close();
+    delete reader;
+}
+
+TEST_CASE("DNS UDP handler does not allocate per packet", "[pcap][udp][dns]")
+{
+
+    pcpp::IFileReaderDevice *reader = pcpp::IFileReaderDevice::getReader("tests/fixtures/dns_udp_tcp_random.pcap");
+
+    CHECK(reader->open());
+
+    // pcpp allocates the layers of a packet, so they are all parsed up front
+    struct UdpPacket {
+        std::unique_ptr<pcpp::RawPacket> raw;
+        std::unique_ptr<pcpp::Packet> packet;
+        PacketDirection dir;
+        uint32_t flow_key;
+    };
+    std::vector<UdpPacket> udp_packets;
+    pcpp::RawPacket rawPacket;
+    while (reader->getNextPacket(rawPacket)) {
+        auto raw = std::make_unique<pcpp::RawPacket>(rawPacket);
+        auto packet = std::make_unique<pcpp::Packet>(raw.get());
+        auto ipv4 = packet->getLayerOfType<pcpp::IPv4Layer>();
+        if (!ipv4 || !packet->isPacketOfType(pcpp::UDP)) {
+            continue;
+        }
+        // host_spec is 192.168.0.0/24
+        auto dir = ((ntohl(ipv4->getDstIPv4Address().toInt()) >> 24) == 192) ? PacketDirection::toHost : PacketDirection::fromHost;
+        auto flow_key = pcpp::hash5Tuple(packet.get());
+        udp_packets.push_back({std::move(raw), std::move(packet), dir, flow_key});
+    }
+    reader->close();
+    delete reader;
+    REQUIRE(udp_packets.size() == 2971);
+
+    PcapInputStream stream{"pcap-test"};
+    visor::Config c;
+    auto stream_proxy = static_cast<PcapInputEventProxy *>(stream.add_event_proxy(c));
+    c.config_set<uint64_t>("num_periods", 1);
+    DnsStreamHandler dns_handler{"dns-test", stream_proxy, &c};
+    dns_handler.config_set<visor::Configurable::StringList>("only_qname_suffix", {".com", ".net", "example.org"});
+    dns_handler.start();
+
+    EnrichmentContext enrichment;
+    auto replay = [&]() {
+        size_t allocations{0};
+        for (auto &udp : udp_packets) {
+            auto stamp = udp.raw->getPacketTimeStamp();
+            auto before = alloc_count;
+            stream_proxy->udp_signal(*udp.packet, udp.dir, pcpp::IPv4, udp.flow_key, stamp, enrichment);
+            allocations += alloc_count - before;
+        }
+        return allocations;
+    };
+
+    // the first pass fills the sketches, which copy a qname the first time they see it, and sizes the transaction table
+    CHECK(replay() > 0);
+    // after that, decode, filtering, metrics and transaction tracking run without allocating
+    CHECK(replay() == 0);
+
+    dns_handler.stop();
+
+    auto counters = dns_handler.metrics()->bucket(0)->counters();
+    CHECK(counters.UDP.value() == 2 * 2971);
+    CHECK(counters.xacts_out.value() == 2 * 1481);
+    nlohmann::json j;
+    dns_handler.metrics()->bucket(0)->to_json(j);
+    CHECK(j["top_qname2"][0]["name"] == ".test.com");
+}
+
+TEST_CASE("DNS UDP payloads too short for a header are counted", "[udp][dns]")
+{
+    // ethernet, ipv4 192.168.0.1 -> 8.8.8.8, udp 40000 -> 53, then 4 bytes where the 12 byte DNS header should be
+    uint8_t frame[] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0x08, 0x00,
+        0x45, 0x00, 0x00, 0x20, 0x00, 0x01, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00, 192, 168, 0, 1, 8, 8, 8, 8,
+        0x9c, 0x40, 0x00, 0x35, 0x00, 0x0c, 0x00, 0x00,
+        0x12, 0x34, 0x01, 0x00};
+    timeval tv{1567706414, 0};
+    pcpp::RawPacket raw(frame, static_cast<int>(sizeof(frame)), tv, false);
+    pcpp::Packet packet(&raw);
+    REQUIRE(packet.getLayerOfType<pcpp::UdpLayer>() != nullptr);
+    timespec stamp{1567706414, 0};
+
+    PcapInputStream stream{"pcap-test"};
+    visor::Config c;
+    auto stream_proxy = static_cast<PcapInputEventProxy *>(stream.add_event_proxy(c));
+    c.config_set<uint64_t>("num_periods", 1);
+    DnsStreamHandler dns_handler{"dns-test", stream_proxy, &c};
+    EnrichmentContext enrichment;
+
+    SECTION("on the wire counters")
+    {
+        dns_handler.start();
+        stream_proxy->udp_signal(packet, PacketDirection::toHost, pcpp::IPv4, 1, stamp, enrichment);
+        dns_handler.stop();
+
+        auto counters = dns_handler.metrics()->bucket(0)->counters();
+        auto event_data = dns_handler.metrics()->bucket(0)->event_data_locked();
+        CHECK(event_data.num_events->value() == 1);
+        CHECK(counters.UDP.value() == 1);
+        CHECK(counters.IPv4.value() == 1);
+        CHECK(counters.queries.value() == 0);
+        CHECK(counters.replies.value() == 0);
+        CHECK(counters.filtered.value() == 0);
+    }
+
+    SECTION("filtered when an rcode is required")
+    {
+        dns_handler.config_set<uint64_t>("only_rcode", NXDomain);
+        dns_handler.start();
+        stream_proxy->udp_signal(packet, PacketDirection::toHost, pcpp::IPv4, 1, stamp, enrichment);
+        dns_handler.stop();
+
+        auto counters = dns_handler.metrics()->bucket(0)->counters();
+        CHECK(counters.UDP.value() == 0);
+        CHECK(counters.filtered.value() == 1);
+    }
+}
+
+TEST_CASE("DNS over TCP framing", "[tcp][dns]")
+{
+    // three length prefixed messages of different sizes
+    std::vector<std::vector<uint8_t>> messages;
+    std::vector<uint8_t> stream;
+    for (size_t size : {17, 40, 300}) {
+        std::vector<uint8_t> msg(size);
+        for (size_t i = 0; i < size; ++i) {
+            msg[i] = static_cast<uint8_t>(i * 7 + size);
+        }
+        stream.push_back(static_cast<uint8_t>(size >> 8));
+        stream.push_back(static_cast<uint8_t>(size & 0xff));
+        stream.insert(stream.end(), msg.begin(), msg.end());
+        messages.push_back(std::move(msg));
+    }
+
+    std::vector<std::vector<uint8_t>> received;
+    auto collect = [&received](const uint8_t *data, size_t size) {
+        received.emplace_back(data, data + size);
+    };
+
+    SECTION("single segment is framed in place")
+    {
+        std::vector<const uint8_t *> views;
+        TcpSessionData session([&](const uint8_t *data, size_t size) {
+            views.push_back(data);
+            collect(data, size);
+        });
+        session.receive_dns_wire_data(stream.data(), stream.size());
+        CHECK(received == messages);
+        REQUIRE(views.size() == 3);
+        CHECK(views[0] == stream.data() + 2);
+        CHECK(views[2] == stream.data() + stream.size() - 300);
+        CHECK(session.buffered_size() == 0);
+    }
+
+    SECTION("every split point")
+    {
+        for (size_t split = 1; split < stream.size(); ++split) {
+            received.clear();
+            TcpSessionData session(collect);
+            session.receive_dns_wire_data(stream.data(), split);
+            session.receive_dns_wire_data(stream.data() + split, stream.size() - split);
+            CHECK(received == messages);
+            CHECK(session.buffered_size() == 0);
+        }
+    }
+
+    SECTION("one byte at a time")
+    {
+        TcpSessionData session(collect);
+        for (auto byte : stream) {
+            session.receive_dns_wire_data(&byte, 1);
+        }
+        CHECK(received == messages);
+    }
+
+    SECTION("invalid size stops the session")
+    {
+        TcpSessionData session(collect);
+        const uint8_t bad[] = {0x00, 0x05, 1, 2, 3, 4, 5};
+        session.receive_dns_wire_data(bad, sizeof(bad));
+        session.receive_dns_wire_data(stream.data(), stream.size());
+        CHECK(received.empty());
+        CHECK(session.buffered_size() == 0);
+    }
+}
+
 TEST_CASE("Parse DNS UDP IPv4 tests", "[pcap][ipv4][udp][dns]")
 {
 
@@ -4,7 +4,6 @@
 
 #include "FlowStreamHandler.h"
 #include "GeoDB.h"
-#include "utils.h"
 #include <Corrade/Utility/Debug.h>
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
@@ -14,7 +13,10 @@
 #pragma GCC diagnostic pop
 #include <arpa/inet.h>
 #include <cpc_union.hpp>
+#include <cstring>
 #include <fmt/format.h>
+#include <sstream>
+#include <unordered_map>
 
 namespace visor::handler::flow {
 
@@ -71,9 +73,24 @@ void FlowStreamHandler::start()
         _metrics->set_recorded_stream();
     }
 
+    bool preaggregation{false};
+    if (config_exists("preaggregation_ms") && config_get<uint64_t>("preaggregation_ms") > 0) {
+        uint64_t max_flows = config_exists("preaggregation_max_flows") ? config_get<uint64_t>("preaggregation_max_flows") : 4096;
+        _metrics->set_preaggregation(std::chrono::milliseconds(config_get<uint64_t>("preaggregation_ms")), max_flows);
+        preaggregation = true;
+    }
+
+    if (config_exists("max_devices")) {
+        _metrics->set_max_devices(config_get<uint64_t>("max_devices"));
+    }
+
     if (_flow_proxy) {
         _sflow_connection = _flow_proxy->sflow_signal.connect(&FlowStreamHandler::process_sflow_cb, this);
         _netflow_connection = _flow_proxy->netflow_signal.connect(&FlowStreamHandler::process_netflow_cb, this);
+        if (preaggregation) {
+            // drains the table while exporters are quiet
+            _heartbeat_connection = _flow_proxy->heartbeat_signal.connect(&FlowStreamHandler::flush_preaggregated, this);
+        }
     }
 
     _running = true;
@@ -88,7 +105,9 @@ void FlowStreamHandler::stop()
     if (_flow_proxy) {
         _sflow_connection.disconnect();
         _netflow_connection.disconnect();
+        _heartbeat_connection.disconnect();
     }
+    _metrics->flush_preaggregated();
 
     _running = false;
 }
@@ -108,12 +127,41 @@ void FlowStreamHandler::set_end_tstamp(timespec stamp)
     _metrics->set_end_tstamp(stamp);
 }
 
+void FlowStreamHandler::flush_preaggregated([[maybe_unused]] timespec stamp)
+{
+    _metrics->flush_preaggregated();
+}
+
+// unset (all zero) addresses are left out
+static inline void set_ipv4(FlowData &flow, EnrichmentContext::Endpoint endpoint, uint32_t ipv4)
+{
+    if (ipv4) {
+        flow.enrichment.set_ip(endpoint, IpKey::from_ipv4(ipv4));
+    }
+}
+
+static inline void set_ipv6(FlowData &flow, EnrichmentContext::Endpoint endpoint, const uint8_t *ipv6)
+{
+    static constexpr uint8_t unset[16]{};
+    if (std::memcmp(ipv6, unset, sizeof(unset))) {
+        flow.enrichment.set_ip(endpoint, IpKey::from_ipv6(ipv6));
+    }
+}
+
 void FlowStreamHandler::process_sflow_cb(const SFSample &payload)
 {
+    CpuScope scope(_cpu_account);
     timespec stamp;
     // use now()
     std::timespec_get(&stamp, TIME_UTC);
-    FlowPacket packet(stamp);
+    thread_local FlowPacket packet;
+    packet.reset(stamp);
+    if (payload.agent_addr.type == SFLADDRESSTYPE_IP_V4) {
+        packet.device.address = IpKey::from_ipv4(payload.agent_addr.address.ip_v4.addr);
+    } else if (payload.agent_addr.type == SFLADDRESSTYPE_IP_V6) {
+        packet.device.address = IpKey::from_ipv6(payload.agent_addr.address.ip_v6.addr);
+    }
+    packet.device.id = payload.agentSubId;
 
     for (const auto &sample : payload.elements) {
 
@@ -122,8 +170,8 @@ void FlowStreamHandler::process_sflow_cb(const SFSample &payload)
             continue;
         }
 
-        FlowData flow = {};
-        pcpp::ProtocolType l3;
+        auto &flow = packet.flow_data.emplace_back();
+        flow.records = 1;
         if (sample.gotIPV6) {
             flow.is_ipv6 = true;
         }
@@ -153,24 +201,22 @@ void FlowStreamHandler::process_sflow_cb(const SFSample &payload)
 
         if (sample.ipsrc.type == SFLADDRESSTYPE_IP_V4) {
             flow.is_ipv6 = false;
-            flow.ipv4_in = pcpp::IPv4Address(sample.ipsrc.address.ip_v4.addr);
-
+            set_ipv4(flow, EnrichmentContext::Src, sample.ipsrc.address.ip_v4.addr);
         } else if (sample.ipsrc.type == SFLADDRESSTYPE_IP_V6) {
             flow.is_ipv6 = true;
-            flow.ipv6_in = pcpp::IPv6Address(sample.ipsrc.address.ip_v6.addr);
+            set_ipv6(flow, EnrichmentContext::Src, sample.ipsrc.address.ip_v6.addr);
         }
 
         if (sample.ipdst.type == SFLADDRESSTYPE_IP_V4) {
             flow.is_ipv6 = false;
-            flow.ipv4_out = pcpp::IPv4Address(sample.ipdst.address.ip_v4.addr);
+            set_ipv4(flow, EnrichmentContext::Dst, sample.ipdst.address.ip_v4.addr);
         } else if (sample.ipdst.type == SFLADDRESSTYPE_IP_V6) {
             flow.is_ipv6 = true;
-            flow.ipv6_out = pcpp::IPv6Address(sample.ipdst.address.ip_v6.addr);
+            set_ipv6(flow, EnrichmentContext::Dst, sample.ipdst.address.ip_v6.addr);
         }
 
-        if (!_filtering(flow)) {
-            packet.flow_data.push_back(flow);
-        } else {
+        if (_filtering(flow)) {
+            packet.flow_data.pop_back();
             ++packet.filtered;
         }
     }
@@ -179,6 +225,7 @@ void FlowStreamHandler::process_sflow_cb(const SFSample &payload)
 
 void FlowStreamHandler::process_netflow_cb(const NFSample &payload)
 {
+    CpuScope scope(_cpu_account);
     timespec stamp;
     if (payload.time_sec || payload.time_nanosec) {
         stamp.tv_sec = payload.time_sec;
@@ -187,10 +234,14 @@ void FlowStreamHandler::process_netflow_cb(const NFSample &payload)
         // use now()
         std::timespec_get(&stamp, TIME_UTC);
     }
-    FlowPacket packet(stamp);
+    thread_local FlowPacket packet;
+    packet.reset(stamp);
+    packet.device.address = payload.exporter;
+    packet.device.id = payload.source_id;
 
     for (const auto &sample : payload.flows) {
-        FlowData flow = {};
+        auto &flow = packet.flow_data.emplace_back();
+        flow.records = 1;
         if (sample.is_ipv6) {
             flow.is_ipv6 = true;
         }
@@ -214,16 +265,15 @@ void FlowStreamHandler::process_netflow_cb(const NFSample &payload)
         flow.if_in_index = sample.if_index_in;
 
         if (sample.is_ipv6) {
-            flow.ipv6_in = pcpp::IPv6Address(reinterpret_cast<uint8_t *>(sample.src_ip));
-            flow.ipv6_out = pcpp::IPv6Address(reinterpret_cast<uint8_t *>(sample.dst_ip));
+            set_ipv6(flow, EnrichmentContext::Src, sample.src_ip6);
+            set_ipv6(flow, EnrichmentContext::Dst, sample.dst_ip6);
         } else {
-            flow.ipv4_in = pcpp::IPv4Address(sample.src_ip);
-            flow.ipv4_out = pcpp::IPv4Address(sample.dst_ip);
+            set_ipv4(flow, EnrichmentContext::Src, sample.src_ip);
+            set_ipv4(flow, EnrichmentContext::Dst, sample.dst_ip);
         }
 
-        if (!_filtering(flow)) {
-            packet.flow_data.push_back(flow);
-        } else {
+        if (_filtering(flow)) {
+            packet.flow_data.pop_back();
             ++packet.filtered;
         }
     }
@@ -234,44 +284,31 @@ void FlowStreamHandler::process_netflow_cb(const NFSample &payload)
 bool FlowStreamHandler::_filtering(const FlowData &flow)
 {
     if (_f_enabled[Filters::OnlyHosts]) {
-        if (flow.is_ipv6 && !_match_subnet(0, flow.ipv6_in.toBytes()) && !_match_subnet(0, flow.ipv6_out.toBytes())) {
-            return true;
-        } else if (!_match_subnet(flow.ipv4_in.toInt()) && !_match_subnet(flow.ipv4_out.toInt())) {
-            return true;
-        }
-    }
-    if (_f_enabled[Filters::GeoLocNotFound] && geo::GeoIP().enabled()) {
-        if (!flow.is_ipv6) {
-            struct sockaddr_in sa4;
-            if (IPv4_to_sockaddr(flow.ipv4_in, &sa4) && geo::GeoIP().getGeoLocString(&sa4) != "Unknown") {
-                return true;
-            } else if (IPv4_to_sockaddr(flow.ipv4_out, &sa4) && geo::GeoIP().getGeoLocString(&sa4) != "Unknown") {
-                return true;
+        auto match = [this, &flow](EnrichmentContext::Endpoint endpoint) {
+            if (!flow.enrichment.has_ip(endpoint)) {
+                return false;
             }
-        } else {
-            struct sockaddr_in6 sa6;
-            if (IPv6_to_sockaddr(flow.ipv6_in, &sa6) && geo::GeoIP().getGeoLocString(&sa6) != "Unknown") {
-                return true;
-            } else if (IPv6_to_sockaddr(flow.ipv6_out, &sa6) && geo::GeoIP().getGeoLocString(&sa6) != "Unknown") {
-                return true;
+            const auto &ip = flow.enrichment.ip(endpoint);
+            if (ip.is_ipv4()) {
+                uint32_t ipv4;
+                std::memcpy(&ipv4, &ip.addr[12], sizeof(ipv4));
+                return _match_subnet(ipv4);
             }
+            return _match_subnet(0, ip.addr.data());
+        };
+        if (!match(EnrichmentContext::Src) && !match(EnrichmentContext::Dst)) {
+            return true;
         }
     }
-    if (_f_enabled[Filters::AsnNotFound] && geo::GeoASN().enabled()) {
-        if (!flow.is_ipv6) {
-            struct sockaddr_in sa4;
-            if (IPv4_to_sockaddr(flow.ipv4_in, &sa4) && geo::GeoASN().getASNString(&sa4) != "Unknown") {
-                return true;
-            } else if (IPv4_to_sockaddr(flow.ipv4_out, &sa4) && geo::GeoASN().getASNString(&sa4) != "Unknown") {
-                return true;
-            }
-        } else {
-            struct sockaddr_in6 sa6;
-            if (IPv6_to_sockaddr(flow.ipv6_in, &sa6) && geo::GeoASN().getASNString(&sa6) != "Unknown") {
-                return true;
-            } else if (IPv6_to_sockaddr(flow.ipv6_out, &sa6)  && geo::GeoASN().getASNString(&sa6) != "Unknown") {
-                return true;
-            }
+    bool geo_filter = _f_enabled[Filters::GeoLocNotFound] && geo::GeoIP().enabled();
+    bool asn_filter = _f_enabled[Filters::AsnNotFound] && geo::GeoASN().enabled();
+    if (geo_filter || asn_filter) {
+        const auto &enrichment = flow.enrichment;
+        if (geo_filter && (enrichment.geo_loc(EnrichmentContext::Src) != geo::MaxmindDB::UNKNOWN_ID || enrichment.geo_loc(EnrichmentContext::Dst) != geo::MaxmindDB::UNKNOWN_ID)) {
+            return true;
+        }
+        if (asn_filter && (enrichment.asn(EnrichmentContext::Src) != geo::MaxmindDB::UNKNOWN_ID || enrichment.asn(EnrichmentContext::Dst) != geo::MaxmindDB::UNKNOWN_ID)) {
+            return true;
         }
     }
     return false;
@@ -365,6 +402,25 @@ void FlowMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
     _rate.merge(other._rate);
     _throughput.merge(other._throughput);
 
+    _merge_metrics(other);
+
+    // devices are merged by key, keeping them apart in windows merged over several periods
+    std::shared_lock r_devices(other._devices_mutex);
+    std::unique_lock w_devices(_devices_mutex);
+    _evicted_devices += other._evicted_devices;
+    for (const auto &entry : other._devices) {
+        auto &device = _devices[entry.first];
+        if (!device) {
+            device = _new_device();
+        }
+        device->merge(*entry.second);
+        device->_last_flow = std::max(device->_last_flow.load(), entry.second->_last_flow.load());
+    }
+}
+
+// everything but the rates, which the caller accounts for
+void FlowMetricsBucket::_merge_metrics(const FlowMetricsBucket &other)
+{
     std::shared_lock r_lock(other._mutex);
     std::unique_lock w_lock(_mutex);
 
@@ -415,20 +471,98 @@ void FlowMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
     _payload_size.merge(other._payload_size);
 }
 
-void FlowMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
+/**
+ * The text format wants every metric family exactly once, as one group of lines after its HELP and TYPE. Each part
+ * renders the same families, for the aggregate view or for one device: their series are gathered under the family the
+ * first part started, in that order.
+ */
+static void group_metric_families(std::stringstream &out, const std::vector<std::string> &parts)
 {
+    std::vector<std::string> order;
+    std::unordered_map<std::string, std::string> families;
+    for (const auto &part : parts) {
+        std::istringstream in(part);
+        std::string line;
+        std::string *family{nullptr};
+        bool first{false};
+        while (std::getline(in, line)) {
+            if (line.rfind("# HELP ", 0) == 0) {
+                auto name = line.substr(7, line.find(' ', 7) - 7);
+                auto [it, inserted] = families.try_emplace(name);
+                if (inserted) {
+                    order.push_back(name);
+                }
+                family = &it->second;
+                first = inserted;
+                if (!first) {
+                    continue;
+                }
+            } else if (line.rfind("# TYPE ", 0) == 0 && !first) {
+                continue;
+            }
+            if (family) {
+                family->append(line).push_back('\n');
+            }
+        }
+    }
+    for (const auto &name : order) {
+        out << families[name];
+    }
+}
 
-    _rate.to_prometheus(out, add_labels);
-    _throughput.to_prometheus(out, add_labels);
+void FlowMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
+{
+    std::shared_lock r_devices(_devices_mutex);
+    if (_devices.empty()) {
+        _rate.to_prometheus(out, add_labels);
+        _throughput.to_prometheus(out, add_labels);
+        _event_data_to_prometheus(out, add_labels);
+        _metrics_to_prometheus(out, add_labels);
+        return;
+    }
 
+    // the aggregate view over this bucket and every device
+    FlowMetricsBucket merged;
+    merged.configure_groups(_groups);
+    merged.update_topn_metrics(_topn_count);
+    merged._merge_metrics(*this);
+    for (const auto &device : _devices) {
+        merged._merge_metrics(*device.second);
+    }
+    std::vector<std::string> parts;
     {
-        auto [num_events, num_samples, event_rate, event_lock] = event_data_locked(); // thread safe
+        std::stringstream aggregate;
+        _rate.to_prometheus(aggregate, add_labels);
+        _throughput.to_prometheus(aggregate, add_labels);
+        _event_data_to_prometheus(aggregate, add_labels);
+        merged._metrics_to_prometheus(aggregate, add_labels);
+        parts.push_back(aggregate.str());
+    }
+
+    // followed by the same families per device, told apart by a device label
+    for (const auto &device : _devices) {
+        auto device_labels = add_labels;
+        device_labels["device"] = device.first.to_string();
+        std::stringstream device_out;
+        device.second->_rate.to_prometheus(device_out, device_labels);
+        device.second->_throughput.to_prometheus(device_out, device_labels);
+        device.second->_metrics_to_prometheus(device_out, device_labels);
+        parts.push_back(device_out.str());
+    }
+    group_metric_families(out, parts);
+}
 
-        event_rate->to_prometheus(out, add_labels);
-        num_events->to_prometheus(out, add_labels);
-        num_samples->to_prometheus(out, add_labels);
-    }
+void FlowMetricsBucket::_event_data_to_prometheus(std::stringstream &out, const Metric::LabelMap &add_labels) const
+{
+    auto [num_events, num_samples, event_rate, event_lock] = event_data_locked(); // thread safe
+
+    event_rate->to_prometheus(out, add_labels);
+    num_events->to_prometheus(out, add_labels);
+    num_samples->to_prometheus(out, add_labels);
+}
 
+void FlowMetricsBucket::_metrics_to_prometheus(std::stringstream &out, const Metric::LabelMap &add_labels) const
+{
     std::shared_lock r_lock(_mutex);
 
     if (group_enabled(group::FlowMetrics::Counters)) {
@@ -449,30 +583,30 @@ void FlowMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap a
     }
 
     if (group_enabled(group::FlowMetrics::TopByBytes)) {
-        _topByBytes.topSrcIP.to_prometheus(out, add_labels);
-        _topByBytes.topDstIP.to_prometheus(out, add_labels);
+        _topByBytes.topSrcIP.to_prometheus(out, add_labels, [](const IpKey &val) { return val.to_string(); });
+        _topByBytes.topDstIP.to_prometheus(out, add_labels, [](const IpKey &val) { return val.to_string(); });
         _topByBytes.topSrcPort.to_prometheus(out, add_labels, [](const uint16_t &val) { return std::to_string(val); });
         _topByBytes.topDstPort.to_prometheus(out, add_labels, [](const uint16_t &val) { return std::to_string(val); });
-        _topByBytes.topSrcIPandPort.to_prometheus(out, add_labels);
-        _topByBytes.topDstIPandPort.to_prometheus(out, add_labels);
+        _topByBytes.topSrcIPandPort.to_prometheus(out, add_labels, [](const IpPortKey &val) { return val.to_string(); });
+        _topByBytes.topDstIPandPort.to_prometheus(out, add_labels, [](const IpPortKey &val) { return val.to_string(); });
         _topByBytes.topInIfIndex.to_prometheus(out, add_labels, [](const uint32_t &val) { return std::to_string(val); });
         _topByBytes.topOutIfIndex.to_prometheus(out, add_labels, [](const uint32_t &val) { return std::to_string(val); });
     }
 
     if (group_enabled(group::FlowMetrics::TopByPackets)) {
-        _topByPackets.topSrcIP.to_prometheus(out, add_labels);
-        _topByPackets.topDstIP.to_prometheus(out, add_labels);
+        _topByPackets.topSrcIP.to_prometheus(out, add_labels, [](const IpKey &val) { return val.to_string(); });
+        _topByPackets.topDstIP.to_prometheus(out, add_labels, [](const IpKey &val) { return val.to_string(); });
         _topByPackets.topSrcPort.to_prometheus(out, add_labels, [](const uint16_t &val) { return std::to_string(val); });
         _topByPackets.topDstPort.to_prometheus(out, add_labels, [](const uint16_t &val) { return std::to_string(val); });
-        _topByPackets.topSrcIPandPort.to_prometheus(out, add_labels);
-        _topByPackets.topDstIPandPort.to_prometheus(out, add_labels);
+        _topByPackets.topSrcIPandPort.to_prometheus(out, add_labels, [](const IpPortKey &val) { return val.to_string(); });
+        _topByPackets.topDstIPandPort.to_prometheus(out, add_labels, [](const IpPortKey &val) { return val.to_string(); });
         _topByPackets.topInIfIndex.to_prometheus(out, add_labels, [](const uint32_t &val) { return std::to_string(val); });
         _topByPackets.topOutIfIndex.to_prometheus(out, add_labels, [](const uint32_t &val) { return std::to_string(val); });
     }
 
     if (group_enabled(group::FlowMetrics::TopGeo)) {
-        _topGeoLoc.to_prometheus(out, add_labels);
-        _topASN.to_prometheus(out, add_labels);
+        _topGeoLoc.to_prometheus(out, add_labels, [](const geo::MaxmindDB::Id &val) { return geo::GeoIP().name(val); });
+        _topASN.to_prometheus(out, add_labels, [](const geo::MaxmindDB::Id &val) { return geo::GeoASN().name(val); });
     }
 
     _payload_size.to_prometheus(out, add_labels);
@@ -494,6 +628,33 @@ void FlowMetricsBucket::to_json(json &j) const
         num_samples->to_json(j);
     }
 
+    std::shared_lock r_devices(_devices_mutex);
+    if (_devices.empty()) {
+        _metrics_to_json(j);
+        return;
+    }
+
+    // the aggregate view over this bucket and every device
+    FlowMetricsBucket merged;
+    merged.configure_groups(_groups);
+    merged.update_topn_metrics(_topn_count);
+    merged._merge_metrics(*this);
+    for (const auto &device : _devices) {
+        merged._merge_metrics(*device.second);
+    }
+    merged._metrics_to_json(j);
+
+    j["devices_evicted"] = _evicted_devices;
+    for (const auto &device : _devices) {
+        auto &device_j = j["devices"][device.first.to_string()];
+        device.second->_rate.to_json(device_j, live_rates);
+        device.second->_throughput.to_json(device_j, live_rates);
+        device.second->_metrics_to_json(device_j);
+    }
+}
+
+void FlowMetricsBucket::_metrics_to_json(json &j) const
+{
     std::shared_lock r_lock(_mutex);
 
     if (group_enabled(group::FlowMetrics::Counters)) {
@@ -514,30 +675,30 @@ void FlowMetricsBucket::to_json(json &j) const
     }
 
     if (group_enabled(group::FlowMetrics::TopByBytes)) {
-        _topByBytes.topSrcIP.to_json(j);
-        _topByBytes.topDstIP.to_json(j);
+        _topByBytes.topSrcIP.to_json(j, [](const IpKey &val) { return val.to_string(); });
+        _topByBytes.topDstIP.to_json(j, [](const IpKey &val) { return val.to_string(); });
         _topByBytes.topSrcPort.to_json(j, [](const uint16_t &val) { return std::to_string(val); });
         _topByBytes.topDstPort.to_json(j, [](const uint16_t &val) { return std::to_string(val); });
-        _topByBytes.topSrcIPandPort.to_json(j);
-        _topByBytes.topDstIPandPort.to_json(j);
+        _topByBytes.topSrcIPandPort.to_json(j, [](const IpPortKey &val) { return val.to_string(); });
+        _topByBytes.topDstIPandPort.to_json(j, [](const IpPortKey &val) { return val.to_string(); });
         _topByBytes.topInIfIndex.to_json(j, [](const uint32_t &val) { return std::to_string(val); });
         _topByBytes.topOutIfIndex.to_json(j, [](const uint32_t &val) { return std::to_string(val); });
     }
 
     if (group_enabled(group::FlowMetrics::TopByPackets)) {
-        _topByPackets.topSrcIP.to_json(j);
-        _topByPackets.topDstIP.to_json(j);
+        _topByPackets.topSrcIP.to_json(j, [](const IpKey &val) { return val.to_string(); });
+        _topByPackets.topDstIP.to_json(j, [](const IpKey &val) { return val.to_string(); });
         _topByPackets.topSrcPort.to_json(j, [](const uint16_t &val) { return std::to_string(val); });
         _topByPackets.topDstPort.to_json(j, [](const uint16_t &val) { return std::to_string(val); });
-        _topByPackets.topSrcIPandPort.to_json(j);
-        _topByPackets.topDstIPandPort.to_json(j);
+        _topByPackets.topSrcIPandPort.to_json(j, [](const IpPortKey &val) { return val.to_string(); });
+        _topByPackets.topDstIPandPort.to_json(j, [](const IpPortKey &val) { return val.to_string(); });
         _topByPackets.topInIfIndex.to_json(j, [](const uint32_t &val) { return std::to_string(val); });
         _topByPackets.topOutIfIndex.to_json(j, [](const uint32_t &val) { return std::to_string(val); });
     }
 
     if (group_enabled(group::FlowMetrics::TopGeo)) {
-        _topGeoLoc.to_json(j);
-        _topASN.to_json(j);
+        _topGeoLoc.to_json(j, [](const geo::MaxmindDB::Id &val) { return geo::GeoIP().name(val); });
+        _topASN.to_json(j, [](const geo::MaxmindDB::Id &val) { return geo::GeoASN().name(val); });
     }
 
     _payload_size.to_json(j);
@@ -556,28 +717,28 @@ void FlowMetricsBucket::process_flow(bool deep, const FlowPacket &payload)
         _throughput += flow.payload_size;
 
         if (group_enabled(group::FlowMetrics::Counters)) {
-            ++_counters.total;
+            _counters.total += flow.records;
 
             if (flow.is_ipv6) {
-                ++_counters.IPv6;
+                _counters.IPv6 += flow.records;
             } else {
-                ++_counters.IPv4;
+                _counters.IPv4 += flow.records;
             }
 
             switch (flow.l4) {
             case IP_PROTOCOL::UDP:
-                ++_counters.UDP;
+                _counters.UDP += flow.records;
                 break;
             case IP_PROTOCOL::TCP:
-                ++_counters.TCP;
+                _counters.TCP += flow.records;
                 break;
             default:
-                ++_counters.OtherL4;
+                _counters.OtherL4 += flow.records;
                 break;
             }
         }
 
-        _payload_size.update(flow.payload_size);
+        _payload_size.update(flow.payload_size / flow.records);
 
         if (!deep) {
             continue;
@@ -602,110 +763,149 @@ void FlowMetricsBucket::process_flow(bool deep, const FlowPacket &payload)
             (flow.dst_port > 0) ? _dstPortCard.update(flow.dst_port) : void();
         }
 
-        if (!flow.is_ipv6 && flow.ipv4_in.isValid()) {
-            group_enabled(group::FlowMetrics::Cardinality) ? _srcIPCard.update(flow.ipv4_in.toInt()) : void();
-            auto ip = flow.ipv4_in.toString();
-            if (group_enabled(group::FlowMetrics::TopByBytes)) {
-                _topByBytes.topSrcIP.update(ip, flow.payload_size);
-                if (flow.src_port > 0) {
-                    _topByBytes.topSrcIPandPort.update(ip + ":" + std::to_string(flow.src_port), flow.payload_size);
-                }
-            }
-            if (group_enabled(group::FlowMetrics::TopByPackets)) {
-                _topByPackets.topSrcIP.update(ip, flow.packets);
-                if (flow.src_port > 0) {
-                    _topByPackets.topSrcIPandPort.update(ip + ":" + std::to_string(flow.src_port), flow.packets);
-                }
-            }
-            _process_geo_metrics(flow.ipv4_in);
-        } else if (flow.is_ipv6 && flow.ipv6_in.isValid()) {
-            group_enabled(group::FlowMetrics::Cardinality) ? _srcIPCard.update(reinterpret_cast<const void *>(flow.ipv6_in.toBytes()), 16) : void();
-            auto ip = flow.ipv6_in.toString();
-            if (group_enabled(group::FlowMetrics::TopByPackets)) {
-                _topByBytes.topSrcIP.update(ip, flow.payload_size);
-                if (flow.src_port > 0) {
-                    _topByBytes.topSrcIPandPort.update(ip + ":" + std::to_string(flow.src_port), flow.payload_size);
-                }
-            }
-            if (group_enabled(group::FlowMetrics::TopByPackets)) {
-                _topByPackets.topSrcIP.update(ip, flow.packets);
-                if (flow.src_port > 0) {
-                    _topByPackets.topSrcIPandPort.update(ip + ":" + std::to_string(flow.src_port), flow.packets);
-                }
-            }
-            _process_geo_metrics(flow.ipv6_in);
+        bool has_src_ip = flow.enrichment.has_ip(EnrichmentContext::Src);
+        const auto &src_ip = flow.enrichment.ip(EnrichmentContext::Src);
+        if (has_src_ip) {
+            group_enabled(group::FlowMetrics::Cardinality) ? _update_ip_cardinality(_srcIPCard, src_ip) : void();
+            _process_geo_metrics(flow.enrichment, EnrichmentContext::Src, flow.records);
         }
 
-        if (!flow.is_ipv6 && flow.ipv4_out.isValid()) {
-            group_enabled(group::FlowMetrics::Cardinality) ? _dstIPCard.update(flow.ipv4_out.toInt()) : void();
-            auto ip = flow.ipv4_out.toString();
-            if (group_enabled(group::FlowMetrics::TopByBytes)) {
-                _topByBytes.topDstIP.update(ip, flow.payload_size);
-                if (flow.dst_port > 0) {
-                    _topByBytes.topDstIPandPort.update(ip + ":" + std::to_string(flow.dst_port), flow.payload_size);
-                }
+        bool has_dst_ip = flow.enrichment.has_ip(EnrichmentContext::Dst);
+        const auto &dst_ip = flow.enrichment.ip(EnrichmentContext::Dst);
+        if (has_dst_ip) {
+            group_enabled(group::FlowMetrics::Cardinality) ? _update_ip_cardinality(_dstIPCard, dst_ip) : void();
+            _process_geo_metrics(flow.enrichment, EnrichmentContext::Dst, flow.records);
+        }
+
+        if (group_enabled(group::FlowMetrics::TopByBytes)) {
+            if (has_src_ip) {
+                _process_top_ips(_topByBytes.topSrcIP, _topByBytes.topSrcIPandPort, src_ip, flow.src_port, flow.payload_size);
             }
-            if (group_enabled(group::FlowMetrics::TopByPackets)) {
-                _topByPackets.topDstIP.update(ip, flow.packets);
-                if (flow.dst_port > 0) {
-                    _topByPackets.topDstIPandPort.update(flow.ipv4_out.toString() + ":" + std::to_string(flow.dst_port), flow.packets);
-                }
+            if (has_dst_ip) {
+                _process_top_ips(_topByBytes.topDstIP, _topByBytes.topDstIPandPort, dst_ip, flow.dst_port, flow.payload_size);
             }
-            _process_geo_metrics(flow.ipv4_out);
-        } else if (flow.is_ipv6 && flow.ipv6_out.isValid()) {
-            group_enabled(group::FlowMetrics::Cardinality) ? _dstIPCard.update(reinterpret_cast<const void *>(flow.ipv6_out.toBytes()), 16) : void();
-            auto ip = flow.ipv6_in.toString();
-            if (group_enabled(group::FlowMetrics::TopByBytes)) {
-                _topByBytes.topDstIP.update(ip, flow.payload_size);
-                if (flow.dst_port > 0) {
-                    _topByBytes.topDstIPandPort.update(ip + ":" + std::to_string(flow.dst_port), flow.payload_size);
-                }
+        }
+        if (group_enabled(group::FlowMetrics::TopByPackets)) {
+            if (has_src_ip) {
+                _process_top_ips(_topByPackets.topSrcIP, _topByPackets.topSrcIPandPort, src_ip, flow.src_port, flow.packets);
             }
-            if (group_enabled(group::FlowMetrics::TopByPackets)) {
-                _topByPackets.topDstIP.update(ip, flow.packets);
-                if (flow.dst_port > 0) {
-                    _topByPackets.topDstIPandPort.update(ip + ":" + std::to_string(flow.dst_port), flow.packets);
-                }
+            if (has_dst_ip) {
+                _process_top_ips(_topByPackets.topDstIP, _topByPackets.topDstIPandPort, dst_ip, flow.dst_port, flow.packets);
             }
-            _process_geo_metrics(flow.ipv6_out);
         }
     }
 }
 
-inline void FlowMetricsBucket::_process_geo_metrics(const pcpp::IPv4Address &ipv4)
+void FlowMetricsBucket::process_device_flow(bool deep, const FlowPacket &payload, size_t max_devices)
 {
-    if (geo::enabled() && group_enabled(group::FlowMetrics::TopGeo)) {
-        struct sockaddr_in sa4;
-        if (IPv4_to_sockaddr(ipv4, &sa4)) {
-            if (geo::GeoIP().enabled()) {
-                _topGeoLoc.update(geo::GeoIP().getGeoLocString(&sa4));
-            }
-            if (geo::GeoASN().enabled()) {
-                _topASN.update(geo::GeoASN().getASNString(&sa4));
-            }
+    // the aggregate rates are kept here, device buckets keep their own
+    for (const auto &flow : payload.flow_data) {
+        _rate += flow.packets;
+        _throughput += flow.payload_size;
+    }
+
+    {
+        std::shared_lock r_lock(_devices_mutex);
+        if (auto it = _devices.find(payload.device); it != _devices.end()) {
+            it->second->_last_flow.store(payload.stamp.tv_sec, std::memory_order_relaxed);
+            it->second->process_flow(deep, payload);
+            return;
         }
     }
+
+    std::unique_lock w_lock(_devices_mutex);
+    auto it = _devices.find(payload.device);
+    if (it == _devices.end()) {
+        if (_devices.size() >= max_devices) {
+            auto lru = std::min_element(_devices.begin(), _devices.end(), [](const auto &a, const auto &b) {
+                return a.second->_last_flow.load(std::memory_order_relaxed) < b.second->_last_flow.load(std::memory_order_relaxed);
+            });
+            // keep its flows in the aggregate view
+            _merge_metrics(*lru->second);
+            _devices.erase(lru);
+            ++_evicted_devices;
+        }
+        it = _devices.emplace(payload.device, _new_device()).first;
+    }
+    it->second->_last_flow.store(payload.stamp.tv_sec, std::memory_order_relaxed);
+    it->second->process_flow(deep, payload);
 }
 
-inline void FlowMetricsBucket::_process_geo_metrics(const pcpp::IPv6Address &ipv6)
+std::unique_ptr<FlowMetricsBucket> FlowMetricsBucket::_new_device() const
+{
+    auto device = std::make_unique<FlowMetricsBucket>();
+    device->configure_groups(_groups);
+    device->update_topn_metrics(_topn_count);
+    device->set_start_tstamp(start_tstamp());
+    if (recorded_stream()) {
+        device->set_recorded_stream();
+    }
+    return device;
+}
+
+inline void FlowMetricsBucket::_update_ip_cardinality(Cardinality &card, const IpKey &ip)
+{
+    // hashed as before addresses were kept as IpKey, IPv4 by value and IPv6 by bytes
+    if (ip.is_ipv4()) {
+        uint32_t ipv4;
+        std::memcpy(&ipv4, &ip.addr[12], sizeof(ipv4));
+        card.update(ipv4);
+    } else {
+        card.update(reinterpret_cast<const void *>(ip.addr.data()), 16);
+    }
+}
+
+inline void FlowMetricsBucket::_process_top_ips(TopN<IpKey> &top_ip, TopN<IpPortKey> &top_ip_port, const IpKey &ip, uint16_t port, uint64_t weight)
+{
+    top_ip.update(ip, weight);
+    if (port > 0) {
+        top_ip_port.update(IpPortKey{ip, port}, weight);
+    }
+}
+
+inline void FlowMetricsBucket::_process_geo_metrics(const EnrichmentContext &enrichment, EnrichmentContext::Endpoint endpoint, uint32_t records)
 {
     if (geo::enabled() && group_enabled(group::FlowMetrics::TopGeo)) {
-        struct sockaddr_in6 sa6;
-        if (IPv6_to_sockaddr(ipv6, &sa6)) {
-            if (geo::GeoIP().enabled()) {
-                _topGeoLoc.update(geo::GeoIP().getGeoLocString(&sa6));
-            }
-            if (geo::GeoASN().enabled()) {
-                _topASN.update(geo::GeoASN().getASNString(&sa6));
-            }
+        if (geo::GeoIP().enabled()) {
+            _topGeoLoc.update(enrichment.geo_loc(endpoint), records);
+        }
+        if (geo::GeoASN().enabled()) {
+            _topASN.update(enrichment.asn(endpoint), records);
         }
     }
 }
 
 void FlowMetricsManager::process_flow(const FlowPacket &payload)
 {
-    new_event(payload.stamp);
+    auto deep = new_event(payload.stamp);
+    if (_aggregator) {
+        if (_aggregator->add(payload, deep, std::chrono::steady_clock::now())) {
+            flush_preaggregated();
+        }
+        return;
+    }
+    _process(deep, payload);
+}
+
+void FlowMetricsManager::_process(bool deep, const FlowPacket &payload)
+{
     // process in the "live" bucket
-    live_bucket()->process_flow(_deep_sampling_now, payload);
+    if (_max_devices && payload.device.valid()) {
+        live_bucket()->process_device_flow(deep, payload, _max_devices);
+    } else {
+        live_bucket()->process_flow(deep, payload);
+    }
+}
+
+void FlowMetricsManager::flush_preaggregated()
+{
+    if (!_aggregator) {
+        return;
+    }
+    thread_local std::vector<FlowPacket> packets;
+    auto count = _aggregator->flush(packets, std::chrono::steady_clock::now());
+    for (size_t i = 0; i < count; ++i) {
+        _process(packets[i].deep, packets[i]);
+    }
 }
 }
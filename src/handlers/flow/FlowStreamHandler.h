@@ -5,13 +5,26 @@
 #pragma once
 
 #include "AbstractMetricsManager.h"
+#include "EnrichmentContext.h"
 #include "FlowInputStream.h"
+#include "GeoDB.h"
+#include "IpKey.h"
 #include "MockInputStream.h"
 #include "StreamHandler.h"
 #include <Corrade/Utility/Debug.h>
 #include <IPv4Layer.h>
 #include <IPv6Layer.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <robin_hood.h>
+#include <shared_mutex>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 namespace visor::handler::flow {
 
@@ -33,30 +46,217 @@ enum FlowMetrics : visor::MetricGroupIntType {
 };
 }
 
+/**
+ * The device a flow was exported by: the sFlow agent address and sub agent id, or the address NetFlow/IPFIX was received
+ * from and its observation domain (source_id). All zero when unknown, formatted as "address:id".
+ */
+struct FlowDeviceKey {
+    IpKey address;
+    uint32_t id{0};
+
+    bool valid() const
+    {
+        return address != IpKey{};
+    }
+
+    std::string to_string() const
+    {
+        return address.to_string() + ":" + std::to_string(id);
+    }
+
+    bool operator==(const FlowDeviceKey &other) const
+    {
+        return id == other.id && address == other.address;
+    }
+
+    size_t hash() const
+    {
+        return address.hash() ^ (static_cast<size_t>(id) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    struct Hash {
+        size_t operator()(const FlowDeviceKey &key) const
+        {
+            return key.hash();
+        }
+    };
+};
+
 struct FlowData {
     bool is_ipv6;
     IP_PROTOCOL l4;
+    // flow records summed into this one, 1 unless pre-aggregated
+    uint32_t records;
+    uint64_t packets;
     size_t payload_size;
-    uint32_t packets;
-    pcpp::IPv4Address ipv4_in;
-    pcpp::IPv4Address ipv4_out;
-    pcpp::IPv6Address ipv6_in;
-    pcpp::IPv6Address ipv6_out;
     uint16_t src_port;
     uint16_t dst_port;
     uint32_t if_in_index;
     uint32_t if_out_index;
+    // the in (Src) and out (Dst) addresses, along with their geo lookups shared by the filters and the metrics
+    EnrichmentContext enrichment;
 };
+// flows are copied into reused batches, keep them plain data
+static_assert(std::is_trivially_copyable_v<FlowData>);
 
+/**
+ * The flows of one datagram. Handlers keep one per thread and reset() it for every datagram, so the capacity of
+ * flow_data is reused.
+ */
 struct FlowPacket {
-    timespec stamp;
-    uint64_t filtered;
+    timespec stamp{};
+    FlowDeviceKey device{};
+    uint64_t filtered{0};
+    // whether the flows were deep sampled, set on the payloads FlowAggregator flushes
+    bool deep{true};
     std::vector<FlowData> flow_data;
 
-    FlowPacket(timespec stamp)
-        : stamp(stamp)
-        , filtered(0)
+    void reset(timespec stamp)
+    {
+        this->stamp = stamp;
+        device = {};
+        filtered = 0;
+        deep = true;
+        flow_data.clear();
+    }
+};
+
+/**
+ * Short interval pre-aggregation of flow records, ahead of the metrics bucket.
+ *
+ * Exporters report many records for the same conversation within a second. Records from the same device with the same
+ * addresses, ports, protocol and interfaces are summed in a flat hash table and reach the sketches as a single weighted record when the
+ * table is flushed: once the interval elapsed, or once it holds max_flows records. Weighted TopN, rates, cardinalities
+ * and counters come out the same, payload size quantiles see the mean payload size of each aggregated record.
+ *
+ * The deep sampling decision is made per datagram when it arrives. It is part of the key, so deep and shallow records
+ * are summed apart and each keeps its decision through the flush.
+ *
+ * Thread safe, the lock is only held to hash flows in or to take the table out.
+ */
+class FlowAggregator
+{
+public:
+    struct Key {
+        FlowDeviceKey device;
+        IpKey src_ip;
+        IpKey dst_ip;
+        uint32_t if_in_index;
+        uint32_t if_out_index;
+        uint16_t src_port;
+        uint16_t dst_port;
+        IP_PROTOCOL l4;
+        bool is_ipv6;
+        bool deep;
+
+        Key(const FlowDeviceKey &device, const FlowData &flow, bool deep)
+            : device(device)
+            , src_ip(flow.enrichment.ip(EnrichmentContext::Src))
+            , dst_ip(flow.enrichment.ip(EnrichmentContext::Dst))
+            , if_in_index(flow.if_in_index)
+            , if_out_index(flow.if_out_index)
+            , src_port(flow.src_port)
+            , dst_port(flow.dst_port)
+            , l4(flow.l4)
+            , is_ipv6(flow.is_ipv6)
+            , deep(deep)
+        {
+        }
+
+        bool operator==(const Key &other) const
+        {
+            return src_port == other.src_port && dst_port == other.dst_port && if_in_index == other.if_in_index
+                && if_out_index == other.if_out_index && l4 == other.l4 && is_ipv6 == other.is_ipv6 && deep == other.deep
+                && src_ip == other.src_ip && dst_ip == other.dst_ip && device == other.device;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const
+        {
+            uint64_t ports = (static_cast<uint64_t>(key.src_port) << 48) | (static_cast<uint64_t>(key.dst_port) << 32)
+                | (static_cast<uint64_t>(key.l4) << 2) | (static_cast<uint64_t>(key.deep) << 1) | key.is_ipv6;
+            uint64_t interfaces = (static_cast<uint64_t>(key.if_in_index) << 32) | key.if_out_index;
+            return key.src_ip.hash() ^ (key.dst_ip.hash() * 31) ^ (key.device.hash() * 7) ^ static_cast<size_t>((ports ^ (interfaces * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL);
+        }
+    };
+
+private:
+    std::mutex _mutex;
+    robin_hood::unordered_flat_map<Key, FlowData, KeyHash> _flows;
+    robin_hood::unordered_flat_map<FlowDeviceKey, uint64_t, FlowDeviceKey::Hash> _filtered;
+    timespec _stamp{};
+    std::chrono::milliseconds _interval;
+    size_t _max_flows;
+    std::chrono::steady_clock::time_point _next_flush;
+
+public:
+    FlowAggregator(std::chrono::milliseconds interval, size_t max_flows)
+        : _interval(interval)
+        , _max_flows(max_flows)
+        , _next_flush(std::chrono::steady_clock::now() + interval)
+    {
+    }
+
+    /**
+     * Aggregate the flows of payload
+     * @param deep whether payload is deep sampled
+     * @return true once the table is due to be flushed
+     */
+    bool add(const FlowPacket &payload, bool deep, std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard lock(_mutex);
+        _stamp = payload.stamp;
+        if (payload.filtered) {
+            _filtered[payload.device] += payload.filtered;
+        }
+        for (const auto &flow : payload.flow_data) {
+            auto [it, inserted] = _flows.try_emplace(Key(payload.device, flow, deep), flow);
+            if (!inserted) {
+                it->second.records += flow.records;
+                it->second.packets += flow.packets;
+                it->second.payload_size += flow.payload_size;
+            }
+        }
+        return _flows.size() >= _max_flows || now >= _next_flush;
+    }
+
+    /**
+     * Move the aggregated flows into payloads, one per device and sampling decision, stamped with the time of the last
+     * one added, and start the next interval. filtered counts go to the deep payload of their device
+     * @return the number of payloads filled, payloads past it are left untouched so their capacity can be reused
+     */
+    size_t flush(std::vector<FlowPacket> &payloads, std::chrono::steady_clock::time_point now)
     {
+        std::lock_guard lock(_mutex);
+        static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+        // payload index of each device, by [deep]
+        thread_local robin_hood::unordered_flat_map<FlowDeviceKey, std::array<size_t, 2>, FlowDeviceKey::Hash> index;
+        index.clear();
+        size_t count{0};
+        auto payload_of = [this, &payloads, &count](const FlowDeviceKey &device, bool deep) -> FlowPacket & {
+            auto &slot = index.try_emplace(device, std::array<size_t, 2>{NONE, NONE}).first->second[deep];
+            if (slot == NONE) {
+                if (payloads.size() <= count) {
+                    payloads.emplace_back();
+                }
+                payloads[count].reset(_stamp);
+                payloads[count].device = device;
+                payloads[count].deep = deep;
+                slot = count++;
+            }
+            return payloads[slot];
+        };
+        for (const auto &entry : _filtered) {
+            payload_of(entry.first, true).filtered = entry.second;
+        }
+        for (const auto &entry : _flows) {
+            payload_of(entry.first.device, entry.first.deep).flow_data.push_back(entry.second);
+        }
+        _flows.clear();
+        _filtered.clear();
+        _next_flush = now + _interval;
+        return count;
     }
 };
 
@@ -71,16 +271,16 @@ protected:
     Cardinality _srcPortCard;
     Cardinality _dstPortCard;
 
-    TopN<std::string> _topGeoLoc;
-    TopN<std::string> _topASN;
+    TopN<geo::MaxmindDB::Id> _topGeoLoc;
+    TopN<geo::MaxmindDB::Id> _topASN;
 
     struct topns {
-        TopN<std::string> topSrcIP;
-        TopN<std::string> topDstIP;
+        TopN<IpKey> topSrcIP;
+        TopN<IpKey> topDstIP;
         TopN<uint16_t> topSrcPort;
         TopN<uint16_t> topDstPort;
-        TopN<std::string> topSrcIPandPort;
-        TopN<std::string> topDstIPandPort;
+        TopN<IpPortKey> topSrcIPandPort;
+        TopN<IpPortKey> topDstIPandPort;
         TopN<uint32_t> topInIfIndex;
         TopN<uint32_t> topOutIfIndex;
         topns(std::string metric)
@@ -137,8 +337,22 @@ protected:
     Rate _rate;
     Rate _throughput;
 
-    void _process_geo_metrics(const pcpp::IPv4Address &ipv4);
-    void _process_geo_metrics(const pcpp::IPv6Address &ipv6);
+    // per device sub buckets, see process_device_flow()
+    mutable std::shared_mutex _devices_mutex;
+    robin_hood::unordered_map<FlowDeviceKey, std::unique_ptr<FlowMetricsBucket>, FlowDeviceKey::Hash> _devices;
+    uint64_t _evicted_devices{0};
+    // seconds stamp of the last flow of a device bucket, for LRU eviction
+    std::atomic_int64_t _last_flow{0};
+    size_t _topn_count{10};
+
+    std::unique_ptr<FlowMetricsBucket> _new_device() const;
+    void _merge_metrics(const FlowMetricsBucket &other);
+    void _metrics_to_json(json &j) const;
+    void _metrics_to_prometheus(std::stringstream &out, const Metric::LabelMap &add_labels) const;
+    void _event_data_to_prometheus(std::stringstream &out, const Metric::LabelMap &add_labels) const;
+    void _process_geo_metrics(const EnrichmentContext &enrichment, EnrichmentContext::Endpoint endpoint, uint32_t records);
+    void _update_ip_cardinality(Cardinality &card, const IpKey &ip);
+    void _process_top_ips(TopN<IpKey> &top_ip, TopN<IpPortKey> &top_ip_port, const IpKey &ip, uint16_t port, uint64_t weight);
 
 public:
     FlowMetricsBucket()
@@ -169,6 +383,7 @@ public:
     void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override;
     void update_topn_metrics(size_t topn_count) override
     {
+        _topn_count = topn_count;
         _topByBytes.set_topn_count(topn_count);
         _topByPackets.set_topn_count(topn_count);
         _topGeoLoc.set_topn_count(topn_count);
@@ -181,20 +396,57 @@ public:
         // stop rate collection
         _rate.cancel();
         _throughput.cancel();
+        std::shared_lock lock(_devices_mutex);
+        for (const auto &device : _devices) {
+            device.second->_rate.cancel();
+            device.second->_throughput.cancel();
+        }
+    }
+
+    size_t device_count() const
+    {
+        std::shared_lock lock(_devices_mutex);
+        return _devices.size();
     }
 
     void process_flow(bool deep, const FlowPacket &payload);
+
+    /**
+     * Process payload in the sub bucket of its device, so flows from different devices only contend on the device
+     * index. Once max_devices are kept the least recently seen one is merged into this bucket and dropped. The
+     * aggregate view (to_json(), to_prometheus()) merges this bucket with every device.
+     */
+    void process_device_flow(bool deep, const FlowPacket &payload, size_t max_devices);
 };
 
 class FlowMetricsManager final : public visor::AbstractMetricsManager<FlowMetricsBucket>
 {
+    std::unique_ptr<FlowAggregator> _aggregator;
+    size_t _max_devices{0};
+
+    void _process(bool deep, const FlowPacket &payload);
+
 public:
     FlowMetricsManager(const Configurable *window_config)
         : visor::AbstractMetricsManager<FlowMetricsBucket>(window_config)
     {
     }
 
+    // not thread safe, call before processing flows
+    void set_preaggregation(std::chrono::milliseconds interval, size_t max_flows)
+    {
+        _aggregator = std::make_unique<FlowAggregator>(interval, max_flows);
+    }
+
+    // not thread safe, call before processing flows. 0 keeps all devices in one bucket
+    void set_max_devices(size_t max_devices)
+    {
+        _max_devices = max_devices;
+    }
+
     void process_flow(const FlowPacket &payload);
+    // moves pre-aggregated flows, if any, into the live bucket
+    void flush_preaggregated();
 };
 
 class FlowStreamHandler final : public visor::StreamMetricsHandler<FlowMetricsManager>
@@ -206,6 +458,7 @@ class FlowStreamHandler final : public visor::StreamMetricsHandler<FlowMetricsMa
 
     sigslot::connection _sflow_connection;
     sigslot::connection _netflow_connection;
+    sigslot::connection _heartbeat_connection;
 
     std::vector<Ipv4Subnet> _IPv4_host_list;
     std::vector<Ipv6Subnet> _IPv6_host_list;
@@ -231,6 +484,7 @@ class FlowStreamHandler final : public visor::StreamMetricsHandler<FlowMetricsMa
     void process_netflow_cb(const NFSample &);
     void set_start_tstamp(timespec stamp);
     void set_end_tstamp(timespec stamp);
+    void flush_preaggregated(timespec stamp);
 
     void _parse_host_specs(const std::vector<std::string> &host_list);
     bool _match_subnet(uint32_t ipv4 = 0, const uint8_t *ipv6 = nullptr);
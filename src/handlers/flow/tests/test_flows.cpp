@@ -3,9 +3,32 @@
 #include "FlowInputStream.h"
 #include "FlowStreamHandler.h"
 #include "GeoDB.h"
+#include "tests/AllocCounter.h"
+#include <PcapFileDevice.h>
+#include <UdpLayer.h>
+#include <arpa/inet.h>
+#include <set>
+#include <thread>
 
 using namespace visor::handler::flow;
 
+static std::vector<std::vector<uint8_t>> udp_payloads(const std::string &file)
+{
+    std::vector<std::vector<uint8_t>> payloads;
+    auto reader = pcpp::IFileReaderDevice::getReader(file);
+    reader->open();
+    pcpp::RawPacket raw_packet;
+    while (reader->getNextPacket(raw_packet)) {
+        pcpp::Packet packet(&raw_packet);
+        if (auto udp = packet.getLayerOfType<pcpp::UdpLayer>(); udp) {
+            payloads.emplace_back(udp->getLayerPayload(), udp->getLayerPayload() + udp->getLayerPayloadSize());
+        }
+    }
+    reader->close();
+    delete reader;
+    return payloads;
+}
+
 TEST_CASE("Parse sflow stream", "[sflow][flow]")
 {
 
@@ -195,4 +218,361 @@ TEST_CASE("Parse netflow stream", "[netflow][flow]")
     CHECK(j["top_src_ips_bytes"][0]["estimate"] == 6066232);
     CHECK(j["top_src_ips_packets"][0]["estimate"] == 7858);
     CHECK(j["payload_size"]["p50"] == 5926641);
-}
\ No newline at end of file
+}
+TEST_CASE("Parse netflow stream with pre-aggregation", "[netflow][flow]")
+{
+
+    FlowInputStream stream{"netflow-test"};
+    stream.config_set("flow_type", "netflow");
+    stream.config_set("pcap_file", "tests/fixtures/nf9.pcap");
+
+    visor::Config c;
+    auto stream_proxy = stream.add_event_proxy(c);
+    c.config_set<uint64_t>("num_periods", 1);
+    FlowStreamHandler flow_handler{"flow-test", stream_proxy, &c};
+    flow_handler.config_set<uint64_t>("preaggregation_ms", 60000);
+
+    flow_handler.start();
+    stream.start();
+    stream.stop();
+    flow_handler.stop();
+
+    auto counters = flow_handler.metrics()->bucket(0)->counters();
+    auto event_data = flow_handler.metrics()->bucket(0)->event_data_locked();
+
+    // the same results as without pre-aggregation, flushed on stop
+    CHECK(event_data.num_events->value() == 1);
+    CHECK(counters.IPv4.value() == 24);
+    CHECK(counters.OtherL4.value() == 24);
+    CHECK(counters.total.value() == 24);
+
+    nlohmann::json j;
+    flow_handler.metrics()->bucket(0)->to_json(j);
+
+    CHECK(j["cardinality"]["dst_ips_out"] == 24);
+    CHECK(j["cardinality"]["src_ips_in"] == 24);
+    CHECK(j["top_src_ips_bytes"][0]["estimate"] == 6066232);
+    CHECK(j["top_src_ips_packets"][0]["estimate"] == 7858);
+    CHECK(j["payload_size"]["p50"] == 5926641);
+}
+
+TEST_CASE("Flow pre-aggregation", "[flow]")
+{
+    auto flow_of = [](uint32_t src, uint16_t dst_port, uint64_t packets, size_t bytes) {
+        FlowData flow{};
+        flow.records = 1;
+        flow.l4 = IP_PROTOCOL::TCP;
+        flow.packets = packets;
+        flow.payload_size = bytes;
+        flow.dst_port = dst_port;
+        flow.enrichment.set_ip(visor::EnrichmentContext::Src, visor::IpKey::from_ipv4(src));
+        flow.enrichment.set_ip(visor::EnrichmentContext::Dst, visor::IpKey::from_ipv4(0x01010101));
+        return flow;
+    };
+
+    auto now = std::chrono::steady_clock::now();
+    FlowAggregator aggregator(std::chrono::milliseconds(100), 3);
+
+    FlowPacket packet;
+    packet.reset({10, 0});
+    packet.filtered = 1;
+    packet.flow_data.push_back(flow_of(0x0a000001, 53, 1, 100));
+    packet.flow_data.push_back(flow_of(0x0a000001, 53, 2, 200));
+    packet.flow_data.push_back(flow_of(0x0a000002, 53, 3, 300));
+    CHECK_FALSE(aggregator.add(packet, true, now));
+
+    packet.reset({11, 0});
+    packet.flow_data.push_back(flow_of(0x0a000001, 53, 4, 400));
+    packet.flow_data.push_back(flow_of(0x0a000001, 443, 5, 500));
+    // three distinct flows fill the table
+    CHECK(aggregator.add(packet, true, now));
+
+    std::vector<FlowPacket> payloads;
+    REQUIRE(aggregator.flush(payloads, now) == 1);
+    auto &flushed = payloads[0];
+    CHECK(flushed.stamp.tv_sec == 11);
+    CHECK(flushed.filtered == 1);
+    REQUIRE(flushed.flow_data.size() == 3);
+    uint32_t records{0};
+    for (const auto &flow : flushed.flow_data) {
+        records += flow.records;
+        if (flow.enrichment.ip(visor::EnrichmentContext::Src) == visor::IpKey::from_ipv4(0x0a000001) && flow.dst_port == 53) {
+            CHECK(flow.records == 3);
+            CHECK(flow.packets == 7);
+            CHECK(flow.payload_size == 700);
+        }
+    }
+    CHECK(records == 5);
+
+    // flushing starts the next interval
+    packet.reset({12, 0});
+    packet.flow_data.push_back(flow_of(0x0a000003, 53, 1, 100));
+    CHECK_FALSE(aggregator.add(packet, true, now + std::chrono::milliseconds(50)));
+    CHECK(aggregator.add(packet, true, now + std::chrono::milliseconds(100)));
+    REQUIRE(aggregator.flush(payloads, now + std::chrono::milliseconds(100)) == 1);
+    REQUIRE(flushed.flow_data.size() == 1);
+    CHECK(flushed.flow_data[0].records == 2);
+    CHECK(flushed.filtered == 0);
+
+    // the same flow from two devices is kept apart
+    packet.reset({13, 0});
+    packet.device.address = visor::IpKey::from_ipv4(0x0100000a);
+    packet.flow_data.push_back(flow_of(0x0a000003, 53, 1, 100));
+    aggregator.add(packet, true, now);
+    packet.device.id = 1;
+    packet.filtered = 2;
+    aggregator.add(packet, true, now);
+    REQUIRE(aggregator.flush(payloads, now) == 2);
+    for (size_t i = 0; i < 2; ++i) {
+        REQUIRE(payloads[i].flow_data.size() == 1);
+        CHECK(payloads[i].flow_data[0].records == 1);
+        CHECK(payloads[i].filtered == payloads[i].device.id * 2);
+    }
+
+    // records merge with those of the same sampling decision, and keep it through the flush
+    packet.reset({14, 0});
+    packet.flow_data.push_back(flow_of(0x0a000004, 53, 1, 100));
+    aggregator.add(packet, true, now);
+    aggregator.add(packet, false, now);
+    aggregator.add(packet, true, now);
+    REQUIRE(aggregator.flush(payloads, now) == 2);
+    for (size_t i = 0; i < 2; ++i) {
+        REQUIRE(payloads[i].flow_data.size() == 1);
+        CHECK(payloads[i].flow_data[0].records == (payloads[i].deep ? 2 : 1));
+        CHECK(payloads[i].flow_data[0].packets == (payloads[i].deep ? 2 : 1));
+    }
+    CHECK(payloads[0].deep != payloads[1].deep);
+}
+
+TEST_CASE("Parse netflow stream with device metrics", "[netflow][flow]")
+{
+
+    FlowInputStream stream{"netflow-test"};
+    stream.config_set("flow_type", "netflow");
+    stream.config_set("pcap_file", "tests/fixtures/nf9.pcap");
+
+    visor::Config c;
+    auto stream_proxy = stream.add_event_proxy(c);
+    c.config_set<uint64_t>("num_periods", 1);
+    FlowStreamHandler flow_handler{"flow-test", stream_proxy, &c};
+    flow_handler.config_set<uint64_t>("max_devices", 16);
+
+    flow_handler.start();
+    stream.start();
+    stream.stop();
+    flow_handler.stop();
+
+    REQUIRE(flow_handler.metrics()->bucket(0)->device_count() == 1);
+
+    nlohmann::json j;
+    flow_handler.metrics()->bucket(0)->to_json(j);
+
+    // the aggregate view is unchanged
+    CHECK(j["flows"] == 24);
+    CHECK(j["ipv4"] == 24);
+    CHECK(j["cardinality"]["src_ips_in"] == 24);
+    CHECK(j["top_src_ips_bytes"][0]["estimate"] == 6066232);
+    CHECK(j["devices_evicted"] == 0);
+    REQUIRE(j["devices"].size() == 1);
+    auto &device = j["devices"].begin().value();
+    CHECK(device["flows"] == 24);
+    CHECK(device["top_src_ips_bytes"][0]["estimate"] == 6066232);
+
+    std::stringstream output;
+    flow_handler.metrics()->bucket(0)->to_prometheus(output, {{"module", "flow-test"}});
+    CHECK(output.str().find("flow_ipv4{module=\"flow-test\"} 24") != std::string::npos);
+    CHECK(output.str().find("flow_ipv4{device=\"" + j["devices"].begin().key() + "\",module=\"flow-test\"} 24") != std::string::npos);
+    // every family once, with the aggregate and device series grouped under it
+    std::set<std::string> families;
+    std::string line, family;
+    while (std::getline(output, line)) {
+        if (line.rfind("# HELP ", 0) == 0) {
+            family = line.substr(7, line.find(' ', 7) - 7);
+            CHECK(families.insert(family).second);
+        } else if (line.rfind("# ", 0) != 0) {
+            CHECK(line.rfind(family, 0) == 0);
+        }
+    }
+    CHECK(families.count("flow_ipv4") == 1);
+}
+
+TEST_CASE("Flow device eviction", "[flow]")
+{
+    std::bitset<visor::GROUP_SIZE> groups;
+    groups.set(group::FlowMetrics::Counters);
+    groups.set(group::FlowMetrics::TopByPackets);
+    FlowMetricsBucket bucket;
+    bucket.configure_groups(&groups);
+
+    FlowPacket packet;
+    auto device_flow = [&packet](uint32_t exporter, time_t stamp) -> const FlowPacket & {
+        packet.reset({stamp, 0});
+        packet.device.address = visor::IpKey::from_ipv4(exporter);
+        auto &flow = packet.flow_data.emplace_back();
+        flow.records = 1;
+        flow.l4 = IP_PROTOCOL::UDP;
+        flow.packets = 10;
+        flow.payload_size = 1000;
+        flow.enrichment.set_ip(visor::EnrichmentContext::Src, visor::IpKey::from_ipv4(exporter));
+        return packet;
+    };
+
+    bucket.process_device_flow(true, device_flow(0x0100000a, 1), 2);
+    bucket.process_device_flow(true, device_flow(0x0200000a, 2), 2);
+    bucket.process_device_flow(true, device_flow(0x0100000a, 3), 2);
+    // the least recently seen device, 10.0.0.2, makes room
+    bucket.process_device_flow(true, device_flow(0x0300000a, 4), 2);
+    CHECK(bucket.device_count() == 2);
+
+    nlohmann::json j;
+    bucket.to_json(j);
+    CHECK(j["flows"] == 4);
+    CHECK(j["udp"] == 4);
+    CHECK(j["devices_evicted"] == 1);
+    CHECK(j["devices"]["10.0.0.1:0"]["flows"] == 2);
+    CHECK(j["devices"]["10.0.0.3:0"]["flows"] == 1);
+    CHECK(j["devices"].count("10.0.0.2:0") == 0);
+    CHECK(j["top_src_ips_packets"].size() == 3);
+}
+
+TEST_CASE("Flow metrics from concurrent workers", "[netflow][flow]")
+{
+
+    FlowInputStream stream{"netflow-test"};
+    stream.config_set("flow_type", "netflow");
+
+    visor::Config c;
+    auto stream_proxy = static_cast<FlowInputEventProxy *>(stream.add_event_proxy(c));
+    c.config_set<uint64_t>("num_periods", 10);
+    c.config_set<uint64_t>("deep_sample_rate", 50);
+    FlowStreamHandler flow_handler{"flow-test", stream_proxy, &c};
+
+    flow_handler.start();
+
+    // each worker sends one datagram per second of export time, from the start of the first period on. they run
+    // unsynchronized, but the latest time stamp only ever moves by one second, so each period shifts exactly once
+    constexpr uint32_t workers = 4;
+    constexpr uint32_t seconds = 290;
+    auto start = static_cast<uint32_t>(flow_handler.metrics()->start_tstamp().tv_sec);
+    std::vector<std::thread> threads;
+    for (uint32_t w = 0; w < workers; ++w) {
+        threads.emplace_back([stream_proxy, start, w] {
+            NFSample sample;
+            for (uint32_t i = 0; i < seconds; ++i) {
+                sample.reset();
+                sample.time_sec = start + i;
+                auto &flow = sample.flows.emplace_back();
+                flow.protocol = IP_PROTOCOL::UDP;
+                flow.src_ip = htonl(0x0a000001 + w);
+                flow.dst_ip = htonl(0x0a000100);
+                flow.dst_port = 53;
+                flow.flow_packets = 1;
+                flow.flow_octets = 100;
+                stream_proxy->netflow_signal(sample);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    flow_handler.stop();
+
+    REQUIRE(flow_handler.metrics()->current_periods() == 5);
+    uint64_t flows{0}, events{0}, samples{0};
+    for (uint64_t period = 0; period < 5; ++period) {
+        auto bucket = flow_handler.metrics()->bucket(period);
+        auto event_data = bucket->event_data_locked();
+        events += event_data.num_events->value();
+        samples += event_data.num_samples->value();
+        flows += bucket->counters().UDP.value();
+        // every shift opened one period, 60 seconds after the previous one. the first period started with the handler
+        if (period && period < 4) {
+            CHECK(bucket->start_tstamp().tv_sec + 60 == flow_handler.metrics()->bucket(period - 1)->start_tstamp().tv_sec);
+        }
+    }
+    // nothing was lost to a racing period shift
+    CHECK(events == workers * seconds);
+    CHECK(flows == workers * seconds);
+    CHECK(samples > 0);
+    CHECK(samples < events);
+}
+
+TEST_CASE("Flow handler does not allocate per datagram", "[sflow][netflow][flow]")
+{
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 1);
+
+    SECTION("sflow")
+    {
+        auto datagrams = udp_payloads("tests/fixtures/ecmp.pcap");
+        // decoded up front, the handler callbacks are measured on their own
+        std::vector<SFSample> samples(datagrams.size());
+        for (size_t i = 0; i < datagrams.size(); ++i) {
+            samples[i].rawSample = datagrams[i].data();
+            samples[i].rawSampleLen = datagrams[i].size();
+            read_sflow_datagram(&samples[i]);
+        }
+
+        FlowInputStream stream{"sflow-test"};
+        stream.config_set("flow_type", "sflow");
+        auto stream_proxy = static_cast<FlowInputEventProxy *>(stream.add_event_proxy(c));
+        FlowStreamHandler flow_handler{"flow-test", stream_proxy, &c};
+        flow_handler.start();
+
+        auto replay = [&]() {
+            auto allocations = alloc_count;
+            for (const auto &sample : samples) {
+                stream_proxy->sflow_signal(sample);
+            }
+            return alloc_count - allocations;
+        };
+        // the first pass sizes the per thread flow batch and fills the sketches
+        CHECK(replay() > 0);
+        // after that, flow conversion, filtering and metrics run without allocating
+        CHECK(replay() == 0);
+
+        flow_handler.stop();
+        CHECK(flow_handler.metrics()->bucket(0)->counters().TCP.value() == 2 * 52785);
+    }
+
+    SECTION("netflow")
+    {
+        auto datagrams = udp_payloads("tests/fixtures/nf9.pcap");
+        // the first pass learns the templates, the samples of the second one carry every flow
+        NetflowTemplateCache templates;
+        auto exporter = visor::IpKey::from_ipv4(htonl(0xc0a80001));
+        std::vector<NFSample> samples(datagrams.size());
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t i = 0; i < datagrams.size(); ++i) {
+                samples[i].reset();
+                samples[i].raw_sample = datagrams[i].data();
+                samples[i].raw_sample_len = datagrams[i].size();
+                process_netflow_packet(&samples[i], templates, exporter, 1000);
+            }
+        }
+        size_t flows{0};
+        for (const auto &sample : samples) {
+            flows += sample.flows.size();
+        }
+        REQUIRE(flows > 0);
+
+        FlowInputStream stream{"netflow-test"};
+        stream.config_set("flow_type", "netflow");
+        auto stream_proxy = static_cast<FlowInputEventProxy *>(stream.add_event_proxy(c));
+        FlowStreamHandler flow_handler{"flow-test", stream_proxy, &c};
+        flow_handler.start();
+
+        auto replay = [&]() {
+            auto allocations = alloc_count;
+            for (const auto &sample : samples) {
+                stream_proxy->netflow_signal(sample);
+            }
+            return alloc_count - allocations;
+        };
+        CHECK(replay() > 0);
+        CHECK(replay() == 0);
+
+        flow_handler.stop();
+        CHECK(flow_handler.metrics()->bucket(0)->counters().total.value() == 2 * flows);
+    }
+}
@@ -4,9 +4,30 @@
 
 #include "InputResourcesStreamHandler.h"
 #include "Policies.h"
+#include <algorithm>
 
 namespace visor::handler::resources {
 
+namespace {
+
+// how each CpuUsage field is reported. perf fields are only reported when perf counters are enabled
+struct CpuField {
+    const char *name;
+    uint64_t CpuUsage::*value;
+    bool perf;
+    const char *desc;
+};
+
+const CpuField CPU_FIELDS[] = {
+    {"calls", &CpuUsage::calls, false, "Number of event callbacks"},
+    {"cpu_ns", &CpuUsage::cpu_ns, false, "Thread CPU time in nanoseconds spent in event callbacks, estimated from sampled calls"},
+    {"task_clock_ns", &CpuUsage::task_clock_ns, true, "perf task-clock in nanoseconds spent in event callbacks, estimated from sampled calls"},
+    {"context_switches", &CpuUsage::context_switches, true, "perf context switches during event callbacks, estimated from sampled calls"},
+    {"page_faults", &CpuUsage::page_faults, true, "perf page faults during event callbacks, estimated from sampled calls"},
+};
+
+}
+
 InputResourcesStreamHandler::InputResourcesStreamHandler(const std::string &name, InputEventProxy *proxy, const Configurable *window_config, StreamHandler *handler)
     : visor::StreamMetricsHandler<InputResourcesMetricsManager>(name, window_config)
     , _timer(0)
@@ -26,6 +47,7 @@ InputResourcesStreamHandler::InputResourcesStreamHandler(const std::string &name
         if (!_pcap_proxy && !_mock_proxy && !_dnstap_proxy && !_flow_proxy) {
             throw StreamHandlerException(fmt::format("ResourcesStreamHandler: unsupported input event proxy {}", proxy->name()));
         }
+        _proxy = proxy;
     }
 }
 
@@ -40,6 +62,8 @@ void InputResourcesStreamHandler::start()
     }
 
     if (_pcap_proxy) {
+        // only counts the packets the other handlers want
+        _pcap_proxy->want_packets(std::nullopt);
         _pkt_connection = _pcap_proxy->packet_signal.connect(&InputResourcesStreamHandler::process_packet_cb, this);
         _policies_connection = _pcap_proxy->policy_signal.connect(&InputResourcesStreamHandler::process_policies_cb, this);
         _heartbeat_connection = _pcap_proxy->heartbeat_signal.connect(&InputResourcesStreamHandler::check_period_shift, this);
@@ -65,6 +89,7 @@ void InputResourcesStreamHandler::stop()
 
     if (_pcap_proxy) {
         _pkt_connection.disconnect();
+        _pcap_proxy->release_packets(std::nullopt);
     } else if (_dnstap_proxy) {
         _dnstap_connection.disconnect();
     } else if (_flow_proxy) {
@@ -82,52 +107,86 @@ void InputResourcesStreamHandler::process_policies_cb(const Policy *policy, Acti
     int16_t policies_number = 0;
     int16_t handlers_count = 0;
 
+    std::unique_lock lock(_policies_mutex);
     switch (action) {
     case Action::AddPolicy:
         policies_number = 1;
         handlers_count = policy->get_handlers_list_size();
+        _policies.push_back(policy);
         break;
     case Action::RemovePolicy:
         policies_number = -1;
         handlers_count = -policy->get_handlers_list_size();
+        _policies.erase(std::remove(_policies.begin(), _policies.end(), policy), _policies.end());
+        for (const auto &module : policy->modules()) {
+            _last_handler_cpu.erase(module->name());
+        }
         break;
     }
+    lock.unlock();
 
     _metrics->process_policies(policies_number, handlers_count);
 }
 
 void InputResourcesStreamHandler::process_sflow_cb([[maybe_unused]] const SFSample &)
 {
+    CpuScope scope(_cpu_account);
     if (difftime(time(NULL), _timer) >= MEASURE_INTERVAL) {
         _timer = time(NULL);
-        _metrics->process_resources(_monitor.cpu_percentage(), _monitor.memory_usage());
+        _measure_resources();
     }
 }
 
 void InputResourcesStreamHandler::process_netflow_cb([[maybe_unused]] const NFSample &)
 {
+    CpuScope scope(_cpu_account);
     if (difftime(time(NULL), _timer) >= MEASURE_INTERVAL) {
         _timer = time(NULL);
-        _metrics->process_resources(_monitor.cpu_percentage(), _monitor.memory_usage());
+        _measure_resources();
     }
 }
 
 void InputResourcesStreamHandler::process_dnstap_cb([[maybe_unused]] const dnstap::Dnstap &, [[maybe_unused]] size_t)
 {
+    CpuScope scope(_cpu_account);
     if (difftime(time(NULL), _timer) >= MEASURE_INTERVAL) {
         _timer = time(NULL);
-        _metrics->process_resources(_monitor.cpu_percentage(), _monitor.memory_usage());
+        _measure_resources();
     }
 }
 
-void InputResourcesStreamHandler::process_packet_cb([[maybe_unused]] pcpp::Packet &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] timespec stamp)
+void InputResourcesStreamHandler::process_packet_cb([[maybe_unused]] pcpp::Packet &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] timespec stamp, [[maybe_unused]] const EnrichmentContext &enrichment)
 {
+    CpuScope scope(_cpu_account);
     if (stamp.tv_sec >= _timestamp.tv_sec + MEASURE_INTERVAL) {
         _timestamp = stamp;
-        _metrics->process_resources(_monitor.cpu_percentage(), _monitor.memory_usage());
+        _measure_resources();
     }
 }
 
+void InputResourcesStreamHandler::_measure_resources()
+{
+    InputResourcesMetricsBucket::HandlerCpuMap handlers;
+    std::unique_lock lock(_policies_mutex);
+    for (const auto policy : _policies) {
+        for (const auto module : policy->modules()) {
+            auto handler = dynamic_cast<const StreamHandler *>(module);
+            if (!handler || handler == this) {
+                continue;
+            }
+            auto usage = handler->cpu_account().usage();
+            auto &last = _last_handler_cpu[handler->name()];
+            handlers[handler->name()] = {policy->name(), usage - last};
+            last = usage;
+        }
+    }
+    auto dispatch = _proxy->cpu_account().usage();
+
+    _metrics->process_resources(_monitor.cpu_percentage(), _monitor.memory_usage());
+    _metrics->process_cpu_accounting(dispatch - _last_dispatch_cpu, handlers);
+    _last_dispatch_cpu = dispatch;
+}
+
 void InputResourcesMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
 {
     // static because caller guarantees only our own bucket type
@@ -139,6 +198,13 @@ void InputResourcesMetricsBucket::specialized_merge(const AbstractMetricsBucket
     _cpu_usage.merge(other._cpu_usage);
     _memory_bytes.merge(other._memory_bytes);
 
+    _dispatch_cpu += other._dispatch_cpu;
+    for (const auto &[module, cpu] : other._handler_cpu) {
+        auto &merged = _handler_cpu[module];
+        merged.policy = cpu.policy;
+        merged.usage += cpu.usage;
+    }
+
     // Merge only the first bucket which is the more recent
     if (!_merged) {
         _policy_count += other._policy_count;
@@ -163,6 +229,31 @@ void InputResourcesMetricsBucket::to_prometheus(std::stringstream &out, Metric::
     _memory_bytes.to_prometheus(out, add_labels);
     _policy_count.to_prometheus(out, add_labels);
     _handler_count.to_prometheus(out, add_labels);
+
+    bool perf = CpuAccount::perf_counters_enabled();
+    for (const auto &field : CPU_FIELDS) {
+        if (field.perf && !perf) {
+            continue;
+        }
+        Counter dispatch("resources", {"dispatch", field.name}, fmt::format("{}, dispatching from the input to its handlers", field.desc));
+        dispatch += _dispatch_cpu.*field.value;
+        dispatch.to_prometheus(out, add_labels);
+
+        if (_handler_cpu.empty()) {
+            continue;
+        }
+        // one series per handler, labeled like the handler's own metrics
+        auto handler_desc = fmt::format("{}, per handler", field.desc);
+        Counter handler("resources", {"handler", field.name}, handler_desc);
+        out << "# HELP " << handler.base_name_snake() << ' ' << handler_desc << std::endl;
+        out << "# TYPE " << handler.base_name_snake() << " gauge" << std::endl;
+        for (const auto &[module, cpu] : _handler_cpu) {
+            Metric::LabelMap labels(add_labels);
+            labels["policy"] = cpu.policy;
+            labels["module"] = module;
+            out << handler.name_snake({}, labels) << ' ' << cpu.usage.*field.value << std::endl;
+        }
+    }
 }
 
 void InputResourcesMetricsBucket::to_json(json &j) const
@@ -183,6 +274,18 @@ void InputResourcesMetricsBucket::to_json(json &j) const
     _memory_bytes.to_json(j);
     _policy_count.to_json(j);
     _handler_count.to_json(j);
+
+    bool perf = CpuAccount::perf_counters_enabled();
+    for (const auto &field : CPU_FIELDS) {
+        if (field.perf && !perf) {
+            continue;
+        }
+        j["dispatch"][field.name] = _dispatch_cpu.*field.value;
+        for (const auto &[module, cpu] : _handler_cpu) {
+            j["handlers"][module]["policy"] = cpu.policy;
+            j["handlers"][module][field.name] = cpu.usage.*field.value;
+        }
+    }
 }
 
 void InputResourcesMetricsBucket::process_resources(double cpu_usage, uint64_t memory_usage)
@@ -201,6 +304,18 @@ void InputResourcesMetricsBucket::process_policies(int16_t policy_count, int16_t
     _handler_count += handler_count;
 }
 
+void InputResourcesMetricsBucket::process_cpu_accounting(const CpuUsage &dispatch, const HandlerCpuMap &handlers)
+{
+    std::unique_lock lock(_mutex);
+
+    _dispatch_cpu += dispatch;
+    for (const auto &[module, cpu] : handlers) {
+        auto &entry = _handler_cpu[module];
+        entry.policy = cpu.policy;
+        entry.usage += cpu.usage;
+    }
+}
+
 void InputResourcesMetricsManager::process_resources(double cpu_usage, uint64_t memory_usage, timespec stamp)
 {
     if (stamp.tv_sec == 0) {
@@ -228,4 +343,10 @@ void InputResourcesMetricsManager::process_policies(int16_t policy_count, int16_
     // process in the "live" bucket. this will parse the resources if we are deep sampling
     live_bucket()->process_policies(policy_count, handler_count);
 }
+
+void InputResourcesMetricsManager::process_cpu_accounting(const CpuUsage &dispatch, const InputResourcesMetricsBucket::HandlerCpuMap &handlers)
+{
+    // no new event: this is measured together with process_resources()
+    live_bucket()->process_cpu_accounting(dispatch, handlers);
+}
 }
\ No newline at end of file
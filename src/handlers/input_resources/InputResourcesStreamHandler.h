@@ -5,6 +5,7 @@
 #pragma once
 
 #include "AbstractMetricsManager.h"
+#include "CpuAccounting.h"
 #include "DnstapInputStream.h"
 #include "FlowInputStream.h"
 #include "MockInputStream.h"
@@ -13,7 +14,10 @@
 #include "ThreadMonitor.h"
 #include <Corrade/Utility/Debug.h>
 #include <limits>
+#include <map>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace visor::handler::resources {
 
@@ -26,6 +30,13 @@ constexpr double MEASURE_INTERVAL = 5; // in seconds
 
 class InputResourcesMetricsBucket final : public visor::AbstractMetricsBucket
 {
+public:
+    struct HandlerCpu {
+        std::string policy;
+        CpuUsage usage;
+    };
+    // keyed by handler module name
+    typedef std::map<std::string, HandlerCpu> HandlerCpuMap;
 
 protected:
     mutable std::shared_mutex _mutex;
@@ -34,6 +45,9 @@ protected:
     Quantile<uint64_t> _memory_bytes;
     Counter _policy_count;
     Counter _handler_count;
+    // cpu accounting for this period: dispatch cost of the input event proxy, and cost of each handler on the input
+    CpuUsage _dispatch_cpu;
+    HandlerCpuMap _handler_cpu;
     bool _merged;
 
 public:
@@ -57,6 +71,7 @@ public:
 
     void process_resources(double cpu_usage, uint64_t memory_usage);
     void process_policies(int16_t policy_count, int16_t handler_count);
+    void process_cpu_accounting(const CpuUsage &dispatch, const HandlerCpuMap &handlers);
 };
 
 class InputResourcesMetricsManager final : public visor::AbstractMetricsManager<InputResourcesMetricsBucket>
@@ -79,6 +94,7 @@ public:
 
     void process_resources(double cpu_usage, uint64_t memory_usage, timespec stamp = timespec());
     void process_policies(int16_t policy_count, int16_t handler_count, bool self = false);
+    void process_cpu_accounting(const CpuUsage &dispatch, const InputResourcesMetricsBucket::HandlerCpuMap &handlers);
 };
 
 class InputResourcesStreamHandler final : public visor::StreamMetricsHandler<InputResourcesMetricsManager>
@@ -87,6 +103,14 @@ class InputResourcesStreamHandler final : public visor::StreamMetricsHandler<Inp
     time_t _timer;
     timespec _timestamp;
 
+    // policies attached to the input, their handlers are accounted for on each measurement.
+    // policies are added and removed from the control thread while the input measures, hence the mutex
+    std::mutex _policies_mutex;
+    std::vector<const Policy *> _policies;
+    InputEventProxy *_proxy{nullptr};
+    CpuUsage _last_dispatch_cpu;
+    std::map<std::string, CpuUsage> _last_handler_cpu;
+
     PcapInputEventProxy *_pcap_proxy{nullptr};
     DnstapInputEventProxy *_dnstap_proxy{nullptr};
     MockInputEventProxy *_mock_proxy{nullptr};
@@ -104,7 +128,9 @@ class InputResourcesStreamHandler final : public visor::StreamMetricsHandler<Inp
     void process_netflow_cb(const NFSample &);
     void process_dnstap_cb(const dnstap::Dnstap &, size_t);
     void process_policies_cb(const Policy *policy, Action action);
-    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp);
+    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp, const EnrichmentContext &enrichment);
+
+    void _measure_resources();
 
 public:
     InputResourcesStreamHandler(const std::string &name, InputEventProxy *proxy, const Configurable *window_config, StreamHandler *handler = nullptr);
@@ -4,8 +4,9 @@
 
 #pragma once
 
+#include <ctime>
 #include <fstream>
-#include <vector>
+#include <limits>
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 #elif __APPLE__
@@ -20,10 +21,15 @@ class ThreadMonitor
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 #elif __APPLE__
 #elif __linux__
-    static constexpr size_t PROC_STAT_POS_UTIME = 13;
-    static constexpr size_t PROC_STAT_POS_STIME = 14;
-    uint64_t _last_system_time = 0;
-    uint64_t _last_thread_time = 0;
+    uint64_t _last_thread_ns = 0;
+    uint64_t _last_wall_ns = 0;
+
+    static uint64_t _clock_ns(clockid_t clock)
+    {
+        timespec ts{};
+        clock_gettime(clock, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+    }
 #endif
 public:
     ThreadMonitor() = default;
@@ -36,42 +42,22 @@ public:
 #elif __APPLE__
         return 0;
 #elif __linux__
-        uint64_t stat;
-
-        std::ifstream system_stat("/proc/stat");
-        std::string line;
-        std::getline(system_stat, line);
-        std::stringstream cpu_times(line.erase(0, 5));
-        uint64_t system_total_time = 0;
-        while (cpu_times >> stat) {
-            system_total_time += stat;
-        }
-        system_total_time = system_total_time / sysconf(_SC_NPROCESSORS_ONLN);
-
-        std::vector<std::string> stats;
-        std::ifstream thread_stat("/proc/thread-self/stat");
-        std::string stat_str;
-        while (thread_stat >> stat_str) {
-            stats.push_back(stat_str);
-            if (stats.size() > PROC_STAT_POS_STIME)
-                break;
-        }
-
-        if (stats.size() <= PROC_STAT_POS_STIME) {
+        // cpu time of this thread against wall time since the last call, so 100 is one core fully busy
+        uint64_t thread_ns = _clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        uint64_t wall_ns = _clock_ns(CLOCK_MONOTONIC);
+        if (!_last_wall_ns || wall_ns <= _last_wall_ns) {
+            _last_thread_ns = thread_ns;
+            _last_wall_ns = wall_ns;
             return 0.0;
         }
 
-        uint64_t thread_total_time = std::stoull(stats[PROC_STAT_POS_UTIME]) + std::stoull(stats[PROC_STAT_POS_STIME]);
-
-        uint64_t current_thread_time = thread_total_time - _last_thread_time;
-        _last_thread_time = thread_total_time;
-        double current_period_time = system_total_time - _last_system_time;
-        _last_system_time = system_total_time;
-
-        double cpu_usage = (current_thread_time / current_period_time) * 100.0;
-        if (cpu_usage < 0.0) {
-            cpu_usage = 0.0;
+        // the calling thread may change between calls, its clock is then unrelated to the last reading
+        double cpu_usage = 0.0;
+        if (thread_ns > _last_thread_ns) {
+            cpu_usage = static_cast<double>(thread_ns - _last_thread_ns) / static_cast<double>(wall_ns - _last_wall_ns) * 100.0;
         }
+        _last_thread_ns = thread_ns;
+        _last_wall_ns = wall_ns;
         return cpu_usage;
 #endif
     }
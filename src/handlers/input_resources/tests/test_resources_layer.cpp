@@ -5,6 +5,16 @@
 #include "InputResourcesStreamHandler.h"
 #include "PcapInputStream.h"
 #include "Policies.h"
+#include <PcapFileDevice.h>
+#include <UdpLayer.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 using namespace visor::handler::resources;
 
@@ -107,4 +117,163 @@ TEST_CASE("Check resources for sflow input", "[sflow][resources]")
     CHECK(j["memory_bytes"]["p50"] != nullptr);
     CHECK(j["policy_count"] == 0);
     CHECK(j["handler_count"] == 0);
-}
\ No newline at end of file
+}
+
+#ifdef __linux__
+TEST_CASE("Check resources for sflow input with several workers", "[sflow][resources]")
+{
+    std::vector<std::vector<uint8_t>> datagrams;
+    auto reader = pcpp::IFileReaderDevice::getReader("tests/fixtures/ecmp.pcap");
+    REQUIRE(reader->open());
+    pcpp::RawPacket raw_packet;
+    while (reader->getNextPacket(raw_packet)) {
+        pcpp::Packet packet(&raw_packet);
+        if (auto udp = packet.getLayerOfType<pcpp::UdpLayer>(); udp) {
+            datagrams.emplace_back(udp->getLayerPayload(), udp->getLayerPayload() + udp->getLayerPayloadSize());
+        }
+    }
+    reader->close();
+    delete reader;
+    REQUIRE(!datagrams.empty());
+
+    uint16_t port = 6347;
+    FlowInputStream stream{"sflow-test"};
+    stream.config_set("flow_type", "sflow");
+    stream.config_set("bind", "127.0.0.1");
+    stream.config_set<uint64_t>("port", port);
+    stream.config_set<uint64_t>("workers", 4);
+
+    visor::Config c;
+    auto stream_proxy = static_cast<FlowInputEventProxy *>(stream.add_event_proxy(c));
+    c.config_set<uint64_t>("num_periods", 1);
+    InputResourcesStreamHandler resources_handler{"resource-test", stream_proxy, &c};
+
+    // stands in for another handler of the policy: the workers must never run it, or the resources handler, at once
+    std::atomic<int> inside{0};
+    std::atomic<int> overlaps{0};
+    std::atomic<uint64_t> dispatched{0};
+    auto connection = stream_proxy->sflow_signal.connect([&](const SFSample &) {
+        if (inside.fetch_add(1) != 0) {
+            ++overlaps;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+        inside.fetch_sub(1);
+        ++dispatched;
+    });
+
+    resources_handler.start();
+    stream.start();
+
+    // each client gets its own source port, so the kernel spreads them over the workers
+    sockaddr_in dst{};
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &dst.sin_addr);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < 8; ++i) {
+        clients.emplace_back([&datagrams, &dst] {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            for (const auto &datagram : datagrams) {
+                sendto(fd, datagram.data(), datagram.size(), 0, reinterpret_cast<const sockaddr *>(&dst), sizeof(dst));
+                // stay well below the socket buffers, a dropped datagram is not what this test is about
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            close(fd);
+        });
+    }
+    // policies come and go on the control thread while the workers measure
+    auto policy = std::make_unique<visor::Policy>("policy-test", nullptr, false);
+    for (int i = 0; i < 20; ++i) {
+        stream.add_policy(policy.get());
+        stream.remove_policy(policy.get());
+    }
+    for (auto &client : clients) {
+        client.join();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    stream.stop();
+    resources_handler.stop();
+    connection.disconnect();
+
+    nlohmann::json info;
+    stream.info_json(info);
+    uint64_t received{0};
+    for (const auto &packets : info["flow"]["worker_packets"]) {
+        received += packets.get<uint64_t>();
+    }
+    CHECK(received > 0);
+    CHECK(info["flow"]["packet_errors"] == 0);
+    CHECK(dispatched == received);
+    CHECK(overlaps == 0);
+
+    auto event_data = resources_handler.metrics()->bucket(0)->event_data_locked();
+    CHECK(event_data.num_events->value() >= 1);
+
+    nlohmann::json j;
+    resources_handler.metrics()->bucket(0)->to_json(j);
+    CHECK(j["policy_count"] == 0);
+    CHECK(j["handler_count"] == 0);
+}
+#endif
+
+TEST_CASE("CPU accounting", "[resources]")
+{
+    visor::CpuAccount account;
+    uint64_t sink{0};
+    for (uint64_t i = 0; i < 1000; ++i) {
+        visor::CpuScope scope(account);
+        for (uint64_t k = 0; k < 1000; ++k) {
+            sink += k ^ i;
+        }
+    }
+    CHECK(sink != 0);
+
+    auto usage = account.usage();
+    CHECK(usage.calls == 1000);
+    CHECK(usage.cpu_ns > 0);
+    CHECK(usage.task_clock_ns == 0);
+
+    auto delta = account.usage() - usage;
+    CHECK(delta.calls == 0);
+    CHECK((usage - account.usage()).cpu_ns == 0);
+}
+
+TEST_CASE("Check handler cpu accounting for pcap input", "[pcap][resources]")
+{
+    PcapInputStream stream{"pcap-test"};
+    stream.config_set("pcap_file", "tests/fixtures/dns_ipv4_udp.pcap");
+    stream.config_set("bpf", std::string());
+
+    visor::Config c;
+    auto stream_proxy = stream.add_event_proxy(c);
+    c.config_set<uint64_t>("num_periods", 1);
+    InputResourcesStreamHandler resources_handler{"resource-test", stream_proxy, &c};
+    // any handler on the input is accounted for, use a second resources handler as the policy's handler
+    InputResourcesStreamHandler policy_handler{"policy-test-handler", stream_proxy, &c};
+
+    auto policy = std::make_unique<visor::Policy>("policy-test", nullptr, false);
+    policy->add_module(&policy_handler);
+
+    resources_handler.start();
+    policy_handler.start();
+    stream.add_policy(policy.get());
+    stream.start();
+    stream.stop();
+    stream.remove_policy(policy.get());
+    policy_handler.stop();
+    resources_handler.stop();
+
+    nlohmann::json j;
+    resources_handler.metrics()->bucket(0)->to_json(j);
+
+    CHECK(j["dispatch"]["calls"] >= 1);
+    CHECK(j["dispatch"]["cpu_ns"] != nullptr);
+    CHECK(j["handlers"]["policy-test-handler"]["policy"] == "policy-test");
+    CHECK(j["handlers"]["policy-test-handler"]["cpu_ns"] != nullptr);
+    CHECK(j["handlers"]["resource-test"] == nullptr);
+
+    std::stringstream output;
+    resources_handler.metrics()->bucket(0)->to_prometheus(output, {{"policy", "default"}});
+    CHECK(output.str().find("resources_handler_cpu_ns{module=\"policy-test-handler\",policy=\"policy-test\"}") != std::string::npos);
+}
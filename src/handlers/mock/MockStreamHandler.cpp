@@ -36,6 +36,7 @@ MockStreamHandler::~MockStreamHandler()
 
 void MockStreamHandler::process_random_int(uint64_t i)
 {
+    CpuScope scope(_cpu_account);
     _logger->info("mock handler received random int signal: {}", i);
     _metrics->process_random_int(i);
 }
@@ -70,6 +70,8 @@ void NetStreamHandler::start()
     }
 
     if (_pcap_proxy) {
+        // every packet
+        _pcap_proxy->want_packets(std::string());
         _pkt_connection = _pcap_proxy->packet_signal.connect(&NetStreamHandler::process_packet_cb, this);
         _start_tstamp_connection = _pcap_proxy->start_tstamp_signal.connect(&NetStreamHandler::set_start_tstamp, this);
         _end_tstamp_connection = _pcap_proxy->end_tstamp_signal.connect(&NetStreamHandler::set_end_tstamp, this);
@@ -94,6 +96,7 @@ void NetStreamHandler::stop()
         _pkt_connection.disconnect();
         _start_tstamp_connection.disconnect();
         _end_tstamp_connection.disconnect();
+        _pcap_proxy->release_packets(std::string());
     } else if (_dnstap_proxy) {
         _dnstap_connection.disconnect();
     } else if (_dns_handler) {
@@ -109,10 +112,11 @@ NetStreamHandler::~NetStreamHandler()
 }
 
 // callback from input module
-void NetStreamHandler::process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp)
+void NetStreamHandler::process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp, const EnrichmentContext &enrichment)
 {
-    if (!_filtering(payload, dir, stamp)) {
-        _metrics->process_packet(payload, dir, l3, l4, stamp);
+    CpuScope scope(_cpu_account);
+    if (!_filtering(dir, stamp, enrichment)) {
+        _metrics->process_packet(payload, dir, l3, l4, stamp, enrichment);
     }
 }
 
@@ -128,56 +132,36 @@ void NetStreamHandler::set_end_tstamp(timespec stamp)
 
 void NetStreamHandler::process_dnstap_cb(const dnstap::Dnstap &payload, size_t size)
 {
+    CpuScope scope(_cpu_account);
     _metrics->process_dnstap(payload, size);
 }
 
-void NetStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, [[maybe_unused]] uint32_t flowkey, timespec stamp)
+void NetStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, [[maybe_unused]] uint32_t flowkey, timespec stamp, const EnrichmentContext &enrichment)
 {
-    if (!_filtering(payload, dir, stamp)) {
-        _metrics->process_packet(payload, dir, l3, pcpp::UDP, stamp);
+    CpuScope scope(_cpu_account);
+    if (!_filtering(dir, stamp, enrichment)) {
+        _metrics->process_packet(payload, dir, l3, pcpp::UDP, stamp, enrichment);
     }
 }
 
-bool NetStreamHandler::_filtering(pcpp::Packet &payload, PacketDirection dir, timespec stamp)
+bool NetStreamHandler::_filtering(PacketDirection dir, timespec stamp, const EnrichmentContext &enrichment)
 {
-    if (_f_enabled[Filters::GeoLocNotFound] && geo::GeoIP().enabled() && dir != PacketDirection::unknown) {
-        if (auto IPv4Layer = payload.getLayerOfType<pcpp::IPv4Layer>(); IPv4Layer) {
-            struct sockaddr_in sa4;
-            if (dir == PacketDirection::toHost && IPv4tosockaddr(IPv4Layer->getSrcIPv4Address(), &sa4) && geo::GeoIP().getGeoLocString(&sa4) != "Unknown") {
-                goto will_filter;
-            } else if (dir == PacketDirection::fromHost && IPv4tosockaddr(IPv4Layer->getDstIPv4Address(), &sa4) && geo::GeoIP().getGeoLocString(&sa4) != "Unknown") {
-                goto will_filter;
-            }
-        } else if (auto IPv6layer = payload.getLayerOfType<pcpp::IPv6Layer>(); IPv6layer) {
-            struct sockaddr_in6 sa6;
-            if (dir == PacketDirection::toHost && IPv6tosockaddr(IPv6layer->getSrcIPv6Address(), &sa6) && geo::GeoIP().getGeoLocString(&sa6) != "Unknown") {
-                goto will_filter;
-            } else if (dir == PacketDirection::fromHost && IPv6tosockaddr(IPv6layer->getDstIPv6Address(), &sa6) && geo::GeoIP().getGeoLocString(&sa6) != "Unknown") {
-                goto will_filter;
-            }
-        }
+    bool geo_filter = _f_enabled[Filters::GeoLocNotFound] && geo::GeoIP().enabled();
+    bool asn_filter = _f_enabled[Filters::AsnNotFound] && geo::GeoASN().enabled();
+    if ((!geo_filter && !asn_filter) || dir == PacketDirection::unknown) {
+        return false;
     }
-    if (_f_enabled[Filters::AsnNotFound] && geo::GeoASN().enabled() && dir != PacketDirection::unknown) {
-        if (auto IPv4Layer = payload.getLayerOfType<pcpp::IPv4Layer>(); IPv4Layer) {
-            struct sockaddr_in sa4;
-            if (dir == PacketDirection::toHost && IPv4tosockaddr(IPv4Layer->getSrcIPv4Address(), &sa4) && geo::GeoASN().getASNString(&sa4) != "Unknown") {
-                goto will_filter;
-            } else if (dir == PacketDirection::fromHost && IPv4tosockaddr(IPv4Layer->getDstIPv4Address(), &sa4) && geo::GeoASN().getASNString(&sa4) != "Unknown") {
-                goto will_filter;
-            }
-        } else if (auto IPv6layer = payload.getLayerOfType<pcpp::IPv6Layer>(); IPv6layer) {
-            struct sockaddr_in6 sa6;
-            if (dir == PacketDirection::toHost && IPv6tosockaddr(IPv6layer->getSrcIPv6Address(), &sa6) && geo::GeoASN().getASNString(&sa6) != "Unknown") {
-                goto will_filter;
-            } else if (dir == PacketDirection::fromHost && IPv6tosockaddr(IPv6layer->getDstIPv6Address(), &sa6) && geo::GeoASN().getASNString(&sa6) != "Unknown") {
-                goto will_filter;
-            }
-        }
+    // the remote endpoint
+    auto endpoint = (dir == PacketDirection::toHost) ? EnrichmentContext::Src : EnrichmentContext::Dst;
+    if (!enrichment.has_ip(endpoint)) {
+        return false;
+    }
+    if ((geo_filter && enrichment.geo_loc(endpoint) != geo::MaxmindDB::UNKNOWN_ID)
+        || (asn_filter && enrichment.asn(endpoint) != geo::MaxmindDB::UNKNOWN_ID)) {
+        _metrics->process_filtered(stamp);
+        return true;
     }
     return false;
-will_filter:
-    _metrics->process_filtered(stamp);
-    return true;
 }
 
 void NetworkMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
@@ -260,12 +244,12 @@ void NetworkMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMa
 
     if (group_enabled(group::NetMetrics::TopIps)) {
         _topIPv4.to_prometheus(out, add_labels, [](const uint32_t &val) { return pcpp::IPv4Address(val).toString(); });
-        _topIPv6.to_prometheus(out, add_labels);
+        _topIPv6.to_prometheus(out, add_labels, [](const IpKey &val) { return val.to_string(); });
     }
 
     if (group_enabled(group::NetMetrics::TopGeo)) {
-        _topGeoLoc.to_prometheus(out, add_labels);
-        _topASN.to_prometheus(out, add_labels);
+        _topGeoLoc.to_prometheus(out, add_labels, [](const geo::MaxmindDB::Id &val) { return geo::GeoIP().name(val); });
+        _topASN.to_prometheus(out, add_labels, [](const geo::MaxmindDB::Id &val) { return geo::GeoASN().name(val); });
     }
 
     _payload_size.to_prometheus(out, add_labels);
@@ -310,12 +294,12 @@ void NetworkMetricsBucket::to_json(json &j) const
 
     if (group_enabled(group::NetMetrics::TopIps)) {
         _topIPv4.to_json(j, [](const uint32_t &val) { return pcpp::IPv4Address(val).toString(); });
-        _topIPv6.to_json(j);
+        _topIPv6.to_json(j, [](const IpKey &val) { return val.to_string(); });
     }
 
     if (group_enabled(group::NetMetrics::TopGeo)) {
-        _topGeoLoc.to_json(j);
-        _topASN.to_json(j);
+        _topGeoLoc.to_json(j, [](const geo::MaxmindDB::Id &val) { return geo::GeoIP().name(val); });
+        _topASN.to_json(j, [](const geo::MaxmindDB::Id &val) { return geo::GeoASN().name(val); });
     }
 
     _payload_size.to_json(j);
@@ -328,7 +312,7 @@ void NetworkMetricsBucket::process_filtered()
     ++_counters.filtered;
 }
 
-void NetworkMetricsBucket::process_packet(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4)
+void NetworkMetricsBucket::process_packet(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, const EnrichmentContext &enrichment)
 {
     if (!deep) {
         process_net_layer(dir, l3, l4, payload.getRawPacket()->getRawDataLen());
@@ -343,7 +327,7 @@ void NetworkMetricsBucket::process_packet(bool deep, pcpp::Packet &payload, Pack
         }
     }
 
-    NetworkPacket packet(dir, l3, l4, payload.getRawPacket()->getRawDataLen(), syn_flag, false);
+    NetworkPacket packet(dir, l3, l4, payload.getRawPacket()->getRawDataLen(), syn_flag, false, enrichment);
 
     if (auto IP4layer = payload.getLayerOfType<pcpp::IPv4Layer>(); IP4layer) {
         packet.is_ipv6 = false;
@@ -414,18 +398,23 @@ void NetworkMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &paylo
         process_net_layer(dir, l3, l4, size);
         return;
     }
-    NetworkPacket packet(dir, l3, l4, size, false, is_ipv6);
+    EnrichmentContext enrichment;
+    NetworkPacket packet(dir, l3, l4, size, false, is_ipv6, enrichment);
 
     if (!is_ipv6 && payload.message().has_query_address() && payload.message().query_address().size() == 4) {
         packet.ipv4_in = pcpp::IPv4Address(reinterpret_cast<const uint8_t *>(payload.message().query_address().data()));
+        enrichment.set_ip(EnrichmentContext::Src, IpKey::from_ipv4(packet.ipv4_in.toInt()));
     } else if (is_ipv6 && payload.message().has_query_address() && payload.message().query_address().size() == 16) {
         packet.ipv6_in = pcpp::IPv6Address(reinterpret_cast<const uint8_t *>(payload.message().query_address().data()));
+        enrichment.set_ip(EnrichmentContext::Src, IpKey::from_ipv6(packet.ipv6_in.toBytes()));
     }
 
     if (!is_ipv6 && payload.message().has_response_address() && payload.message().response_address().size() == 4) {
         packet.ipv4_out = pcpp::IPv4Address(reinterpret_cast<const uint8_t *>(payload.message().response_address().data()));
+        enrichment.set_ip(EnrichmentContext::Dst, IpKey::from_ipv4(packet.ipv4_out.toInt()));
     } else if (is_ipv6 && payload.message().has_response_address() && payload.message().response_address().size() == 16) {
         packet.ipv6_out = pcpp::IPv6Address(reinterpret_cast<const uint8_t *>(payload.message().response_address().data()));
+        enrichment.set_ip(EnrichmentContext::Dst, IpKey::from_ipv6(packet.ipv6_out.toBytes()));
     }
 
     process_net_layer(packet);
@@ -548,50 +537,32 @@ void NetworkMetricsBucket::process_net_layer(NetworkPacket &packet)
     if (!packet.is_ipv6 && packet.ipv4_in.isValid()) {
         group_enabled(group::NetMetrics::Cardinality) ? _srcIPCard.update(packet.ipv4_in.toInt()) : void();
         group_enabled(group::NetMetrics::TopIps) ? _topIPv4.update(packet.ipv4_in.toInt()) : void();
-        _process_geo_metrics(packet.ipv4_in);
+        _process_geo_metrics(packet.enrichment, EnrichmentContext::Src);
     } else if (packet.is_ipv6 && packet.ipv6_in.isValid()) {
         group_enabled(group::NetMetrics::Cardinality) ? _srcIPCard.update(reinterpret_cast<const void *>(packet.ipv6_in.toBytes()), 16) : void();
-        group_enabled(group::NetMetrics::TopIps) ? _topIPv6.update(packet.ipv6_in.toString()) : void();
-        _process_geo_metrics(packet.ipv6_in);
+        group_enabled(group::NetMetrics::TopIps) ? _topIPv6.update(IpKey::from_ipv6(packet.ipv6_in.toBytes())) : void();
+        _process_geo_metrics(packet.enrichment, EnrichmentContext::Src);
     }
 
     if (!packet.is_ipv6 && packet.ipv4_out.isValid()) {
         group_enabled(group::NetMetrics::Cardinality) ? _dstIPCard.update(packet.ipv4_out.toInt()) : void();
         group_enabled(group::NetMetrics::TopIps) ? _topIPv4.update(packet.ipv4_out.toInt()) : void();
-        _process_geo_metrics(packet.ipv4_out);
+        _process_geo_metrics(packet.enrichment, EnrichmentContext::Dst);
     } else if (packet.is_ipv6 && packet.ipv6_out.isValid()) {
         group_enabled(group::NetMetrics::Cardinality) ? _dstIPCard.update(reinterpret_cast<const void *>(packet.ipv6_out.toBytes()), 16) : void();
-        group_enabled(group::NetMetrics::TopIps) ? _topIPv6.update(packet.ipv6_out.toString()) : void();
-        _process_geo_metrics(packet.ipv6_out);
+        group_enabled(group::NetMetrics::TopIps) ? _topIPv6.update(IpKey::from_ipv6(packet.ipv6_out.toBytes())) : void();
+        _process_geo_metrics(packet.enrichment, EnrichmentContext::Dst);
     }
 }
 
-inline void NetworkMetricsBucket::_process_geo_metrics(const pcpp::IPv4Address &ipv4)
+inline void NetworkMetricsBucket::_process_geo_metrics(const EnrichmentContext &enrichment, EnrichmentContext::Endpoint endpoint)
 {
     if (geo::enabled() && group_enabled(group::NetMetrics::TopGeo)) {
-        struct sockaddr_in sa4;
-        if (IPv4tosockaddr(ipv4, &sa4)) {
-            if (geo::GeoIP().enabled()) {
-                _topGeoLoc.update(geo::GeoIP().getGeoLocString(&sa4));
-            }
-            if (geo::GeoASN().enabled()) {
-                _topASN.update(geo::GeoASN().getASNString(&sa4));
-            }
+        if (geo::GeoIP().enabled()) {
+            _topGeoLoc.update(enrichment.geo_loc(endpoint));
         }
-    }
-}
-
-inline void NetworkMetricsBucket::_process_geo_metrics(const pcpp::IPv6Address &ipv6)
-{
-    if (geo::enabled() && group_enabled(group::NetMetrics::TopGeo)) {
-        struct sockaddr_in6 sa6;
-        if (IPv6tosockaddr(ipv6, &sa6)) {
-            if (geo::GeoIP().enabled()) {
-                _topGeoLoc.update(geo::GeoIP().getGeoLocString(&sa6));
-            }
-            if (geo::GeoASN().enabled()) {
-                _topASN.update(geo::GeoASN().getASNString(&sa6));
-            }
+        if (geo::GeoASN().enabled()) {
+            _topASN.update(enrichment.asn(endpoint));
         }
     }
 }
@@ -604,12 +575,12 @@ void NetworkMetricsManager::process_filtered(timespec stamp)
 }
 
 // the general metrics manager entry point
-void NetworkMetricsManager::process_packet(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp)
+void NetworkMetricsManager::process_packet(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp, const EnrichmentContext &enrichment)
 {
     // base event
     new_event(stamp);
     // process in the "live" bucket
-    live_bucket()->process_packet(_deep_sampling_now, payload, dir, l3, l4);
+    live_bucket()->process_packet(_deep_sampling_now, payload, dir, l3, l4, enrichment);
 }
 
 void NetworkMetricsManager::process_dnstap(const dnstap::Dnstap &payload, size_t size)
@@ -7,6 +7,9 @@
 #include "AbstractMetricsManager.h"
 #include "DnsStreamHandler.h"
 #include "DnstapInputStream.h"
+#include "EnrichmentContext.h"
+#include "GeoDB.h"
+#include "IpKey.h"
 #include "MockInputStream.h"
 #include "PcapInputStream.h"
 #include "StreamHandler.h"
@@ -40,14 +43,17 @@ struct NetworkPacket {
     pcpp::IPv4Address ipv4_out;
     pcpp::IPv6Address ipv6_in;
     pcpp::IPv6Address ipv6_out;
+    // geo lookups of the in (Src) and out (Dst) addresses
+    const EnrichmentContext &enrichment;
 
-    NetworkPacket(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size, bool syn_flag, bool is_ipv6)
+    NetworkPacket(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size, bool syn_flag, bool is_ipv6, const EnrichmentContext &enrichment)
         : dir(dir)
         , l3(l3)
         , l4(l4)
         , payload_size(payload_size)
         , syn_flag(syn_flag)
         , is_ipv6(is_ipv6)
+        , enrichment(enrichment)
     {
     }
 };
@@ -61,10 +67,10 @@ protected:
     Cardinality _srcIPCard;
     Cardinality _dstIPCard;
 
-    TopN<std::string> _topGeoLoc;
-    TopN<std::string> _topASN;
+    TopN<geo::MaxmindDB::Id> _topGeoLoc;
+    TopN<geo::MaxmindDB::Id> _topASN;
     TopN<uint32_t> _topIPv4;
-    TopN<std::string> _topIPv6;
+    TopN<IpKey> _topIPv6;
 
     // total numPackets is tracked in base class num_events
     struct counters {
@@ -99,8 +105,7 @@ protected:
     Rate _throughput_in;
     Rate _throughput_out;
 
-    void _process_geo_metrics(const pcpp::IPv4Address &ipv4);
-    void _process_geo_metrics(const pcpp::IPv6Address &ipv6);
+    void _process_geo_metrics(const EnrichmentContext &enrichment, EnrichmentContext::Endpoint endpoint);
 
 public:
     NetworkMetricsBucket()
@@ -151,7 +156,7 @@ public:
     }
 
     void process_filtered();
-    void process_packet(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4);
+    void process_packet(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, const EnrichmentContext &enrichment);
     void process_dnstap(bool deep, const dnstap::Dnstap &payload, size_t size);
     void process_net_layer(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size);
     void process_net_layer(NetworkPacket &packet);
@@ -166,7 +171,7 @@ public:
     }
 
     void process_filtered(timespec stamp);
-    void process_packet(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp);
+    void process_packet(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp, const EnrichmentContext &enrichment);
     void process_dnstap(const dnstap::Dnstap &payload, size_t size);
 };
 
@@ -198,8 +203,8 @@ class NetStreamHandler final : public visor::StreamMetricsHandler<NetworkMetrics
         {"top_ips", group::NetMetrics::TopIps}};
 
     void process_dnstap_cb(const dnstap::Dnstap &, size_t);
-    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp);
-    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp);
+    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp, const EnrichmentContext &enrichment);
+    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp, const EnrichmentContext &enrichment);
     void set_start_tstamp(timespec stamp);
     void set_end_tstamp(timespec stamp);
 
@@ -212,7 +217,7 @@ class NetStreamHandler final : public visor::StreamMetricsHandler<NetworkMetrics
 
     std::bitset<Filters::FiltersMAX> _f_enabled;
 
-    bool _filtering(pcpp::Packet &payload, PacketDirection dir, timespec stamp);
+    bool _filtering(PacketDirection dir, timespec stamp, const EnrichmentContext &enrichment);
 
 public:
     NetStreamHandler(const std::string &name, InputEventProxy *proxy, const Configurable *window_config, StreamHandler *handler = nullptr);
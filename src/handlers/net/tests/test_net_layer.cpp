@@ -96,6 +96,11 @@ TEST_CASE("Parse net (dns) UDP IPv6 tests", "[pcap][ipv6][udp][net]")
     CHECK(counters.UDP.value() == 140);
     CHECK(counters.IPv4.value() == 0);
     CHECK(counters.IPv6.value() == 140);
+
+    nlohmann::json j;
+    net_handler.metrics()->bucket(0)->to_json(j);
+    CHECK(j["top_ipv6"][0]["estimate"] == 280);
+    CHECK(j["top_ipv6"][0]["name"] == "::1");
 }
 
 TEST_CASE("Parse net (dns) TCP IPv6 tests", "[pcap][ipv6][tcp][net]")
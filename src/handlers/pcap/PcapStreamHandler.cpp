@@ -37,6 +37,7 @@ void PcapStreamHandler::start()
 
         _pcap_tcp_reassembly_errors_connection = _pcap_proxy->tcp_reassembly_error_signal.connect(&PcapStreamHandler::process_pcap_tcp_reassembly_error, this);
         _pcap_stats_connection = _pcap_proxy->pcap_stats_signal.connect(&PcapStreamHandler::process_pcap_stats, this);
+        _ring_stats_connection = _pcap_proxy->ring_stats_signal.connect(&PcapStreamHandler::process_ring_stats, this);
         _heartbeat_connection = _pcap_proxy->heartbeat_signal.connect(&PcapStreamHandler::check_period_shift, this);
     }
 
@@ -54,6 +55,7 @@ void PcapStreamHandler::stop()
         _end_tstamp_connection.disconnect();
         _pcap_tcp_reassembly_errors_connection.disconnect();
         _pcap_stats_connection.disconnect();
+        _ring_stats_connection.disconnect();
     }
     _heartbeat_connection.disconnect();
 
@@ -63,12 +65,19 @@ void PcapStreamHandler::stop()
 // callback from input module
 void PcapStreamHandler::process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp)
 {
+    CpuScope scope(_cpu_account);
     _metrics->process_pcap_tcp_reassembly_error(payload, dir, l3, stamp);
 }
 void PcapStreamHandler::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats)
 {
+    CpuScope scope(_cpu_account);
     _metrics->process_pcap_stats(stats);
 }
+void PcapStreamHandler::process_ring_stats(const PacketRingStats &stats)
+{
+    CpuScope scope(_cpu_account);
+    _metrics->process_ring_stats(stats);
+}
 void PcapStreamHandler::set_start_tstamp(timespec stamp)
 {
     _metrics->set_start_tstamp(stamp);
@@ -89,6 +98,7 @@ void PcapMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
     _counters.pcap_TCP_reassembly_errors += other._counters.pcap_TCP_reassembly_errors;
     _counters.pcap_os_drop += other._counters.pcap_os_drop;
     _counters.pcap_if_drop += other._counters.pcap_if_drop;
+    _counters.pcap_ring_freeze += other._counters.pcap_ring_freeze;
 }
 
 void PcapMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
@@ -98,6 +108,7 @@ void PcapMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap a
     _counters.pcap_TCP_reassembly_errors.to_prometheus(out, add_labels);
     _counters.pcap_os_drop.to_prometheus(out, add_labels);
     _counters.pcap_if_drop.to_prometheus(out, add_labels);
+    _counters.pcap_ring_freeze.to_prometheus(out, add_labels);
 }
 
 void PcapMetricsBucket::to_json(json &j) const
@@ -107,6 +118,7 @@ void PcapMetricsBucket::to_json(json &j) const
     _counters.pcap_TCP_reassembly_errors.to_json(j);
     _counters.pcap_os_drop.to_json(j);
     _counters.pcap_if_drop.to_json(j);
+    _counters.pcap_ring_freeze.to_json(j);
 }
 
 void PcapMetricsBucket::process_pcap_tcp_reassembly_error([[maybe_unused]] bool deep, [[maybe_unused]] pcpp::Packet &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3)
@@ -135,6 +147,26 @@ void PcapMetricsBucket::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &s
     }
 }
 
+void PcapMetricsBucket::process_ring_stats(const PacketRingStats &stats)
+{
+    std::unique_lock lock(_mutex);
+
+    // same as the pcap counters, the input reports totals since the capture started
+    if (_counters.pcap_last_os_drop == std::numeric_limits<uint64_t>::max() || _counters.pcap_last_ring_freeze == std::numeric_limits<uint64_t>::max()) {
+        _counters.pcap_last_os_drop = stats.drops;
+        _counters.pcap_last_ring_freeze = stats.freezes;
+        return;
+    }
+    if (stats.drops > _counters.pcap_last_os_drop) {
+        _counters.pcap_os_drop += stats.drops - _counters.pcap_last_os_drop;
+        _counters.pcap_last_os_drop = stats.drops;
+    }
+    if (stats.freezes > _counters.pcap_last_ring_freeze) {
+        _counters.pcap_ring_freeze += stats.freezes - _counters.pcap_last_ring_freeze;
+        _counters.pcap_last_ring_freeze = stats.freezes;
+    }
+}
+
 // the general metrics manager entry point
 void PcapMetricsManager::process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp)
 {
@@ -152,5 +184,15 @@ void PcapMetricsManager::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &
     // process in the "live" bucket
     live_bucket()->process_pcap_stats(stats);
 }
+void PcapMetricsManager::process_ring_stats(const PacketRingStats &stats)
+{
+    timespec stamp;
+    // use now()
+    std::timespec_get(&stamp, TIME_UTC);
+    // base event
+    new_event(stamp);
+    // process in the "live" bucket
+    live_bucket()->process_ring_stats(stats);
+}
 
 }
\ No newline at end of file
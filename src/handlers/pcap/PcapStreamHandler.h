@@ -32,10 +32,14 @@ protected:
         Counter pcap_if_drop;
         uint64_t pcap_last_if_drop{std::numeric_limits<uint64_t>::max()};
 
+        Counter pcap_ring_freeze;
+        uint64_t pcap_last_ring_freeze{std::numeric_limits<uint64_t>::max()};
+
         counters()
-            : pcap_TCP_reassembly_errors("pcap", {"tcp_reassembly_errors"}, "Count of TCP reassembly errors")
+            : pcap_TCP_reassembly_errors("pcap", {"tcp_reassembly_errors"}, "Count of TCP reassembly errors, on the connections a handler wants reassembled")
             , pcap_os_drop("pcap", {"os_drops"}, "Count of packets dropped by the operating system (if supported)")
             , pcap_if_drop("pcap", {"if_drops"}, "Count of packets dropped by the interface (if supported)")
+            , pcap_ring_freeze("pcap", {"ring_freezes"}, "Count of times the af_packet ring was full and the kernel froze its queue (af_packet only)")
         {
         }
     };
@@ -63,6 +67,7 @@ public:
 
     void process_pcap_tcp_reassembly_error(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3);
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_ring_stats(const PacketRingStats &stats);
 };
 
 class PcapMetricsManager final : public visor::AbstractMetricsManager<PcapMetricsBucket>
@@ -75,6 +80,7 @@ public:
 
     void process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp);
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_ring_stats(const PacketRingStats &stats);
 };
 
 class PcapStreamHandler final : public visor::StreamMetricsHandler<PcapMetricsManager>
@@ -87,11 +93,13 @@ class PcapStreamHandler final : public visor::StreamMetricsHandler<PcapMetricsMa
 
     sigslot::connection _pcap_tcp_reassembly_errors_connection;
     sigslot::connection _pcap_stats_connection;
+    sigslot::connection _ring_stats_connection;
 
     sigslot::connection _heartbeat_connection;
 
     void process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp);
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_ring_stats(const PacketRingStats &stats);
 
     void set_start_tstamp(timespec stamp);
     void set_end_tstamp(timespec stamp);
@@ -36,3 +36,24 @@ TEST_CASE("Parse net (dns) random UDP/TCP tests", "[pcap][net]")
     CHECK(counters.pcap_os_drop.value() == 0);
     CHECK(counters.pcap_if_drop.value() == 0);
 }
+
+TEST_CASE("af_packet ring statistics", "[pcap][af_packet]")
+{
+
+    PcapMetricsBucket bucket;
+
+    // the first totals only set the baseline
+    bucket.process_ring_stats(PacketRingStats{1000, 10, 2});
+    bucket.process_ring_stats(PacketRingStats{2000, 25, 3});
+    bucket.process_ring_stats(PacketRingStats{3000, 25, 3});
+
+    auto counters = bucket.counters();
+    CHECK(counters.pcap_os_drop.value() == 15);
+    CHECK(counters.pcap_ring_freeze.value() == 1);
+    CHECK(counters.pcap_if_drop.value() == 0);
+
+    nlohmann::json j;
+    bucket.to_json(j);
+    CHECK(j["os_drops"] == 15);
+    CHECK(j["ring_freezes"] == 1);
+}
@@ -5,7 +5,11 @@
 #include "DnstapInputStream.h"
 #include "DnstapException.h"
 #include "FrameSession.h"
+#include <cstring>
+#include <arpa/inet.h>
 #include <filesystem>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <uvw/async.h>
 #include <uvw/loop.h>
 #include <uvw/pipe.h>
@@ -51,24 +55,8 @@ void DnstapInputStream::_read_frame_stream_file()
 
         result = fstrm_reader_read(reader, &data, &len_data);
         if (result == fstrm_res_success) {
-            // Data frame ready, parse protobuf
-            ::dnstap::Dnstap d;
-            if (!d.ParseFromArray(data, len_data)) {
-                _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
-                continue;
-            }
-            if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
-                _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
-                continue;
-            }
-
-            // Emit signal to handlers
-            if (!_filtering(d)) {
-                std::shared_lock lock(_input_mutex);
-                for (auto &proxy : _event_proxies) {
-                    static_cast<DnstapInputEventProxy *>(proxy.get())->dnstap_cb(d, len_data);
-                }
-            }
+            // Data frame ready
+            _process_frame(data, len_data);
         } else if (result == fstrm_res_stop) {
             // Normal end of data stream
             break;
@@ -82,6 +70,29 @@ void DnstapInputStream::_read_frame_stream_file()
     fstrm_reader_destroy(&reader);
 }
 
+void DnstapInputStream::_process_frame(const void *data, std::size_t len_data)
+{
+    // Data frame ready, parse protobuf. the message is reused for every frame handled by this thread: ParseFromArray
+    // clears it first but keeps the sub messages and string buffers allocated, so steady state parsing does not allocate
+    thread_local ::dnstap::Dnstap d;
+    if (!d.ParseFromArray(data, len_data)) {
+        _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
+        return;
+    }
+    if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
+        _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
+        return;
+    }
+
+    // Emit signal to handlers. they get a reference which is only valid during the call
+    if (!_filtering(d)) {
+        std::shared_lock lock(_input_mutex);
+        for (auto &proxy : _event_proxies) {
+            static_cast<DnstapInputEventProxy *>(proxy.get())->dnstap_cb(d, len_data);
+        }
+    }
+}
+
 void DnstapInputStream::start()
 {
 
@@ -94,61 +105,111 @@ void DnstapInputStream::start()
         _running = true;
         _read_frame_stream_file();
         return;
-    } else if (config_exists("socket")) {
+    }
+
+    uint64_t io_loops{1};
+    if (config_exists("io_loops")) {
+        io_loops = config_get<uint64_t>("io_loops");
+        if (io_loops == 0 || io_loops > MAX_IO_LOOPS) {
+            throw DnstapException("io_loops must be between 1 and " + std::to_string(MAX_IO_LOOPS));
+        }
+    }
+
+    if (config_exists("socket")) {
+        _create_io_loops(io_loops);
         _create_frame_stream_unix_socket();
     } else if (config_exists("tcp")) {
+        _create_io_loops(io_loops);
         _create_frame_stream_tcp_socket();
     } else {
         throw DnstapException("config must specify one of: socket, dnstap_file");
     }
+    _run_io_loops();
 
     _running = true;
 }
 
-void DnstapInputStream::_create_frame_stream_tcp_socket()
+void DnstapInputStream::_create_io_loops(size_t count)
 {
-    assert(config_exists("tcp"));
-
-    // split address and port
-    auto tcp_config = config_get<std::string>("tcp");
-    if (tcp_config.find(':') == std::string::npos) {
-        throw DnstapException("invalid tcp address specification, use HOST:PORT");
-    }
+    _io_loops.clear();
+    _next_loop = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto io = std::make_unique<IoLoop>();
+        auto io_p = io.get();
+
+        // io loop, run in its own thread
+        io->loop = uvw::Loop::create();
+        if (!io->loop) {
+            throw DnstapException("unable to create io loop");
+        }
+        // AsyncHandle lets us stop the loop from its own thread
+        io->async_h = io->loop->resource<uvw::AsyncHandle>();
+        if (!io->async_h) {
+            throw DnstapException("unable to initialize AsyncHandle");
+        }
+        io->async_h->once<uvw::AsyncEvent>([this, io_p](const auto &, auto &handle) {
+            if (io_p == _io_loops.front().get()) {
+                _timer->stop();
+                _timer->close();
+                if (_unix_server_h) {
+                    _unix_server_h->stop();
+                    _unix_server_h->close();
+                }
+            }
+            if (io_p->tcp_server_h) {
+                io_p->tcp_server_h->stop();
+                io_p->tcp_server_h->close();
+            }
+            io_p->handoff_h->close();
+            {
+                // clients handed off but never opened
+                std::lock_guard lock(io_p->handoff_mutex);
+                for (auto fd : io_p->handoff_fds) {
+                    ::close(fd);
+                }
+                io_p->handoff_fds.clear();
+            }
+            io_p->loop->stop();
+            io_p->loop->close();
+            handle.close();
+        });
+        io->async_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
+            _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
+            handle.close();
+        });
 
-    std::string host;
-    unsigned int port;
-    try {
-        host = tcp_config.substr(0, tcp_config.find(':'));
-        port = std::stoul(tcp_config.substr(tcp_config.find(':') + 1, std::string::npos));
-    } catch (std::exception &err) {
-        throw DnstapException("unable to parse tcp address specification, use HOST:PORT");
-    }
+        io->handoff_h = io->loop->resource<uvw::AsyncHandle>();
+        if (!io->handoff_h) {
+            throw DnstapException("unable to initialize AsyncHandle");
+        }
+        io->handoff_h->on<uvw::AsyncEvent>([this, io_p](const auto &, auto &) {
+            // sends may coalesce, so drain everything queued so far
+            std::vector<uv_os_fd_t> fds;
+            {
+                std::lock_guard lock(io_p->handoff_mutex);
+                fds.swap(io_p->handoff_fds);
+            }
+            for (auto fd : fds) {
+                auto client = io_p->loop->resource<uvw::PipeHandle>();
+                if (!client) {
+                    _logger->error("[{}]: unable to initialize handed off client PipeHandle", _name);
+                    ::close(fd);
+                    continue;
+                }
+                client->open(fd);
+                _start_unix_session(*io_p, client);
+            }
+        });
+        io->handoff_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
+            _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
+            handle.close();
+        });
 
-    // main io loop, run in its own thread
-    _io_loop = uvw::Loop::create();
-    if (!_io_loop) {
-        throw DnstapException("unable to create io loop");
+        _io_loops.push_back(std::move(io));
     }
-    // AsyncHandle lets us stop the loop from its own thread
-    _async_h = _io_loop->resource<uvw::AsyncHandle>();
-    if (!_async_h) {
-        throw DnstapException("unable to initialize AsyncHandle");
-    }
-    _async_h->once<uvw::AsyncEvent>([this](const auto &, auto &handle) {
-        _timer->stop();
-        _timer->close();
-        _tcp_server_h->stop();
-        _tcp_server_h->close();
-        _io_loop->stop();
-        _io_loop->close();
-        handle.close();
-    });
-    _async_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
-        _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
-        handle.close();
-    });
 
-    _timer = _io_loop->resource<uvw::TimerHandle>();
+    // heartbeats are driven by the first loop
+    _timer = _io_loops.front()->loop->resource<uvw::TimerHandle>();
     if (!_timer) {
         throw DnstapException("unable to initialize TimerHandle");
     }
@@ -158,146 +219,185 @@ void DnstapInputStream::_create_frame_stream_tcp_socket()
         std::timespec_get(&stamp, TIME_UTC);
         std::shared_lock lock(_input_mutex);
         for (auto &proxy : _event_proxies) {
-            static_cast<DnstapInputEventProxy *>(proxy.get())->heartbeat_cb(stamp);
+            auto dnstap_proxy = static_cast<DnstapInputEventProxy *>(proxy.get());
+            auto dispatch_lock = dnstap_proxy->dispatch_lock();
+            dnstap_proxy->heartbeat_cb(stamp);
         }
     });
     _timer->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
         _logger->error("[{}] TimerEvent error: {}", _name, err.what());
         handle.close();
     });
+}
 
-    // setup server socket
-    _tcp_server_h = _io_loop->resource<uvw::TCPHandle>();
-    if (!_tcp_server_h) {
-        throw DnstapException("unable to initialize server PipeHandle");
+void DnstapInputStream::_run_io_loops()
+{
+    // spawn the loops
+    for (auto &io : _io_loops) {
+        io->thread = std::make_unique<std::thread>([this, io_p = io.get()] {
+            if (io_p == _io_loops.front().get()) {
+                _timer->start(uvw::TimerHandle::Time{1000}, uvw::TimerHandle::Time{HEARTBEAT_INTERVAL * 1000});
+            }
+            io_p->loop->run();
+        });
     }
+}
 
-    _tcp_server_h->on<uvw::ErrorEvent>([this](const auto &err, auto &) {
-        _logger->error("[{}] socket error: {}", _name, err.what());
-        throw DnstapException(err.what());
+void DnstapInputStream::_start_tcp_session(IoLoop &io, std::shared_ptr<uvw::TCPHandle> client)
+{
+    auto on_data_frame = [this](const void *data, std::size_t len_data) {
+        _process_frame(data, len_data);
+    };
+
+    client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, uvw::TCPHandle &c_sock) {
+        _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
+        c_sock.stop();
+        c_sock.close();
     });
 
-    // ListenEvent happens on client connection
-    _tcp_server_h->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::TCPHandle &) {
-        auto client = _io_loop->resource<uvw::TCPHandle>();
-        if (!client) {
-            throw DnstapException("unable to initialize connected client TCPHandle");
+    // client sent data
+    client->on<uvw::DataEvent>([this, &io](const uvw::DataEvent &data, uvw::TCPHandle &c_sock) {
+        assert(io.tcp_sessions[c_sock.fd()]);
+        try {
+            io.tcp_sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
+        } catch (DnstapException &err) {
+            _logger->error("[{}] dnstap client read error: {}", _name, err.what());
+            c_sock.stop();
+            c_sock.close();
         }
+    });
+    // client was closed
+    client->on<uvw::CloseEvent>([this, &io](const uvw::CloseEvent &, uvw::TCPHandle &c_sock) {
+        _logger->info("[{}]: dnstap client disconnected", _name);
+        io.tcp_sessions.erase(c_sock.fd());
+    });
+    // client read EOF
+    client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::TCPHandle &c_sock) {
+        _logger->info("[{}]: dnstap client EOF {}", _name, _tcp_ipv6 ? c_sock.peer<uvw::IPv6>().ip : c_sock.peer().ip);
+        c_sock.stop();
+        c_sock.close();
+    });
 
-        auto on_data_frame = [this](const void *data, std::size_t len_data) {
-            // Data frame ready, parse protobuf
-            ::dnstap::Dnstap d;
-            if (!d.ParseFromArray(data, len_data)) {
-                _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
-                return;
-            }
-            if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
-                _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
-                return;
-            }
+    _logger->info("[{}]: dnstap client connected {}", _name, _tcp_ipv6 ? client->peer<uvw::IPv6>().ip : client->peer().ip);
+    io.tcp_sessions[client->fd()] = std::make_unique<FrameSessionData<uvw::TCPHandle>>(client, CONTENT_TYPE, on_data_frame);
+    client->read();
+}
 
-            // Emit signal to handlers
-            if (!_filtering(d)) {
-                std::shared_lock lock(_input_mutex);
-                for (auto &proxy : _event_proxies) {
-                    static_cast<DnstapInputEventProxy *>(proxy.get())->dnstap_cb(d, len_data);
-                }
-            }
-        };
+void DnstapInputStream::_start_unix_session(IoLoop &io, std::shared_ptr<uvw::PipeHandle> client)
+{
+    auto on_data_frame = [this](const void *data, std::size_t len_data) {
+        _process_frame(data, len_data);
+    };
+
+    client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, uvw::PipeHandle &c_sock) {
+        _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
+        c_sock.stop();
+        c_sock.close();
+    });
 
-        client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, uvw::TCPHandle &c_sock) {
-            _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
+    // client sent data
+    client->on<uvw::DataEvent>([this, &io](const uvw::DataEvent &data, uvw::PipeHandle &c_sock) {
+        assert(io.unix_sessions[c_sock.fd()]);
+        try {
+            io.unix_sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
+        } catch (DnstapException &err) {
+            _logger->error("[{}] dnstap client read error: {}", _name, err.what());
             c_sock.stop();
             c_sock.close();
+        }
+    });
+    // client was closed
+    client->on<uvw::CloseEvent>([this, &io](const uvw::CloseEvent &, uvw::PipeHandle &c_sock) {
+        _logger->info("[{}]: dnstap client disconnected", _name);
+        io.unix_sessions.erase(c_sock.fd());
+    });
+    // client read EOF
+    client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::PipeHandle &c_sock) {
+        _logger->info("[{}]: dnstap client EOF {}", _name, c_sock.fd());
+        c_sock.stop();
+        c_sock.close();
+    });
+
+    _logger->info("[{}]: dnstap client connected {}", _name, client->fd());
+    io.unix_sessions[client->fd()] = std::make_unique<FrameSessionData<uvw::PipeHandle>>(client, CONTENT_TYPE, on_data_frame);
+    client->read();
+}
+
+void DnstapInputStream::_create_frame_stream_tcp_socket()
+{
+    assert(config_exists("tcp"));
+
+    // split address and port. the port follows the last colon, IPv6 addresses may be in brackets
+    auto tcp_config = config_get<std::string>("tcp");
+    auto port_delimiter = tcp_config.rfind(':');
+    if (port_delimiter == std::string::npos) {
+        throw DnstapException("invalid tcp address specification, use HOST:PORT");
+    }
+
+    std::string host;
+    unsigned int port;
+    try {
+        host = tcp_config.substr(0, port_delimiter);
+        port = std::stoul(tcp_config.substr(port_delimiter + 1, std::string::npos));
+    } catch (std::exception &err) {
+        throw DnstapException("unable to parse tcp address specification, use HOST:PORT");
+    }
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    in6_addr ipv6;
+    _tcp_ipv6 = (inet_pton(AF_INET6, host.c_str(), &ipv6) == 1);
+
+    _logger->info("[{}]: opening dnstap server on {} with {} io loop(s)", _name, config_get<std::string>("tcp"), _io_loops.size());
+    bool reuse_port = _io_loops.size() > 1;
+    for (auto &io : _io_loops) {
+        auto io_p = io.get();
+
+        // setup server socket. with several loops the socket has to exist before bind so SO_REUSEPORT can be set,
+        // then the kernel spreads incoming connections across the loops
+        io->tcp_server_h = reuse_port ? io->loop->resource<uvw::TCPHandle>(_tcp_ipv6 ? AF_INET6 : AF_INET) : io->loop->resource<uvw::TCPHandle>();
+        if (!io->tcp_server_h) {
+            throw DnstapException("unable to initialize server TCPHandle");
+        }
+
+        io->tcp_server_h->on<uvw::ErrorEvent>([this](const auto &err, auto &) {
+            _logger->error("[{}] socket error: {}", _name, err.what());
+            throw DnstapException(err.what());
         });
 
-        // client sent data
-        client->on<uvw::DataEvent>([this](const uvw::DataEvent &data, uvw::TCPHandle &c_sock) {
-            assert(_tcp_sessions[c_sock.fd()]);
-            try {
-                _tcp_sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
-            } catch (DnstapException &err) {
-                _logger->error("[{}] dnstap client read error: {}", _name, err.what());
-                c_sock.stop();
-                c_sock.close();
+        // ListenEvent happens on client connection
+        io->tcp_server_h->on<uvw::ListenEvent>([this, io_p](const uvw::ListenEvent &, uvw::TCPHandle &server) {
+            auto client = io_p->loop->resource<uvw::TCPHandle>();
+            if (!client) {
+                throw DnstapException("unable to initialize connected client TCPHandle");
             }
+            server.accept(*client);
+            _start_tcp_session(*io_p, client);
         });
-        // client was closed
-        client->on<uvw::CloseEvent>([this](const uvw::CloseEvent &, uvw::TCPHandle &c_sock) {
-            _logger->info("[{}]: dnstap client disconnected", _name);
-            _tcp_sessions.erase(c_sock.fd());
-        });
-        // client read EOF
-        client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::TCPHandle &c_sock) {
-            _logger->info("[{}]: dnstap client EOF {}", _name, c_sock.peer().ip);
-            c_sock.stop();
-            c_sock.close();
-        });
-
-        _tcp_server_h->accept(*client);
-        _logger->info("[{}]: dnstap client connected {}", _name, client->peer().ip);
-        _tcp_sessions[client->fd()] = std::make_unique<FrameSessionData<uvw::TCPHandle>>(client, CONTENT_TYPE, on_data_frame);
-        client->read();
-    });
-
-    _logger->info("[{}]: opening dnstap server on {}", _name, config_get<std::string>("tcp"));
-    _tcp_server_h->bind(host, port);
-    _tcp_server_h->listen();
 
-    // spawn the loop
-    _io_thread = std::make_unique<std::thread>([this] {
-        _timer->start(uvw::TimerHandle::Time{1000}, uvw::TimerHandle::Time{HEARTBEAT_INTERVAL * 1000});
-        _io_loop->run();
-    });
+        if (reuse_port) {
+            int on = 1;
+            if (::setsockopt(io->tcp_server_h->fd(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+                throw DnstapException(std::string("unable to set SO_REUSEPORT: ") + std::strerror(errno));
+            }
+        }
+        if (_tcp_ipv6) {
+            io->tcp_server_h->bind<uvw::IPv6>(host, port);
+        } else {
+            io->tcp_server_h->bind(host, port);
+        }
+        io->tcp_server_h->listen();
+    }
 }
+
 void DnstapInputStream::_create_frame_stream_unix_socket()
 {
     assert(config_exists("socket"));
 
-    // main io loop, run in its own thread
-    _io_loop = uvw::Loop::create();
-    if (!_io_loop) {
-        throw DnstapException("unable to create io loop");
-    }
-    // AsyncHandle lets us stop the loop from its own thread
-    _async_h = _io_loop->resource<uvw::AsyncHandle>();
-    if (!_async_h) {
-        throw DnstapException("unable to initialize AsyncHandle");
-    }
-    _async_h->once<uvw::AsyncEvent>([this](const auto &, auto &handle) {
-        _timer->stop();
-        _timer->close();
-        _unix_server_h->stop();
-        _unix_server_h->close();
-        _io_loop->stop();
-        _io_loop->close();
-        handle.close();
-    });
-    _async_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
-        _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
-        handle.close();
-    });
-
-    _timer = _io_loop->resource<uvw::TimerHandle>();
-    if (!_timer) {
-        throw DnstapException("unable to initialize TimerHandle");
-    }
-    _timer->on<uvw::TimerEvent>([this](const auto &, auto &handle) {
-        timespec stamp;
-        // use now()
-        std::timespec_get(&stamp, TIME_UTC);
-        std::shared_lock lock(_input_mutex);
-        for (auto &proxy : _event_proxies) {
-            static_cast<DnstapInputEventProxy *>(proxy.get())->heartbeat_cb(stamp);
-        }
-    });
-    _timer->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
-        _logger->error("[{}] TimerEvent error: {}", _name, err.what());
-        handle.close();
-    });
+    auto &home = *_io_loops.front();
 
     // setup server socket
-    _unix_server_h = _io_loop->resource<uvw::PipeHandle>();
+    _unix_server_h = home.loop->resource<uvw::PipeHandle>();
     if (!_unix_server_h) {
         throw DnstapException("unable to initialize server PipeHandle");
     }
@@ -307,80 +407,41 @@ void DnstapInputStream::_create_frame_stream_unix_socket()
         throw DnstapException(err.what());
     });
 
-    // ListenEvent happens on client connection
-    _unix_server_h->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::PipeHandle &) {
-        auto client = _io_loop->resource<uvw::PipeHandle>();
+    // ListenEvent happens on client connection. unix sockets have no SO_REUSEPORT balancing, so the first loop
+    // accepts every client and hands them out round robin
+    _unix_server_h->on<uvw::ListenEvent>([this, &home](const uvw::ListenEvent &, uvw::PipeHandle &) {
+        auto client = home.loop->resource<uvw::PipeHandle>();
         if (!client) {
             throw DnstapException("unable to initialize connected client PipeHandle");
         }
-
-        auto on_data_frame = [this](const void *data, std::size_t len_data) {
-            // Data frame ready, parse protobuf
-            ::dnstap::Dnstap d;
-            if (!d.ParseFromArray(data, len_data)) {
-                _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
-                return;
-            }
-            if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
-                _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
-                return;
-            }
-            // Emit signal to handlers
-            if (!_filtering(d)) {
-                std::shared_lock lock(_input_mutex);
-                for (auto &proxy : _event_proxies) {
-                    static_cast<DnstapInputEventProxy *>(proxy.get())->dnstap_cb(d, len_data);
-                }
-            }
-        };
-
-        client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, uvw::PipeHandle &c_sock) {
-            _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
-            c_sock.stop();
-            c_sock.close();
-        });
-
-        // client sent data
-        client->on<uvw::DataEvent>([this](const uvw::DataEvent &data, uvw::PipeHandle &c_sock) {
-            assert(_unix_sessions[c_sock.fd()]);
-            try {
-                _unix_sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
-            } catch (DnstapException &err) {
-                _logger->error("[{}] dnstap client read error: {}", _name, err.what());
-                c_sock.stop();
-                c_sock.close();
-            }
-        });
-        // client was closed
-        client->on<uvw::CloseEvent>([this](const uvw::CloseEvent &, uvw::PipeHandle &c_sock) {
-            _logger->info("[{}]: dnstap client disconnected", _name);
-            _unix_sessions.erase(c_sock.fd());
-        });
-        // client read EOF
-        client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::PipeHandle &c_sock) {
-            _logger->info("[{}]: dnstap client EOF {}", _name, c_sock.fd());
-            c_sock.stop();
-            c_sock.close();
-        });
-
         _unix_server_h->accept(*client);
-        _logger->info("[{}]: dnstap client connected {}", _name, client->fd());
-        _unix_sessions[client->fd()] = std::make_unique<FrameSessionData<uvw::PipeHandle>>(client, CONTENT_TYPE, on_data_frame);
-        client->read();
+
+        auto &io = *_io_loops[_next_loop++ % _io_loops.size()];
+        if (&io == &home) {
+            _start_unix_session(home, client);
+            return;
+        }
+        // a handle belongs to the loop that created it: pass a duplicate of the descriptor and let the target loop
+        // open its own handle on it
+        auto fd = ::dup(client->fd());
+        client->close();
+        if (fd < 0) {
+            _logger->error("[{}]: unable to hand off dnstap client: {}", _name, std::strerror(errno));
+            return;
+        }
+        {
+            std::lock_guard lock(io.handoff_mutex);
+            io.handoff_fds.push_back(fd);
+        }
+        io.handoff_h->send();
     });
 
     // attempt to remove socket if it exists, ignore errors
     std::filesystem::remove(config_get<std::string>("socket"));
 
-    _logger->info("[{}]: opening dnstap server on {}", _name, config_get<std::string>("socket"));
+    _logger->info("[{}]: opening dnstap server on {} with {} io loop(s)", _name, config_get<std::string>("socket"), _io_loops.size());
     _unix_server_h->bind(config_get<std::string>("socket"));
     _unix_server_h->listen();
-
-    // spawn the loop
-    _io_thread = std::make_unique<std::thread>([this] {
-        _timer->start(uvw::TimerHandle::Time{1000}, uvw::TimerHandle::Time{HEARTBEAT_INTERVAL * 1000});
-        _io_loop->run();
-    });
 }
 
 void DnstapInputStream::stop()
@@ -389,12 +450,14 @@ void DnstapInputStream::stop()
         return;
     }
 
-    if (_async_h && _io_thread) {
-        // we have to use AsyncHandle to stop the loop from the same thread the loop is running in
-        _async_h->send();
-        // waits for _io_loop->run() to return
-        if (_io_thread->joinable()) {
-            _io_thread->join();
+    for (auto &io : _io_loops) {
+        if (io->async_h && io->thread) {
+            // we have to use AsyncHandle to stop the loop from the same thread the loop is running in
+            io->async_h->send();
+            // waits for the loop's run() to return
+            if (io->thread->joinable()) {
+                io->thread->join();
+            }
         }
     }
 
@@ -8,9 +8,12 @@
 #include "InputStream.h"
 #include "dnstap.pb.h"
 #include <DnsLayer.h>
+#include <mutex>
 #include <spdlog/spdlog.h>
+#include <thread>
 #include <unordered_map>
 #include <uv.h>
+#include <vector>
 
 namespace uvw {
 class Loop;
@@ -31,22 +34,46 @@ const static std::string CONTENT_TYPE = "protobuf:dnstap.Dnstap";
 
 class DnstapInputStream : public visor::InputStream
 {
+    // io_loops spreads clients, framing and decoding over threads. it does not shard the handlers: each policy keeps
+    // one instance of each, and frames from all loops reach it one at a time (see DnstapInputEventProxy)
+    static constexpr uint64_t MAX_IO_LOOPS = 64;
+
     std::shared_ptr<spdlog::logger> _logger;
 
-    std::unique_ptr<std::thread> _io_thread;
-    std::shared_ptr<uvw::Loop> _io_loop;
-    std::shared_ptr<uvw::AsyncHandle> _async_h;
-    std::shared_ptr<uvw::TimerHandle> _timer;
+    // an event loop running in its own thread, with the client sessions it serves
+    struct IoLoop {
+        std::unique_ptr<std::thread> thread;
+        std::shared_ptr<uvw::Loop> loop;
+        // stops the loop from its own thread
+        std::shared_ptr<uvw::AsyncHandle> async_h;
 
-    std::shared_ptr<uvw::PipeHandle> _unix_server_h;
-    std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::PipeHandle>>> _unix_sessions;
+        // unix socket clients accepted on the first loop and handed off to this one, as raw descriptors
+        std::shared_ptr<uvw::AsyncHandle> handoff_h;
+        std::mutex handoff_mutex;
+        std::vector<uv_os_fd_t> handoff_fds;
 
-    std::shared_ptr<uvw::TCPHandle> _tcp_server_h;
-    std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::TCPHandle>>> _tcp_sessions;
+        // tcp: every loop listens on the same port (SO_REUSEPORT when there is more than one loop)
+        std::shared_ptr<uvw::TCPHandle> tcp_server_h;
+
+        std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::PipeHandle>>> unix_sessions;
+        std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::TCPHandle>>> tcp_sessions;
+    };
+    std::vector<std::unique_ptr<IoLoop>> _io_loops;
+    // the first loop runs the heartbeat timer and, for unix sockets, the listening socket
+    std::shared_ptr<uvw::TimerHandle> _timer;
+    std::shared_ptr<uvw::PipeHandle> _unix_server_h;
+    size_t _next_loop{0};
+    // the tcp listener address family, from the tcp setting
+    bool _tcp_ipv6{false};
 
     void _read_frame_stream_file();
+    void _create_io_loops(size_t count);
+    void _run_io_loops();
     void _create_frame_stream_unix_socket();
     void _create_frame_stream_tcp_socket();
+    void _start_unix_session(IoLoop &io, std::shared_ptr<uvw::PipeHandle> client);
+    void _start_tcp_session(IoLoop &io, std::shared_ptr<uvw::TCPHandle> client);
+    void _process_frame(const void *data, std::size_t len_data);
 
     inline bool _filtering([[maybe_unused]] const ::dnstap::Dnstap &d)
     {
@@ -80,6 +107,10 @@ class DnstapInputEventProxy : public visor::InputEventProxy
     std::vector<Ipv4Subnet> _IPv4_host_list;
     std::vector<Ipv6Subnet> _IPv6_host_list;
 
+    // handlers are not required to be thread safe, but with several io loops frames arrive from several threads.
+    // handlers of the same policy are serialized here, so only handlers of different policies run in parallel
+    std::mutex _dispatch_mutex;
+
     bool _match_subnet(const std::string &dnstap_ip);
 
     void _parse_host_specs(const std::vector<std::string> &host_list);
@@ -101,8 +132,15 @@ public:
         return policy_signal.slot_count() + heartbeat_signal.slot_count() + dnstap_signal.slot_count();
     }
 
+    std::unique_lock<std::mutex> dispatch_lock()
+    {
+        return std::unique_lock(_dispatch_mutex);
+    }
+
     void dnstap_cb(const ::dnstap::Dnstap &dnstap, size_t size)
     {
+        CpuScope scope(_cpu_account);
+        // filtering only reads the host lists, so it runs outside the dispatch lock
         if (_f_enabled[Filters::OnlyHosts]) {
             if (dnstap.message().has_query_address() && dnstap.message().has_response_address()) {
                 if (!_match_subnet(dnstap.message().query_address()) && !_match_subnet(dnstap.message().response_address())) {
@@ -121,6 +159,7 @@ public:
             }
         }
 
+        auto lock = dispatch_lock();
         dnstap_signal(dnstap, size);
     }
 
@@ -30,7 +30,9 @@ private:
     std::shared_ptr<C> _client_h;
     std::string _content_type;
     using binary = std::basic_string<uint8_t>;
+    // frames are consumed by advancing _read_pos, the consumed prefix is only reclaimed in receive_socket_data
     binary _buffer;
+    size_t _read_pos{0};
     bool _is_bidir;
 
     on_data_frame_cb_t _on_data_frame_cb;
@@ -51,8 +53,15 @@ public:
     {
     }
 
+    // data frames are passed to the callback as views into the session buffer, valid only during the call
     void receive_socket_data(const uint8_t data[], std::size_t data_len);
 
+    // bytes received but not yet consumed as frames
+    std::size_t pending_size() const
+    {
+        return _buffer.size() - _read_pos;
+    }
+
     const FrameState &state() const
     {
         return _state;
@@ -152,20 +161,33 @@ bool FrameSessionData<C>::_decode_control_frame(const void *control_frame, size_
 template <typename C>
 void FrameSessionData<C>::receive_socket_data(const uint8_t data[], std::size_t data_len)
 {
+    if (_read_pos == _buffer.size()) {
+        // everything was consumed, start over at the front
+        _buffer.clear();
+        _read_pos = 0;
+    } else if (_read_pos > _buffer.capacity() / 2) {
+        // move the partial frame down once the consumed prefix is most of the buffer, so this happens at most once
+        // per buffer worth of frames instead of once per frame
+        _buffer.erase(0, _read_pos);
+        _read_pos = 0;
+    }
     _buffer.append(data, data_len);
     while (_try_yield_frame()) { }
 }
 template <typename C>
 bool FrameSessionData<C>::_try_yield_frame()
 {
+    const uint8_t *frame = _buffer.data() + _read_pos;
+    std::size_t available = _buffer.size() - _read_pos;
 
     std::uint32_t frame_len{0};
 
-    if (_buffer.size() < sizeof(frame_len)) {
-        throw DnstapException("invalid data: header length");
+    if (available < sizeof(frame_len)) {
+        // need more data
+        return false;
     }
 
-    std::memcpy(&frame_len, _buffer.data(), sizeof(frame_len));
+    std::memcpy(&frame_len, frame, sizeof(frame_len));
     frame_len = ntohl(frame_len);
 
     if (frame_len != 0) {
@@ -180,27 +202,26 @@ bool FrameSessionData<C>::_try_yield_frame()
             throw DnstapException("data frame too large");
         }
 
-        if (_buffer.size() >= sizeof(frame_len) + frame_len) {
-            _on_data_frame_cb(_buffer.data() + sizeof(frame_len), frame_len);
-            _buffer.erase(0, sizeof(frame_len) + frame_len);
+        if (available >= sizeof(frame_len) + frame_len) {
+            _read_pos += sizeof(frame_len) + frame_len;
+            _on_data_frame_cb(frame + sizeof(frame_len), frame_len);
         } else {
             // need more data
             return false;
         }
     } else {
-        // this is a control frame
+        // this is a control frame: escape code, control frame length, control frame
         // note this happens infrequently
 
-        _buffer.erase(0, sizeof(frame_len)); // erase escape code
-
         // get control frame length
         std::uint32_t ctrl_len{0};
 
-        if (_buffer.size() < sizeof(ctrl_len)) {
-            throw DnstapException("invalid data: control frame length");
+        if (available < sizeof(frame_len) + sizeof(ctrl_len)) {
+            // need more data
+            return false;
         }
 
-        std::memcpy(&ctrl_len, _buffer.data(), sizeof(ctrl_len));
+        std::memcpy(&ctrl_len, frame + sizeof(frame_len), sizeof(ctrl_len));
         ctrl_len = ntohl(ctrl_len);
 
         // ensure we never allocate more than max
@@ -208,18 +229,18 @@ bool FrameSessionData<C>::_try_yield_frame()
             throw DnstapException("control frame too large");
         }
 
-        if (_buffer.size() >= sizeof(ctrl_len) + ctrl_len) {
-            if (!_decode_control_frame(_buffer.data() + sizeof(ctrl_len), ctrl_len)) {
+        if (available >= sizeof(frame_len) + sizeof(ctrl_len) + ctrl_len) {
+            if (!_decode_control_frame(frame + sizeof(frame_len) + sizeof(ctrl_len), ctrl_len)) {
                 throw DnstapException("unable to parse control frame");
             }
-            _buffer.erase(0, sizeof(ctrl_len) + ctrl_len);
+            _read_pos += sizeof(frame_len) + sizeof(ctrl_len) + ctrl_len;
         } else {
             // need more data
             return false;
         }
     }
     // parsed ok. if we have more data, try to parse another frame.
-    return _buffer.size();
+    return _read_pos < _buffer.size();
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,73 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "DnstapInputStream.h"
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <iterator>
+
+using namespace visor::input::dnstap;
+
+struct NullClient {
+    void write(std::unique_ptr<char[]>, unsigned int)
+    {
+    }
+};
+
+static uint32_t read_len(const std::vector<uint8_t> &data, size_t pos)
+{
+    uint32_t len;
+    std::memcpy(&len, data.data() + pos, sizeof(len));
+    return ntohl(len);
+}
+
+// the captured fixture: a START control frame followed by data frames, the last one cut short. the complete data
+// frames are repeated to build a stream large enough to span many socket reads
+static std::vector<uint8_t> load_stream(size_t repeat)
+{
+    std::ifstream file("inputs/dnstap/tests/fixtures/fixture.dnstap", std::ios::binary);
+    std::vector<uint8_t> fixture{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    if (fixture.size() < 8) {
+        return {};
+    }
+    size_t start_len = 8 + read_len(fixture, 4);
+    size_t end = start_len;
+    while (end + 4 <= fixture.size() && end + 4 + read_len(fixture, end) <= fixture.size()) {
+        end += 4 + read_len(fixture, end);
+    }
+
+    std::vector<uint8_t> stream(fixture.begin(), fixture.begin() + start_len);
+    for (size_t i = 0; i < repeat; ++i) {
+        stream.insert(stream.end(), fixture.begin() + start_len, fixture.begin() + end);
+    }
+    return stream;
+}
+
+static void BM_frameSessionData(benchmark::State &state)
+{
+    auto stream = load_stream(100);
+    if (stream.empty()) {
+        state.SkipWithError("unable to read fixture.dnstap");
+        return;
+    }
+    // typical socket read size
+    const size_t chunk = state.range(0);
+    size_t frames{0};
+    for (auto _ : state) {
+        auto on_data_frame = [&frames](const void *data, std::size_t) {
+            benchmark::DoNotOptimize(data);
+            ++frames;
+        };
+        FrameSessionData<NullClient> session(std::make_shared<NullClient>(), CONTENT_TYPE, on_data_frame);
+        for (size_t pos = 0; pos < stream.size(); pos += chunk) {
+            session.receive_socket_data(stream.data() + pos, std::min(chunk, stream.size() - pos));
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * stream.size());
+    state.counters["frames"] = benchmark::Counter(frames, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_frameSessionData)->Arg(4096)->Arg(65536);
+
+BENCHMARK_MAIN();
@@ -1,6 +1,15 @@
 
 #include "DnstapInputStream.h"
+#include <arpa/inet.h>
 #include <catch2/catch.hpp>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <netinet/in.h>
+#include <set>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace visor::input::dnstap;
 
@@ -91,6 +100,37 @@ TEST_CASE("bi-directional frame stream process", "[dnstap][frmstrm]")
     CHECK(df_count == 4);
 }
 
+TEST_CASE("uni-directional frame stream split across reads", "[dnstap][frmstrm]")
+{
+    std::ifstream file("inputs/dnstap/tests/fixtures/fixture.dnstap", std::ios::binary);
+    REQUIRE(file.good());
+    std::vector<uint8_t> stream{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+    for (size_t chunk : {size_t{1}, size_t{3}, size_t{100}, size_t{4096}, stream.size()}) {
+        int df_count{0};
+        size_t df_bytes{0};
+        auto on_data_frame = [&df_count, &df_bytes](const void *data, std::size_t len_data) {
+            ++df_count;
+            df_bytes += len_data;
+            ::dnstap::Dnstap d;
+            CHECK(d.ParseFromArray(data, len_data));
+        };
+
+        auto client = std::make_shared<MockClient>();
+        FrameSessionData<MockClient> session(client, CONTENT_TYPE, on_data_frame);
+        for (size_t pos = 0; pos < stream.size(); pos += chunk) {
+            CHECK_NOTHROW(session.receive_socket_data(stream.data() + pos, std::min(chunk, stream.size() - pos)));
+        }
+        CHECK(session.state() == FrameSessionData<MockClient>::FrameState::Running);
+        CHECK(session.is_bidir() == false);
+        CHECK(df_count == 153);
+        // the capture ends part way into a data frame, which stays pending
+        CHECK(session.pending_size() == 242);
+        // start control frame is 42 bytes, every data frame has a 4 byte length prefix
+        CHECK(42 + 4 * 153 + df_bytes + session.pending_size() == stream.size());
+    }
+}
+
 TEST_CASE("dnstap file", "[dnstap][file]")
 {
     DnstapInputStream stream{"dnstap-test"};
@@ -119,6 +159,199 @@ TEST_CASE("dnstap unix socket", "[dnstap][unix]")
     stream.stop();
 }
 
+TEST_CASE("dnstap tcp socket with several io loops", "[dnstap][tcp]")
+{
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("tcp", "127.0.0.1:5353");
+    stream.config_set<uint64_t>("io_loops", 4);
+
+    stream.start();
+    stream.stop();
+}
+
+TEST_CASE("dnstap unix socket with several io loops", "[dnstap][unix]")
+{
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("socket", "/tmp/dnstap-test.sock");
+    stream.config_set<uint64_t>("io_loops", 4);
+
+    stream.start();
+    stream.stop();
+}
+
+static std::vector<uint8_t> fixture_stream()
+{
+    std::ifstream file("inputs/dnstap/tests/fixtures/fixture.dnstap", std::ios::binary);
+    REQUIRE(file.good());
+    return std::vector<uint8_t>{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+// connect to the input and stream the uni-directional fixture through it, returns the connected socket
+static int send_fixture(int family, const sockaddr *addr, socklen_t addr_len, const std::vector<uint8_t> &stream)
+{
+    int fd = ::socket(family, SOCK_STREAM, 0);
+    REQUIRE(fd >= 0);
+    REQUIRE(::connect(fd, addr, addr_len) == 0);
+    for (size_t pos = 0; pos < stream.size();) {
+        auto sent = ::send(fd, stream.data() + pos, stream.size() - pos, MSG_NOSIGNAL);
+        REQUIRE(sent > 0);
+        pos += static_cast<size_t>(sent);
+    }
+    return fd;
+}
+
+// counts the frames reaching handlers and the io loop threads they came from
+struct FrameCounter {
+    std::mutex mutex;
+    size_t frames{0};
+    std::set<std::thread::id> threads;
+
+    void connect(DnstapInputStream &stream, visor::Config &filter)
+    {
+        auto proxy = static_cast<DnstapInputEventProxy *>(stream.add_event_proxy(filter));
+        proxy->dnstap_signal.connect([this]([[maybe_unused]] const ::dnstap::Dnstap &d, [[maybe_unused]] size_t size) {
+            std::lock_guard lock(mutex);
+            ++frames;
+            threads.insert(std::this_thread::get_id());
+        });
+    }
+
+    bool wait_for(size_t expected)
+    {
+        for (int i = 0; i < 500; ++i) {
+            {
+                std::lock_guard lock(mutex);
+                if (frames >= expected) {
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+};
+
+TEST_CASE("dnstap unix socket clients spread over io loops", "[dnstap][unix]")
+{
+    constexpr size_t CLIENTS = 4;
+    auto stream_data = fixture_stream();
+
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("socket", "/tmp/dnstap-test.sock");
+    stream.config_set<uint64_t>("io_loops", CLIENTS);
+    visor::Config filter;
+    FrameCounter counter;
+    counter.connect(stream, filter);
+
+    stream.start();
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, "/tmp/dnstap-test.sock", sizeof(addr.sun_path) - 1);
+    std::vector<int> clients;
+    for (size_t i = 0; i < CLIENTS; ++i) {
+        clients.push_back(send_fixture(AF_UNIX, reinterpret_cast<sockaddr *>(&addr), sizeof(addr), stream_data));
+    }
+
+    // every client sends the 153 complete data frames of the fixture
+    CHECK(counter.wait_for(CLIENTS * 153));
+    for (auto fd : clients) {
+        ::close(fd);
+    }
+    stream.stop();
+
+    std::lock_guard lock(counter.mutex);
+    CHECK(counter.frames == CLIENTS * 153);
+    // clients are handed out round robin, one to each loop
+    CHECK(counter.threads.size() == CLIENTS);
+}
+
+TEST_CASE("dnstap tcp clients spread over io loops", "[dnstap][tcp]")
+{
+    constexpr size_t CLIENTS = 16;
+    auto stream_data = fixture_stream();
+
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("tcp", "127.0.0.1:5353");
+    stream.config_set<uint64_t>("io_loops", 4);
+    visor::Config filter;
+    filter.config_set<visor::Configurable::StringList>("only_hosts", {"192.168.0.0/24"});
+    FrameCounter counter;
+    counter.connect(stream, filter);
+    // a second policy on the same input sees every frame too
+    visor::Config other_filter;
+    FrameCounter other_counter;
+    other_counter.connect(stream, other_filter);
+
+    stream.start();
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(5353);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::vector<int> clients;
+    for (size_t i = 0; i < CLIENTS; ++i) {
+        clients.push_back(send_fixture(AF_INET, reinterpret_cast<sockaddr *>(&addr), sizeof(addr), stream_data));
+    }
+
+    CHECK(counter.wait_for(CLIENTS * 153));
+    CHECK(other_counter.wait_for(CLIENTS * 153));
+    for (auto fd : clients) {
+        ::close(fd);
+    }
+    stream.stop();
+
+    std::lock_guard lock(counter.mutex);
+    CHECK(counter.frames == CLIENTS * 153);
+    // the kernel balances connections over the listeners, which loops get them is not fixed
+    CHECK(counter.threads.size() >= 1);
+    std::lock_guard other_lock(other_counter.mutex);
+    CHECK(other_counter.frames == CLIENTS * 153);
+}
+
+TEST_CASE("dnstap tcp socket on IPv6 with several io loops", "[dnstap][tcp]")
+{
+    // skip where the loopback has no IPv6
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(5354);
+    addr.sin6_addr = in6addr_loopback;
+    int probe = ::socket(AF_INET6, SOCK_STREAM, 0);
+    bool has_ipv6 = probe >= 0 && ::bind(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    if (probe >= 0) {
+        ::close(probe);
+    }
+    if (!has_ipv6) {
+        WARN("no IPv6 loopback, skipping");
+        return;
+    }
+
+    auto stream_data = fixture_stream();
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("tcp", "[::1]:5354");
+    stream.config_set<uint64_t>("io_loops", 2);
+    visor::Config filter;
+    FrameCounter counter;
+    counter.connect(stream, filter);
+
+    stream.start();
+    auto fd = send_fixture(AF_INET6, reinterpret_cast<sockaddr *>(&addr), sizeof(addr), stream_data);
+    CHECK(counter.wait_for(153));
+    ::close(fd);
+    stream.stop();
+
+    std::lock_guard lock(counter.mutex);
+    CHECK(counter.frames == 153);
+}
+
+TEST_CASE("dnstap invalid io loops", "[dnstap][tcp]")
+{
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("tcp", "127.0.0.1:5353");
+    stream.config_set<uint64_t>("io_loops", 0);
+    REQUIRE_THROWS_WITH(stream.start(), "io_loops must be between 1 and 64");
+}
+
 TEST_CASE("dnstap file filter by valid subnet", "[dnstap][file][filter]")
 {
     DnstapInputStream stream{"dnstap-test"};
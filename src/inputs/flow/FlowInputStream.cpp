@@ -4,12 +4,46 @@
 
 #include "FlowInputStream.h"
 #include "FlowException.h"
+#include <IPv4Layer.h>
+#include <IPv6Layer.h>
 #include <Packet.h>
 #include <PcapFileDevice.h>
 #include <UdpLayer.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 namespace visor::input::flow {
 
+// a dual stack socket reports IPv4 peers v4-mapped, they are keyed as the IPv4 exporters they are
+static IpKey peer_ipv6_key(const uint8_t *ipv6)
+{
+    if (IN6_IS_ADDR_V4MAPPED(reinterpret_cast<const in6_addr *>(ipv6))) {
+        uint32_t ipv4;
+        std::memcpy(&ipv4, ipv6 + 12, sizeof(ipv4));
+        return IpKey::from_ipv4(ipv4);
+    }
+    return IpKey::from_ipv6(ipv6);
+}
+
+#ifdef __linux__
+static IpKey peer_key(const sockaddr_storage &peer)
+{
+    if (peer.ss_family == AF_INET) {
+        return IpKey::from_ipv4(reinterpret_cast<const sockaddr_in *>(&peer)->sin_addr.s_addr);
+    } else if (peer.ss_family == AF_INET6) {
+        return peer_ipv6_key(reinterpret_cast<const sockaddr_in6 *>(&peer)->sin6_addr.s6_addr);
+    }
+    return IpKey{};
+}
+#endif
+
 FlowInputStream::FlowInputStream(const std::string &name)
     : visor::InputStream(name)
     , _flow_type(Type::SFLOW)
@@ -19,6 +53,14 @@ FlowInputStream::FlowInputStream(const std::string &name)
     assert(_logger);
 }
 
+FlowInputStream::~FlowInputStream()
+{
+    stop();
+#ifdef __linux__
+    _stop_workers();
+#endif
+}
+
 void FlowInputStream::start()
 {
 
@@ -39,6 +81,10 @@ void FlowInputStream::start()
         _logger->warn("flow_type not specified, using sflow");
     }
 
+    if (config_exists("template_ttl")) {
+        _nf_templates.set_ttl(config_get<uint64_t>("template_ttl"));
+    }
+
     if (config_exists("pcap_file")) {
         // read sflow from pcap file. this is a special case from a command line utility
         _running = true;
@@ -62,13 +108,15 @@ void FlowInputStream::_read_from_pcap_file()
 
     datasketches::frequent_items_sketch<uint16_t> sketch(3);
 
+    SFSample sflow_sample;
+    NFSample netflow_sample;
     while (reader->getNextPacket(rawPacket)) {
         if (_flow_type == Type::SFLOW) {
             pcpp::Packet sflow_pkt(&rawPacket);
             if (sflow_pkt.isPacketOfType(pcpp::UDP)) {
                 pcpp::UdpLayer *udpLayer = sflow_pkt.getLayerOfType<pcpp::UdpLayer>();
-                SFSample sample;
-                std::memset(&sample, 0, sizeof(sample));
+                auto &sample = sflow_sample;
+                sample.reset();
                 sample.rawSample = udpLayer->getLayerPayload();
                 sample.rawSampleLen = udpLayer->getLayerPayloadSize();
                 try {
@@ -85,11 +133,17 @@ void FlowInputStream::_read_from_pcap_file()
             pcpp::Packet sflow_pkt(&rawPacket);
             if (sflow_pkt.isPacketOfType(pcpp::UDP)) {
                 pcpp::UdpLayer *udpLayer = sflow_pkt.getLayerOfType<pcpp::UdpLayer>();
-                NFSample sample;
-                std::memset(&sample, 0, sizeof(sample));
+                auto &sample = netflow_sample;
+                sample.reset();
                 sample.raw_sample = udpLayer->getLayerPayload();
                 sample.raw_sample_len = udpLayer->getLayerPayloadSize();
-                if (process_netflow_packet(&sample)) {
+                IpKey exporter;
+                if (auto ipv4 = sflow_pkt.getLayerOfType<pcpp::IPv4Layer>(); ipv4) {
+                    exporter = IpKey::from_ipv4(ipv4->getSrcIPv4Address().toInt());
+                } else if (auto ipv6 = sflow_pkt.getLayerOfType<pcpp::IPv6Layer>(); ipv6) {
+                    exporter = IpKey::from_ipv6(ipv6->getSrcIPv6Address().toBytes());
+                }
+                if (process_netflow_packet(&sample, _nf_templates, exporter, rawPacket.getPacketTimeStamp().tv_sec)) {
                     std::shared_lock lock(_input_mutex);
                     for (auto &proxy : _event_proxies) {
                         static_cast<FlowInputEventProxy *>(proxy.get())->netflow_cb(sample);
@@ -109,6 +163,13 @@ void FlowInputStream::_create_frame_stream_udp_socket()
 {
     auto bind = config_get<std::string>("bind");
     auto port = config_get<uint64_t>("port");
+    uint64_t workers = 1;
+    if (config_exists("workers")) {
+        workers = config_get<uint64_t>("workers");
+        if (workers == 0) {
+            throw FlowException("workers must be at least 1");
+        }
+    }
     // main io loop, run in its own thread
     _io_loop = uvw::Loop::create();
     if (!_io_loop) {
@@ -122,8 +183,10 @@ void FlowInputStream::_create_frame_stream_udp_socket()
     _async_h->once<uvw::AsyncEvent>([this](const auto &, auto &handle) {
         _timer->stop();
         _timer->close();
-        _udp_server_h->stop();
-        _udp_server_h->close();
+        if (_udp_server_h) {
+            _udp_server_h->stop();
+            _udp_server_h->close();
+        }
         _io_loop->stop();
         _io_loop->close();
         handle.close();
@@ -141,9 +204,12 @@ void FlowInputStream::_create_frame_stream_udp_socket()
         timespec stamp;
         // use now()
         std::timespec_get(&stamp, TIME_UTC);
+        _nf_templates.expire(stamp.tv_sec);
         std::shared_lock lock(_input_mutex);
         for (auto &proxy : _event_proxies) {
-            static_cast<FlowInputEventProxy *>(proxy.get())->heartbeat_cb(stamp);
+            auto flow_proxy = static_cast<FlowInputEventProxy *>(proxy.get());
+            auto dispatch_lock = flow_proxy->dispatch_lock();
+            flow_proxy->heartbeat_cb(stamp);
         }
     });
     _timer->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
@@ -151,6 +217,14 @@ void FlowInputStream::_create_frame_stream_udp_socket()
         handle.close();
     });
 
+#ifdef __linux__
+    _logger->info("[{}] binding flow UDP server on {}:{} with {} worker(s)", _name, bind, port, workers);
+    _create_udp_workers(bind, static_cast<uint16_t>(port), workers);
+#else
+    if (workers > 1) {
+        _logger->warn("[{}] workers is only supported on Linux, using 1", _name);
+    }
+
     // setup server socket
     _udp_server_h = _io_loop->resource<uvw::UDPHandle>();
     if (!_udp_server_h) {
@@ -162,47 +236,20 @@ void FlowInputStream::_create_frame_stream_udp_socket()
         throw FlowException(err.what());
     });
 
-    // ListenEvent happens on client connection
-    if (_flow_type == Type::SFLOW) {
-        _udp_server_h->on<uvw::UDPDataEvent>([this](const uvw::UDPDataEvent &event, uvw::UDPHandle &) {
-            SFSample sample;
-            std::memset(&sample, 0, sizeof(sample));
-            sample.rawSample = reinterpret_cast<uint8_t *>(event.data.get());
-            sample.rawSampleLen = event.length;
-            sample.sourceIP.type = SFLADDRESSTYPE_IP_V4;
-            struct sockaddr_in peer4;
-            inet_pton(AF_INET, event.sender.ip.c_str(), &(peer4.sin_addr));
-            std::memcpy(&sample.sourceIP.address.ip_v4.addr, &peer4.sin_addr, 4);
-            try {
-                read_sflow_datagram(&sample);
-                std::shared_lock lock(_input_mutex);
-                for (auto &proxy : _event_proxies) {
-                    static_cast<FlowInputEventProxy *>(proxy.get())->sflow_cb(sample);
-                }
-            } catch (const std::exception &e) {
-                ++_error_count;
-            }
-        });
-    } else if (_flow_type == Type::NETFLOW) {
-        _udp_server_h->on<uvw::UDPDataEvent>([this](const uvw::UDPDataEvent &event, uvw::UDPHandle &) {
-            NFSample sample;
-            std::memset(&sample, 0, sizeof(sample));
-            sample.raw_sample = reinterpret_cast<uint8_t *>(event.data.get());
-            sample.raw_sample_len = event.length;
-            if (process_netflow_packet(&sample)) {
-                std::shared_lock lock(_input_mutex);
-                for (auto &proxy : _event_proxies) {
-                    static_cast<FlowInputEventProxy *>(proxy.get())->netflow_cb(sample);
-                }
-            } else {
-                ++_error_count;
-            }
-        });
-    }
+    _udp_server_h->on<uvw::UDPDataEvent>([this](const uvw::UDPDataEvent &event, uvw::UDPHandle &) {
+        IpKey peer;
+        if (uint32_t ipv4; inet_pton(AF_INET, event.sender.ip.c_str(), &ipv4) == 1) {
+            peer = IpKey::from_ipv4(ipv4);
+        } else if (uint8_t ipv6[16]; inet_pton(AF_INET6, event.sender.ip.c_str(), ipv6) == 1) {
+            peer = peer_ipv6_key(ipv6);
+        }
+        _process_datagram(reinterpret_cast<uint8_t *>(event.data.get()), event.length, peer);
+    });
 
     _logger->info("[{}] binding flow UDP server on {}:{}", _name, bind, port);
     _udp_server_h->bind(bind, port);
     _udp_server_h->recv();
+#endif
 
     // spawn the loop
     _io_thread = std::make_unique<std::thread>([this] {
@@ -211,6 +258,191 @@ void FlowInputStream::_create_frame_stream_udp_socket()
     });
 }
 
+void FlowInputStream::_process_datagram(uint8_t *data, size_t len, const IpKey &peer)
+{
+    if (_flow_type == Type::SFLOW) {
+        // reused by every datagram the thread receives, the decoded elements keep their capacity
+        thread_local SFSample sample;
+        sample.reset();
+        sample.rawSample = data;
+        sample.rawSampleLen = static_cast<uint32_t>(len);
+        if (peer.is_ipv4()) {
+            sample.sourceIP.type = SFLADDRESSTYPE_IP_V4;
+            std::memcpy(&sample.sourceIP.address.ip_v4.addr, &peer.addr[12], 4);
+        } else {
+            sample.sourceIP.type = SFLADDRESSTYPE_IP_V6;
+            std::memcpy(sample.sourceIP.address.ip_v6.addr, peer.addr.data(), 16);
+        }
+        try {
+            read_sflow_datagram(&sample);
+            std::shared_lock lock(_input_mutex);
+            for (auto &proxy : _event_proxies) {
+                static_cast<FlowInputEventProxy *>(proxy.get())->sflow_cb(sample);
+            }
+        } catch (const std::exception &e) {
+            ++_error_count;
+        }
+    } else if (_flow_type == Type::NETFLOW) {
+        thread_local NFSample sample;
+        sample.reset();
+        sample.raw_sample = data;
+        sample.raw_sample_len = static_cast<uint32_t>(len);
+        if (process_netflow_packet(&sample, _nf_templates, peer, std::time(nullptr))) {
+            std::shared_lock lock(_input_mutex);
+            for (auto &proxy : _event_proxies) {
+                static_cast<FlowInputEventProxy *>(proxy.get())->netflow_cb(sample);
+            }
+        } else {
+            ++_error_count;
+        }
+    }
+}
+
+#ifdef __linux__
+void FlowInputStream::_create_udp_workers(const std::string &bind, uint16_t port, size_t count)
+{
+    sockaddr_storage addr{};
+    socklen_t addr_len;
+    if (auto sin = reinterpret_cast<sockaddr_in *>(&addr); inet_pton(AF_INET, bind.c_str(), &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        addr_len = sizeof(sockaddr_in);
+    } else if (auto sin6 = reinterpret_cast<sockaddr_in6 *>(&addr); inet_pton(AF_INET6, bind.c_str(), &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        addr_len = sizeof(sockaddr_in6);
+    } else {
+        throw FlowException(fmt::format("invalid bind address \"{}\"", bind));
+    }
+
+    _workers.clear();
+    _stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_stop_fd == -1) {
+        throw FlowException(fmt::format("unable to create eventfd: {}", std::strerror(errno)));
+    }
+
+    try {
+        for (size_t i = 0; i < count; ++i) {
+            auto &worker = _workers.emplace_back(std::make_unique<Worker>());
+            worker->fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (worker->fd == -1) {
+                throw FlowException(fmt::format("unable to create UDP socket: {}", std::strerror(errno)));
+            }
+            int on = 1;
+            // every worker binds the same address and the kernel spreads exporters over them by hash
+            if (count > 1 && setsockopt(worker->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+                throw FlowException(fmt::format("unable to set SO_REUSEPORT: {}", std::strerror(errno)));
+            }
+            if (setsockopt(worker->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1) {
+                throw FlowException(fmt::format("unable to set SO_RXQ_OVFL: {}", std::strerror(errno)));
+            }
+            if (::bind(worker->fd, reinterpret_cast<sockaddr *>(&addr), addr_len) == -1) {
+                throw FlowException(fmt::format("unable to bind {}:{}: {}", bind, port, std::strerror(errno)));
+            }
+        }
+    } catch (const FlowException &) {
+        _stop_workers();
+        throw;
+    }
+
+    _receiving = true;
+    for (auto &worker : _workers) {
+        worker->thread = std::make_unique<std::thread>([this, w = worker.get()] { _receive(*w); });
+    }
+}
+
+void FlowInputStream::_receive(Worker &worker)
+{
+    union Control {
+        char buf[CMSG_SPACE(sizeof(uint32_t))];
+        cmsghdr align;
+    };
+
+    // everything recvmmsg reads into is allocated once, datagrams are processed in place
+    std::vector<uint8_t> buffers(RECV_BATCH * MAX_DATAGRAM);
+    std::vector<mmsghdr> msgs(RECV_BATCH);
+    std::vector<iovec> iovs(RECV_BATCH);
+    std::vector<sockaddr_storage> peers(RECV_BATCH);
+    std::vector<Control> controls(RECV_BATCH);
+    for (size_t i = 0; i < RECV_BATCH; ++i) {
+        iovs[i].iov_base = buffers.data() + i * MAX_DATAGRAM;
+        iovs[i].iov_len = MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &peers[i];
+        msgs[i].msg_hdr.msg_control = controls[i].buf;
+    }
+
+    pollfd pfds[2]{};
+    pfds[0].fd = worker.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = _stop_fd;
+    pfds[1].events = POLLIN;
+
+    while (_receiving) {
+        // name and control lengths are value-result, reset them for every batch
+        for (auto &msg : msgs) {
+            msg.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            msg.msg_hdr.msg_controllen = sizeof(Control);
+        }
+        int received = recvmmsg(worker.fd, msgs.data(), RECV_BATCH, MSG_DONTWAIT, nullptr);
+        if (received == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                _logger->error("[{}] recvmmsg error: {}", _name, std::strerror(errno));
+            }
+            if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+                _logger->error("[{}] poll error: {}", _name, std::strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < received; ++i) {
+            auto &hdr = msgs[i].msg_hdr;
+            for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                    uint32_t drops;
+                    std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                    worker.drops.store(drops, std::memory_order_relaxed);
+                }
+            }
+            // like libuv, empty datagrams are not delivered
+            if (msgs[i].msg_len == 0) {
+                continue;
+            }
+            worker.packets.fetch_add(1, std::memory_order_relaxed);
+            if (hdr.msg_flags & MSG_TRUNC) {
+                ++_error_count;
+                continue;
+            }
+            _process_datagram(static_cast<uint8_t *>(iovs[i].iov_base), msgs[i].msg_len, peer_key(peers[i]));
+        }
+    }
+}
+
+void FlowInputStream::_stop_workers()
+{
+    _receiving = false;
+    if (_stop_fd != -1) {
+        uint64_t one = 1;
+        [[maybe_unused]] auto written = write(_stop_fd, &one, sizeof(one));
+    }
+    for (auto &worker : _workers) {
+        if (worker->thread && worker->thread->joinable()) {
+            worker->thread->join();
+        }
+        worker->thread.reset();
+        if (worker->fd != -1) {
+            close(worker->fd);
+            worker->fd = -1;
+        }
+    }
+    if (_stop_fd != -1) {
+        close(_stop_fd);
+        _stop_fd = -1;
+    }
+}
+#endif
+
 void FlowInputStream::stop()
 {
     if (!_running) {
@@ -225,6 +457,9 @@ void FlowInputStream::stop()
             _io_thread->join();
         }
     }
+#ifdef __linux__
+    _stop_workers();
+#endif
 
     _running = false;
 }
@@ -233,6 +468,22 @@ void FlowInputStream::info_json(json &j) const
 {
     common_info_json(j);
     j[schema_key()]["packet_errors"] = _error_count.load();
+#ifdef __linux__
+    if (!_workers.empty()) {
+        uint64_t drops{0};
+        j[schema_key()]["worker_packets"] = json::array();
+        for (const auto &worker : _workers) {
+            j[schema_key()]["worker_packets"].push_back(worker->packets.load());
+            drops += worker->drops.load();
+        }
+        j[schema_key()]["socket_drops"] = drops;
+    }
+#endif
+    if (_flow_type == Type::NETFLOW) {
+        j[schema_key()]["templates"] = _nf_templates.size();
+        j[schema_key()]["template_misses"] = _nf_templates.misses();
+        j[schema_key()]["templates_expired"] = _nf_templates.expired();
+    }
 }
 
 std::unique_ptr<InputEventProxy> FlowInputStream::create_event_proxy(const Configurable &filter)
@@ -7,6 +7,7 @@
 #include "InputStream.h"
 #include "NetflowData.h"
 #include "SflowData.h"
+#include <mutex>
 #include <spdlog/spdlog.h>
 #include <uvw.hpp>
 
@@ -30,12 +31,40 @@ class FlowInputStream : public visor::InputStream
 
     std::shared_ptr<uvw::UDPHandle> _udp_server_h;
 
+#ifdef __linux__
+    /**
+     * One native receive thread with its own SO_REUSEPORT socket, reading datagrams in recvmmsg batches into buffers
+     * allocated once at start
+     */
+    struct Worker {
+        int fd{-1};
+        std::unique_ptr<std::thread> thread;
+        std::atomic<uint64_t> packets{0};
+        // kernel SO_RXQ_OVFL counter: datagrams dropped on this socket because its receive queue was full
+        std::atomic<uint64_t> drops{0};
+    };
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::atomic<bool> _receiving{false};
+    int _stop_fd{-1};
+
+    void _create_udp_workers(const std::string &bind, uint16_t port, size_t count);
+    void _receive(Worker &worker);
+    void _stop_workers();
+#endif
+
+    NetflowTemplateCache _nf_templates;
+
     void _read_from_pcap_file();
     void _create_frame_stream_udp_socket();
+    void _process_datagram(uint8_t *data, size_t len, const IpKey &peer);
 
 public:
+    // datagrams read per recvmmsg call, and the largest datagram read in full
+    static constexpr size_t RECV_BATCH = 32;
+    static constexpr size_t MAX_DATAGRAM = 65536;
+
     FlowInputStream(const std::string &name);
-    ~FlowInputStream() = default;
+    ~FlowInputStream();
 
     // visor::AbstractModule
     std::string schema_key() const override
@@ -50,6 +79,10 @@ public:
 
 class FlowInputEventProxy : public visor::InputEventProxy
 {
+    // handlers are not required to be thread safe, but with several workers samples arrive from several threads.
+    // handlers of the same policy are serialized here, so only handlers of different policies run in parallel
+    std::mutex _dispatch_mutex;
+
 public:
     FlowInputEventProxy(const std::string &name, const Configurable &filter)
         : InputEventProxy(name, filter)
@@ -63,13 +96,22 @@ public:
         return policy_signal.slot_count() + heartbeat_signal.slot_count() + sflow_signal.slot_count() + netflow_signal.slot_count();
     }
 
+    std::unique_lock<std::mutex> dispatch_lock()
+    {
+        return std::unique_lock(_dispatch_mutex);
+    }
+
     void sflow_cb(const SFSample &sflow)
     {
+        CpuScope scope(_cpu_account);
+        auto lock = dispatch_lock();
         sflow_signal(sflow);
     }
 
     void netflow_cb(const NFSample &netflow)
     {
+        CpuScope scope(_cpu_account);
+        auto lock = dispatch_lock();
         netflow_signal(netflow);
     }
 
@@ -5,8 +5,16 @@
 #pragma once
 
 #include "EndianPortable.h"
+#include "IpKey.h"
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
 #include <netflow.h>
 #include <robin_hood.h>
+#include <shared_mutex>
 #include <vector>
 
 namespace visor::input::flow {
@@ -27,9 +35,13 @@ struct NFSample {
     uint32_t flow_sequence;
     uint32_t source_id;
 
+    /* the address the packet was received from */
+    IpKey exporter;
+
     struct Flows {
         bool is_ipv6 = false;
         uint32_t src_ip, dst_ip, nexthop_ip;
+        uint8_t src_ip6[16], dst_ip6[16];
         uint16_t if_index_in, if_index_out;
         uint32_t flow_packets, flow_octets;
         uint32_t flow_start, flow_finish;
@@ -39,22 +51,319 @@ struct NFSample {
         uint8_t src_mask, dst_mask;
     };
     std::vector<Flows> flows;
+
+    /**
+     * Clear every field for the next packet, keeping the capacity of flows so a reused sample stops allocating
+     */
+    void reset()
+    {
+        auto kept = std::move(flows);
+        kept.clear();
+        *this = NFSample{};
+        flows = std::move(kept);
+    }
+};
+
+/**
+ * A NetFlow v9 or IPFIX template compiled into a decoder: the offset in the record of each field we decode, along with
+ * where and how it lands in NFSample::Flows. Fields we do not decode are only accounted for in record_len(), so decoding
+ * a record touches the handful of fields we care about instead of interpreting every template field.
+ */
+class NetflowTemplate
+{
+public:
+    static constexpr uint16_t VARIABLE_LENGTH = 0xffff;
+
+private:
+    enum class Op : uint8_t {
+        Copy,
+        Copy16,
+        Copy32,
+        IpVersion,
+        Ipv6Addr
+    };
+
+    struct Field {
+        uint16_t offset;
+        uint16_t len;
+        uint16_t target;
+        uint8_t target_len;
+        Op op;
+
+        bool operator==(const Field &other) const
+        {
+            return offset == other.offset && len == other.len && target == other.target && target_len == other.target_len && op == other.op;
+        }
+    };
+
+    std::vector<Field> _fields;
+    uint32_t _record_len{0};
+
+    static Field _target(uint16_t type)
+    {
+#define NF_TARGET(member, op) \
+    Field{0, 0, static_cast<uint16_t>(offsetof(NFSample::Flows, member)), sizeof(NFSample::Flows::member), op}
+        // v9 and IPFIX share the field types we decode
+        switch (type) {
+        case NF9_IN_BYTES:
+            return NF_TARGET(flow_octets, Op::Copy32);
+        case NF9_IN_PACKETS:
+            return NF_TARGET(flow_packets, Op::Copy32);
+        case NF9_IN_PROTOCOL:
+            return NF_TARGET(protocol, Op::Copy);
+        case NF9_SRC_TOS:
+            return NF_TARGET(tos, Op::Copy);
+        case NF9_TCP_FLAGS:
+            return NF_TARGET(tcp_flags, Op::Copy);
+        case NF9_SRC_MASK:
+        case NF9_IPV6_SRC_MASK:
+            return NF_TARGET(src_mask, Op::Copy);
+        case NF9_DST_MASK:
+        case NF9_IPV6_DST_MASK:
+            return NF_TARGET(dst_mask, Op::Copy);
+        case NF9_L4_SRC_PORT:
+            return NF_TARGET(src_port, Op::Copy16);
+        case NF9_L4_DST_PORT:
+            return NF_TARGET(dst_port, Op::Copy16);
+        case NF9_INPUT_SNMP:
+            return NF_TARGET(if_index_in, Op::Copy16);
+        case NF9_OUTPUT_SNMP:
+            return NF_TARGET(if_index_out, Op::Copy16);
+        case NF9_SRC_AS:
+            return NF_TARGET(src_as, Op::Copy16);
+        case NF9_DST_AS:
+            return NF_TARGET(dst_as, Op::Copy16);
+        case NF9_LAST_SWITCHED:
+            return NF_TARGET(flow_finish, Op::Copy32);
+        case NF9_FIRST_SWITCHED:
+            return NF_TARGET(flow_start, Op::Copy32);
+        case NF9_IPV4_SRC_ADDR:
+            return NF_TARGET(src_ip, Op::Copy);
+        case NF9_IPV6_SRC_ADDR:
+            return NF_TARGET(src_ip6, Op::Ipv6Addr);
+        case NF9_IPV4_DST_ADDR:
+            return NF_TARGET(dst_ip, Op::Copy);
+        case NF9_IPV6_DST_ADDR:
+            return NF_TARGET(dst_ip6, Op::Ipv6Addr);
+        case NF9_IPV4_NEXT_HOP:
+        case NF9_IPV6_NEXT_HOP:
+            return NF_TARGET(nexthop_ip, Op::Copy);
+        case NF9_IP_PROTOCOL_VERSION:
+            return NF_TARGET(is_ipv6, Op::IpVersion);
+        default:
+            return Field{0, 0, 0, 0, Op::Copy};
+        }
+#undef NF_TARGET
+    }
+
+public:
+    /**
+     * Append the next template field
+     * @param type field type, 0 for a field that is not decoded (e.g. enterprise specific)
+     * @return false if the field has a variable length, which a compiled template can not decode
+     */
+    bool add_field(uint16_t type, uint16_t len)
+    {
+        if (len == VARIABLE_LENGTH) {
+            return false;
+        }
+        auto field = _target(type);
+        // fields wider than their target are skipped, values are right aligned (big endian) in narrower ones
+        if (field.target_len && len <= field.target_len && (field.op != Op::IpVersion || len == 1) && (field.op != Op::Ipv6Addr || len == 16)) {
+            field.offset = static_cast<uint16_t>(_record_len);
+            field.len = len;
+            _fields.push_back(field);
+        }
+        _record_len += len;
+        return _record_len <= VARIABLE_LENGTH;
+    }
+
+    uint32_t record_len() const
+    {
+        return _record_len;
+    }
+
+    // keeps the capacity, for compiling into the same template object again
+    void clear()
+    {
+        _fields.clear();
+        _record_len = 0;
+    }
+
+    void decode(const uint8_t *record, NFSample::Flows &flow) const
+    {
+        auto base = reinterpret_cast<uint8_t *>(&flow);
+        for (const auto &field : _fields) {
+            auto target = base + field.target;
+            switch (field.op) {
+            case Op::IpVersion:
+                if (record[field.offset] == 6) {
+                    flow.is_ipv6 = true;
+                }
+                break;
+            case Op::Ipv6Addr:
+                std::memcpy(target, record + field.offset, 16);
+                flow.is_ipv6 = true;
+                break;
+            case Op::Copy:
+                std::memcpy(target + (field.target_len - field.len), record + field.offset, field.len);
+                break;
+            case Op::Copy16: {
+                uint16_t value;
+                std::memcpy(target + (field.target_len - field.len), record + field.offset, field.len);
+                std::memcpy(&value, target, sizeof(value));
+                value = be16toh(value);
+                std::memcpy(target, &value, sizeof(value));
+                break;
+            }
+            case Op::Copy32: {
+                uint32_t value;
+                std::memcpy(target + (field.target_len - field.len), record + field.offset, field.len);
+                std::memcpy(&value, target, sizeof(value));
+                value = be32toh(value);
+                std::memcpy(target, &value, sizeof(value));
+                break;
+            }
+            }
+        }
+    }
+
+    bool operator==(const NetflowTemplate &other) const
+    {
+        return _record_len == other._record_len && _fields == other._fields;
+    }
 };
 
-// A hash function used to hash a pair of any kind
-struct hash_pair {
-    template <class T1, class T2>
-    size_t operator()(const std::pair<T1, T2> &p) const
+/**
+ * Templates are scoped to the exporter and its observation domain (source_id), template ids are only unique within
+ * one of them
+ */
+struct NetflowTemplateKey {
+    IpKey exporter;
+    uint32_t source_id{0};
+    uint16_t version{0};
+    uint16_t template_id{0};
+
+    bool operator==(const NetflowTemplateKey &other) const
     {
-        auto hash1 = std::hash<T1>{}(p.first);
-        auto hash2 = std::hash<T2>{}(p.second);
-        return hash1 ^ hash2;
+        return template_id == other.template_id && source_id == other.source_id && version == other.version && exporter == other.exporter;
+    }
+
+    size_t hash() const
+    {
+        uint64_t id = (static_cast<uint64_t>(source_id) << 32) | (static_cast<uint64_t>(version) << 16) | template_id;
+        return exporter.hash() ^ static_cast<size_t>(id * 0x9e3779b97f4a7c15ULL);
     }
 };
 
-using NfMapID = std::pair<uint32_t, uint16_t>;
-static robin_hood::unordered_map<NfMapID, peer_nf9_template, hash_pair> nf9_template_map;
-static robin_hood::unordered_map<NfMapID, peer_nf10_template, hash_pair> nf10_template_map;
+struct NetflowTemplateKeyHash {
+    size_t operator()(const NetflowTemplateKey &key) const
+    {
+        return key.hash();
+    }
+};
+
+/**
+ * NetFlow v9/IPFIX templates received by one flow input.
+ *
+ * Exporters resend their templates periodically, a template not refreshed within its TTL is considered withdrawn: it no
+ * longer decodes data and is dropped by expire(). Data referring to a template we do not hold is counted as a miss.
+ *
+ * Safe to use from several receiving threads: lookups share a lock and hand out the compiled template, so replacing or
+ * expiring it does not affect a decode in progress.
+ */
+class NetflowTemplateCache
+{
+    struct Entry {
+        std::shared_ptr<const NetflowTemplate> nf_template;
+        std::time_t refreshed;
+    };
+
+    mutable std::shared_mutex _mutex;
+    robin_hood::unordered_map<NetflowTemplateKey, Entry, NetflowTemplateKeyHash> _templates;
+    std::time_t _ttl;
+
+    mutable std::atomic<uint64_t> _misses{0};
+    std::atomic<uint64_t> _expired{0};
+
+public:
+    static constexpr std::time_t DEFAULT_TTL = 1800;
+
+    explicit NetflowTemplateCache(std::time_t ttl = DEFAULT_TTL)
+        : _ttl(ttl)
+    {
+    }
+
+    // not thread safe, set before receiving
+    void set_ttl(std::time_t ttl)
+    {
+        _ttl = ttl;
+    }
+
+    /**
+     * Add or refresh the template for key, nf_template is only copied when it changed
+     */
+    void add(const NetflowTemplateKey &key, const NetflowTemplate &nf_template, std::time_t now)
+    {
+        std::unique_lock lock(_mutex);
+        auto &entry = _templates[key];
+        if (!entry.nf_template || !(*entry.nf_template == nf_template)) {
+            entry.nf_template = std::make_shared<const NetflowTemplate>(nf_template);
+        }
+        entry.refreshed = now;
+    }
+
+    /**
+     * @return the template for key, nullptr (counted as a miss) if it is unknown or expired
+     */
+    std::shared_ptr<const NetflowTemplate> find(const NetflowTemplateKey &key, std::time_t now) const
+    {
+        {
+            std::shared_lock lock(_mutex);
+            if (auto it = _templates.find(key); it != _templates.end() && now - it->second.refreshed <= _ttl) {
+                return it->second.nf_template;
+            }
+        }
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    /**
+     * Drop the templates not refreshed within the TTL
+     * @return the number of templates dropped
+     */
+    size_t expire(std::time_t now)
+    {
+        size_t expired{0};
+        std::unique_lock lock(_mutex);
+        for (auto it = _templates.begin(); it != _templates.end();) {
+            if (now - it->second.refreshed > _ttl) {
+                it = _templates.erase(it);
+                ++expired;
+            } else {
+                ++it;
+            }
+        }
+        _expired.fetch_add(expired, std::memory_order_relaxed);
+        return expired;
+    }
+
+    size_t size() const
+    {
+        std::shared_lock lock(_mutex);
+        return _templates.size();
+    }
+
+    uint64_t misses() const
+    {
+        return _misses.load(std::memory_order_relaxed);
+    }
+
+    uint64_t expired() const
+    {
+        return _expired.load(std::memory_order_relaxed);
+    }
+};
 
 static bool process_netflow_v1(NFSample *sample)
 {
@@ -212,132 +521,63 @@ static bool process_netflow_v7(NFSample *sample)
     return true;
 }
 
-static inline void be_copy(uint8_t *data, uint8_t *target, uint32_t target_length, uint32_t rec_length)
-{
-    if (target_length < rec_length) {
-        return;
-    }
-    memcpy(target + (target_length - rec_length), data, rec_length);
-}
-
-static bool process_netflow_v9_template(uint8_t *pkt, size_t len, uint32_t source_id)
+/*
+ * NetFlow v9 and IPFIX share the layout of template and data flowsets, only the flowset ids differ and IPFIX template
+ * fields may carry an enterprise number
+ */
+static bool process_netflow_template(uint8_t *pkt, size_t len, NetflowTemplateKey key, bool ipfix, NetflowTemplateCache &templates, std::time_t now)
 {
-    struct NF9_FLOWSET_HEADER_COMMON *template_header;
     struct NF9_TEMPLATE_FLOWSET_HEADER *tmplh;
     struct NF9_TEMPLATE_FLOWSET_RECORD *tmplr;
-    uint32_t i, count, offset, template_id, total_size;
-    peer_nf9_template nf9_template;
-
-    template_header = reinterpret_cast<struct NF9_FLOWSET_HEADER_COMMON *>(pkt);
-    if (len < sizeof(*template_header)) {
-        return false;
-    }
+    size_t offset;
 
-    if (be16toh(template_header->flowset_id) != NF9_TEMPLATE_FLOWSET_ID) {
+    if (len < sizeof(struct NF9_FLOWSET_HEADER_COMMON)) {
         return false;
     }
 
-    for (offset = sizeof(*template_header); offset < len;) {
+    // stops on padding at the end of the flowset
+    for (offset = sizeof(struct NF9_FLOWSET_HEADER_COMMON); offset + sizeof(*tmplh) <= len;) {
         tmplh = reinterpret_cast<struct NF9_TEMPLATE_FLOWSET_HEADER *>(pkt + offset);
 
-        template_id = be16toh(tmplh->template_id);
-        count = be16toh(tmplh->count);
+        key.template_id = be16toh(tmplh->template_id);
+        uint16_t count = be16toh(tmplh->count);
         offset += sizeof(*tmplh);
 
-        total_size = 0;
-        std::vector<peer_nf9_record> template_recs;
-        for (i = 0; i < count; i++) {
-            if (offset >= len) {
+        // refreshes of a known template compile into the same object and are not copied, so they do not allocate
+        thread_local NetflowTemplate nf_template;
+        nf_template.clear();
+        bool complete = true;
+        for (uint16_t i = 0; i < count && complete; i++) {
+            if (offset + sizeof(*tmplr) > len) {
+                complete = false;
                 break;
             }
 
             tmplr = reinterpret_cast<struct NF9_TEMPLATE_FLOWSET_RECORD *>(pkt + offset);
-            uint32_t rec_length = be16toh(tmplr->length);
-            uint32_t rec_type = be16toh(tmplr->type);
-
-            peer_nf9_record recs(rec_type, rec_length);
+            uint16_t rec_type = be16toh(tmplr->type);
+            uint16_t rec_length = be16toh(tmplr->length);
             offset += sizeof(*tmplr);
-            template_recs.push_back(recs);
-            total_size += rec_length;
+
+            if (ipfix && (rec_type & NF10_ENTERPRISE)) {
+                // enterprise specific, followed by the enterprise number
+                offset += sizeof(uint32_t);
+                rec_type = 0;
+            }
+            complete = nf_template.add_field(rec_type, rec_length);
         }
-        nf9_template.template_id = template_id;
-        nf9_template.source_id = source_id;
-        nf9_template.num_records = count;
-        nf9_template.records = template_recs;
-        nf9_template.num_records = i;
-        nf9_template.total_len = total_size;
 
-        nf9_template_map[NfMapID(source_id, template_id)] = nf9_template;
+        if (complete && nf_template.record_len() > 0) {
+            templates.add(key, nf_template, now);
+        }
     }
 
     return true;
 }
 
-static void nf9_rec_to_flow(NFSample::Flows *flow, struct peer_nf9_record *rec, uint8_t *data)
-{
-    /* XXX: use a table-based interpreter */
-    switch (rec->type) {
-
-#define V9_FIELD(v9_field, target, target_length)                                    \
-    case v9_field:                                                                   \
-        be_copy(data, reinterpret_cast<uint8_t *>(target), target_length, rec->len); \
-        break
-#define V9_FIELD_16(v9_field, target, target_length)                                 \
-    case v9_field:                                                                   \
-        be_copy(data, reinterpret_cast<uint8_t *>(target), target_length, rec->len); \
-        *(target) = be16toh(*target);                                                \
-        break
-#define V9_FIELD_32(v9_field, target, target_length)                                 \
-    case v9_field:                                                                   \
-        be_copy(data, reinterpret_cast<uint8_t *>(target), target_length, rec->len); \
-        *(target) = be32toh(*target);                                                \
-        break
-
-        V9_FIELD_32(NF9_IN_BYTES, &flow->flow_octets, sizeof(flow->flow_octets));
-        V9_FIELD_32(NF9_IN_PACKETS, &flow->flow_packets, sizeof(flow->flow_octets));
-        V9_FIELD(NF9_IN_PROTOCOL, &flow->protocol, sizeof(flow->protocol));
-        V9_FIELD(NF9_SRC_TOS, &flow->tos, sizeof(flow->tos));
-        V9_FIELD(NF9_TCP_FLAGS, &flow->tcp_flags, sizeof(flow->tcp_flags));
-        V9_FIELD(NF9_SRC_MASK, &flow->src_mask, sizeof(flow->src_mask));
-        V9_FIELD(NF9_DST_MASK, &flow->dst_mask, sizeof(flow->dst_mask));
-        V9_FIELD_16(NF9_L4_SRC_PORT, &flow->src_port, sizeof(flow->src_port));
-        V9_FIELD_16(NF9_INPUT_SNMP, &flow->if_index_in, sizeof(flow->if_index_in));
-        V9_FIELD_16(NF9_L4_DST_PORT, &flow->dst_port, sizeof(flow->dst_port));
-        V9_FIELD_16(NF9_OUTPUT_SNMP, &flow->if_index_out, sizeof(flow->if_index_out));
-        V9_FIELD_16(NF9_SRC_AS, &flow->src_as, sizeof(flow->src_as));
-        V9_FIELD_16(NF9_DST_AS, &flow->dst_as, sizeof(flow->dst_as));
-        V9_FIELD_32(NF9_LAST_SWITCHED, &flow->flow_finish, sizeof(flow->flow_finish));
-        V9_FIELD_32(NF9_FIRST_SWITCHED, &flow->flow_start, sizeof(flow->flow_start));
-        V9_FIELD(NF9_IPV6_SRC_MASK, &flow->src_mask, sizeof(flow->src_mask));
-        V9_FIELD(NF9_IPV6_DST_MASK, &flow->dst_mask, sizeof(flow->dst_mask));
-        V9_FIELD(NF9_IPV4_SRC_ADDR, &flow->src_ip, sizeof(flow->src_ip));
-        V9_FIELD(NF9_IPV6_SRC_ADDR, &flow->src_ip, sizeof(flow->src_ip));
-        V9_FIELD(NF9_IPV4_DST_ADDR, &flow->dst_ip, sizeof(flow->dst_ip));
-        V9_FIELD(NF9_IPV6_DST_ADDR, &flow->dst_ip, sizeof(flow->dst_ip));
-        V9_FIELD(NF9_IPV4_NEXT_HOP, &flow->nexthop_ip, sizeof(flow->nexthop_ip));
-        V9_FIELD(NF9_IPV6_NEXT_HOP, &flow->nexthop_ip, sizeof(flow->nexthop_ip));
-
-    case NF9_IP_PROTOCOL_VERSION:
-        uint8_t version = 0;
-        be_copy(data, reinterpret_cast<uint8_t *>(&version), sizeof(version), rec->len);
-        if (version == 6) {
-            flow->is_ipv6 = true;
-        }
-        break;
-#undef V9_FIELD_32
-#undef V9_FIELD_16
-#undef V9_FIELD
-    }
-}
-
-static bool process_netflow_v9_data(std::vector<NFSample::Flows> *flows, uint8_t *pkt, size_t len, uint32_t source_id, uint32_t *num_flows)
+static bool process_netflow_data(std::vector<NFSample::Flows> *flows, uint8_t *pkt, size_t len, NetflowTemplateKey key, const NetflowTemplateCache &templates, std::time_t now, uint32_t *num_flows)
 {
     struct NF9_DATA_FLOWSET_HEADER *dath;
-    uint16_t flowset_id, i, j, offset, num_flowsets;
-
-    if (nf9_template_map.empty()) {
-        return false;
-    }
+    size_t i, offset, num_records;
 
     *num_flows = 0;
 
@@ -346,42 +586,32 @@ static bool process_netflow_v9_data(std::vector<NFSample::Flows> *flows, uint8_t
         return false;
     }
 
-    flowset_id = be16toh(dath->c.flowset_id);
+    key.template_id = be16toh(dath->c.flowset_id);
 
-    auto iter = nf9_template_map.find(NfMapID(source_id, flowset_id));
-    if (iter == nf9_template_map.end()) {
-        return false;
-    }
-
-    auto nf9_template = iter->second;
-    if (nf9_template.records.empty()) {
-        return false;
+    auto nf_template = templates.find(key, now);
+    if (!nf_template) {
+        // data ahead of its template, or after it expired: skip the flowset
+        return true;
     }
 
     offset = sizeof(*dath);
-    num_flowsets = (len - offset) / nf9_template.total_len;
+    num_records = (len - offset) / nf_template->record_len();
 
-    if (num_flowsets == 0 || num_flowsets > 0x4000) {
+    if (num_records == 0 || num_records > 0x4000) {
         return false;
     }
 
-    for (i = 0; i < num_flowsets; i++) {
-        uint32_t offset_recs = 0;
-        NFSample::Flows flow = {};
-        for (j = 0; j < nf9_template.num_records; j++) {
-            nf9_rec_to_flow(&flow, &nf9_template.records[j], pkt + offset + offset_recs);
-            offset_recs += nf9_template.records[j].len;
-        }
-        flows->push_back(flow);
-        offset += nf9_template.total_len;
+    for (i = 0; i < num_records; i++) {
+        nf_template->decode(pkt + offset, flows->emplace_back());
+        offset += nf_template->record_len();
     }
 
-    *num_flows = j;
+    *num_flows = static_cast<uint32_t>(num_records);
 
     return true;
 }
 
-static bool process_netflow_v9(NFSample *sample)
+static bool process_netflow_v9(NFSample *sample, NetflowTemplateCache &templates, const IpKey &exporter, std::time_t now)
 {
     struct NF9_HEADER *nf9_hdr = reinterpret_cast<struct NF9_HEADER *>(sample->raw_sample);
 
@@ -398,10 +628,11 @@ static bool process_netflow_v9(NFSample *sample)
     sample->flow_sequence = be32toh(nf9_hdr->package_sequence);
     sample->source_id = be32toh(nf9_hdr->source_id);
 
+    NetflowTemplateKey key{exporter, sample->source_id, sample->version, 0};
+
     offset = sizeof(*nf9_hdr);
     total_flows = 0;
 
-    std::vector<NFSample::Flows> flows;
     for (i = 0;; i++) {
         /* Make sure we don't run off the end of the flow */
         if (offset >= sample->raw_sample_len) {
@@ -419,7 +650,7 @@ static bool process_netflow_v9(NFSample *sample)
 
         switch (flowset_id) {
         case NF9_TEMPLATE_FLOWSET_ID:
-            if (!process_netflow_v9_template(sample->raw_sample + offset, flowset_len, sample->source_id)) {
+            if (!process_netflow_template(sample->raw_sample + offset, flowset_len, key, false, templates, now)) {
                 return false;
             }
             break;
@@ -431,7 +662,7 @@ static bool process_netflow_v9(NFSample *sample)
                 /* XXX ratelimit */
                 break;
             }
-            if (!process_netflow_v9_data(&flows, sample->raw_sample + offset, flowset_len, sample->source_id, &flowset_flows)) {
+            if (!process_netflow_data(&sample->flows, sample->raw_sample + offset, flowset_len, key, templates, now, &flowset_flows)) {
                 return false;
             }
             total_flows += flowset_flows;
@@ -443,175 +674,13 @@ static bool process_netflow_v9(NFSample *sample)
         /* XXX check header->count against what we got */
     }
 
-    sample->flows = flows;
-
     if (total_flows > 0) {
         return true;
     }
     return false;
 }
 
-static void nf10_rec_to_flow(NFSample::Flows *flow, struct peer_nf10_record *rec, uint8_t *data)
-{
-    /* XXX: use a table-based interpreter */
-    switch (rec->type) {
-
-#define V10_FIELD(v10_field, target, target_length)                                  \
-    case v10_field:                                                                  \
-        be_copy(data, reinterpret_cast<uint8_t *>(target), target_length, rec->len); \
-        break
-#define V10_FIELD_16(v10_field, target, target_length)                               \
-    case v10_field:                                                                  \
-        be_copy(data, reinterpret_cast<uint8_t *>(target), target_length, rec->len); \
-        *(target) = be16toh(*target);                                                \
-        break
-#define V10_FIELD_32(v10_field, target, target_length)                               \
-    case v10_field:                                                                  \
-        be_copy(data, reinterpret_cast<uint8_t *>(target), target_length, rec->len); \
-        *(target) = be32toh(*target);                                                \
-        break
-
-        V10_FIELD_32(NF10_IN_BYTES, &flow->flow_octets, sizeof(flow->flow_octets));
-        V10_FIELD_32(NF10_IN_PACKETS, &flow->flow_packets, sizeof(flow->flow_octets));
-        V10_FIELD(NF10_IN_PROTOCOL, &flow->protocol, sizeof(flow->protocol));
-        V10_FIELD(NF10_SRC_TOS, &flow->tos, sizeof(flow->tos));
-        V10_FIELD(NF10_TCP_FLAGS, &flow->tcp_flags, sizeof(flow->tcp_flags));
-        V10_FIELD(NF10_SRC_MASK, &flow->src_mask, sizeof(flow->src_mask));
-        V10_FIELD(NF10_DST_MASK, &flow->dst_mask, sizeof(flow->dst_mask));
-        V10_FIELD_16(NF10_L4_SRC_PORT, &flow->src_port, sizeof(flow->src_port));
-        V10_FIELD_16(NF10_INPUT_SNMP, &flow->if_index_in, sizeof(flow->if_index_in));
-        V10_FIELD_16(NF10_L4_DST_PORT, &flow->dst_port, sizeof(flow->dst_port));
-        V10_FIELD_16(NF10_OUTPUT_SNMP, &flow->if_index_out, sizeof(flow->if_index_out));
-        V10_FIELD_16(NF10_SRC_AS, &flow->src_as, sizeof(flow->src_as));
-        V10_FIELD_16(NF10_DST_AS, &flow->dst_as, sizeof(flow->dst_as));
-        V10_FIELD_32(NF10_LAST_SWITCHED, &flow->flow_finish, sizeof(flow->flow_finish));
-        V10_FIELD_32(NF10_FIRST_SWITCHED, &flow->flow_start, sizeof(flow->flow_start));
-        V10_FIELD(NF10_IPV6_SRC_MASK, &flow->src_mask, sizeof(flow->src_mask));
-        V10_FIELD(NF10_IPV6_DST_MASK, &flow->dst_mask, sizeof(flow->dst_mask));
-        V10_FIELD(NF10_IPV4_SRC_ADDR, &flow->src_ip, sizeof(flow->src_ip));
-        V10_FIELD(NF10_IPV6_SRC_ADDR, &flow->src_ip, sizeof(flow->src_ip));
-        V10_FIELD(NF10_IPV4_DST_ADDR, &flow->dst_ip, sizeof(flow->dst_ip));
-        V10_FIELD(NF10_IPV6_DST_ADDR, &flow->dst_ip, sizeof(flow->dst_ip));
-        V10_FIELD(NF10_IPV4_NEXT_HOP, &flow->nexthop_ip, sizeof(flow->nexthop_ip));
-        V10_FIELD(NF10_IPV6_NEXT_HOP, &flow->nexthop_ip, sizeof(flow->nexthop_ip));
-
-    case NF10_IP_PROTOCOL_VERSION:
-        uint8_t version = 0;
-        be_copy(data, reinterpret_cast<uint8_t *>(&version), sizeof(version), rec->len);
-        if (version == 6) {
-            flow->is_ipv6 = true;
-        }
-        break;
-#undef V10_FIELD_32
-#undef V10_FIELD_16
-#undef V10_FIELD
-    }
-}
-
-static bool process_netflow_v10_data(std::vector<NFSample::Flows> *flows, uint8_t *pkt, size_t len, uint32_t source_id, uint32_t *num_flows)
-{
-    struct NF10_DATA_FLOWSET_HEADER *dath;
-    uint16_t flowset_id, i, j, offset, num_flowsets;
-
-    if (nf10_template_map.empty()) {
-        return false;
-    }
-
-    *num_flows = 0;
-
-    dath = reinterpret_cast<struct NF10_DATA_FLOWSET_HEADER *>(pkt);
-    if (len < sizeof(*dath)) {
-        return false;
-    }
-
-    flowset_id = be16toh(dath->c.flowset_id);
-
-    auto iter = nf10_template_map.find(NfMapID(source_id, flowset_id));
-    if (iter == nf10_template_map.end()) {
-        return false;
-    }
-
-    auto nf10_template = iter->second;
-    if (nf10_template.records.empty()) {
-        return false;
-    }
-
-    offset = sizeof(*dath);
-    num_flowsets = (len - offset) / nf10_template.total_len;
-
-    if (num_flowsets == 0 || num_flowsets > 0x4000) {
-        return false;
-    }
-
-    for (i = 0; i < num_flowsets; i++) {
-        uint32_t offset_recs = 0;
-        NFSample::Flows flow = {};
-        for (j = 0; j < nf10_template.num_records; j++) {
-            nf10_rec_to_flow(&flow, &nf10_template.records[j], pkt + offset + offset_recs);
-            offset_recs += nf10_template.records[j].len;
-        }
-        flows->push_back(flow);
-        offset += nf10_template.total_len;
-    }
-
-    *num_flows = j;
-    return true;
-}
-
-static bool process_netflow_v10_template(uint8_t *pkt, size_t len, uint32_t source_id)
-{
-    struct NF10_FLOWSET_HEADER_COMMON *template_header;
-    struct NF10_TEMPLATE_FLOWSET_HEADER *tmplh;
-    struct NF10_TEMPLATE_FLOWSET_RECORD *tmplr;
-    uint32_t i, count, offset, template_id, total_size;
-    peer_nf10_template nf10_template;
-
-    template_header = reinterpret_cast<struct NF10_FLOWSET_HEADER_COMMON *>(pkt);
-    if (len < sizeof(*template_header)) {
-        return false;
-    }
-
-    if (be16toh(template_header->flowset_id) != NF10_TEMPLATE_FLOWSET_ID) {
-        return false;
-    }
-
-    for (offset = sizeof(*template_header); offset < len;) {
-        tmplh = reinterpret_cast<struct NF10_TEMPLATE_FLOWSET_HEADER *>(pkt + offset);
-
-        template_id = be16toh(tmplh->template_id);
-        count = be16toh(tmplh->count);
-        offset += sizeof(*tmplh);
-
-        total_size = 0;
-        std::vector<peer_nf10_record> template_recs;
-        for (i = 0; i < count; i++) {
-            if (offset >= len) {
-                break;
-            }
-
-            tmplr = reinterpret_cast<struct NF10_TEMPLATE_FLOWSET_RECORD *>(pkt + offset);
-            uint32_t rec_length = be16toh(tmplr->length);
-            uint32_t rec_type = be16toh(tmplr->type);
-
-            peer_nf10_record recs(rec_type, rec_length);
-            offset += sizeof(*tmplr);
-            template_recs.push_back(recs);
-            total_size += rec_length;
-        }
-        nf10_template.template_id = template_id;
-        nf10_template.source_id = source_id;
-        nf10_template.num_records = count;
-        nf10_template.records = template_recs;
-        nf10_template.num_records = i;
-        nf10_template.total_len = total_size;
-
-        nf10_template_map[NfMapID(source_id, template_id)] = nf10_template;
-    }
-
-    return true;
-}
-
-static bool process_netflow_v10(NFSample *sample)
+static bool process_netflow_v10(NFSample *sample, NetflowTemplateCache &templates, const IpKey &exporter, std::time_t now)
 {
     struct NF10_HEADER *nf10_hdr = reinterpret_cast<struct NF10_HEADER *>(sample->raw_sample);
 
@@ -627,10 +696,11 @@ static bool process_netflow_v10(NFSample *sample)
     sample->flow_sequence = be32toh(nf10_hdr->package_sequence);
     sample->source_id = be32toh(nf10_hdr->source_id);
 
+    NetflowTemplateKey key{exporter, sample->source_id, sample->version, 0};
+
     offset = sizeof(*nf10_hdr);
     total_flows = 0;
 
-    std::vector<NFSample::Flows> flows;
     for (i = 0;; i++) {
         /* Make sure we don't run off the end of the flow */
         if (offset >= sample->raw_sample_len) {
@@ -648,7 +718,7 @@ static bool process_netflow_v10(NFSample *sample)
 
         switch (flowset_id) {
         case NF10_TEMPLATE_FLOWSET_ID:
-            if (!process_netflow_v10_template(sample->raw_sample + offset, flowset_len, sample->source_id)) {
+            if (!process_netflow_template(sample->raw_sample + offset, flowset_len, key, true, templates, now)) {
                 return false;
             }
             break;
@@ -660,7 +730,7 @@ static bool process_netflow_v10(NFSample *sample)
                 /* XXX ratelimit */
                 break;
             }
-            if (!process_netflow_v10_data(&flows, sample->raw_sample + offset, flowset_len, sample->source_id, &flowset_flows)) {
+            if (!process_netflow_data(&sample->flows, sample->raw_sample + offset, flowset_len, key, templates, now, &flowset_flows)) {
                 return false;
             }
             total_flows += flowset_flows;
@@ -672,18 +742,27 @@ static bool process_netflow_v10(NFSample *sample)
         /* XXX check header->count against what we got */
     }
 
-    sample->flows = flows;
-
     if (total_flows > 0) {
         return true;
     }
     return false;
 }
 
-static bool process_netflow_packet(NFSample *sample)
+/**
+ * Decode sample->raw_sample, appending its flows to sample->flows: a reused sample has to be reset() first
+ * @param templates the NetFlow v9/IPFIX templates of the input receiving the packet
+ * @param exporter the address the packet was received from
+ * @param now current time in seconds, for template expiry
+ */
+static bool process_netflow_packet(NFSample *sample, NetflowTemplateCache &templates, const IpKey &exporter, std::time_t now)
 {
     struct NF_HEADER_COMMON *hdr = reinterpret_cast<struct NF_HEADER_COMMON *>(sample->raw_sample);
 
+    if (sample->raw_sample_len < sizeof(*hdr)) {
+        return false;
+    }
+
+    sample->exporter = exporter;
     sample->version = be16toh(hdr->version);
     sample->nflows = be16toh(hdr->flows);
 
@@ -695,11 +774,11 @@ static bool process_netflow_packet(NFSample *sample)
     case 7:
         return process_netflow_v7(sample);
     case 9:
-        return process_netflow_v9(sample);
+        return process_netflow_v9(sample, templates, exporter, now);
     case 10:
-        return process_netflow_v10(sample);
+        return process_netflow_v10(sample, templates, exporter, now);
     default:
         return false;
     }
 }
-}
\ No newline at end of file
+}
@@ -12,6 +12,7 @@
 #include <netinet/in.h>
 #include <sflow.h>
 #include <sflow_v2v4.h>
+#include <vector>
 
 #define IPX_HDR_LEN 30
 #define IPX_MAX_DATA 546
@@ -201,6 +202,17 @@ struct SFSample {
     } s;
 
     std::vector<Element> elements;
+
+    /**
+     * Clear every field for the next datagram, keeping the capacity of elements so a reused sample stops allocating
+     */
+    void reset()
+    {
+        auto kept = std::move(elements);
+        kept.clear();
+        *this = SFSample{};
+        elements = std::move(kept);
+    }
 };
 
 inline static uint32_t getData32_nobswap(SFSample *sample)
@@ -1,8 +1,28 @@
 #include "FlowInputStream.h"
+#include "tests/AllocCounter.h"
+#include <PcapFileDevice.h>
+#include <UdpLayer.h>
 #include <catch2/catch.hpp>
 
 using namespace visor::input::flow;
 
+static std::vector<std::vector<uint8_t>> udp_payloads(const std::string &file)
+{
+    std::vector<std::vector<uint8_t>> payloads;
+    auto reader = pcpp::IFileReaderDevice::getReader(file);
+    reader->open();
+    pcpp::RawPacket raw_packet;
+    while (reader->getNextPacket(raw_packet)) {
+        pcpp::Packet packet(&raw_packet);
+        if (auto udp = packet.getLayerOfType<pcpp::UdpLayer>(); udp) {
+            payloads.emplace_back(udp->getLayerPayload(), udp->getLayerPayload() + udp->getLayerPayloadSize());
+        }
+    }
+    reader->close();
+    delete reader;
+    return payloads;
+}
+
 TEST_CASE("sflow pcap file", "[flow][sflow][file]")
 {
 
@@ -37,9 +57,202 @@ TEST_CASE("netflow pcap file", "[flow][netflow][file]")
     nlohmann::json j;
     stream.info_json(j);
     CHECK(j["flow"]["packet_errors"] == 0);
+    CHECK(j["flow"]["templates"] == 1);
+    CHECK(j["flow"]["template_misses"] == 1);
     CHECK(j["module"]["config"]["pcap_file"] == "tests/fixtures/nf9.pcap");
 }
 
+static void put16(std::vector<uint8_t> &pkt, uint16_t value)
+{
+    pkt.push_back(value >> 8);
+    pkt.push_back(value & 0xff);
+}
+
+static void put32(std::vector<uint8_t> &pkt, uint32_t value)
+{
+    put16(pkt, value >> 16);
+    put16(pkt, value & 0xffff);
+}
+
+// NetFlow v9 packet, with a template flowset for template 256 if with_template, and a data flowset of two records
+static std::vector<uint8_t> nf9_packet(bool with_template)
+{
+    std::vector<uint8_t> pkt;
+    put16(pkt, 9);
+    put16(pkt, with_template ? 3 : 2);
+    put32(pkt, 0);
+    put32(pkt, 0);
+    put32(pkt, 1);
+    put32(pkt, 42); // source_id
+    if (with_template) {
+        put16(pkt, NF9_TEMPLATE_FLOWSET_ID);
+        put16(pkt, 4 + 4 + 5 * 4);
+        put16(pkt, 256);
+        put16(pkt, 5);
+        put16(pkt, NF9_IPV4_SRC_ADDR);
+        put16(pkt, 4);
+        put16(pkt, NF9_IPV4_DST_ADDR);
+        put16(pkt, 4);
+        put16(pkt, NF9_ENGINE_ID); // not decoded
+        put16(pkt, 1);
+        put16(pkt, NF9_L4_DST_PORT);
+        put16(pkt, 2);
+        put16(pkt, NF9_IN_BYTES);
+        put16(pkt, 4);
+    }
+    put16(pkt, 256);
+    put16(pkt, 4 + 2 * 15);
+    for (uint32_t i = 0; i < 2; ++i) {
+        put32(pkt, 0x0a000001 + i);
+        put32(pkt, 0x0a000101);
+        pkt.push_back(7);
+        put16(pkt, 53);
+        put32(pkt, 1000 * (i + 1));
+    }
+    return pkt;
+}
+
+static bool parse_netflow(std::vector<uint8_t> pkt, NFSample &sample, NetflowTemplateCache &templates, const visor::IpKey &exporter, std::time_t now)
+{
+    sample = NFSample{};
+    sample.raw_sample = pkt.data();
+    sample.raw_sample_len = pkt.size();
+    return process_netflow_packet(&sample, templates, exporter, now);
+}
+
+TEST_CASE("netflow template cache", "[flow][netflow]")
+{
+    NetflowTemplateCache templates(60);
+    auto exporter = visor::IpKey::from_ipv4(htonl(0xc0a80001));
+    NFSample sample;
+
+    SECTION("Templates decode data")
+    {
+        CHECK(parse_netflow(nf9_packet(true), sample, templates, exporter, 1000));
+        CHECK(templates.size() == 1);
+        REQUIRE(sample.flows.size() == 2);
+        CHECK(sample.flows[0].src_ip == htonl(0x0a000001));
+        CHECK(sample.flows[1].src_ip == htonl(0x0a000002));
+        CHECK(sample.flows[0].dst_ip == htonl(0x0a000101));
+        CHECK(sample.flows[0].dst_port == 53);
+        CHECK(sample.flows[1].flow_octets == 2000);
+        CHECK(sample.source_id == 42);
+
+        CHECK(parse_netflow(nf9_packet(false), sample, templates, exporter, 1010));
+        CHECK(sample.flows.size() == 2);
+        CHECK(templates.misses() == 0);
+    }
+
+    SECTION("Templates are scoped to their exporter")
+    {
+        CHECK(parse_netflow(nf9_packet(true), sample, templates, exporter, 1000));
+        CHECK_FALSE(parse_netflow(nf9_packet(false), sample, templates, visor::IpKey::from_ipv4(htonl(0xc0a80002)), 1000));
+        CHECK(templates.misses() == 1);
+    }
+
+    SECTION("Templates expire")
+    {
+        CHECK(parse_netflow(nf9_packet(true), sample, templates, exporter, 1000));
+        CHECK(templates.expire(1060) == 0);
+        CHECK_FALSE(parse_netflow(nf9_packet(false), sample, templates, exporter, 1061));
+        CHECK(templates.misses() == 1);
+        CHECK(templates.expire(1061) == 1);
+        CHECK(templates.size() == 0);
+        CHECK(templates.expired() == 1);
+        // a refreshed template decodes again
+        CHECK(parse_netflow(nf9_packet(true), sample, templates, exporter, 1100));
+        CHECK(sample.flows.size() == 2);
+    }
+
+    SECTION("IPv6 addresses")
+    {
+        std::vector<uint8_t> pkt;
+        put16(pkt, 9);
+        put16(pkt, 2);
+        put32(pkt, 0);
+        put32(pkt, 0);
+        put32(pkt, 1);
+        put32(pkt, 42);
+        put16(pkt, NF9_TEMPLATE_FLOWSET_ID);
+        put16(pkt, 4 + 4 + 2 * 4);
+        put16(pkt, 257);
+        put16(pkt, 2);
+        put16(pkt, NF9_IPV6_SRC_ADDR);
+        put16(pkt, 16);
+        put16(pkt, NF9_IPV6_DST_ADDR);
+        put16(pkt, 16);
+        put16(pkt, 257);
+        put16(pkt, 4 + 32);
+        for (uint8_t i = 0; i < 32; ++i) {
+            pkt.push_back(i);
+        }
+
+        CHECK(parse_netflow(pkt, sample, templates, exporter, 1000));
+        REQUIRE(sample.flows.size() == 1);
+        CHECK(sample.flows[0].is_ipv6);
+        CHECK(sample.flows[0].src_ip6[0] == 0);
+        CHECK(sample.flows[0].src_ip6[15] == 15);
+        CHECK(sample.flows[0].dst_ip6[0] == 16);
+        CHECK(sample.flows[0].dst_ip6[15] == 31);
+    }
+}
+
+TEST_CASE("flow decoding reuses samples", "[flow][sflow][netflow]")
+{
+    SECTION("sflow")
+    {
+        auto datagrams = udp_payloads("tests/fixtures/ecmp.pcap");
+        REQUIRE(!datagrams.empty());
+        SFSample sample;
+        auto decode = [&sample](std::vector<uint8_t> &datagram) {
+            sample.reset();
+            sample.rawSample = datagram.data();
+            sample.rawSampleLen = datagram.size();
+            read_sflow_datagram(&sample);
+        };
+        for (auto &datagram : datagrams) {
+            CHECK_NOTHROW(decode(datagram));
+        }
+        auto allocations = alloc_count;
+        size_t elements{0};
+        for (auto &datagram : datagrams) {
+            decode(datagram);
+            elements += sample.elements.size();
+        }
+        CHECK(alloc_count == allocations);
+        CHECK(elements > 0);
+    }
+
+    SECTION("netflow")
+    {
+        auto datagrams = udp_payloads("tests/fixtures/nf9.pcap");
+        REQUIRE(!datagrams.empty());
+        NetflowTemplateCache templates;
+        auto exporter = visor::IpKey::from_ipv4(htonl(0xc0a80001));
+        NFSample sample;
+        auto decode = [&](std::vector<uint8_t> &datagram) {
+            sample.reset();
+            sample.raw_sample = datagram.data();
+            sample.raw_sample_len = datagram.size();
+            return process_netflow_packet(&sample, templates, exporter, 1000);
+        };
+        // the first pass learns the templates, the second one decodes every flow
+        for (int pass = 0; pass < 2; ++pass) {
+            for (auto &datagram : datagrams) {
+                decode(datagram);
+            }
+        }
+        auto allocations = alloc_count;
+        size_t flows{0};
+        for (auto &datagram : datagrams) {
+            decode(datagram);
+            flows += sample.flows.size();
+        }
+        CHECK(alloc_count == allocations);
+        CHECK(flows > 0);
+    }
+}
+
 TEST_CASE("sflow udp socket", "[sflow][udp]")
 {
 
@@ -102,6 +315,57 @@ TEST_CASE("netflow udp socket", "[netflow][udp]")
     CHECK(j["flow"]["packet_errors"] == 1);
 }
 
+#ifdef __linux__
+TEST_CASE("netflow udp socket workers", "[netflow][udp]")
+{
+
+    std::string bind = "127.0.0.1";
+    uint64_t port = 6345;
+
+    FlowInputStream stream{"netflow-test"};
+    stream.config_set("flow_type", "netflow");
+    stream.config_set("bind", bind);
+    stream.config_set("port", port);
+    stream.config_set("workers", uint64_t{2});
+
+    CHECK_NOTHROW(stream.start());
+
+    // each client gets its own source port, so the kernel spreads them over the workers
+    auto loop = uvw::Loop::getDefault();
+    auto dataSend = std::unique_ptr<char[]>(new char[2]{'b', 'c'});
+    for (int i = 0; i < 8; ++i) {
+        auto client = loop->resource<uvw::UDPHandle>();
+        client->once<uvw::SendEvent>([](const uvw::SendEvent &, uvw::UDPHandle &handle) {
+            handle.close();
+        });
+        client->send(uvw::Addr{bind, static_cast<unsigned int>(port)}, dataSend.get(), 2);
+    }
+    loop->run();
+
+    uv_sleep(100);
+
+    CHECK_NOTHROW(stream.stop());
+
+    nlohmann::json j;
+    stream.info_json(j);
+    CHECK(j["flow"]["packet_errors"] == 8);
+    REQUIRE(j["flow"]["worker_packets"].size() == 2);
+    CHECK(j["flow"]["worker_packets"][0].get<uint64_t>() + j["flow"]["worker_packets"][1].get<uint64_t>() == 8);
+    CHECK(j["flow"]["socket_drops"] == 0);
+}
+#endif
+
+TEST_CASE("flow udp socket with no workers", "[flow][udp]")
+{
+    FlowInputStream stream{"netflow-test"};
+    stream.config_set("flow_type", "netflow");
+    stream.config_set("bind", "127.0.0.1");
+    stream.config_set("port", uint64_t{6346});
+    stream.config_set("workers", uint64_t{0});
+
+    CHECK_THROWS_WITH(stream.start(), "workers must be at least 1");
+}
+
 TEST_CASE("sflow udp socket without bind", "[flow][sflow][udp]")
 {
     FlowInputStream stream{"sflow-test"};
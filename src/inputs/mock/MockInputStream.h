@@ -49,6 +49,7 @@ public:
 
     void random_int_cb(uint64_t value)
     {
+        CpuScope scope(_cpu_account);
         random_int_signal(value);
     }
 
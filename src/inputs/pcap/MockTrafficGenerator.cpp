@@ -0,0 +1,373 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "MockTrafficGenerator.h"
+#include <algorithm>
+#include <cmath>
+
+namespace visor::input::pcap {
+
+namespace {
+
+constexpr size_t ETH_SIZE = 14;
+constexpr size_t IPV4_SIZE = 20;
+constexpr size_t UDP_SIZE = 8;
+constexpr size_t TCP_SIZE = 20;
+constexpr size_t HTTPS_PAYLOAD = 512;
+
+constexpr uint8_t PROTO_TCP = 6;
+constexpr uint8_t PROTO_UDP = 17;
+constexpr uint8_t TCP_FIN = 0x01;
+constexpr uint8_t TCP_PSH = 0x08;
+constexpr uint8_t TCP_ACK = 0x10;
+
+constexpr std::array<uint8_t, 6> SERVER_MAC{0x00, 0x50, 0x43, 0x11, 0x22, 0x33};
+constexpr std::array<uint8_t, 6> CLIENT_MAC{0x00, 0x50, 0x43, 0xaa, 0xbb, 0xcc};
+constexpr std::array<uint8_t, 4> SERVER_IPV4{192, 168, 0, 1};
+// clients are 10.0.x.y, the last two bytes are the client number
+constexpr std::array<uint8_t, 4> CLIENT_IPV4{10, 0, 0, 0};
+constexpr std::array<uint8_t, 16> SERVER_IPV6{0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x53};
+// clients are fd00::x:y
+constexpr std::array<uint8_t, 16> CLIENT_IPV6{0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+constexpr size_t NAMES = 10000;
+constexpr size_t CLIENTS = 4096;
+// "h" followed by the name number
+constexpr size_t LABEL_DIGITS = 5;
+
+constexpr std::array<const char *, 4> ZONES{"pktvisor-mock.dev", "example.com", "example.net", "service.example.org"};
+constexpr std::array<unsigned, ZONES.size()> ZONE_WEIGHTS{40, 30, 20, 10};
+// A, AAAA, PTR, TXT, MX
+constexpr std::array<uint16_t, 5> QTYPES{1, 28, 12, 16, 15};
+constexpr std::array<unsigned, QTYPES.size()> QTYPE_WEIGHTS{60, 25, 7, 5, 3};
+// NOERROR, NXDOMAIN, SERVFAIL, REFUSED in per mille
+constexpr std::array<uint8_t, 4> RCODES{0, 3, 2, 5};
+constexpr std::array<unsigned, RCODES.size()> RCODE_WEIGHTS{900, 80, 15, 5};
+// per mille of the queries never answered
+constexpr unsigned UNANSWERED = 10;
+
+template <size_t N>
+size_t weighted(const std::array<unsigned, N> &weights, unsigned roll)
+{
+    for (size_t i = 0; i < N; ++i) {
+        if (roll < weights[i]) {
+            return i;
+        }
+        roll -= weights[i];
+    }
+    return N - 1;
+}
+
+void put16(uint8_t *p, uint16_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 8);
+    p[1] = static_cast<uint8_t>(value);
+}
+
+void put32(uint8_t *p, uint32_t value)
+{
+    put16(p, static_cast<uint16_t>(value >> 16));
+    put16(p + 2, static_cast<uint16_t>(value));
+}
+
+uint32_t sum16(const uint8_t *p, size_t size, uint32_t sum = 0)
+{
+    for (; size > 1; p += 2, size -= 2) {
+        sum += static_cast<uint32_t>(p[0] << 8 | p[1]);
+    }
+    if (size) {
+        sum += static_cast<uint32_t>(p[0] << 8);
+    }
+    return sum;
+}
+
+uint16_t fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return static_cast<uint16_t>(~sum);
+}
+
+void append(std::vector<uint8_t> &bytes, std::initializer_list<uint8_t> values)
+{
+    bytes.insert(bytes.end(), values);
+}
+
+template <size_t N>
+void append(std::vector<uint8_t> &bytes, const std::array<uint8_t, N> &values)
+{
+    bytes.insert(bytes.end(), values.begin(), values.end());
+}
+
+void append_name(std::vector<uint8_t> &bytes, const std::string &name)
+{
+    size_t start = 0;
+    while (start < name.size()) {
+        auto end = std::min(name.find('.', start), name.size());
+        bytes.push_back(static_cast<uint8_t>(end - start));
+        bytes.insert(bytes.end(), name.begin() + static_cast<std::ptrdiff_t>(start), name.begin() + static_cast<std::ptrdiff_t>(end));
+        start = end + 1;
+    }
+    bytes.push_back(0);
+}
+
+// ethernet and IP headers, the lengths are set by finish_headers()
+void append_headers(std::vector<uint8_t> &bytes, bool ipv6, bool from_server, uint8_t protocol, size_t &client_ip)
+{
+    append(bytes, from_server ? CLIENT_MAC : SERVER_MAC);
+    append(bytes, from_server ? SERVER_MAC : CLIENT_MAC);
+    if (ipv6) {
+        append(bytes, {0x86, 0xdd});
+        append(bytes, {0x60, 0, 0, 0, 0, 0, protocol, 64});
+        client_ip = bytes.size() + (from_server ? 16 : 0);
+        append(bytes, from_server ? SERVER_IPV6 : CLIENT_IPV6);
+        append(bytes, from_server ? CLIENT_IPV6 : SERVER_IPV6);
+    } else {
+        append(bytes, {0x08, 0x00});
+        // DF, TTL 64
+        append(bytes, {0x45, 0, 0, 0, 0, 0, 0x40, 0, 64, protocol, 0, 0});
+        client_ip = bytes.size() + (from_server ? 4 : 0);
+        append(bytes, from_server ? SERVER_IPV4 : CLIENT_IPV4);
+        append(bytes, from_server ? CLIENT_IPV4 : SERVER_IPV4);
+    }
+}
+
+// UDP or TCP header, returns the offset of the client port
+size_t append_l4(std::vector<uint8_t> &bytes, bool tcp, bool from_server, uint16_t server_port, uint8_t tcp_flags)
+{
+    auto l4 = bytes.size();
+    bytes.resize(l4 + (tcp ? TCP_SIZE : UDP_SIZE));
+    put16(&bytes[l4 + (from_server ? 0 : 2)], server_port);
+    if (tcp) {
+        bytes[l4 + 12] = (TCP_SIZE / 4) << 4;
+        bytes[l4 + 13] = tcp_flags;
+        put16(&bytes[l4 + 14], 65535);
+    }
+    return l4 + (from_server ? 2 : 0);
+}
+
+void finish_headers(std::vector<uint8_t> &bytes, bool ipv6, bool tcp, size_t l4)
+{
+    if (ipv6) {
+        put16(&bytes[ETH_SIZE + 4], static_cast<uint16_t>(bytes.size() - l4));
+    } else {
+        put16(&bytes[ETH_SIZE + 2], static_cast<uint16_t>(bytes.size() - ETH_SIZE));
+    }
+    if (!tcp) {
+        put16(&bytes[l4 + 4], static_cast<uint16_t>(bytes.size() - l4));
+    }
+}
+
+}
+
+MockTrafficGenerator::Zipf::Zipf(size_t n, double s)
+    : _cdf(n)
+{
+    double sum{0};
+    for (size_t i = 0; i < n; ++i) {
+        sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+        _cdf[i] = sum;
+    }
+    for (auto &p : _cdf) {
+        p /= sum;
+    }
+}
+
+size_t MockTrafficGenerator::Zipf::operator()(std::mt19937_64 &rng) const
+{
+    std::uniform_real_distribution<double> uniform;
+    auto it = std::upper_bound(_cdf.begin(), _cdf.end(), uniform(rng));
+    return std::min(static_cast<size_t>(it - _cdf.begin()), _cdf.size() - 1);
+}
+
+size_t MockTrafficGenerator::_dns_template(bool ipv6, bool tcp, Kind kind, size_t zone, size_t qtype)
+{
+    return (((static_cast<size_t>(ipv6) * 2 + static_cast<size_t>(tcp)) * KINDS_SIZE + kind) * ZONES.size() + zone) * QTYPES.size() + qtype;
+}
+
+MockTrafficGenerator::Template MockTrafficGenerator::_build_dns(bool ipv6, bool tcp, Kind kind, const std::string &zone, uint16_t qtype)
+{
+    Template t;
+    t.ipv6 = ipv6;
+    t.tcp = tcp;
+    auto &bytes = t.bytes;
+    bool from_server = (kind != Query);
+
+    append_headers(bytes, ipv6, from_server, tcp ? PROTO_TCP : PROTO_UDP, t.client_ip);
+    t.l4 = bytes.size();
+    // one segment each way, which also closes the connection
+    t.client_port = append_l4(bytes, tcp, from_server, 53, TCP_PSH | TCP_ACK | TCP_FIN);
+    size_t length_prefix = bytes.size();
+    if (tcp) {
+        append(bytes, {0, 0});
+    }
+
+    t.dns = bytes.size();
+    // RD, and QR RA in responses
+    append(bytes, {0, 0, static_cast<uint8_t>(from_server ? 0x81 : 0x01), static_cast<uint8_t>(from_server ? 0x80 : 0x00)});
+    append(bytes, {0, 1, 0, static_cast<uint8_t>(kind == Answer), 0, 0, 0, 0});
+    t.label = bytes.size() + 2;
+    append_name(bytes, "h" + std::string(LABEL_DIGITS, '0') + "." + zone);
+    append(bytes, {static_cast<uint8_t>(qtype >> 8), static_cast<uint8_t>(qtype), 0, 1});
+
+    if (kind == Answer) {
+        // the question name, class IN, TTL 300
+        append(bytes, {0xc0, 0x0c, static_cast<uint8_t>(qtype >> 8), static_cast<uint8_t>(qtype), 0, 1, 0, 0, 0x01, 0x2c});
+        std::vector<uint8_t> rdata;
+        switch (qtype) {
+        case 1:
+            append(rdata, {192, 0, 2, 10});
+            break;
+        case 28:
+            append(rdata, {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x10});
+            break;
+        case 15:
+            append(rdata, {0, 10});
+            append_name(rdata, "mail." + zone);
+            break;
+        case 16:
+            append(rdata, {11, 'v', '=', 's', 'p', 'f', '1', ' ', '-', 'a', 'l', 'l'});
+            break;
+        default:
+            append_name(rdata, "host." + zone);
+            break;
+        }
+        append(bytes, {static_cast<uint8_t>(rdata.size() >> 8), static_cast<uint8_t>(rdata.size())});
+        bytes.insert(bytes.end(), rdata.begin(), rdata.end());
+    }
+
+    if (tcp) {
+        put16(&bytes[length_prefix], static_cast<uint16_t>(bytes.size() - t.dns));
+    }
+    finish_headers(bytes, ipv6, tcp, t.l4);
+    return t;
+}
+
+MockTrafficGenerator::Template MockTrafficGenerator::_build_https(bool ipv6, bool from_server)
+{
+    Template t;
+    t.ipv6 = ipv6;
+    t.tcp = true;
+    append_headers(t.bytes, ipv6, from_server, PROTO_TCP, t.client_ip);
+    t.l4 = t.bytes.size();
+    t.client_port = append_l4(t.bytes, true, from_server, 443, TCP_PSH | TCP_ACK);
+    t.bytes.resize(t.bytes.size() + HTTPS_PAYLOAD, 0x17);
+    finish_headers(t.bytes, ipv6, true, t.l4);
+    return t;
+}
+
+MockTrafficGenerator::MockTrafficGenerator(const Config &config)
+    : _config(config)
+    , _rng(config.seed ? config.seed : std::random_device{}())
+    , _names(NAMES, 1.0)
+    , _clients(CLIENTS, 0.8)
+{
+    _pending.reserve(1024);
+    _dns.resize(_dns_template(true, true, static_cast<Kind>(KINDS_SIZE - 1), ZONES.size() - 1, QTYPES.size() - 1) + 1);
+    for (bool ipv6 : {false, true}) {
+        for (bool tcp : {false, true}) {
+            for (auto kind : {Query, Answer, Empty}) {
+                for (size_t zone = 0; zone < ZONES.size(); ++zone) {
+                    for (size_t qtype = 0; qtype < QTYPES.size(); ++qtype) {
+                        _dns[_dns_template(ipv6, tcp, kind, zone, qtype)] = _build_dns(ipv6, tcp, kind, ZONES[zone], QTYPES[qtype]);
+                    }
+                }
+            }
+        }
+        for (bool from_server : {false, true}) {
+            _https[ipv6][from_server] = _build_https(ipv6, from_server);
+        }
+    }
+}
+
+MockTrafficGenerator::Packet MockTrafficGenerator::_emit(Template &t, uint16_t client, uint16_t client_port)
+{
+    auto bytes = t.bytes.data();
+    auto address_size = t.ipv6 ? 16 : 4;
+    put16(bytes + t.client_ip + address_size - 2, client);
+    put16(bytes + t.client_port, client_port);
+    if (t.tcp) {
+        _tcp_seq += 1000;
+        put32(bytes + t.l4 + 4, _tcp_seq);
+    }
+
+    if (!t.ipv6) {
+        put16(bytes + ETH_SIZE + 10, 0);
+        put16(bytes + ETH_SIZE + 10, fold(sum16(bytes + ETH_SIZE, IPV4_SIZE)));
+    }
+    // the UDP checksum is optional over IPv4
+    if (t.tcp || t.ipv6) {
+        auto checksum = t.l4 + (t.tcp ? 16 : 6);
+        auto l4_size = t.bytes.size() - t.l4;
+        put16(bytes + checksum, 0);
+        // pseudo header: addresses, protocol, length
+        auto addresses = t.ipv6 ? ETH_SIZE + 8 : ETH_SIZE + 12;
+        uint32_t sum = sum16(bytes + addresses, 2 * static_cast<size_t>(address_size));
+        sum += t.tcp ? PROTO_TCP : PROTO_UDP;
+        sum += static_cast<uint32_t>(l4_size);
+        auto result = fold(sum16(bytes + t.l4, l4_size, sum));
+        put16(bytes + checksum, (!t.tcp && !result) ? 0xffff : result);
+    }
+    return {bytes, t.bytes.size()};
+}
+
+MockTrafficGenerator::Packet MockTrafficGenerator::next(const timespec &now)
+{
+    auto now_ns = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+
+    auto write_dns = [](Template &t, uint16_t id, uint16_t name) {
+        put16(&t.bytes[t.dns], id);
+        for (size_t i = LABEL_DIGITS, n = name; i > 0; --i, n /= 10) {
+            t.bytes[t.label + i - 1] = static_cast<uint8_t>('0' + n % 10);
+        }
+    };
+
+    auto later = [](const Pending &a, const Pending &b) { return a.due > b.due; };
+
+    if (!_pending.empty() && _pending.front().due <= now_ns) {
+        std::pop_heap(_pending.begin(), _pending.end(), later);
+        auto pending = _pending.back();
+        _pending.pop_back();
+        auto &t = _dns[pending.dns_template];
+        write_dns(t, pending.id, pending.name);
+        t.bytes[t.dns + 3] = static_cast<uint8_t>((t.bytes[t.dns + 3] & 0xf0) | pending.rcode);
+        return _emit(t, pending.client, pending.client_port);
+    }
+
+    std::uniform_int_distribution<unsigned> percent(0, 99);
+    std::uniform_int_distribution<unsigned> per_mille(0, 999);
+    std::uniform_int_distribution<uint16_t> port(1024, 65535);
+
+    if (percent(_rng) >= _config.dns_percent) {
+        bool ipv6 = percent(_rng) < _config.ipv6_percent;
+        bool from_server = _rng() & 1;
+        return _emit(_https[ipv6][from_server], static_cast<uint16_t>(_clients(_rng)), port(_rng));
+    }
+
+    bool ipv6 = percent(_rng) < _config.ipv6_percent;
+    bool tcp = percent(_rng) < _config.tcp_percent;
+    auto zone = weighted(ZONE_WEIGHTS, percent(_rng));
+    auto qtype = weighted(QTYPE_WEIGHTS, percent(_rng));
+    auto name = static_cast<uint16_t>(_names(_rng));
+    auto client = static_cast<uint16_t>(_clients(_rng));
+    auto client_port = port(_rng);
+    auto id = static_cast<uint16_t>(_rng());
+
+    if (per_mille(_rng) >= UNANSWERED) {
+        auto rcode = RCODES[weighted(RCODE_WEIGHTS, per_mille(_rng))];
+        // mostly answered from cache, the rest recursing
+        int64_t latency = (percent(_rng) < 70) ? std::uniform_int_distribution<int64_t>(200000, 2000000)(_rng)
+                                               : std::uniform_int_distribution<int64_t>(10000000, 80000000)(_rng);
+        auto response = _dns_template(ipv6, tcp, rcode ? Empty : Answer, zone, qtype);
+        _pending.push_back(Pending{now_ns + latency, static_cast<uint32_t>(response), client, client_port, id, name, rcode});
+        std::push_heap(_pending.begin(), _pending.end(), later);
+    }
+
+    auto &t = _dns[_dns_template(ipv6, tcp, Query, zone, qtype)];
+    write_dns(t, id, name);
+    return _emit(t, client, client_port);
+}
+
+}
@@ -0,0 +1,125 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace visor::input::pcap {
+
+/**
+ * Synthetic ethernet traffic for the "mock" source: DNS transactions over UDP and TCP, IPv4 and IPv6, between a pool of
+ * clients and one server, along with some HTTPS segments.
+ *
+ * Every kind of packet is built once as a template, next() only writes the fields which vary (addresses, ports, ids,
+ * the first label of the qname, the rcode) into a template and fixes up its checksums, so it does not allocate.
+ * Responses follow their query after a simulated server latency and match it, so transactions can be tracked. Names
+ * and clients are picked with a Zipf distribution, query types and response codes with fixed weights.
+ *
+ * Not thread safe, the mock source drives it from its own thread.
+ */
+class MockTrafficGenerator
+{
+public:
+    // the addresses of the server, to use as host_spec
+    static constexpr char HOST_SPEC[] = "192.168.0.1/32,2001:db8::53/128";
+
+    struct Config {
+        // percent of the DNS transactions over IPv6 (the rest over IPv4)
+        unsigned ipv6_percent{20};
+        // percent of the DNS transactions over TCP (the rest over UDP)
+        unsigned tcp_percent{5};
+        // percent of the new packets which start a DNS transaction (the rest are HTTPS segments)
+        unsigned dns_percent{90};
+        uint64_t seed{0};
+    };
+
+    struct Packet {
+        const uint8_t *data;
+        size_t size;
+    };
+
+private:
+    enum Kind : uint8_t {
+        Query,
+        Answer,
+        // responses with an error rcode do not carry an answer
+        Empty,
+        KINDS_SIZE
+    };
+
+    struct Template {
+        std::vector<uint8_t> bytes;
+        bool ipv6;
+        bool tcp;
+        size_t l4;
+        // offsets of the fields next() writes
+        size_t client_ip;
+        size_t client_port;
+        size_t dns{0};
+        size_t label{0};
+    };
+
+    // a query waiting for its response
+    struct Pending {
+        int64_t due;
+        uint32_t dns_template;
+        uint16_t client;
+        uint16_t client_port;
+        uint16_t id;
+        uint16_t name;
+        uint8_t rcode;
+    };
+
+    class Zipf
+    {
+        std::vector<double> _cdf;
+
+    public:
+        Zipf(size_t n, double s);
+        size_t operator()(std::mt19937_64 &rng) const;
+    };
+
+    Config _config;
+    std::mt19937_64 _rng;
+    Zipf _names;
+    Zipf _clients;
+
+    // DNS templates, see _dns_template()
+    std::vector<Template> _dns;
+    // HTTPS templates, by [ipv6][from server]
+    std::array<std::array<Template, 2>, 2> _https;
+
+    // queries waiting for their response, a heap with the earliest due on top
+    std::vector<Pending> _pending;
+
+    uint32_t _tcp_seq{0};
+
+    static size_t _dns_template(bool ipv6, bool tcp, Kind kind, size_t zone, size_t qtype);
+    static Template _build_dns(bool ipv6, bool tcp, Kind kind, const std::string &zone, uint16_t qtype);
+    static Template _build_https(bool ipv6, bool from_server);
+
+    Packet _emit(Template &t, uint16_t client, uint16_t client_port);
+
+public:
+    MockTrafficGenerator(const Config &config);
+
+    /**
+     * @param now time stamp of the packet, paces the responses
+     * @return the next packet, valid until the next call
+     */
+    Packet next(const timespec &now);
+
+    size_t pending() const
+    {
+        return _pending.size();
+    }
+};
+
+}
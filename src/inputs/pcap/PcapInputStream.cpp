@@ -10,22 +10,23 @@
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #pragma clang diagnostic ignored "-Wc99-extensions"
 #pragma GCC diagnostic ignored "-Wpedantic"
-#include <DnsLayer.h> // used only for mock generator
-#include <EthLayer.h>
 #include <IPv4Layer.h>
 #include <IPv6Layer.h>
 #include <Logger.h>
 #include <PacketUtils.h>
 #include <PcapFileDevice.h>
 #include <SystemUtils.h>
+#include <TcpLayer.h>
 #pragma GCC diagnostic pop
 #include <IpUtils.h>
+#include <algorithm>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <cstdint>
 #include <cstring>
 #include <netinet/in.h>
 #include <sstream>
+#include <unistd.h>
 
 using namespace std::chrono;
 
@@ -87,13 +88,25 @@ void PcapInputStream::start()
         return;
     }
 
+    if (config_exists("tcp_timeout")) {
+        _tcp_timers = TcpTimerWheel(config_get<uint64_t>("tcp_timeout"));
+    }
+
+    {
+        // handlers attached before the start
+        std::shared_lock lock(_input_mutex);
+        for (auto &proxy : _event_proxies) {
+            static_cast<PcapInputEventProxy *>(proxy.get())->refresh_tcp_consumers();
+        }
+    }
+
     if (config_exists("pcap_file")) {
         // read from pcap file. this is a special case from a command line utility
         assert(config_exists("bpf"));
         _pcapFile = true;
         // note, parse_host_spec should be called manually by now (in CLI)
         _running = true;
-        _open_pcap(config_get<std::string>("pcap_file"), config_get<std::string>("bpf"));
+        _open_pcap(config_get<std::string>("pcap_file"), _capture_filter());
         return;
     }
 
@@ -138,6 +151,10 @@ void PcapInputStream::start()
     }
     std::string ifNameList = _get_interface_list();
 
+    // held until _running, handlers declaring what they want meanwhile rebuild the filter right after
+    std::unique_lock filter_lock(_filter_mutex);
+    _active_filter = (_cur_pcap_source == PcapSource::mock) ? std::string() : _capture_filter();
+
     if (_cur_pcap_source == PcapSource::libpcap) {
         pcpp::PcapLiveDevice *pcapDevice;
         // extract pcap live device by interface name or IP address
@@ -160,21 +177,44 @@ void PcapInputStream::start()
         _pcapDevice = std::unique_ptr<pcpp::PcapLiveDevice>(pcapDevice->clone());
 
         _get_hosts_from_libpcap_iface();
-        _open_libpcap_iface(config_get<std::string>("bpf"));
+        _open_libpcap_iface(_active_filter);
     } else if (_cur_pcap_source == PcapSource::af_packet) {
 #ifndef __linux__
         assert(true);
 #else
-        _open_af_packet_iface(TARGET, config_get<std::string>("bpf"));
+        _open_af_packet_iface(TARGET, _active_filter);
 #endif
     } else if (_cur_pcap_source == PcapSource::mock) {
-        _mock_generator_thread = std::make_unique<std::thread>([this] {
-            while (_running) {
-                _generate_mock_traffic();
-                // 10 qps. could be configurable in future.
-                std::this_thread::sleep_for(100ms);
+        MockTrafficGenerator::Config mock;
+        auto percent = [this](const std::string &key, unsigned &value) {
+            if (config_exists(key)) {
+                auto config_value = config_get<uint64_t>(key);
+                if (config_value > 100) {
+                    throw PcapException(key + " must be between 0 and 100");
+                }
+                value = static_cast<unsigned>(config_value);
             }
-        });
+        };
+        percent("mock_ipv6_percent", mock.ipv6_percent);
+        percent("mock_tcp_percent", mock.tcp_percent);
+        percent("mock_dns_percent", mock.dns_percent);
+        if (config_exists("mock_seed")) {
+            mock.seed = config_get<uint64_t>("mock_seed");
+        }
+        uint64_t rate = MOCK_RATE;
+        if (config_exists("mock_rate")) {
+            rate = config_get<uint64_t>("mock_rate");
+        }
+        if (!rate) {
+            throw PcapException("mock_rate must be at least 1");
+        }
+        // the mock server is the host, unless host_spec says otherwise
+        if (_hostIPv4.empty() && _hostIPv6.empty()) {
+            parseHostSpec(MockTrafficGenerator::HOST_SPEC, _hostIPv4, _hostIPv6);
+        }
+        // running before the generator thread looks
+        _running = true;
+        _mock_generator_thread = std::make_unique<std::thread>([this, mock, rate] { _generate_mock_traffic(mock, rate); });
     } else {
         assert(true);
     }
@@ -182,6 +222,70 @@ void PcapInputStream::start()
     _running = true;
 }
 
+/**
+ * The "bpf" of the tap, narrowed down to the union of the packets the handlers declared they want (see
+ * PcapInputEventProxy::want_packets()) unless "auto_bpf" is false. Left as is if a handler wants every packet, or no
+ * handler consumes packets at all.
+ */
+std::string PcapInputStream::_capture_filter() const
+{
+    auto bpf = config_exists("bpf") ? config_get<std::string>("bpf") : std::string();
+    if (config_exists("auto_bpf") && !config_get<bool>("auto_bpf")) {
+        return bpf;
+    }
+
+    std::vector<std::string> wanted;
+    {
+        std::shared_lock lock(_input_mutex);
+        for (auto &proxy : _event_proxies) {
+            auto proxy_wanted = static_cast<PcapInputEventProxy *>(proxy.get())->wanted_packets();
+            if (!proxy_wanted) {
+                return bpf;
+            }
+            for (auto &expression : *proxy_wanted) {
+                if (std::find(wanted.begin(), wanted.end(), expression) == wanted.end()) {
+                    wanted.push_back(std::move(expression));
+                }
+            }
+        }
+    }
+    if (wanted.empty()) {
+        return bpf;
+    }
+
+    std::string handlers;
+    for (const auto &expression : wanted) {
+        handlers += (handlers.empty() ? "(" : " or (") + expression + ")";
+    }
+    // VLAN tagged frames only match behind the vlan primitive, which moves the offsets of what follows it
+    handlers = fmt::format("{0} or (vlan and ({0}))", handlers);
+    return bpf.empty() ? handlers : fmt::format("({}) and ({})", bpf, handlers);
+}
+
+void PcapInputStream::_update_capture_filter()
+{
+    std::unique_lock filter_lock(_filter_mutex);
+    // pcap files are filtered once when opened
+    if (!_running || _pcapFile) {
+        return;
+    }
+    auto filter = _capture_filter();
+    if (filter == _active_filter) {
+        return;
+    }
+    if (_cur_pcap_source == PcapSource::libpcap && _pcapDevice) {
+        if (filter.empty() ? !_pcapDevice->clearFilter() : !_pcapDevice->setFilter(filter)) {
+            throw PcapException("Cannot set BPF filter to interface: " + filter);
+        }
+    }
+#ifdef __linux__
+    if (_cur_pcap_source == PcapSource::af_packet && _af_device) {
+        _af_device->set_filter(filter);
+    }
+#endif
+    _active_filter = std::move(filter);
+}
+
 std::string PcapInputStream::_get_interface_list() const
 {
     // gather list of valid interfaces
@@ -203,6 +307,8 @@ void PcapInputStream::stop()
         return;
     }
 
+    std::unique_lock filter_lock(_filter_mutex);
+
     if (!_pcapFile && _pcapDevice) {
         // stop capturing and close the live device
         _pcapDevice->clearFilter();
@@ -216,15 +322,17 @@ void PcapInputStream::stop()
     }
 #endif
 
-    // close all connections which are still opened
-    _tcp_reassembly.closeAllConnections();
-
-    _running = false;
-
     if (_mock_generator_thread) {
+        // the generator feeds the TCP reassembly, so it has to be done first
+        _running = false;
         _mock_generator_thread->join();
         _mock_generator_thread.reset(nullptr);
     }
+
+    // close all connections which are still opened
+    _tcp_reassembly.closeAllConnections();
+
+    _running = false;
 }
 
 void PcapInputStream::tcp_message_ready(int8_t side, const pcpp::TcpStreamData &tcpData)
@@ -233,7 +341,7 @@ void PcapInputStream::tcp_message_ready(int8_t side, const pcpp::TcpStreamData &
     for (auto &proxy : _event_proxies) {
         dynamic_cast<PcapInputEventProxy *>(proxy.get())->tcp_message_ready_cb(side, tcpData);
     }
-    _lru_list.put(tcpData.getConnectionData().flowKey, tcpData.getConnectionData().endTime);
+    _tcp_timers.touch(tcpData.getConnectionData().flowKey, tcpData.getConnectionData().endTime.tv_sec);
 }
 
 void PcapInputStream::tcp_connection_start(const pcpp::ConnectionData &connectionData)
@@ -242,7 +350,7 @@ void PcapInputStream::tcp_connection_start(const pcpp::ConnectionData &connectio
     for (auto &proxy : _event_proxies) {
         dynamic_cast<PcapInputEventProxy *>(proxy.get())->tcp_connection_start_cb(connectionData);
     }
-    _lru_list.put(connectionData.flowKey, connectionData.startTime);
+    _tcp_timers.touch(connectionData.flowKey, connectionData.startTime.tv_sec);
 }
 
 void PcapInputStream::tcp_connection_end(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason)
@@ -251,7 +359,7 @@ void PcapInputStream::tcp_connection_end(const pcpp::ConnectionData &connectionD
     for (auto &proxy : _event_proxies) {
         static_cast<PcapInputEventProxy *>(proxy.get())->tcp_connection_end_cb(connectionData, reason);
     }
-    _lru_list.eraseElement(connectionData.flowKey);
+    _tcp_timers.erase(connectionData.flowKey);
 }
 
 void PcapInputStream::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats)
@@ -260,6 +368,29 @@ void PcapInputStream::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &sta
     for (auto &proxy : _event_proxies) {
         static_cast<PcapInputEventProxy *>(proxy.get())->process_pcap_stats(stats);
     }
+    _heartbeat_tick();
+}
+
+void PcapInputStream::process_ring_stats(const PacketRingStats &stats)
+{
+    {
+        std::unique_lock ring_lock(_ring_stats_mutex);
+        _ring_stats = stats;
+    }
+    std::shared_lock lock(_input_mutex);
+    for (auto &proxy : _event_proxies) {
+        static_cast<PcapInputEventProxy *>(proxy.get())->process_ring_stats(stats);
+    }
+    _heartbeat_tick();
+}
+
+// called once a second along with the statistics of the live sources, with _input_mutex held
+void PcapInputStream::_heartbeat_tick()
+{
+    // picks up handlers which connected to the tcp signals without declaring their ports
+    for (auto &proxy : _event_proxies) {
+        static_cast<PcapInputEventProxy *>(proxy.get())->refresh_tcp_consumers();
+    }
     if (!repeat_counter) {
         // use now()
         timespec stamp;
@@ -275,81 +406,46 @@ void PcapInputStream::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &sta
     }
 }
 
-void PcapInputStream::_generate_mock_traffic()
+void PcapInputStream::_generate_mock_traffic(const MockTrafficGenerator::Config &config, uint64_t rate)
 {
+    MockTrafficGenerator generator(config);
+
+    auto start = steady_clock::now();
+    auto next_heartbeat = start;
+    uint64_t sent{0};
+    while (_running) {
+        auto now = steady_clock::now();
+        // the live sources drive it from their statistics
+        if (now >= next_heartbeat) {
+            std::shared_lock lock(_input_mutex);
+            _heartbeat_tick();
+            next_heartbeat = now + 1s;
+        }
 
-    PacketDirection dir = (std::rand() % 2 == 0) ? PacketDirection::toHost : PacketDirection::fromHost;
-
-    pcpp::MacAddress host_mac("00:50:43:11:22:33");
-    pcpp::IPv4Address host_ip("192.168.0.1");
-
-    pcpp::MacAddress other_mac("aa:bb:cc:dd:" + std::string('a' + std::rand() % 26, 2));
-    pcpp::IPv4Address other_ip("10.0.0." + std::to_string(std::rand() % 255));
-
-    // create a new Ethernet layer
-    pcpp::EthLayer *newEthernetLayer{nullptr};
-    if (dir == PacketDirection::toHost) {
-        newEthernetLayer = new pcpp::EthLayer(other_mac, host_mac);
-    } else {
-        newEthernetLayer = new pcpp::EthLayer(host_mac, other_mac);
-    }
-
-    // create a new IPv4 layer
-    pcpp::IPv4Layer *newIPLayer;
-    if (dir == PacketDirection::toHost) {
-        newIPLayer = new pcpp::IPv4Layer(other_ip, host_ip);
-    } else {
-        newIPLayer = new pcpp::IPv4Layer(host_ip, other_ip);
-    }
-    newIPLayer->getIPv4Header()->ipId = pcpp::hostToNet16(2000);
-    newIPLayer->getIPv4Header()->timeToLive = 64;
-
-    // create a new UDP layer
-    pcpp::UdpLayer *newUdpLayer;
-    if (dir == PacketDirection::toHost) {
-        newUdpLayer = new pcpp::UdpLayer(std::rand() % 65536, 53);
-    } else {
-        newUdpLayer = new pcpp::UdpLayer(53, std::rand() % 65536);
-    }
-
-    // create a new DNS layer
-    std::random_device rd;
-    std::mt19937 g(rd());
-    pcpp::DnsLayer *newDnsLayer = new pcpp::DnsLayer();
-    std::vector<pcpp::DnsType> types{pcpp::DNS_TYPE_A, pcpp::DNS_TYPE_AAAA, pcpp::DNS_TYPE_PTR, pcpp::DNS_TYPE_MX, pcpp::DNS_TYPE_TXT};
-    std::shuffle(types.begin(), types.end(), g);
-    newDnsLayer->addQuery(std::to_string(std::rand() % 20) + ".pktvisor-mock.dev", types[0], pcpp::DNS_CLASS_IN);
-    newDnsLayer->getDnsHeader()->transactionID = std::rand() % 65536; // note this does not work with our transaction tracking
-    if (dir == PacketDirection::fromHost) {
-        // mocking a server
-        newDnsLayer->getDnsHeader()->queryOrResponse = 1;
-        newDnsLayer->getDnsHeader()->responseCode = std::rand() % 6;
-    }
-
-    // create a packet with initial capacity of 100 bytes (will grow automatically if needed)
-    pcpp::Packet newPacket(100);
-
-    // add all the layers we created. newPacket takes ownership and frees them.
-    newPacket.addLayer(newEthernetLayer, true);
-    newPacket.addLayer(newIPLayer, true);
-    newPacket.addLayer(newUdpLayer, true);
-    newPacket.addLayer(newDnsLayer, true);
-    newPacket.computeCalculateFields();
-
-    pcpp::Packet packet(newPacket.getRawPacket());
-    pcpp::ProtocolType l3 = pcpp::IPv4;
-    pcpp::ProtocolType l4 = pcpp::UDP;
-    timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    std::shared_lock lock(_input_mutex);
-    for (auto &proxy : _event_proxies) {
-        auto pcap_proxy = static_cast<PcapInputEventProxy *>(proxy.get());
-        pcap_proxy->process_packet_cb(packet, dir, l3, l4, ts);
-        pcap_proxy->process_udp_packet_cb(packet, dir, l3, pcpp::hash5Tuple(&packet), ts);
+        auto due = static_cast<uint64_t>(duration<double>(now - start).count() * static_cast<double>(rate));
+        if (sent >= due) {
+            auto wait = duration<double>(static_cast<double>(sent + 1) / static_cast<double>(rate)) - (now - start);
+            std::this_thread::sleep_for(std::min<steady_clock::duration>(duration_cast<steady_clock::duration>(wait), 100ms));
+            continue;
+        }
+        // when the handlers can not keep up, run flat out but do not try to catch up for more than a second
+        if (due - sent > rate) {
+            sent = due - rate;
+        }
+        auto burst = std::min<uint64_t>(due - sent, MOCK_BURST);
+        for (uint64_t i = 0; i < burst; ++i) {
+            timespec stamp;
+            std::timespec_get(&stamp, TIME_UTC);
+            auto packet = generator.next(stamp);
+            pcpp::RawPacket raw_packet(packet.data, static_cast<int>(packet.size), stamp, false, pcpp::LINKTYPE_ETHERNET);
+            process_raw_packet(&raw_packet);
+        }
+        sent += burst;
+        _mock_packets.fetch_add(burst, std::memory_order_relaxed);
     }
 }
 
-void PcapInputStream::process_raw_packet(pcpp::RawPacket *rawPacket)
+void PcapInputStream::process_raw_packet(pcpp::RawPacket *rawPacket, uint32_t flow_key)
 {
     pcpp::ProtocolType l3(pcpp::UnknownProtocol), l4(pcpp::UnknownProtocol);
     pcpp::Packet packet(rawPacket, pcpp::TCP | pcpp::UDP);
@@ -390,48 +486,65 @@ void PcapInputStream::process_raw_packet(pcpp::RawPacket *rawPacket)
         }
     }
 
+    // geo enrichment is looked up lazily, by the first handler needing it
+    EnrichmentContext enrichment;
+    if (IP4layer) {
+        enrichment = EnrichmentContext(IpKey::from_ipv4(IP4layer->getSrcIPv4Address().toInt()), IpKey::from_ipv4(IP4layer->getDstIPv4Address().toInt()));
+    } else if (IP6layer) {
+        enrichment = EnrichmentContext(IpKey::from_ipv6(IP6layer->getSrcIPv6Address().toBytes()), IpKey::from_ipv6(IP6layer->getDstIPv6Address().toBytes()));
+    }
+
     auto timestamp = rawPacket->getPacketTimeStamp();
     // interface to handlers
     std::shared_lock lock(_input_mutex);
     for (auto &proxy : _event_proxies) {
-        static_cast<PcapInputEventProxy *>(proxy.get())->process_packet_cb(packet, dir, l3, l4, timestamp);
+        static_cast<PcapInputEventProxy *>(proxy.get())->process_packet_cb(packet, dir, l3, l4, timestamp, enrichment);
     }
 
     if (l4 == pcpp::UDP) {
+        // hashed once, for every handler
+        if (!flow_key) {
+            flow_key = pcpp::hash5Tuple(&packet);
+        }
         for (auto &proxy : _event_proxies) {
-            static_cast<PcapInputEventProxy *>(proxy.get())->process_udp_packet_cb(packet, dir, l3, pcpp::hash5Tuple(&packet), timestamp);
+            static_cast<PcapInputEventProxy *>(proxy.get())->process_udp_packet_cb(packet, dir, l3, flow_key, timestamp, enrichment);
         }
     } else if (l4 == pcpp::TCP) {
-        lock.unlock();
-        auto result = _tcp_reassembly.reassemblePacket(packet);
-        lock.lock();
-        switch (result) {
-        case pcpp::TcpReassembly::Error_PacketDoesNotMatchFlow:
-        case pcpp::TcpReassembly::NonTcpPacket:
-        case pcpp::TcpReassembly::NonIpPacket:
-            for (auto &proxy : _event_proxies) {
-                static_cast<PcapInputEventProxy *>(proxy.get())->process_pcap_tcp_reassembly_error(packet, dir, l3, timestamp);
-            }
-        case pcpp::TcpReassembly::TcpMessageHandled:
-        case pcpp::TcpReassembly::OutOfOrderTcpMessageBuffered:
-        case pcpp::TcpReassembly::FIN_RSTWithNoData:
-        case pcpp::TcpReassembly::Ignore_PacketWithNoData:
-        case pcpp::TcpReassembly::Ignore_PacketOfClosedFlow:
-        case pcpp::TcpReassembly::Ignore_Retransimission:
-            break;
+        // skip reassembly, and the connection state it keeps, unless a handler wants one of the ports
+        auto tcp_layer = packet.getLayerOfType<pcpp::TcpLayer>();
+        bool wanted{false};
+        if (tcp_layer) {
+            auto src_port = ntohs(tcp_layer->getTcpHeader()->portSrc);
+            auto dst_port = ntohs(tcp_layer->getTcpHeader()->portDst);
+            wanted = std::any_of(_event_proxies.begin(), _event_proxies.end(), [src_port, dst_port](const auto &proxy) {
+                return static_cast<PcapInputEventProxy *>(proxy.get())->tcp_wanted(src_port, dst_port);
+            });
         }
-
-        for (uint8_t counter = 0; counter < MAX_TCP_CLEANUPS; counter++) {
-            if (_lru_list.getSize() == 0) {
-                break;
-            }
-            auto connection = _lru_list.getLRUElement();
-            if (timestamp.tv_sec < connection.second.tv_sec + TCP_TIMEOUT) {
+        if (wanted) {
+            lock.unlock();
+            auto result = _tcp_reassembly.reassemblePacket(packet);
+            lock.lock();
+            switch (result) {
+            case pcpp::TcpReassembly::Error_PacketDoesNotMatchFlow:
+            case pcpp::TcpReassembly::NonTcpPacket:
+            case pcpp::TcpReassembly::NonIpPacket:
+                for (auto &proxy : _event_proxies) {
+                    static_cast<PcapInputEventProxy *>(proxy.get())->process_pcap_tcp_reassembly_error(packet, dir, l3, timestamp);
+                }
+            case pcpp::TcpReassembly::TcpMessageHandled:
+            case pcpp::TcpReassembly::OutOfOrderTcpMessageBuffered:
+            case pcpp::TcpReassembly::FIN_RSTWithNoData:
+            case pcpp::TcpReassembly::Ignore_PacketWithNoData:
+            case pcpp::TcpReassembly::Ignore_PacketOfClosedFlow:
+            case pcpp::TcpReassembly::Ignore_Retransimission:
                 break;
             }
-            _tcp_reassembly.closeConnection(connection.first);
-            _lru_list.eraseElement(connection.first);
+        } else {
+            _tcp_reassembly_bypassed.fetch_add(1, std::memory_order_relaxed);
         }
+
+        // only does work once per second of packet time
+        _tcp_timers.advance(timestamp.tv_sec, [this](uint32_t flow_key) { _tcp_reassembly.closeConnection(flow_key); });
     } else {
         // unsupported layer3 protocol
     }
@@ -499,7 +612,44 @@ void PcapInputStream::_open_pcap(const std::string &fileName, const std::string
 void PcapInputStream::_open_af_packet_iface(const std::string &iface, const std::string &bpfFilter)
 {
 
-    _af_device = std::make_unique<AFPacket>(this, _packet_arrives_cb, bpfFilter, iface);
+    // ring geometry, the ring is locked in memory so its size counts against RLIMIT_MEMLOCK
+    uint64_t block_size = AFPacket::DEFAULT_BLOCK_SIZE;
+    if (config_exists("af_packet_block_kb")) {
+        block_size = config_get<uint64_t>("af_packet_block_kb") * 1024;
+    }
+    uint64_t ring_size = static_cast<uint64_t>(AFPacket::DEFAULT_BLOCK_SIZE) * AFPacket::DEFAULT_NUM_BLOCKS;
+    if (config_exists("af_packet_ring_mb")) {
+        ring_size = config_get<uint64_t>("af_packet_ring_mb") * 1024 * 1024;
+    }
+    uint64_t block_timeout = AFPacket::DEFAULT_BLOCK_TIMEOUT;
+    if (config_exists("af_packet_block_timeout_ms")) {
+        block_timeout = config_get<uint64_t>("af_packet_block_timeout_ms");
+    }
+    auto page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    if (!block_size || block_size % page_size || block_size > UINT32_MAX) {
+        throw PcapException(fmt::format("af_packet_block_kb must be a multiple of the page size ({} bytes)", page_size));
+    }
+    if (ring_size < block_size || ring_size / block_size > UINT32_MAX) {
+        throw PcapException("af_packet_ring_mb must hold at least one block");
+    }
+    if (!block_timeout || block_timeout > UINT32_MAX) {
+        throw PcapException("af_packet_block_timeout_ms must be at least 1");
+    }
+
+    int fanout_group = -1;
+    if (config_exists("af_packet_fanout_group")) {
+        auto group = config_get<uint64_t>("af_packet_fanout_group");
+        if (group > UINT16_MAX) {
+            throw PcapException("af_packet_fanout_group must be between 0 and 65535");
+        }
+        fanout_group = static_cast<int>(group);
+    }
+    // only symmetric hashes keep both directions of a flow on one key, which the kernel hash is unless the NIC provides
+    // an asymmetric RSS hash, so this is opt in
+    bool use_rxhash = config_exists("af_packet_rxhash") && config_get<bool>("af_packet_rxhash");
+
+    _af_device = std::make_unique<AFPacket>(this, bpfFilter, iface, fanout_group, static_cast<unsigned int>(block_size), 1 << 11,
+        static_cast<unsigned int>(ring_size / block_size), static_cast<unsigned int>(block_timeout), use_rxhash);
     _af_device->start_capture();
 }
 #endif
@@ -613,14 +763,22 @@ void PcapInputStream::info_json(json &j) const
         break;
     case PcapSource::mock:
         info["pcap_source"] = "mock";
+        info["mock"]["packets"] = _mock_packets.load(std::memory_order_relaxed);
         break;
     }
+    info["tcp_reassembly_bypassed"] = _tcp_reassembly_bypassed.load(std::memory_order_relaxed);
+    if (_cur_pcap_source == PcapSource::af_packet) {
+        std::unique_lock ring_lock(_ring_stats_mutex);
+        info["af_packet"]["packets"] = _ring_stats.packets;
+        info["af_packet"]["drops"] = _ring_stats.drops;
+        info["af_packet"]["freezes"] = _ring_stats.freezes;
+    }
     j[schema_key()] = info;
 }
 
 std::unique_ptr<InputEventProxy> PcapInputStream::create_event_proxy(const Configurable &filter)
 {
-    return std::make_unique<PcapInputEventProxy>(_name, filter);
+    return std::make_unique<PcapInputEventProxy>(_name, filter, [this] { _update_capture_filter(); });
 }
 
 void PcapInputStream::parse_host_spec()
@@ -4,7 +4,9 @@
 
 #pragma once
 
+#include "EnrichmentContext.h"
 #include "InputStream.h"
+#include "MockTrafficGenerator.h"
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 #include <IpAddress.h>
@@ -12,10 +14,14 @@
 #include <TcpReassembly.h>
 #include <UdpLayer.h>
 #pragma GCC diagnostic pop
-#include "VisorLRUList.h"
+#include "TcpTimerWheel.h"
 #include "utils.h"
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <unordered_map>
 #include <vector>
 #ifdef __linux__
@@ -37,15 +43,26 @@ enum class PacketDirection {
     unknown
 };
 
+/**
+ * Kernel statistics of the af_packet ring, totals since the capture started
+ */
+struct PacketRingStats {
+    // packets the ring received, including the dropped ones
+    uint64_t packets{0};
+    uint64_t drops{0};
+    // times the ring was full and the kernel froze its queue
+    uint64_t freezes{0};
+};
+
 class PcapInputStream : public visor::InputStream
 {
 
 private:
-    static constexpr uint8_t TCP_TIMEOUT = 30;
-    static constexpr uint8_t MAX_TCP_CLEANUPS = 100;
+    // default idle timeout of TCP connections in seconds, see "tcp_timeout"
+    static constexpr std::time_t TCP_TIMEOUT = 30;
 
     static const PcapSource DefaultPcapSource = PcapSource::libpcap;
-    LRUList<uint32_t, timeval> _lru_list;
+    TcpTimerWheel _tcp_timers{TCP_TIMEOUT};
     IPv4subnetList _hostIPv4;
     IPv6subnetList _hostIPv6;
 
@@ -57,8 +74,12 @@ private:
 
     uint8_t repeat_counter = 0;
 
-    // mock source
+    // mock source, packets per second unless "mock_rate" is set
+    static constexpr uint64_t MOCK_RATE = 10;
+    // most packets generated between two looks at the clock
+    static constexpr uint64_t MOCK_BURST = 1024;
     std::unique_ptr<std::thread> _mock_generator_thread;
+    std::atomic_uint64_t _mock_packets{0};
 
 #ifdef __linux__
     // af_packet source
@@ -66,12 +87,25 @@ private:
 #endif
 
     pcpp::TcpReassembly _tcp_reassembly;
+    // TCP packets no handler declared interest in, see PcapInputEventProxy::want_tcp_ports()
+    std::atomic_uint64_t _tcp_reassembly_bypassed{0};
+
+    mutable std::mutex _ring_stats_mutex;
+    PacketRingStats _ring_stats;
+
+    // the BPF filter installed on the live device, see _capture_filter()
+    std::mutex _filter_mutex;
+    std::string _active_filter;
+
+    std::string _capture_filter() const;
+    void _update_capture_filter();
+    void _heartbeat_tick();
 
 protected:
     void _open_pcap(const std::string &fileName, const std::string &bpfFilter);
     void _open_libpcap_iface(const std::string &bpfFilter = "");
     void _get_hosts_from_libpcap_iface();
-    void _generate_mock_traffic();
+    void _generate_mock_traffic(const MockTrafficGenerator::Config &config, uint64_t rate);
     std::string _get_interface_list() const;
 
 #ifdef __linux__
@@ -96,8 +130,12 @@ public:
     void parse_host_spec();
 
     // public methods that can be called from a static callback method via cookie, required by PcapPlusPlus
-    void process_raw_packet(pcpp::RawPacket *rawPacket);
+    /**
+     * @param flow_key symmetric flow hash of the packet provided by the capture source, 0 to compute it from the 5-tuple
+     */
+    void process_raw_packet(pcpp::RawPacket *rawPacket, uint32_t flow_key = 0);
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_ring_stats(const PacketRingStats &stats);
     void tcp_message_ready(int8_t side, const pcpp::TcpStreamData &tcpData);
     void tcp_connection_start(const pcpp::ConnectionData &connectionData);
     void tcp_connection_end(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason);
@@ -105,38 +143,164 @@ public:
 
 class PcapInputEventProxy: public visor::InputEventProxy
 {
+    // number of handlers wanting each TCP port reassembled
+    std::unique_ptr<std::atomic_uint16_t[]> _tcp_ports;
+    std::atomic_uint32_t _tcp_declared{0};
+    // slots of tcp_message_ready_signal, see refresh_tcp_consumers(). slot_count() takes the signal lock, it is kept
+    // off the packet path
+    std::atomic_uint32_t _tcp_consumers{0};
+
+    // BPF expressions declared by handlers, std::nullopt for handlers only observing
+    mutable std::mutex _wanted_mutex;
+    std::vector<std::optional<std::string>> _wanted_packets;
+    std::function<void()> _on_wanted_packets;
+
+    void _update_tcp_ports(const std::function<bool(uint16_t)> &wanted, int16_t delta)
+    {
+        for (uint32_t port = 0; port <= UINT16_MAX; ++port) {
+            if (wanted(static_cast<uint16_t>(port))) {
+                _tcp_ports[port].fetch_add(static_cast<uint16_t>(delta), std::memory_order_relaxed);
+            }
+        }
+    }
+
 public:
-    PcapInputEventProxy(const std::string &name, const Configurable &filter)
+    PcapInputEventProxy(const std::string &name, const Configurable &filter, std::function<void()> on_wanted_packets = {})
         : InputEventProxy(name, filter)
+        , _tcp_ports(std::make_unique<std::atomic_uint16_t[]>(UINT16_MAX + 1))
+        , _on_wanted_packets(std::move(on_wanted_packets))
     {
     }
 
     ~PcapInputEventProxy() = default;
 
+    /**
+     * Declare the TCP ports a handler needs reassembled, wanted() is evaluated once per port. Connections on ports no
+     * handler of the input wants skip reassembly altogether. Handlers connecting tcp_message_ready_signal without
+     * declaring their ports get every connection, from the next refresh_tcp_consumers() on.
+     *
+     * Call before connecting the tcp signals, and release_tcp_ports() with the same predicate after disconnecting them.
+     */
+    void want_tcp_ports(const std::function<bool(uint16_t)> &wanted)
+    {
+        _update_tcp_ports(wanted, 1);
+        ++_tcp_declared;
+        refresh_tcp_consumers();
+    }
+
+    void release_tcp_ports(const std::function<bool(uint16_t)> &wanted)
+    {
+        --_tcp_declared;
+        _update_tcp_ports(wanted, -1);
+        refresh_tcp_consumers();
+    }
+
+    /**
+     * Count the handlers connected to tcp_message_ready_signal. The input calls it when it starts and on every
+     * heartbeat, and the proxy whenever ports are declared or released.
+     */
+    void refresh_tcp_consumers()
+    {
+        _tcp_consumers.store(static_cast<uint32_t>(tcp_message_ready_signal.slot_count()), std::memory_order_relaxed);
+    }
+
+    /**
+     * Declare the packets a handler consumes as a BPF expression, "" for every packet. The input captures only the union
+     * of what its handlers declared (on top of the "bpf" of the tap) and rebuilds its kernel filter as handlers come and
+     * go. Handlers which only observe the packets others want, like packet counters, declare std::nullopt.
+     *
+     * Handlers connecting packet_signal or udp_signal have to declare, as long as one of them did not the input captures
+     * every packet. Call before connecting the signals, and release_packets() with the same expression after
+     * disconnecting them.
+     */
+    void want_packets(const std::optional<std::string> &bpf)
+    {
+        {
+            std::unique_lock lock(_wanted_mutex);
+            _wanted_packets.push_back(bpf);
+        }
+        if (_on_wanted_packets) {
+            _on_wanted_packets();
+        }
+    }
+
+    void release_packets(const std::optional<std::string> &bpf)
+    {
+        {
+            std::unique_lock lock(_wanted_mutex);
+            if (auto it = std::find(_wanted_packets.begin(), _wanted_packets.end(), bpf); it != _wanted_packets.end()) {
+                _wanted_packets.erase(it);
+            }
+        }
+        if (_on_wanted_packets) {
+            _on_wanted_packets();
+        }
+    }
+
+    /**
+     * @return the BPF expressions declared by the handlers consuming packets, std::nullopt if one of them wants every
+     * packet or did not declare
+     */
+    std::optional<std::vector<std::string>> wanted_packets() const
+    {
+        std::unique_lock lock(_wanted_mutex);
+        if (packet_signal.slot_count() + udp_signal.slot_count() > _wanted_packets.size()) {
+            return std::nullopt;
+        }
+        std::vector<std::string> wanted;
+        for (const auto &bpf : _wanted_packets) {
+            if (!bpf) {
+                continue;
+            }
+            if (bpf->empty()) {
+                return std::nullopt;
+            }
+            wanted.push_back(*bpf);
+        }
+        return wanted;
+    }
+
+    /**
+     * @return true if a handler wants the TCP connection between these ports reassembled
+     */
+    bool tcp_wanted(uint16_t src_port, uint16_t dst_port) const
+    {
+        if (_tcp_ports[src_port].load(std::memory_order_relaxed) || _tcp_ports[dst_port].load(std::memory_order_relaxed)) {
+            return true;
+        }
+        // handlers which did not declare their ports want every connection
+        return _tcp_consumers.load(std::memory_order_relaxed) > _tcp_declared.load(std::memory_order_relaxed);
+    }
+
     size_t consumer_count() const override
     {
-        return policy_signal.slot_count() + heartbeat_signal.slot_count() + packet_signal.slot_count() + udp_signal.slot_count() + start_tstamp_signal.slot_count() + tcp_message_ready_signal.slot_count() + tcp_connection_start_signal.slot_count() + tcp_connection_end_signal.slot_count() + tcp_reassembly_error_signal.slot_count() + pcap_stats_signal.slot_count();
+        return policy_signal.slot_count() + heartbeat_signal.slot_count() + packet_signal.slot_count() + udp_signal.slot_count() + start_tstamp_signal.slot_count() + tcp_message_ready_signal.slot_count() + tcp_connection_start_signal.slot_count() + tcp_connection_end_signal.slot_count() + tcp_reassembly_error_signal.slot_count() + pcap_stats_signal.slot_count() + ring_stats_signal.slot_count();
     }
 
-    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp)
+    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp, const EnrichmentContext &enrichment)
     {
-        packet_signal(payload, dir, l3, l4, stamp);
+        CpuScope scope(_cpu_account);
+        packet_signal(payload, dir, l3, l4, stamp, enrichment);
     }
 
-    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp)
+    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp, const EnrichmentContext &enrichment)
     {
-        udp_signal(payload, dir, l3, flowkey, stamp);
+        CpuScope scope(_cpu_account);
+        udp_signal(payload, dir, l3, flowkey, stamp, enrichment);
     }
     void tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData)
     {
+        CpuScope scope(_cpu_account);
         tcp_message_ready_signal(side, tcpData);
     }
     void tcp_connection_start_cb(const pcpp::ConnectionData &connectionData)
     {
+        CpuScope scope(_cpu_account);
         tcp_connection_start_signal(connectionData);
     }
     void tcp_connection_end_cb(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason)
     {
+        CpuScope scope(_cpu_account);
         tcp_connection_end_signal(connectionData, reason);
     }
     void start_tstamp_cb(timespec stamp)
@@ -158,11 +322,17 @@ public:
         pcap_stats_signal(stats);
     }
 
+    void process_ring_stats(const PacketRingStats &stats)
+    {
+        ring_stats_signal(stats);
+    }
+
     // handler functionality
     // IF THIS changes, see consumer_count()
     // note: these are mutable because consumer_count() calls slot_count() which is not const (unclear if it could/should be)
-    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, pcpp::ProtocolType, timespec> packet_signal;
-    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, uint32_t, timespec> udp_signal;
+    // one EnrichmentContext per packet, shared by every handler (and chained handler) seeing it
+    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, pcpp::ProtocolType, timespec, const EnrichmentContext &> packet_signal;
+    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, uint32_t, timespec, const EnrichmentContext &> udp_signal;
     mutable sigslot::signal<timespec> start_tstamp_signal;
     mutable sigslot::signal<timespec> end_tstamp_signal;
     mutable sigslot::signal<int8_t, const pcpp::TcpStreamData &> tcp_message_ready_signal;
@@ -170,6 +340,8 @@ public:
     mutable sigslot::signal<const pcpp::ConnectionData &, pcpp::TcpReassembly::ConnectionEndReason> tcp_connection_end_signal;
     mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, timespec> tcp_reassembly_error_signal;
     mutable sigslot::signal<const pcpp::IPcapDevice::PcapStats &> pcap_stats_signal;
+    // af_packet source only, instead of pcap_stats_signal
+    mutable sigslot::signal<const PacketRingStats &> ring_stats_signal;
 };
 
 }
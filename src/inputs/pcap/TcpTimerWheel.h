@@ -0,0 +1,130 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <robin_hood.h>
+#include <utility>
+#include <vector>
+
+namespace visor::input::pcap {
+
+/**
+ * Idle expiry of TCP connections, keyed by flow key and driven by packet time stamps (in seconds).
+ *
+ * A hashed timer wheel with one slot per second. touch() only records the last activity of a connection, which is O(1)
+ * and does not move it between slots. Each connection sits in the slot of its deadline, when that second comes up
+ * advance() either expires it or, if it saw activity since, moves it to the slot of its new deadline. advance() only
+ * does work when the second changes, so the per packet cost is a comparison.
+ */
+class TcpTimerWheel
+{
+    struct Connection {
+        std::time_t last_seen;
+        std::time_t deadline;
+    };
+
+    std::time_t _timeout;
+    std::time_t _now{0};
+    robin_hood::unordered_flat_map<uint32_t, Connection> _connections;
+    // (flow key, deadline), entries whose deadline no longer matches the connection are stale
+    std::vector<std::vector<std::pair<uint32_t, std::time_t>>> _slots;
+    std::vector<std::pair<uint32_t, std::time_t>> _expiring;
+
+    void _schedule(uint32_t flow_key, Connection &connection)
+    {
+        // never schedule into a second which already went by
+        connection.deadline = std::max(connection.last_seen + _timeout, _now + 1);
+        _slots[static_cast<size_t>(connection.deadline) & (_slots.size() - 1)].emplace_back(flow_key, connection.deadline);
+    }
+
+public:
+    /**
+     * @param timeout seconds without activity after which a connection expires, at least 1
+     */
+    explicit TcpTimerWheel(std::time_t timeout)
+        : _timeout(std::max<std::time_t>(timeout, 1))
+    {
+        // a power of two larger than the timeout, so every deadline fits within one turn of the wheel
+        size_t slots = 64;
+        while (slots <= static_cast<size_t>(_timeout)) {
+            slots <<= 1;
+        }
+        _slots.resize(slots);
+    }
+
+    std::time_t timeout() const
+    {
+        return _timeout;
+    }
+
+    size_t size() const
+    {
+        return _connections.size();
+    }
+
+    /**
+     * Record activity of flow_key at time stamp now, adding it if new
+     */
+    void touch(uint32_t flow_key, std::time_t now)
+    {
+        auto [it, inserted] = _connections.try_emplace(flow_key, Connection{now, 0});
+        if (inserted) {
+            _schedule(flow_key, it->second);
+        } else if (now > it->second.last_seen) {
+            it->second.last_seen = now;
+        }
+    }
+
+    void erase(uint32_t flow_key)
+    {
+        _connections.erase(flow_key);
+    }
+
+    /**
+     * Move the wheel to time stamp now, calling expire(flow_key) for every connection idle for the timeout. Connections
+     * are removed before expire() is called, which may touch() or erase() connections.
+     */
+    template <typename Expire>
+    void advance(std::time_t now, Expire &&expire)
+    {
+        if (now <= _now) {
+            return;
+        }
+        // after a gap longer than the wheel, every slot is visited once
+        auto from = std::max(_now + 1, now - static_cast<std::time_t>(_slots.size()) + 1);
+        _now = now;
+        for (auto second = from; second <= now; ++second) {
+            auto &slot = _slots[static_cast<size_t>(second) & (_slots.size() - 1)];
+            if (slot.empty()) {
+                continue;
+            }
+            // expire() may schedule connections, so work on a copy of the slot
+            _expiring.swap(slot);
+            for (const auto &[flow_key, deadline] : _expiring) {
+                if (deadline > now) {
+                    // a later turn of the wheel
+                    slot.emplace_back(flow_key, deadline);
+                    continue;
+                }
+                auto it = _connections.find(flow_key);
+                if (it == _connections.end() || it->second.deadline != deadline) {
+                    continue;
+                }
+                if (it->second.last_seen + _timeout > now) {
+                    _schedule(flow_key, it->second);
+                    continue;
+                }
+                _connections.erase(it);
+                expire(flow_key);
+            }
+            _expiring.clear();
+        }
+    }
+};
+
+}
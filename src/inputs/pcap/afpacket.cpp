@@ -5,10 +5,12 @@
 #ifdef __linux__
 #include "afpacket.h"
 
+#include "PcapInputStream.h"
 #include "utils.h"
 #include <Packet.h>
 #include <arpa/inet.h>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <net/ethernet.h>
 #include <net/if.h>
@@ -21,25 +23,30 @@
 
 namespace visor::input::pcap {
 
-AFPacket::AFPacket(PcapInputStream *stream, pcpp::OnPacketArrivesCallback cb, std::string filter,
+AFPacket::AFPacket(PcapInputStream *stream, std::string filter,
     std::string interface_name,
     int fanout_group_id,
     unsigned int block_size,
     unsigned int frame_size,
-    unsigned int num_blocks)
+    unsigned int num_blocks,
+    unsigned int block_timeout,
+    bool use_rxhash)
     : fd(-1)
     , block_size(block_size)
     , frame_size(frame_size)
     , num_blocks(num_blocks)
+    , block_timeout(block_timeout)
     , interface(-1)
     , interface_type(-1)
     , interface_name(std::move(interface_name))
-    , bpf()
     , filter(std::move(filter))
     , fanout_group_id(fanout_group_id)
     , map(nullptr)
-    , cb(std::move(cb))
     , inputStream(stream)
+    , use_rxhash(use_rxhash)
+    , stats_packets(0)
+    , stats_drops(0)
+    , stats_freezes(0)
 {
     fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
 
@@ -83,12 +90,28 @@ void AFPacket::walk_block(struct block_desc *pbd)
         auto data_pointer = (uint8_t *)ppd + ppd->tp_mac;
         pcpp::RawPacket packet(data_pointer, ppd->tp_snaplen, timespec{pbd->h1.ts_last_pkt.ts_sec, pbd->h1.ts_last_pkt.ts_nsec},
             false, pcpp::LINKTYPE_ETHERNET);
-        cb(&packet, nullptr, inputStream);
+        // 0 if the kernel has no hash for the packet, the input then computes one
+        inputStream->process_raw_packet(&packet, use_rxhash ? ppd->hv1.tp_rxhash : 0);
 
         ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
     }
 }
 
+void AFPacket::update_stats()
+{
+    struct tpacket_stats_v3 stats {
+    };
+    socklen_t len = sizeof(stats);
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == -1) {
+        return;
+    }
+    // tp_packets includes the packets dropped
+    stats_packets += stats.tp_packets;
+    stats_drops += stats.tp_drops;
+    stats_freezes += stats.tp_freeze_q_cnt;
+    inputStream->process_ring_stats(PacketRingStats{stats_packets, stats_drops, stats_freezes});
+}
+
 void AFPacket::set_interface()
 {
     if (interface_name == "any") {
@@ -143,18 +166,9 @@ void AFPacket::set_socket_opts()
         }
     }
 
+    // not locked, so the filter can be rebuilt while capturing
     if (!filter.empty()) {
-        memset(&bpf, 0, sizeof(bpf));
-        filter_try_compile(filter, &bpf, interface_type);
-
-        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &bpf, sizeof(bpf)) == -1) {
-            throw PcapException("Failed to attach supplied BPF filter to AF_PACKET socket: " + std::string(strerror(errno)));
-        }
-
-        int lock = 1;
-        if (setsockopt(fd, SOL_SOCKET, SO_LOCK_FILTER, &lock, sizeof(lock)) == -1) {
-            throw PcapException("Failed to lock supplied BPF filter to AF_PACKET socket: " + std::string(strerror(errno)));
-        }
+        set_filter(filter);
     }
 
     // Enable PACKET_RX_RING for the socket
@@ -167,7 +181,7 @@ void AFPacket::set_socket_opts()
     req.tp_block_nr = num_blocks;
     req.tp_frame_nr = (block_size * num_blocks) / frame_size;
 
-    req.tp_retire_blk_tov = 60; // Timeout in msec
+    req.tp_retire_blk_tov = block_timeout; // Timeout in msec
     req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
 
     if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, reinterpret_cast<void *>(&req), sizeof(req)) == -1) {
@@ -217,9 +231,9 @@ void AFPacket::setup()
 
     // Setup fanout if enabled.
     if (fanout_group_id != -1) {
-        // PACKET_FANOUT_LB - round robin
-        // PACKET_FANOUT_CPU - send packets to CPU where packet arrived
-        int fanout_type = PACKET_FANOUT_LB;
+        // PACKET_FANOUT_HASH - by symmetric flow hash, so both directions of a flow (and its state) stay on one socket
+        // PACKET_FANOUT_FLAG_DEFRAG - reassemble IP fragments first, so they hash along with their flow
+        int fanout_type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
 
         int fanout_arg = (fanout_group_id | (fanout_type << 16));
 
@@ -249,11 +263,20 @@ void AFPacket::start_capture()
         pfd.events = POLLIN | POLLERR;
         pfd.revents = 0;
 
+        // same interval as the libpcap statistics
+        auto next_stats = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
         while (running) {
+            if (auto now = std::chrono::steady_clock::now(); now >= next_stats) {
+                update_stats();
+                next_stats = now + std::chrono::seconds(1);
+            }
+
             auto pbd = reinterpret_cast<struct block_desc *>(rd[current_block_num].iov_base);
 
             if ((pbd->h1.block_status & TP_STATUS_USER) == 0) {
-                poll(&pfd, 1, -1);
+                // wake up for the statistics (and stop_capture()) on an idle interface
+                poll(&pfd, 1, 1000);
                 continue;
             }
 
@@ -264,6 +287,28 @@ void AFPacket::start_capture()
     });
 }
 
+void AFPacket::set_filter(const std::string &new_filter)
+{
+    if (new_filter.empty()) {
+        int detach = 0;
+        // ENOENT if no filter is attached
+        if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &detach, sizeof(detach)) == -1 && errno != ENOENT) {
+            throw PcapException("Failed to detach BPF filter from AF_PACKET socket: " + std::string(strerror(errno)));
+        }
+    } else {
+        struct sock_fprog bpf {
+        };
+        filter_try_compile(new_filter, &bpf, interface_type);
+        // the kernel keeps its own copy of the program
+        auto result = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &bpf, sizeof(bpf));
+        free(bpf.filter);
+        if (result == -1) {
+            throw PcapException("Failed to attach supplied BPF filter to AF_PACKET socket: " + std::string(strerror(errno)));
+        }
+    }
+    filter = new_filter;
+}
+
 void filter_try_compile(const std::string &filter, struct sock_fprog *bpf, int link_type)
 {
     int i, ret;
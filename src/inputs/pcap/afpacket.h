@@ -33,17 +33,24 @@ class PcapInputStream;
 
 class AFPacket final
 {
+public:
+    static constexpr unsigned int DEFAULT_BLOCK_SIZE = 1 << 22;
+    static constexpr unsigned int DEFAULT_NUM_BLOCKS = 64;
+    // milliseconds after which the kernel hands over a block which is not full
+    static constexpr unsigned int DEFAULT_BLOCK_TIMEOUT = 60;
+
+private:
     int fd;
 
     unsigned int block_size;
     unsigned int frame_size;
     unsigned int num_blocks;
+    unsigned int block_timeout;
 
     int interface;
     int interface_type;
     std::string interface_name;
 
-    struct sock_fprog bpf;
     std::string filter;
 
     int fanout_group_id;
@@ -51,11 +58,19 @@ class AFPacket final
     std::vector<struct iovec> rd;
     uint8_t *map;
 
-    pcpp::OnPacketArrivesCallback cb;
     PcapInputStream *inputStream;
 
+    // pass the kernel flow hash (tp_rxhash) along as the flow key
+    bool use_rxhash;
+
+    // PACKET_STATISTICS resets on every read, so these keep the totals
+    uint64_t stats_packets;
+    uint64_t stats_drops;
+    uint64_t stats_freezes;
+
     void flush_block(struct block_desc *pbd);
     void walk_block(struct block_desc *pbd);
+    void update_stats();
 
     void set_interface();
     void set_socket_opts();
@@ -65,15 +80,23 @@ class AFPacket final
     std::unique_ptr<std::thread> cap_thread;
 
 public:
-    AFPacket(PcapInputStream *stream, pcpp::OnPacketArrivesCallback cb, std::string filter,
+    AFPacket(PcapInputStream *stream, std::string filter,
         std::string interface_name,
         int fanout_group_id = -1,
-        unsigned int block_size = 1 << 22,
+        unsigned int block_size = DEFAULT_BLOCK_SIZE,
         unsigned int frame_size = 1 << 11,
-        unsigned int num_blocks = 64);
+        unsigned int num_blocks = DEFAULT_NUM_BLOCKS,
+        unsigned int block_timeout = DEFAULT_BLOCK_TIMEOUT,
+        bool use_rxhash = false);
     ~AFPacket();
 
     void start_capture();
+
+    /**
+     * Compile and attach filter to the socket, replacing the one attached (if any) atomically. An empty filter detaches it.
+     */
+    void set_filter(const std::string &filter);
+
     void stop_capture()
     {
         running = false;
@@ -1,6 +1,15 @@
 #include "PcapInputStream.h"
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#include <DnsLayer.h>
+#include <IPv4Layer.h>
+#include <IPv6Layer.h>
+#include <TcpLayer.h>
+#pragma GCC diagnostic pop
 #include <arpa/inet.h>
 #include <catch2/catch.hpp>
+#include <set>
 
 using namespace visor::input::pcap;
 using namespace std::chrono;
@@ -19,3 +28,85 @@ TEST_CASE("Test mock traffic generator", "[pcap][mock]")
 
 }
 
+TEST_CASE("Mock traffic generator packets", "[pcap][mock]")
+{
+
+    MockTrafficGenerator::Config config;
+    config.seed = 1;
+    config.tcp_percent = 20;
+    MockTrafficGenerator generator(config);
+
+    size_t ipv4{0}, ipv6{0}, udp{0}, tcp{0}, queries{0}, responses{0}, matched{0};
+    std::set<std::pair<uint16_t, std::string>> open;
+    timespec stamp{1614874231, 0};
+    for (int i = 0; i < 10000; ++i) {
+        // 10k pps
+        stamp.tv_nsec += 100000;
+        if (stamp.tv_nsec >= 1000000000) {
+            ++stamp.tv_sec;
+            stamp.tv_nsec -= 1000000000;
+        }
+        auto generated = generator.next(stamp);
+        pcpp::RawPacket raw_packet(generated.data, static_cast<int>(generated.size), stamp, false, pcpp::LINKTYPE_ETHERNET);
+        pcpp::Packet packet(&raw_packet);
+
+        ipv4 += packet.isPacketOfType(pcpp::IPv4);
+        ipv6 += packet.isPacketOfType(pcpp::IPv6);
+        udp += packet.isPacketOfType(pcpp::UDP);
+        tcp += packet.isPacketOfType(pcpp::TCP);
+
+        if (!packet.isPacketOfType(pcpp::UDP)) {
+            continue;
+        }
+        auto dns = packet.getLayerOfType<pcpp::DnsLayer>();
+        REQUIRE(dns);
+        REQUIRE(dns->getQueryCount() == 1);
+        auto key = std::make_pair(dns->getDnsHeader()->transactionID, dns->getFirstQuery()->getName());
+        if (dns->getDnsHeader()->queryOrResponse) {
+            ++responses;
+            matched += open.erase(key);
+        } else {
+            ++queries;
+            open.insert(key);
+        }
+    }
+
+    CHECK(ipv4 > ipv6);
+    CHECK(ipv6 > 0);
+    CHECK(udp > tcp);
+    CHECK(tcp > 0);
+    CHECK(queries > 0);
+    CHECK(responses > 0);
+    // every response answers a query, only a few queries are never answered or still pending
+    CHECK(matched == responses);
+    CHECK(generator.pending() + open.size() < queries / 10);
+}
+
+TEST_CASE("Mock traffic rate", "[pcap][mock]")
+{
+
+    PcapInputStream stream{"pcap-test"};
+    stream.config_set("pcap_source", "mock");
+    stream.config_set<uint64_t>("mock_rate", 10000);
+    stream.config_set<uint64_t>("mock_seed", 1);
+
+    visor::Config c;
+    auto proxy = static_cast<PcapInputEventProxy *>(stream.add_event_proxy(c));
+    std::atomic_uint64_t packets{0}, to_host{0};
+    auto connection = proxy->packet_signal.connect([&packets, &to_host](pcpp::Packet &, PacketDirection dir, pcpp::ProtocolType, pcpp::ProtocolType, timespec, const visor::EnrichmentContext &) {
+        ++packets;
+        to_host += (dir == PacketDirection::toHost);
+    });
+
+    stream.start();
+    std::this_thread::sleep_for(1s);
+    stream.stop();
+
+    CHECK(packets > 5000);
+    CHECK(packets < 15000);
+    // the mock server is the host without a host_spec
+    CHECK(to_host > 0);
+    nlohmann::json j;
+    stream.info_json(j);
+    CHECK(j["pcap"]["mock"]["packets"] == packets.load());
+}
@@ -4,6 +4,7 @@
 #pragma clang diagnostic ignored "-Wc99-extensions"
 #pragma clang diagnostic ignored "-Wrange-loop-analysis"
 #include <Packet.h>
+#include <PacketUtils.h>
 #include <PcapFileDevice.h>
 #include <ProtocolType.h>
 #include <UdpLayer.h>
@@ -11,6 +12,7 @@
 #include <catch2/catch.hpp>
 #include <frequent_items_sketch.hpp>
 #pragma GCC diagnostic pop
+#include "PcapInputStream.h"
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 
 TEST_CASE("Top K Src Ports", "[pcap][ipv4][topk][dns][udp]")
@@ -42,3 +44,159 @@ TEST_CASE("Top K Src Ports", "[pcap][ipv4][topk][dns][udp]")
 
 }
 
+TEST_CASE("TCP reassembly of wanted ports only", "[pcap][ipv4][tcp]")
+{
+
+    visor::input::pcap::PcapInputStream stream{"pcap-test"};
+    stream.config_set("pcap_file", "tests/fixtures/dns_ipv4_tcp.pcap");
+    stream.config_set("bpf", "");
+
+    visor::Config c;
+    auto proxy = static_cast<visor::input::pcap::PcapInputEventProxy *>(stream.add_event_proxy(c));
+
+    size_t messages{0};
+    auto connection = proxy->tcp_message_ready_signal.connect([&messages](int8_t, const pcpp::TcpStreamData &) { ++messages; });
+
+    SECTION("wanted")
+    {
+        proxy->want_tcp_ports([](uint16_t port) { return port == 53; });
+        stream.start();
+        stream.stop();
+        CHECK(messages > 0);
+        nlohmann::json j;
+        stream.info_json(j);
+        CHECK(j["pcap"]["tcp_reassembly_bypassed"] == 0);
+    }
+
+    SECTION("not wanted")
+    {
+        proxy->want_tcp_ports([](uint16_t port) { return port == 443; });
+        stream.start();
+        stream.stop();
+        CHECK(messages == 0);
+        nlohmann::json j;
+        stream.info_json(j);
+        CHECK(j["pcap"]["tcp_reassembly_bypassed"] > 0);
+    }
+
+    SECTION("undeclared handlers want every port")
+    {
+        proxy->want_tcp_ports([](uint16_t port) { return port == 443; });
+        auto undeclared = proxy->tcp_message_ready_signal.connect([](int8_t, const pcpp::TcpStreamData &) {});
+        stream.start();
+        stream.stop();
+        CHECK(messages > 0);
+    }
+
+    SECTION("consumers are counted off the packet path")
+    {
+        proxy->want_tcp_ports([](uint16_t port) { return port == 443; });
+        CHECK(proxy->tcp_wanted(40000, 443));
+        CHECK_FALSE(proxy->tcp_wanted(40000, 53));
+        auto undeclared = proxy->tcp_message_ready_signal.connect([](int8_t, const pcpp::TcpStreamData &) {});
+        // seen once the input refreshes the count, on start and on every heartbeat
+        CHECK_FALSE(proxy->tcp_wanted(40000, 53));
+        proxy->refresh_tcp_consumers();
+        CHECK(proxy->tcp_wanted(40000, 53));
+        undeclared.disconnect();
+        proxy->refresh_tcp_consumers();
+        CHECK_FALSE(proxy->tcp_wanted(40000, 53));
+    }
+}
+
+TEST_CASE("Capture only the packets handlers want", "[pcap][bpf]")
+{
+
+    visor::input::pcap::PcapInputStream stream{"pcap-test"};
+    stream.config_set("pcap_file", "tests/fixtures/dns_udp_tcp_random.pcap");
+    stream.config_set("bpf", "");
+
+    visor::Config c;
+    auto proxy = static_cast<visor::input::pcap::PcapInputEventProxy *>(stream.add_event_proxy(c));
+
+    size_t packets{0}, tcp{0};
+    auto count = [&packets, &tcp](pcpp::Packet &, visor::input::pcap::PacketDirection, pcpp::ProtocolType, pcpp::ProtocolType l4, timespec, const visor::EnrichmentContext &) {
+        ++packets;
+        if (l4 == pcpp::TCP) {
+            ++tcp;
+        }
+    };
+
+    SECTION("declared")
+    {
+        proxy->want_packets("tcp");
+        auto connection = proxy->packet_signal.connect(count);
+        stream.start();
+        stream.stop();
+        CHECK(packets > 0);
+        CHECK(packets == tcp);
+    }
+
+    SECTION("observers do not widen the filter")
+    {
+        proxy->want_packets("tcp");
+        proxy->want_packets(std::nullopt);
+        auto connection = proxy->packet_signal.connect(count);
+        stream.start();
+        stream.stop();
+        CHECK(packets > 0);
+        CHECK(packets == tcp);
+    }
+
+    SECTION("undeclared handlers want every packet")
+    {
+        auto connection = proxy->packet_signal.connect(count);
+        stream.start();
+        stream.stop();
+        CHECK(tcp > 0);
+        CHECK(packets > tcp);
+    }
+
+    SECTION("auto_bpf disabled")
+    {
+        stream.config_set("auto_bpf", false);
+        proxy->want_packets("tcp");
+        auto connection = proxy->packet_signal.connect(count);
+        stream.start();
+        stream.stop();
+        CHECK(packets > tcp);
+    }
+}
+
+TEST_CASE("Flow key provided by the capture source", "[pcap][ipv4][udp]")
+{
+
+    visor::input::pcap::PcapInputStream stream{"pcap-test"};
+
+    visor::Config c;
+    auto proxy = static_cast<visor::input::pcap::PcapInputEventProxy *>(stream.add_event_proxy(c));
+
+    std::vector<uint32_t> keys, expected;
+    auto connection = proxy->udp_signal.connect([&keys](pcpp::Packet &, visor::input::pcap::PacketDirection, pcpp::ProtocolType, uint32_t flowkey, timespec, const visor::EnrichmentContext &) { keys.push_back(flowkey); });
+
+    pcpp::IFileReaderDevice *reader = pcpp::IFileReaderDevice::getReader("tests/fixtures/dns_ipv4_udp.pcap");
+    CHECK(reader->open());
+
+    pcpp::RawPacket rawPacket;
+    uint32_t provided{0x5eed};
+    while (reader->getNextPacket(rawPacket)) {
+        pcpp::Packet packet(&rawPacket);
+        if (!packet.isPacketOfType(pcpp::UDP)) {
+            continue;
+        }
+        // alternate between a provided key and one computed from the 5-tuple
+        if (expected.size() % 2) {
+            expected.push_back(pcpp::hash5Tuple(&packet));
+            stream.process_raw_packet(&rawPacket);
+        } else {
+            expected.push_back(provided);
+            stream.process_raw_packet(&rawPacket, provided);
+        }
+    }
+
+    reader->close();
+    delete reader;
+
+    CHECK(expected.size() > 0);
+    CHECK(keys == expected);
+}
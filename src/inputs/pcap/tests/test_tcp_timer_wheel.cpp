@@ -0,0 +1,73 @@
+#include "TcpTimerWheel.h"
+#include <catch2/catch.hpp>
+
+using namespace visor::input::pcap;
+
+TEST_CASE("TCP timer wheel", "[pcap][tcp]")
+{
+    TcpTimerWheel wheel(30);
+    std::vector<uint32_t> expired;
+    auto expire = [&expired](uint32_t flow_key) { expired.push_back(flow_key); };
+
+    SECTION("idle connections expire after the timeout")
+    {
+        wheel.touch(1, 1000);
+        wheel.touch(2, 1010);
+        wheel.advance(1029, expire);
+        CHECK(expired.empty());
+        wheel.advance(1030, expire);
+        CHECK(expired == std::vector<uint32_t>{1});
+        wheel.advance(1040, expire);
+        CHECK(expired == std::vector<uint32_t>{1, 2});
+        CHECK(wheel.size() == 0);
+    }
+
+    SECTION("activity pushes the deadline back")
+    {
+        wheel.touch(1, 1000);
+        wheel.touch(1, 1020);
+        wheel.advance(1030, expire);
+        CHECK(expired.empty());
+        CHECK(wheel.size() == 1);
+        wheel.advance(1049, expire);
+        CHECK(expired.empty());
+        wheel.advance(1050, expire);
+        CHECK(expired == std::vector<uint32_t>{1});
+    }
+
+    SECTION("erased connections do not expire")
+    {
+        wheel.touch(1, 1000);
+        wheel.erase(1);
+        // reusing the flow key schedules it anew
+        wheel.touch(1, 1020);
+        wheel.advance(1030, expire);
+        CHECK(expired.empty());
+        wheel.advance(1050, expire);
+        CHECK(expired == std::vector<uint32_t>{1});
+    }
+
+    SECTION("gaps longer than the wheel")
+    {
+        for (uint32_t flow_key = 0; flow_key < 100; ++flow_key) {
+            wheel.touch(flow_key, 1000 + flow_key);
+        }
+        wheel.advance(100000, expire);
+        CHECK(expired.size() == 100);
+        CHECK(wheel.size() == 0);
+    }
+
+    SECTION("expiry may touch connections")
+    {
+        wheel.touch(1, 1000);
+        wheel.touch(2, 1000);
+        wheel.advance(1030, [&wheel, &expired](uint32_t flow_key) {
+            expired.push_back(flow_key);
+            // e.g. closing a connection flushes its buffered data
+            wheel.touch(flow_key, 1030);
+            wheel.erase(flow_key);
+        });
+        CHECK(expired.size() == 2);
+        CHECK(wheel.size() == 0);
+    }
+}
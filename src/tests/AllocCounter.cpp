@@ -0,0 +1,23 @@
+#include "AllocCounter.h"
+#include <cstdlib>
+#include <new>
+
+thread_local size_t alloc_count{0};
+
+void *operator new(std::size_t size)
+{
+    ++alloc_count;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+// not inlined, otherwise gcc flags every inlined free() of a new'd pointer as mismatched
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
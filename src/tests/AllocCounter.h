@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+
+// heap allocations made by the current thread so far. counted by the global operator new which AllocCounter.cpp
+// replaces, link it into a test executable to check a code path stays allocation free
+extern thread_local size_t alloc_count;
@@ -1,6 +1,14 @@
+#include "EnrichmentContext.h"
 #include "GeoDB.h"
 #include <arpa/inet.h>
+#include <atomic>
 #include <catch2/catch.hpp>
+#include <condition_variable>
+#include <filesystem>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 
 TEST_CASE("GeoIP", "[geoip]")
@@ -123,3 +131,252 @@ TEST_CASE("GeoIP without cache", "[geoip]")
         CHECK(visor::geo::GeoASN().getASNString(&sa6) == "237/Merit Network Inc.");
     }
 }
+
+TEST_CASE("GeoIP interned ids", "[geoip]")
+{
+    CHECK_NOTHROW(visor::geo::GeoIP().enable("tests/fixtures/GeoIP2-City-Test.mmdb", 64));
+    CHECK_NOTHROW(visor::geo::GeoASN().enable("tests/fixtures/GeoIP2-ISP-Test.mmdb", 64));
+
+    uint8_t ipv6[16];
+    inet_pton(AF_INET6, "2a02:dac0::", ipv6);
+    uint32_t ipv4;
+    inet_pton(AF_INET, "89.160.20.112", &ipv4);
+
+    SECTION("Geo ids")
+    {
+        auto russia = visor::geo::GeoIP().getGeoLocId(visor::IpKey::from_ipv6(ipv6));
+        CHECK(russia != visor::geo::MaxmindDB::UNKNOWN_ID);
+        CHECK(visor::geo::GeoIP().name(russia) == "EU/Russia");
+        CHECK(visor::geo::GeoIP().getGeoLocId(visor::IpKey::from_ipv6(ipv6)) == russia);
+        auto sweden = visor::geo::GeoIP().getGeoLocId(visor::IpKey::from_ipv4(ipv4));
+        CHECK(sweden != russia);
+        CHECK(visor::geo::GeoIP().name(sweden) == "EU/Sweden/E/Linköping");
+        CHECK(visor::geo::GeoIP().name(visor::geo::MaxmindDB::UNKNOWN_ID) == "Unknown");
+    }
+
+    SECTION("ASN ids")
+    {
+        inet_pton(AF_INET, "6.6.6.6", &ipv4);
+        CHECK(visor::geo::GeoASN().getASNId(visor::IpKey::from_ipv4(ipv4)) == visor::geo::MaxmindDB::UNKNOWN_ID);
+        inet_pton(AF_INET, "1.128.0.0", &ipv4);
+        auto telstra = visor::geo::GeoASN().getASNId(visor::IpKey::from_ipv4(ipv4));
+        CHECK(visor::geo::GeoASN().name(telstra) == "1221/Telstra Pty Ltd");
+    }
+
+    SECTION("Cache hit rate")
+    {
+        auto before = visor::geo::GeoIP().cache_stats();
+        for (int i = 0; i < 10; ++i) {
+            visor::geo::GeoIP().getGeoLocId(visor::IpKey::from_ipv4(ipv4));
+        }
+        auto after = visor::geo::GeoIP().cache_stats();
+        CHECK(after.misses - before.misses <= 1);
+        CHECK(after.hits - before.hits >= 9);
+        CHECK(after.size <= after.capacity);
+        CHECK(after.hit_rate() > 0.0);
+    }
+
+    SECTION("Cache stays bounded")
+    {
+        for (uint32_t i = 0; i < 10000; ++i) {
+            visor::geo::GeoIP().getGeoLocId(visor::IpKey::from_ipv4(htonl(0x59a00000 + i)));
+        }
+        auto stats = visor::geo::GeoIP().cache_stats();
+        CHECK(stats.size <= stats.capacity);
+        CHECK(visor::geo::GeoIP().getGeoLocString("89.160.20.112") == "EU/Sweden/E/Linköping");
+    }
+
+    SECTION("Concurrent lookups")
+    {
+        std::vector<std::thread> threads;
+        std::atomic<int> mismatches{0};
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&mismatches, t] {
+                for (uint32_t i = 0; i < 2000; ++i) {
+                    struct sockaddr_in sa4 {
+                    };
+                    sa4.sin_family = AF_INET;
+                    sa4.sin_addr.s_addr = htonl(0x01800000 + (i + t) % 512);
+                    if (visor::geo::GeoASN().getASNString(&sa4) != "1221/Telstra Pty Ltd") {
+                        ++mismatches;
+                    }
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        CHECK(mismatches == 0);
+    }
+}
+
+TEST_CASE("GeoIP flat prefix table", "[geoip]")
+{
+    SECTION("Flat lookups")
+    {
+        CHECK_NOTHROW(visor::geo::GeoIP().enable("tests/fixtures/GeoIP2-City-Test.mmdb", 0, true));
+        CHECK_NOTHROW(visor::geo::GeoASN().enable("tests/fixtures/GeoIP2-ISP-Test.mmdb", 0, true));
+        CHECK(visor::geo::GeoIP().table_size() > 0);
+        CHECK(visor::geo::GeoIP().getGeoLocString("2a02:dac0::") == "EU/Russia");
+        CHECK(visor::geo::GeoIP().getGeoLocString("89.160.20.112") == "EU/Sweden/E/Linköping");
+        CHECK(visor::geo::GeoIP().getGeoLocString("216.160.83.56") == "NA/United States/WA/Milton");
+        CHECK(visor::geo::GeoASN().getASNString("1.128.0.0") == "1221/Telstra Pty Ltd");
+        CHECK(visor::geo::GeoASN().getASNString("2401:8080::") == "237/Merit Network Inc.");
+        CHECK(visor::geo::GeoASN().getASNString("6.6.6.6") == "Unknown");
+        CHECK(visor::geo::GeoASN().cache_stats().hits == 0);
+    }
+
+    SECTION("Flat and tree lookups agree")
+    {
+        for (auto file : {"tests/fixtures/GeoIP2-City-Test.mmdb", "tests/fixtures/GeoIP2-ISP-Test.mmdb"}) {
+            visor::geo::MaxmindDB tree, flat;
+            tree.enable(file, 0);
+            flat.enable(file, 0, true);
+            CHECK(tree.table_size() == 0);
+            uint32_t mismatches{0};
+            // every /16, at a varying offset, and both ends of each
+            for (uint32_t prefix = 0; prefix < 0x10000; ++prefix) {
+                for (uint32_t host : {0u, 0xffffu, (prefix * 2654435761u) & 0xffffu}) {
+                    auto ip = visor::IpKey::from_ipv4(htonl((prefix << 16) | host));
+                    if (tree.name(tree.getGeoLocId(ip)) != flat.name(flat.getGeoLocId(ip))
+                        || tree.name(tree.getASNId(ip)) != flat.name(flat.getASNId(ip))) {
+                        ++mismatches;
+                    }
+                }
+            }
+            for (auto address : {"89.160.20.112", "216.160.83.56", "81.2.69.142", "175.16.199.0", "2.125.160.216", "1.128.0.0", "6.6.6.6"}) {
+                uint32_t ipv4;
+                REQUIRE(inet_pton(AF_INET, address, &ipv4) == 1);
+                auto ip = visor::IpKey::from_ipv4(ipv4);
+                if (tree.name(tree.getGeoLocId(ip)) != flat.name(flat.getGeoLocId(ip))) {
+                    ++mismatches;
+                }
+            }
+            for (auto address : {"2a02:dac0::", "2001:218::", "2001:480::1", "2401:8080::", "2c0f:ff00::", "2002:5ba0:1470::", "::ffff:89.160.20.112", "::1", "ffff::"}) {
+                uint8_t ipv6[16];
+                REQUIRE(inet_pton(AF_INET6, address, ipv6) == 1);
+                auto ip = visor::IpKey::from_ipv6(ipv6);
+                if (tree.name(tree.getGeoLocId(ip)) != flat.name(flat.getGeoLocId(ip))) {
+                    ++mismatches;
+                }
+            }
+            CHECK(mismatches == 0);
+        }
+    }
+
+    SECTION("Flat database of one kind")
+    {
+        visor::geo::MaxmindDB asn(visor::geo::MaxmindDB::ASN);
+        asn.enable("tests/fixtures/GeoIP2-ISP-Test.mmdb", 0, true);
+        CHECK(asn.table_size() > 0);
+        CHECK(asn.getASNString("1.128.0.0") == "1221/Telstra Pty Ltd");
+        // the other kind is not precompiled, but still looked up
+        visor::geo::MaxmindDB tree;
+        tree.enable("tests/fixtures/GeoIP2-ISP-Test.mmdb", 0);
+        CHECK(asn.getGeoLocString("1.128.0.0") == tree.getGeoLocString("1.128.0.0"));
+    }
+
+    SECTION("Reload changed file")
+    {
+        auto path = std::filesystem::temp_directory_path() / "pktvisor-geo-reload-test.mmdb";
+        std::filesystem::copy_file("tests/fixtures/GeoIP2-City-Test.mmdb", path, std::filesystem::copy_options::overwrite_existing);
+        visor::geo::MaxmindDB db;
+        db.enable(path.string(), 0, true);
+        CHECK(db.getGeoLocString("89.160.20.112") == "EU/Sweden/E/Linköping");
+        CHECK(!db.reload_if_changed());
+        // a thread which looked up the old version and went idle
+        std::string before, after;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool reloaded{false};
+        std::thread idle([&] {
+            before = db.getGeoLocString("89.160.20.112");
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return reloaded; });
+            after = db.getASNString("1.128.0.0");
+        });
+        // a new release replaces the file
+        auto next = path;
+        next += ".new";
+        std::filesystem::copy_file("tests/fixtures/GeoIP2-ISP-Test.mmdb", next, std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::rename(next, path);
+        CHECK(db.reload_if_changed());
+        CHECK(db.getASNString("1.128.0.0") == "1221/Telstra Pty Ltd");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            reloaded = true;
+        }
+        cv.notify_one();
+        idle.join();
+        CHECK(before == "EU/Sweden/E/Linköping");
+        CHECK(after == "1221/Telstra Pty Ltd");
+        CHECK(!db.reload_if_changed());
+        std::filesystem::remove(path);
+    }
+}
+
+TEST_CASE("Enrichment context", "[geoip]")
+{
+    CHECK_NOTHROW(visor::geo::GeoIP().enable("tests/fixtures/GeoIP2-City-Test.mmdb", 64));
+    CHECK_NOTHROW(visor::geo::GeoASN().enable("tests/fixtures/GeoIP2-ISP-Test.mmdb", 64));
+
+    auto lookups = [](visor::geo::MaxmindDB &db) {
+        auto stats = db.cache_stats();
+        return stats.hits + stats.misses;
+    };
+
+    uint32_t sweden, telstra;
+    inet_pton(AF_INET, "89.160.20.112", &sweden);
+    inet_pton(AF_INET, "1.128.0.0", &telstra);
+    auto src = visor::IpKey::from_ipv4(sweden);
+    auto dst = visor::IpKey::from_ipv4(telstra);
+
+    SECTION("Ids match direct lookups")
+    {
+        visor::EnrichmentContext enrichment(src, dst);
+        CHECK(enrichment.geo_loc(visor::EnrichmentContext::Src) == visor::geo::GeoIP().getGeoLocId(src));
+        CHECK(enrichment.geo_loc(visor::EnrichmentContext::Dst) == visor::geo::GeoIP().getGeoLocId(dst));
+        CHECK(enrichment.asn(visor::EnrichmentContext::Src) == visor::geo::GeoASN().getASNId(src));
+        CHECK(visor::geo::GeoASN().name(enrichment.asn(visor::EnrichmentContext::Dst)) == "1221/Telstra Pty Ltd");
+    }
+
+    SECTION("Lookups are lazy and happen once")
+    {
+        auto geo_before = lookups(visor::geo::GeoIP());
+        auto asn_before = lookups(visor::geo::GeoASN());
+        visor::EnrichmentContext enrichment(src, dst);
+        CHECK(lookups(visor::geo::GeoIP()) == geo_before);
+        for (int i = 0; i < 3; ++i) {
+            enrichment.geo_loc(visor::EnrichmentContext::Src);
+            enrichment.geo_loc(visor::EnrichmentContext::Dst);
+        }
+        CHECK(lookups(visor::geo::GeoIP()) == geo_before + 2);
+        CHECK(lookups(visor::geo::GeoASN()) == asn_before);
+        enrichment.asn(visor::EnrichmentContext::Dst);
+        enrichment.asn(visor::EnrichmentContext::Dst);
+        CHECK(lookups(visor::geo::GeoASN()) == asn_before + 1);
+
+        // a copy carries the ids already looked up
+        auto copy = enrichment;
+        copy.geo_loc(visor::EnrichmentContext::Src);
+        CHECK(lookups(visor::geo::GeoIP()) == geo_before + 2);
+
+        // a new address is looked up again
+        enrichment.set_ip(visor::EnrichmentContext::Src, dst);
+        CHECK(enrichment.geo_loc(visor::EnrichmentContext::Src) == enrichment.geo_loc(visor::EnrichmentContext::Dst));
+        CHECK(lookups(visor::geo::GeoIP()) == geo_before + 3);
+    }
+
+    SECTION("Missing addresses")
+    {
+        auto before = lookups(visor::geo::GeoIP());
+        visor::EnrichmentContext enrichment;
+        enrichment.set_ip(visor::EnrichmentContext::Dst, dst);
+        CHECK(!enrichment.has_ip(visor::EnrichmentContext::Src));
+        CHECK(enrichment.geo_loc(visor::EnrichmentContext::Src) == visor::geo::MaxmindDB::UNKNOWN_ID);
+        CHECK(enrichment.asn(visor::EnrichmentContext::Src) == visor::geo::MaxmindDB::UNKNOWN_ID);
+        CHECK(lookups(visor::geo::GeoIP()) == before);
+        CHECK(enrichment.has_ip(visor::EnrichmentContext::Dst));
+        CHECK(enrichment.ip(visor::EnrichmentContext::Dst) == dst);
+    }
+}
@@ -1,4 +1,5 @@
 #include "AbstractMetricsManager.h"
+#include "IpKey.h"
 #include <catch2/catch.hpp>
 
 using namespace visor;
@@ -259,6 +260,66 @@ TEST_CASE("TopN metrics", "[metrics][topn]")
     }
 }
 
+TEST_CASE("TopN binary ip keys", "[metrics][topn]")
+{
+    Metric::add_static_label("instance", "test instance");
+
+    json j;
+    std::stringstream output;
+    std::string line;
+    TopN<IpKey> top_ip("root", "ip", {"top", "ips"}, "A topn ip metric");
+    TopN<IpPortKey> top_ip_port("root", "ip_port", {"top", "ip_ports"}, "A topn ip and port metric");
+
+    uint32_t ipv4;
+    inet_pton(AF_INET, "10.4.1.2", &ipv4);
+    uint8_t ipv6[16];
+    inet_pton(AF_INET6, "2001:db8::1", ipv6);
+
+    SECTION("IpKey formatting")
+    {
+        CHECK(IpKey::from_ipv4(ipv4).is_ipv4());
+        CHECK(IpKey::from_ipv4(ipv4).to_string() == "10.4.1.2");
+        CHECK(!IpKey::from_ipv6(ipv6).is_ipv4());
+        CHECK(IpKey::from_ipv6(ipv6).to_string() == "2001:db8::1");
+        CHECK(IpPortKey{IpKey::from_ipv6(ipv6), 53}.to_string() == "2001:db8::1:53");
+        CHECK(IpKey::from_ipv4(ipv4) != IpKey::from_ipv6(ipv6));
+        CHECK(IpPortKey{IpKey::from_ipv4(ipv4), 53} != IpPortKey{IpKey::from_ipv4(ipv4), 54});
+
+        // an IPv6 packet may carry a v4-mapped address, it stays IPv6
+        uint8_t mapped[16];
+        inet_pton(AF_INET6, "::ffff:10.4.1.2", mapped);
+        CHECK(!IpKey::from_ipv6(mapped).is_ipv4());
+        CHECK(IpKey::from_ipv6(mapped).to_string() == "::ffff:10.4.1.2");
+        CHECK(IpKey::from_ipv6(mapped) != IpKey::from_ipv4(ipv4));
+        CHECK(IpKey::from_ipv6(mapped).hash() != IpKey::from_ipv4(ipv4).hash());
+    }
+
+    SECTION("TopN ip keys to json")
+    {
+        top_ip.update(IpKey::from_ipv4(ipv4), 10);
+        top_ip.update(IpKey::from_ipv6(ipv6), 3);
+        top_ip.update(IpKey::from_ipv4(ipv4), 10);
+        top_ip.to_json(j, [](const IpKey &val) { return val.to_string(); });
+        CHECK(j["top"]["ips"][0]["estimate"] == 20);
+        CHECK(j["top"]["ips"][0]["name"] == "10.4.1.2");
+        CHECK(j["top"]["ips"][1]["estimate"] == 3);
+        CHECK(j["top"]["ips"][1]["name"] == "2001:db8::1");
+    }
+
+    SECTION("TopN ip and port keys prometheus")
+    {
+        top_ip_port.update(IpPortKey{IpKey::from_ipv4(ipv4), 40268}, 2);
+        top_ip_port.update(IpPortKey{IpKey::from_ipv4(ipv4), 53});
+        top_ip_port.to_prometheus(output, {{"policy", "default"}}, [](const IpPortKey &val) { return val.to_string(); });
+        std::getline(output, line);
+        std::getline(output, line);
+        std::getline(output, line);
+        CHECK(line == R"(root_top_ip_ports{instance="test instance",ip_port="10.4.1.2:40268",policy="default"} 2)");
+        std::getline(output, line);
+        CHECK(line == R"(root_top_ip_ports{instance="test instance",ip_port="10.4.1.2:53",policy="default"} 1)");
+    }
+}
+
 TEST_CASE("Cardinality metrics", "[metrics][cardinality]")
 {
     Metric::add_static_label("instance", "test instance");